@@ -1,18 +1,33 @@
 #include <cstring>
 #include <cassert>
+#include <ctime>
 #include <memory>
 
 #include "whisper.h"
 #include "whisper_session.h"
+#define VLOG_MODULE VLOG_MOD_AGENT
 #include "vlog.h"
 #include "cfg.h"
 #include "agent.h"
 #include "user.h"
 #include "friend.h"
 #include "gadget.h"
-#include "json.h"
+#include "message.h"
+#include "dispatch.h"
 #include "cmd.h"
 #include "input.h"
+#include "state.h"
+#include "probe.h"
+#include "metrics.h"
+#include "trace.h"
+#include "watchdog.h"
+
+// Simulcast viewers are moved between layers once per window, down when
+// this share of their writes failed (in percent), up after that many loss
+// free windows in a row.
+const uint64_t LAYER_WINDOW = 1000000000ULL;
+const uint32_t LAYER_LOSS = 2;
+const int LAYER_CLEAN_WINDOWS = 5;
 
 class status2str {
 public:
@@ -43,65 +58,80 @@ class separator {
 public:
     separator(const char *from): mFrom(from) {}
 
-    std::string userid(void) {
+    IdRef userid(void) {
         const char *pos;
 
         pos = strchr(mFrom, '@');
         if (!pos)
-            return std::string(mFrom);
+            return IdRef(mFrom);
         else
-            return std::string(mFrom, pos-mFrom);
+            return IdRef(mFrom, pos-mFrom);
     }
 
 private:
     const char* mFrom;
 };
 
-std::shared_ptr<CGadget> CPeer::getGadget(const std::string &name) const
-{
-    std::map<std::string, std::shared_ptr<CGadget>>::const_iterator it;
-    it = mGadgets.find(name);
-    return (it != mGadgets.end() ? it->second : nullptr);
-}
-
-void CPeer::addGadget(CAgent* agent, const std::string &name, const GadgetValue &value)
+void CPeer::addGadget(CAgent* agent, GadgetKind kind, const GadgetValue &value)
 {
     CGadget *gadget;
 
-    if (name.compare("bulb") == 0)
-        gadget = new CBulb(agent, value.bValue());
-    else if (name.compare("torch") == 0)
-        gadget = new CTorch(nullptr, agent, value.bValue());
-    else if (name.compare("brightness") == 0)
-        gadget = new CBrightness(agent, value.fValue());
-    else if (name.compare("ring") == 0)
-        gadget = new CRing(agent, value.bValue());
-    else if (name.compare("volume") == 0)
-        gadget = new CVolume(agent, value.fValue());
-    else if (name.compare("camera") == 0)
-        gadget = new CCamera(nullptr, agent, value.bValue());
-    else {
-        vlogE("Unknown gadget name, skipped");
+    gadget = newGadget(kind, agent, value);
+    if (!gadget) {
+        vlogE("Unknown gadget kind, skipped");
         return;
     }
 
-    if (gadget)
-        mGadgets[name] = std::shared_ptr<CGadget>(gadget);
+    mGadgets[kind] = std::shared_ptr<CGadget>(gadget);
+}
+
+typedef void (CAgent::*MessageHandler)(const IdRef&, const GadgetValues&);
+
+/*
+ * Friend message types and the agent method handling each of them.
+ */
+#define MESSAGE_LIST(X) \
+    X("query",  &CAgent::handleQuery)  \
+    X("status", &CAgent::handleStatus) \
+    X("sync",   &CAgent::handleSync)   \
+    X("modify", &CAgent::handleModify)
+
+static
+MessageHandler messageHandler(const char *type)
+{
+#define MESSAGE_CASE(name, handler) \
+    case dispatch::hash(name): \
+        return (strcmp(type, name) == 0) ? handler : nullptr;
+
+    switch(dispatch::hashn(type, strlen(type))) {
+    MESSAGE_LIST(MESSAGE_CASE)
+    default:
+        return nullptr;
+    }
+#undef MESSAGE_CASE
 }
 
 static
 void onIdle(Whisper *whisper, void *context)
 {
+    watchdogIdle();
+    CWatchdogScope scope("onIdle");
+    CMetricTimer timer(metricCbIdle);
+    TRACE("onIdle");
     CAgent *agent = static_cast<CAgent*>(context);
     assert(agent);
 
     agent->handleInput();
+    agent->adaptLayers();
+    logLimitFlush();
 }
 
 static
 void onConnectionStatus(Whisper *whisper, WhisperConnectionStatus status,
                         void *context)
 {
+    CWatchdogScope scope("onConnectionStatus");
+    CMetricTimer timer(metricCbConnection);
     CAgent* agent = static_cast<CAgent*>(context);
 
     vlogI("Device %s server", (const char*)status2str(status));
@@ -112,6 +142,7 @@ void onConnectionStatus(Whisper *whisper, WhisperConnectionStatus status,
 static
 void onReady(Whisper *whisper, void *context)
 {
+    CWatchdogScope scope("onReady");
     CAgent *agent = static_cast<CAgent*>(context);
     char buf[WHISPER_MAX_LOGIN_LEN + 1];
 
@@ -125,6 +156,7 @@ void onReady(Whisper *whisper, void *context)
 static
 void onSelfInfo(Whisper *whisper, const WhisperUserInfo *info, void *context)
 {
+    CWatchdogScope scope("onSelfInfo");
     CAgent* agent = static_cast<CAgent*>(context);
     assert(agent);
 
@@ -134,15 +166,15 @@ void onSelfInfo(Whisper *whisper, const WhisperUserInfo *info, void *context)
 static
 bool onFriendList(Whisper *whisper, const WhisperFriendInfo *info, void *context)
 {
+    CWatchdogScope scope("onFriendList");
     CAgent* agent = static_cast<CAgent*>(context);
     assert(agent);
 
     if (!info) return true;
 
-    std::string peerName(info->user_info.userid);
     std::shared_ptr<CFriend> sp(new CFriend(info));
 
-    agent->addPeer(peerName, sp, false);
+    agent->addPeer(info->user_info.userid, sp, false);
     return true;
 }
 
@@ -150,30 +182,33 @@ static
 void onFriendInfo(Whisper *whisper, const char *friendid,
                   const WhisperFriendInfo *info, void *context)
 {
+    CWatchdogScope scope("onFriendInfo");
+    CMetricTimer timer(metricCbFriendInfo);
     CAgent* agent = static_cast<CAgent*>(context);
     assert(agent);
 
-    std::string peerName(friendid);
     std::shared_ptr<CFriend> sp(new CFriend(info));
 
-    agent->updatePeer(peerName, sp);
+    agent->updatePeer(friendid, sp);
 }
 
 static
 void onFriendConnection(Whisper *whisper, const char *friendid,
                         WhisperConnectionStatus status, void *context)
 {
+    CWatchdogScope scope("onFriendConnection");
+    CMetricTimer timer(metricCbFriendConn);
     CAgent* agent = static_cast<CAgent*>(context);
     assert(agent);
 
-    std::string peerName(friendid);
-    agent->updatePeer(peerName, status);
+    agent->updatePeer(friendid, status);
 }
 
 static
 void onFriendRequest(Whisper *whisper,const char *userid, const WhisperUserInfo *info,
                      const char *hello, void *context)
 {
+    CWatchdogScope scope("onFriendRequest");
     vlogI("Device received friend request from %s with hello:%s", userid, hello);
     vlogI("where is:");
     vlogI("     UserId: %s", info->userid);
@@ -201,6 +236,7 @@ void onFriendResponse(Whisper *whisper, const char *userid, int status,
                       const char *reason, bool entrusted, const char *expire,
                       void *context)
 {
+    CWatchdogScope scope("onFriendResponse");
     vlogI("Device received friend request reply from %", userid);
     vlogI("which is:");
     vlogI("     status: %d", status);
@@ -213,87 +249,70 @@ void onFriendResponse(Whisper *whisper, const char *userid, int status,
 static
 void onFriendAdded(Whisper *whisper, const WhisperFriendInfo *info, void *context)
 {
+    CWatchdogScope scope("onFriendAdded");
+    CMetricTimer timer(metricCbFriendAdded);
     CAgent* agent = static_cast<CAgent*>(context);
     assert(agent);
 
     vlogI("Friend %s added", info->user_info.userid);
 
-    std::string name(info->user_info.userid);
     std::shared_ptr<CFriend> sp(new CFriend(info));
-    agent->addPeer(name, sp);
+    agent->addPeer(info->user_info.userid, sp);
 }
 
 static
 void onFriendRemoved(Whisper *whisper, const char *friendid, void *context)
 {
+    CWatchdogScope scope("onFriendRemoved");
+    CMetricTimer timer(metricCbFriendRemoved);
     CAgent* agent = static_cast<CAgent*>(context);
     assert(agent);
 
     vlogI("Friend %s removed", friendid);
 
-    const std::string name(friendid);
-    agent->delPeer(name);
+    agent->delPeer(friendid);
 }
 
 static
 void onFriendMessage(Whisper *whisper, const char *from, const char *msg,
                      size_t len, void *context)
 {
+    CWatchdogScope scope("onFriendMessage");
+    CMetricTimer timer(metricCbFriendMessage);
+    TRACE("onFriendMessage");
     CAgent* agent = static_cast<CAgent*>(context);
     assert(agent);
 
+    metricMessagesReceived.add();
+
     vlogI("Device received message from %s", from);
     vlogI("where message is: %s", msg);
 
-    Json::Reader reader;
-    Json::Value root;
     std::string type;
+    GadgetValues values;
 
-    if (!reader.parse(std::string(msg), root) || root["type"].empty()) {
+    if (!decodeMessage(msg, strlen(msg), type, values)) {
         vlogI("Parse friend message error, check it");
+        metricMessagesInvalid.add();
         return;
     }
 
-    type = root["type"].asString();
-    if (type.compare("query") == 0) {
-        agent->handleQuery(separator(from).userid());
-        return;
-    }
-
-    std::map<std::string, GadgetValue> values;
-    if (!root["bulb"].empty())
-        values[std::string("bulb")] = GadgetValue(root["bulb"].asBool());
-    if (!root["torch"].empty())
-        values[std::string("torch")] = GadgetValue(root["torch"].asBool());
-    if (!root["brightness"].empty())
-        values[std::string("brightness")] = GadgetValue(root["brightness"].asFloat());
-    if (!root["ring"].empty())
-        values[std::string("ring")] = GadgetValue(root["ring"].asBool());
-    if (!root["volume"].empty())
-        values[std::string("volume")] = GadgetValue(root["volume"].asFloat());
-    if (!root["camera"].empty())
-        values[std::string("camera")] = GadgetValue(root["camera"].asBool());
-
-    if (type.compare("status") == 0) {
-        agent->handleStatus(separator(from).userid(), values);
+    MessageHandler handler = messageHandler(type.c_str());
+    if (!handler) {
+        vlogI("Unknown friend message type %s, skipped", type.c_str());
+        metricMessagesInvalid.add();
         return;
     }
 
-    if (type.compare("sync") == 0) {
-        agent->handleSync(separator(from).userid(), values);
-        return;
-    }
-
-    if (type.compare("modify") == 0) {
-        agent->handleModify(separator(from).userid(), values);
-        return;
-    }
+    (agent->*handler)(separator(from).userid(), values);
 }
 
 static
 void onSessionRequestCallback(Whisper *whisper, const char *from,
                               const char *sdp, size_t len, void *context)
 {
+    CWatchdogScope scope("onSessionRequestCallback");
+    CMetricTimer timer(metricCbSessionRequest);
     CAgent* agent = static_cast<CAgent*>(context);
     assert(agent);
 
@@ -309,15 +328,42 @@ void onSessionRequestCallback(Whisper *whisper, const char *from,
     std::shared_ptr<std::string> spFrom(new std::string(from));
     std::shared_ptr<std::string> spSdp(new std::string(sdp));
     std::shared_ptr<CSession> sess(new CSession(spFrom, spSdp));
+    if (sess)
+        agent->sessionLayers(*sess, sdp);
 
     if (sess && sess->start(whisper))
         agent->addSession(separator(from).userid(), sess);
 }
 
+/*
+ * The SDK filters by the level given to whisper_log_init() but doesn't
+ * pass the level of each message to the printer, so SDK messages are
+ * tagged with the configured level.
+ */
+static int sdkLogLevel = VLOG_INFO;
+
+static
+int vlogLevel(WhisperLogLevel level)
+{
+    switch(level) {
+    case WhisperLogLevel_None:
+        return -1;
+    case WhisperLogLevel_Fatal:
+    case WhisperLogLevel_Error:
+        return VLOG_ERR;
+    case WhisperLogLevel_Warning:
+        return VLOG_WARN;
+    case WhisperLogLevel_Info:
+        return VLOG_INFO;
+    default:
+        return VLOG_DEBUG;
+    }
+}
+
 static
 void logPrint(const char *format, va_list args)
 {
-    logMsgV(VLOG_INFO, format, args);
+    logMsgV(sdkLogLevel, format, args);
 }
 
 bool CAgent::setup(const std::shared_ptr<CConfig> cfg)
@@ -356,8 +402,26 @@ bool CAgent::setup(const std::shared_ptr<CConfig> cfg)
     };
 
     mIsDummy = cfg->isDummy();
+    mIdleInterval = cfg->idleInterval();
+    mStateTtl = cfg->stateTtl();
+
+    mCameras.clear();
+    mSubLayers.assign(cfg->cameras().size(), -1);
+    mMainLayers.clear();
+    for (size_t i = 0; i < cfg->cameras().size(); i++) {
+        int main = cfg->cameras()[i].simulcast;
+
+        mCameras.push_back(cfg->cameras()[i].name);
+        mMainLayers.push_back(main >= 0 ? main : (int)i);
+        if (main >= 0)
+            mSubLayers[main] = (int)i;
+    }
 
-    whisper_log_init((WhisperLogLevel)cfg->getLogLevel(), cfg->logPath(), logPrint);
+    // SDK logs go through vlog, which owns the log file and its rotation.
+    sdkLogLevel = vlogLevel((WhisperLogLevel)cfg->getLogLevel());
+    if (sdkLogLevel >= VLOG_ERR)
+        setModuleLogLevel("whisper", sdkLogLevel);
+    whisper_log_init((WhisperLogLevel)cfg->getLogLevel(), NULL, logPrint);
 
     mWhisper = whisper_new(&options, &callbacks, this);
     if (!mWhisper) {
@@ -400,7 +464,7 @@ void CAgent::run(void)
 {
     int rc;
 
-    rc = whisper_run(mWhisper, 50);
+    rc = whisper_run(mWhisper, mIdleInterval);
     if (rc < 0) {
         vlogE("Start whisper instance failed: 0x%x", whisper_get_error());
         whisper_kill(mWhisper);
@@ -418,15 +482,13 @@ void CAgent::stop(void)
 
 void CAgent::handleInput(void)
 {
-    if (mIsDummy) return;
+    mSessions.reclaim();
 
-    if (mInput->readCmd()) {
-        std::shared_ptr<CCommand> cmd(mInput->getCmd());
-        if (cmd)
-            cmd->execute(*this);
+    if (mIsDummy) return;
 
-        mInput->reset();
-    }
+    std::shared_ptr<CCommand> cmd;
+    while ((cmd = mInput->popCmd()))
+        cmd->execute(*this);
 }
 
 void CAgent::didConnectionStatusChange(WhisperConnectionStatus status)
@@ -454,6 +516,11 @@ void CAgent::didConnectionStatusChange(WhisperConnectionStatus status)
 void CAgent::didReady(void)
 {
     refreshPeerGadgets();
+
+    if (!mScript.empty()) {
+        vlogI("Running script %s", mScript.c_str());
+        execScript(*this, mScript.c_str());
+    }
 }
 
 void CAgent::showMe() const
@@ -462,69 +529,228 @@ void CAgent::showMe() const
 
     vlogI("myid: %s", whisper_get_nodeid(mWhisper, nodeid, sizeof(nodeid)));
 
-    std::map<std::string, std::shared_ptr<CGadget>>::const_iterator it;
     vlogI("gadgets listed:");
-    for (it = mGadgets.begin(); it != mGadgets.end(); ++it) {
-        vlogI("  %s\t%s", it->first.c_str(), it->second->value().c_str());
+    for (int i = 0; i < GadgetKindCount; i++) {
+        if (mGadgets[i])
+            vlogI("  %s\t%s", mGadgets[i]->name(), mGadgets[i]->value().c_str());
     }
 }
 
-void CAgent::addPeer(const std::string &name, std::shared_ptr<CFriend> friendz,
+void CAgent::addPeer(const IdRef &peerId, std::shared_ptr<CFriend> friendz,
                      bool sync)
 {
     if (!friendz) return;
 
-    std::map<std::string, CPeer>::iterator it;
-    it = mPeers.find(name);
-    if (it != mPeers.end())
-        it->second.updateFriend(friendz);
-    else
-        mPeers.insert(std::pair<std::string, CPeer>(name, CPeer(friendz)));
+    std::shared_ptr<CPeer> *peer = mPeers.find(peerId);
+    if (peer)
+        (*peer)->updateFriend(friendz);
+    else if (!(peer = mPeers.insert(peerId, std::shared_ptr<CPeer>(new CPeer(friendz))))) {
+        vlogE("Invalid peer id, skipped");
+        return;
+    } else if (mState) {
+        restorePeerGadgets(mPeers.key(peerId), **peer);
+    }
+    metricPeers.set(mPeers.size());
 
     if (sync)
-        refreshPeerGadgets(name);
+        refreshPeerGadgets(mPeers.key(peerId));
 }
 
-void CAgent::delPeer(const std::string &name)
+void CAgent::delPeer(const IdRef &peerId)
 {
-    std::map<std::string, CPeer>::iterator it;
-    it = mPeers.find(name);
-    if (it != mPeers.end())
-        mPeers.erase(it);
+    std::shared_ptr<CPeer> *peer = mPeers.find(peerId);
+    if (!peer)
+        return;
+
+    bool hadSession = ((*peer)->getSession() != nullptr);
+
+    // A friend added again later starts without the old values.
+    if (mState) {
+        for (int i = 0; i < GadgetKindCount; i++) {
+            std::shared_ptr<CGadget> gadget = (*peer)->getGadget((GadgetKind)i);
+            if (gadget)
+                gadget->persist(NULL, -1);
+        }
+        mState->release(mPeers.key(peerId));
+    }
+
+    mPeers.erase(peerId);
+    metricPeers.set(mPeers.size());
+    if (hadSession)
+        publishSessions();
 }
 
-void CAgent::updatePeer(const std::string &name, std::shared_ptr<CFriend> friendz)
+void CAgent::updatePeer(const IdRef &peerId, std::shared_ptr<CFriend> friendz)
 {
     if (!friendz) return;
 
-    std::map<std::string, CPeer>::iterator it;
-    it = mPeers.find(name);
-    if (it != mPeers.end()) {
-        it->second.updateFriend(friendz);
-        refreshPeerGadgets(name);
+    std::shared_ptr<CPeer> *peer = mPeers.find(peerId);
+    if (peer) {
+        (*peer)->updateFriend(friendz);
+        refreshPeerGadgets(mPeers.key(peerId));
     }
 }
 
-void CAgent::updatePeer(const std::string &name, WhisperConnectionStatus status)
+void CAgent::updatePeer(const IdRef &peerId, WhisperConnectionStatus status)
 {
-    std::map<std::string, CPeer>::iterator it;
-    it = mPeers.find(name);
-    if (it != mPeers.end()) {
-        it->second.getFriend()->status(status);
+    std::shared_ptr<CPeer> *peer = mPeers.find(peerId);
+    if (peer) {
+        (*peer)->getFriend()->status(status);
 
         if (status == WhisperConnectionStatus_Connected)
-            refreshPeerGadgets(name);
+            refreshPeerGadgets(mPeers.key(peerId));
     }
 }
 
-void CAgent::addSession(const std::string &name, std::shared_ptr<CSession> sess)
+void CAgent::addSession(const IdRef &peerId, std::shared_ptr<CSession> sess)
 {
     if (!sess) return;
 
-    std::map<std::string, CPeer>::iterator it;
-    it = mPeers.find(name);
-    if (it != mPeers.end())
-        it->second.addSession(sess);
+    std::shared_ptr<CPeer> *peer = mPeers.find(peerId);
+    if (peer) {
+        (*peer)->addSession(sess);
+        publishSessions();
+    }
+}
+
+// Value of a "<tag><value>" token in a session request, empty without.
+static
+std::string sdpToken(const char *sdp, const char *tag)
+{
+    const char *found = strstr(sdp, tag);
+
+    if (!found)
+        return std::string();
+
+    found += strlen(tag);
+    return std::string(found, strcspn(found, " \t\r\n;"));
+}
+
+int CAgent::sessionCamera(const char *sdp) const
+{
+    std::string name = sdpToken(sdp, "wdemo-camera:");
+
+    if (name.empty())
+        return 0;
+
+    for (size_t i = 0; i < mCameras.size(); i++) {
+        if (mCameras[i] == name)
+            return (int)i;
+    }
+
+    vlogW("No camera %s, session gets %s", name.c_str(),
+          mCameras.empty() ? "the default one" : mCameras[0].c_str());
+    return 0;
+}
+
+void CAgent::sessionLayers(CSession &sess, const char *sdp) const
+{
+    int camera = sessionCamera(sdp);
+    int main = (size_t)camera < mMainLayers.size() ? mMainLayers[camera] : camera;
+    int sub = (size_t)main < mSubLayers.size() ? mSubLayers[main] : -1;
+
+    sess.camera(main);
+    if (camera != main) {
+        sess.layer(camera);
+        sess.pinned(true);
+        return;
+    }
+
+    if (sub < 0)
+        return;
+
+    std::string layer = sdpToken(sdp, "wdemo-layer:");
+    if (layer == "main") {
+        sess.pinned(true);
+    } else if (layer == "sub") {
+        sess.layer(sub);
+        sess.pinned(true);
+    } else {
+        if (!layer.empty() && layer != "auto")
+            vlogW("No layer %s, session follows write loss", layer.c_str());
+
+        // Start low; a clean stream moves it up within a few windows.
+        sess.layer(sub);
+    }
+}
+
+void CAgent::adaptLayers(void)
+{
+    uint64_t now = probeClock();
+
+    if (now - mLayerCheck < LAYER_WINDOW)
+        return;
+    mLayerCheck = now;
+
+    mPeers.forEach([&](const char *peerId, const std::shared_ptr<CPeer> &peer) {
+        std::shared_ptr<CSession> sess = peer->getSession();
+        uint32_t written;
+        uint32_t failed;
+
+        if (!sess || (size_t)sess->camera() >= mSubLayers.size())
+            return;
+
+        sess->takeWrites(written, failed);
+
+        int main = sess->camera();
+        int sub = mSubLayers[main];
+        if (sub < 0 || sess->pinned())
+            return;
+
+        if (failed && failed * 100 >= (written + failed) * LAYER_LOSS) {
+            sess->cleanWindows(0);
+            if (sess->target() != sub) {
+                vlogI("Viewer %s down to layer %s, %u of %u writes failed",
+                      peerId, mCameras[sub].c_str(), failed, written + failed);
+                sess->target(sub);
+            }
+        } else if (sess->target() == sub && written) {
+            sess->cleanWindows(sess->cleanWindows() + 1);
+            if (sess->cleanWindows() >= LAYER_CLEAN_WINDOWS) {
+                vlogI("Viewer %s up to layer %s", peerId, mCameras[main].c_str());
+                sess->cleanWindows(0);
+                sess->target(main);
+            }
+        }
+    });
+}
+
+void CAgent::switchLayers(int camera, size_t shard, size_t shards)
+{
+    CRcuReadLock lock;
+
+    const SessionLists *lists = mSessions.get();
+    if (!lists || (size_t)camera >= lists->size())
+        return;
+
+    const SessionList &sessions = (*lists)[camera];
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (shards > 1 && sessions[i]->shard() % shards != shard)
+            continue;
+        if (sessions[i]->switchLayer(camera))
+            metricLayerSwitches.add();
+    }
+}
+
+void CAgent::publishSessions(void)
+{
+    SessionLists *sessions = new SessionLists(mCameras.empty() ? 1 : mCameras.size());
+    size_t count = 0;
+
+    mPeers.forEach([&](const char *peerId, const std::shared_ptr<CPeer> &peer) {
+        std::shared_ptr<CSession> sess = peer->getSession();
+        if (sess && (size_t)sess->camera() < sessions->size()) {
+            // Simulcast viewers are on both layers; layer() picks one.
+            (*sessions)[sess->camera()].push_back(sess);
+            if ((size_t)sess->camera() < mSubLayers.size() &&
+                mSubLayers[sess->camera()] >= 0)
+                (*sessions)[mSubLayers[sess->camera()]].push_back(sess);
+            count++;
+        }
+    });
+
+    metricSessions.set(count);
+    mSessions.publish(sessions);
 }
 
 void CAgent::reqAddPeer(const std::string &name) const
@@ -540,244 +766,284 @@ void CAgent::reqAddPeer(const std::string &name) const
 
 void CAgent::listPeers(bool withGadgets) const
 {
-    std::map<std::string, CPeer>::const_iterator it;
-    for (it = mPeers.begin(); it != mPeers.end(); ++it)
-        vlogI("Device %s", it->first.c_str());
+    mPeers.forEach([](const char *peerId, const std::shared_ptr<CPeer> &peer) {
+        vlogI("Device %s", peerId);
+    });
 }
 
-std::shared_ptr<CGadget> CAgent::getGadget(const std::string &name) const
+std::shared_ptr<CGadget> CAgent::getGadget(const IdRef &peerId, GadgetKind kind) const
 {
-    std::map<std::string, std::shared_ptr<CGadget>>::const_iterator it;
-    it = mGadgets.find(name);
-    return (it != mGadgets.end() ? it->second : nullptr);
+    const std::shared_ptr<CPeer> *peer = mPeers.find(peerId);
+    return (peer ? (*peer)->getGadget(kind) : nullptr);
 }
 
-std::shared_ptr<CGadget> CAgent::getGadget(const std::string &peerName,
-                                           const std::string &gadgetName) const
+void CAgent::addGadget(std::shared_ptr<CGadget> gadget)
 {
-    std::map<std::string, CPeer>::const_iterator it;
-    it = mPeers.find(peerName);
-    return (it == mPeers.end() ? it->second.getGadget(gadgetName) : nullptr);
+    if (!gadget) return;
+
+    mGadgets[gadget->kind()] = gadget;
+
+    if (!mState)
+        return;
+
+    int slot = mState->slot(NULL, gadget->kind());
+    GadgetValue value;
+    bool warm = mState->load(slot, value) && value.type() == gadget->value().type();
+
+    gadget->persist(mState.get(), slot);
+
+    // Drive the gadget back to where it was, before any peer asks for it.
+    if (!warm)
+        mState->store(slot, gadget->value());
+    else if (!(value == gadget->value())) {
+        vlogI("Gadget %s restored to %s", gadget->name(), value.c_str());
+        gadget->flip(value);
+    }
 }
 
-void CAgent::addGadget(std::shared_ptr<CGadget> gadget)
+void CAgent::addPeerGadget(const char *peerId, CPeer &peer, GadgetKind kind,
+                           const GadgetValue &value, bool restored)
 {
-    if (!gadget) return;
+    peer.addGadget(this, kind, value);
 
-    std::map<std::string, std::shared_ptr<CGadget>>::iterator it;
-    it = mGadgets.find(gadget->name());
-    if (it != mGadgets.end())
-        it->second = gadget;
-    else
-        mGadgets[gadget->name()] = gadget;
+    std::shared_ptr<CGadget> gadget = peer.getGadget(kind);
+    if (!gadget || !mState)
+        return;
+
+    int slot = mState->slot(peerId, kind);
+    gadget->persist(mState.get(), slot);
+
+    // A restored value keeps its original time stamp.
+    if (!restored)
+        mState->store(slot, value);
 }
 
-void CAgent::didGadgetValueChange(const CGadget &gadget) const
+void CAgent::restorePeerGadgets(const char *peerId, CPeer &peer)
 {
-    if (!mIsConnected) return;
+    uint64_t oldest = 0;
 
-    Json::StyledWriter writer;
-    Json::Value node;
-    Json::Value root;
+    mState->forEach(peerId, [&](GadgetKind kind, const GadgetValue &value, uint64_t stamp) {
+        if (value.type() != gadgetType(kind))
+            return;
 
-    node = Json::Value("sync");
-    root["type"] = node;
+        addPeerGadget(peerId, peer, kind, value, true);
+        if (!oldest || stamp < oldest)
+            oldest = stamp;
+    });
 
-    switch(gadget.value().type()) {
-    case Int:
-        node = Json::Value(gadget.value().iValue());
-        break;
-    case Bool:
-        node = Json::Value(gadget.value().bValue());
-        break;
-    case Float:
-        node = Json::Value(gadget.value().fValue());
-        break;
-    default:
-        return;
+    if (oldest) {
+        peer.restoredAt(oldest);
+        vlogD("Peer %s gadgets restored from state file", peerId);
     }
-    root[gadget.name()] = node;
+}
+
+int CAgent::sendMessage(const char *to, const std::string &msg) const
+{
+    int rc;
+
+    rc = whisper_send_friend_message(mWhisper, to, msg.c_str(), msg.length() + 1);
+    if (rc < 0)
+        metricMessageErrors.add();
+    else
+        metricMessagesSent.add();
+    return rc;
+}
+
+void CAgent::didGadgetValueChange(const CGadget &gadget) const
+{
+    if (!mIsConnected) return;
 
+    GadgetValues values;
     std::string msg;
     int rc;
 
-    msg = writer.write(root);
+    gadget.query(values);
+    msg = encodeMessage("sync", values);
     vlogI("message: %s", msg.c_str());
 
-    std::map<std::string, CPeer>::const_iterator it;
-    for (it = mPeers.begin(); it != mPeers.end(); ++it) {
-        rc = whisper_send_friend_message(mWhisper, it->first.c_str(),
-                msg.c_str(), msg.length() + 1);
+    mPeers.forEach([&](const char *peerId, const std::shared_ptr<CPeer> &peer) {
+        rc = sendMessage(peerId, msg);
         if (rc < 0) {
-            vlogE("Broadcast gadget (%s) update value to peer (%s) error (0x%x)",
-                  gadget.name().c_str(), it->first.c_str(),
-                  whisper_get_error());
+            vlogLimitE("Broadcast gadget (%s) update value to peer (%s) error (0x%x)",
+                       gadget.name(), peerId, whisper_get_error());
         }
-    }
+    });
 }
 
-void CAgent::didGadgetValueChange(const CGadget &gadget, const std::string &peerName) const
+void CAgent::showPeerGadgets(GadgetKind kind, const std::vector<std::string> &peerIds) const
 {
-    if (!mIsConnected) return;
+    auto show = [=](const char *peerId, const std::shared_ptr<CPeer> &peer) {
+        std::shared_ptr<CGadget> gadget = peer->getGadget(kind);
+        if (gadget)
+            gadget->status(peerId);
+        else
+            vlogI("%s %s unknown", gadgetName(kind), peerId);
+    };
 
-    Json::StyledWriter writer;
-    Json::Value node;
-    Json::Value root;
+    if (peerIds.empty()) {
+        mPeers.forEach(show);
+        return;
+    }
 
-    node = Json::Value("modify");
-    root["type"] = node;
+    for (size_t i = 0; i < peerIds.size(); i++) {
+        const std::shared_ptr<CPeer> *peer = mPeers.find(peerIds[i]);
+        if (peer)
+            show(peerIds[i].c_str(), *peer);
+        else
+            vlogE("Peer %s not found", peerIds[i].c_str());
+    }
+}
 
-    switch(gadget.value().type()) {
-    case Int:
-        node = Json::Value(gadget.value().iValue());
-        break;
-    case Bool:
-        node = Json::Value(gadget.value().bValue());
-        break;
-    case Float:
-        node = Json::Value(gadget.value().fValue());
-        break;
-    default:
+void CAgent::modifyPeerGadgets(GadgetKind kind, const GadgetValue &value,
+                               const std::vector<std::string> &peerIds)
+{
+    if (!mIsConnected) {
+        vlogE("Not connected, modify %s skipped", gadgetName(kind));
         return;
     }
-    root[gadget.name()] = node;
 
+    // The message is encoded once and fanned out to every target.
+    GadgetValues values;
     std::string msg;
-    int rc;
+    size_t sent = 0;
+    size_t failed = 0;
 
-    msg = writer.write(root);
+    values.set(kind, value);
+    msg = encodeMessage("modify", values);
     vlogI("message: %s", msg.c_str());
 
-    rc = whisper_send_friend_message(mWhisper, peerName.c_str(),
-                                     msg.c_str(), msg.length() + 1);
-    if (rc < 0) {
-        vlogE("Update peer (%s) gadget (%s) value to be %s error (0x%x)",
-              peerName.c_str(), gadget.name().c_str(), gadget.value().c_str(),
-              whisper_get_error());
-    }
-}
+    auto modify = [&](const char *peerId, const std::shared_ptr<CPeer> &peer) {
+        int rc;
 
-void CAgent::handleQuery(const std::string &peerName) const
-{
-    std::map<std::string, GadgetValue> values;
-    std::map<std::string, std::shared_ptr<CGadget>>::const_iterator it;
+        rc = sendMessage(peerId, msg);
+        if (rc < 0) {
+            vlogLimitE("Update peer (%s) gadget (%s) value to be %s error (0x%x)",
+                       peerId, gadgetName(kind), value.c_str(), whisper_get_error());
+            failed++;
+            return;
+        }
 
-    for (it = mGadgets.begin(); it != mGadgets.end(); ++it)
-        it->second->query(values);
+        std::shared_ptr<CGadget> gadget = peer->getGadget(kind);
+        if (gadget)
+            gadget->sync(value);
+        else
+            addPeerGadget(peerId, *peer, kind, value);
+        sent++;
+    };
 
-    Json::StyledWriter writer;
-    Json::Value node;
-    Json::Value root;
+    if (peerIds.empty()) {
+        mPeers.forEach(modify);
+    } else {
+        for (size_t i = 0; i < peerIds.size(); i++) {
+            const std::shared_ptr<CPeer> *peer = mPeers.find(peerIds[i]);
+            if (peer) {
+                modify(mPeers.key(peerIds[i]), *peer);
+            } else {
+                vlogE("Peer %s not found", peerIds[i].c_str());
+                failed++;
+            }
+        }
+    }
 
-    root["type"] = Json::Value("status");
+    vlogI("Gadget %s set to %s on %zu peers (%zu failed)", gadgetName(kind),
+          value.c_str(), sent, failed);
+}
 
-    std::map<std::string, GadgetValue>::const_iterator it1;
-    for (it1 = values.begin(); it1 != values.end(); ++it1) {
-        switch(it1->second.type()) {
-        case Int:
-            node = Json::Value(it1->second.iValue());
-            break;
-        case Bool:
-            node = Json::Value(it1->second.bValue());
-            break;
-        case Float:
-            node = Json::Value(it1->second.fValue());
-            break;
-        default:
-            break;
-        }
+void CAgent::handleQuery(const IdRef &peerId, const GadgetValues &)
+{
+    TRACE("handleQuery");
+    GadgetValues values;
 
-        if (!node.empty())
-            root[it1->first] = node;
+    for (int i = 0; i < GadgetKindCount; i++) {
+        if (mGadgets[i])
+            mGadgets[i]->query(values);
     }
 
     std::string msg;
     int rc;
 
-    msg = writer.write(root);
+    msg = encodeMessage("status", values);
     vlogI("msg: %s", msg.c_str());
 
-    rc = whisper_send_friend_message(mWhisper, peerName.c_str(),
-                msg.c_str(), msg.length() + 1);
+    const char *to = mPeers.key(peerId);
+    std::string toStr;
+    if (!to) {
+        toStr = peerId.str();
+        to = toStr.c_str();
+    }
+
+    rc = sendMessage(to, msg);
     if (rc < 0) {
         vlogE("Send local gadgets values to peer (%s) error (0x%x)",
-              peerName.c_str(), whisper_get_error());
+              to, whisper_get_error());
     }
 }
 
-void CAgent::handleStatus(const std::string &peerName,
-                          const std::map<std::string, GadgetValue> &values)
+void CAgent::syncPeerGadgets(const IdRef &peerId, const GadgetValues &values)
 {
-    if (mIsDummy) return;
-
-    std::map<std::string, CPeer>::iterator it;
-    it = mPeers.find(peerName);
-    if (it == mPeers.end())
+    std::shared_ptr<CPeer> *peer = mPeers.find(peerId);
+    if (!peer)
         return;
 
-    std::map<std::string, GadgetValue>::const_iterator it1;
-    for (it1 = values.begin(); it1 != values.end(); ++it1) {
-        std::shared_ptr<CGadget> sp(it->second.getGadget(it1->first));
+    for (int i = 0; i < GadgetKindCount; i++) {
+        GadgetKind kind = (GadgetKind)i;
+        if (!values.has(kind))
+            continue;
+
+        std::shared_ptr<CGadget> sp((*peer)->getGadget(kind));
         if (sp)
-            sp->sync(it1->second);
+            sp->sync(values.get(kind));
         else
-            it->second.addGadget(this, it1->first, it1->second);
+            addPeerGadget(mPeers.key(peerId), **peer, kind, values.get(kind));
     }
 }
 
-void CAgent::handleSync(const std::string &peerName,
-                          const std::map<std::string, GadgetValue> &values)
+void CAgent::handleStatus(const IdRef &peerId, const GadgetValues &values)
 {
     if (mIsDummy) return;
 
-    std::map<std::string, CPeer>::iterator it;
-    it = mPeers.find(peerName);
-    if (it == mPeers.end())
-        return;
-
-    std::map<std::string, GadgetValue>::const_iterator it1;
-    for (it1 = values.begin(); it1 != values.end(); ++it1) {
-        std::shared_ptr<CGadget> sp(it->second.getGadget(it1->first));
-        if (sp)
-            sp->sync(it1->second);
-        else
-            it->second.addGadget(this, it1->first, it1->second);
-    }
+    syncPeerGadgets(peerId, values);
 }
 
-void CAgent::handleModify(const std::string &peerName,
-                          const std::map<std::string, GadgetValue> &values)
+void CAgent::handleSync(const IdRef &peerId, const GadgetValues &values)
 {
-    std::map<std::string, GadgetValue>::const_iterator it;
-    std::map<std::string, std::shared_ptr<CGadget>>::iterator it1;
+    if (mIsDummy) return;
 
+    syncPeerGadgets(peerId, values);
+}
+
+void CAgent::handleModify(const IdRef &peerId, const GadgetValues &values)
+{
     //TODO:
 
-    for (it = values.begin(); it != values.end(); ++it) {
-        it1 = mGadgets.find(it->first);
-        if (it1 != mGadgets.end())
-            it1->second->flip(it->second);
+    for (int i = 0; i < GadgetKindCount; i++) {
+        GadgetKind kind = (GadgetKind)i;
+        if (values.has(kind) && mGadgets[kind])
+            mGadgets[kind]->flip(values.get(kind));
     }
 }
 
-void CAgent::refreshPeerGadgets(const std::string &peerName) const
+void CAgent::refreshPeerGadgets(const char *peerId) const
 {
-    Json::StyledWriter writer;
-    Json::Value root;
-
-    root["type"] = Json::Value("query");;
+    // Gadget values restored at warm start are trusted for a while, the
+    // peer sends a sync for anything that changes from now on.
+    const std::shared_ptr<CPeer> *peer = mPeers.find(peerId);
+    if (peer && (*peer)->restoredAt() &&
+        (uint64_t)time(NULL) < (*peer)->restoredAt() + mStateTtl) {
+        vlogD("Peer %s gadgets known from state file, query skipped", peerId);
+        return;
+    }
 
     std::string msg;
     int rc;
 
-    msg = writer.write(root);
+    msg = encodeMessage("query", GadgetValues());
     vlogI("Send message: %s", msg.c_str());
 
-    rc = whisper_send_friend_message(mWhisper, peerName.c_str(),
-                msg.c_str(), msg.length() + 1);
+    rc = sendMessage(peerId, msg);
     if (rc < 0) {
-        vlogE("Request to get peer (%s) gadgets value error (0x%x)",
-              peerName.c_str(), whisper_get_error());
+        vlogLimitE("Request to get peer (%s) gadgets value error (0x%x)",
+                   peerId, whisper_get_error());
     }
 }
 
@@ -785,18 +1051,29 @@ void CAgent::refreshPeerGadgets(void) const
 {
     if (mIsDummy) return;
 
-    std::map<std::string, CPeer>::const_iterator it;
-    for (it = mPeers.begin(); it != mPeers.end(); ++it)
-        refreshPeerGadgets(it->first);
+    mPeers.forEach([this](const char *peerId, const std::shared_ptr<CPeer> &peer) {
+        refreshPeerGadgets(peerId);
+    });
 }
 
-void CAgent::sendVideoFrame(const uint8_t *frame, int len)
+void CAgent::sendVideoFrame(const uint8_t *frame, int len, int camera,
+                            size_t shard, size_t shards)
 {
-    std::map<std::string, CPeer>::const_iterator it;
+    CRcuReadLock lock;
+    CMetricTimer timer(metricFrameFanout);
+    TRACE("sendVideoFrame");
+    PROBE(Agent);
+
+    const SessionLists *lists = mSessions.get();
+    if (!lists || (size_t)camera >= lists->size())
+        return;
 
-    for (it = mPeers.begin(); it != mPeers.end(); ++it) {
-        std::shared_ptr<CSession> sess = it->second.getSession();
-        if (sess)
-            sess->write(frame, len);
+    const SessionList *sessions = &(*lists)[camera];
+    for (size_t i = 0; i < sessions->size(); i++) {
+        CSession &session = *(*sessions)[i];
+        if (session.layer() != camera)
+            continue;
+        if (shards == 1 || session.shard() % shards == shard)
+            session.write(frame, len);
     }
 }
@@ -6,9 +6,12 @@
 #include <cassert>
 #include <memory>
 #include <string>
-#include <map>
+#include <array>
+#include <vector>
 
 #include <whisper.h>
+#include "idmap.h"
+#include "rcu.h"
 #include "gadget.h"
 #include "session.h"
 
@@ -16,26 +19,37 @@ class CConfig;
 class CUser;
 class CFriend;
 class CInput;
+class CStateFile;
+
+typedef std::vector<std::shared_ptr<CSession>> SessionList;
+// Viewers of each camera pipeline, by pipeline index.
+typedef std::vector<SessionList> SessionLists;
 
 class CPeer {
 public:
-    CPeer(std::shared_ptr<CFriend> friendz): mFriend(friendz), mGadgets() {}
+    CPeer(std::shared_ptr<CFriend> friendz): mFriend(friendz), mGadgets(), mRestoredAt(0) {}
 
 public:
     std::shared_ptr<CFriend> getFriend(void) const { return mFriend; }
     void updateFriend(std::shared_ptr<CFriend> f) { mFriend = f; }
 
-    std::shared_ptr<CGadget> getGadget(const std::string &name) const;
-    void addGadget(CAgent* agent, const std::string &name, const GadgetValue &value);
+    std::shared_ptr<CGadget> getGadget(GadgetKind kind) const { return mGadgets[kind]; }
+    void addGadget(CAgent* agent, GadgetKind kind, const GadgetValue &value);
 
     void addSession(std::shared_ptr<CSession> session) { mSession = session; }
 
     std::shared_ptr<CSession> getSession(void) const { return mSession; }
 
+    // Wall clock time of the oldest gadget value restored from the state
+    // file, 0 if the peer's gadgets were not restored.
+    uint64_t restoredAt(void) const { return mRestoredAt; }
+    void restoredAt(uint64_t stamp) { mRestoredAt = stamp; }
+
 private:
     std::shared_ptr<CFriend> mFriend;
-    std::map<std::string, std::shared_ptr<CGadget>> mGadgets;
+    std::array<std::shared_ptr<CGadget>, GadgetKindCount> mGadgets;
     std::shared_ptr<CSession> mSession;
+    uint64_t mRestoredAt;
 };
 
 class CAgent {
@@ -43,6 +57,9 @@ public:
     explicit CAgent(std::shared_ptr<CInput> input):
         mWhisper(NULL),
         mIsConnected(false),
+        mIdleInterval(500),
+        mStateTtl(0),
+        mLayerCheck(0),
         mUser(NULL),
         mInput(input),
         mPeers(),
@@ -63,46 +80,98 @@ public:
     void showMe(void) const;
 
     // about Peers.
-    void addPeer(const std::string &name, std::shared_ptr<CFriend>, bool sync = true);
-    void delPeer(const std::string &name);
-    void updatePeer(const std::string &name, std::shared_ptr<CFriend>);
-    void updatePeer(const std::string &name, WhisperConnectionStatus);
+    void addPeer(const IdRef &peerId, std::shared_ptr<CFriend>, bool sync = true);
+    void delPeer(const IdRef &peerId);
+    void updatePeer(const IdRef &peerId, std::shared_ptr<CFriend>);
+    void updatePeer(const IdRef &peerId, WhisperConnectionStatus);
 
     // about session.
-    void addSession(const std::string &name, std::shared_ptr<CSession>);
+    void addSession(const IdRef &peerId, std::shared_ptr<CSession>);
+
+    // Camera pipeline asked for by "wdemo-camera:<name>" in the session
+    // request, the first one without.
+    int sessionCamera(const char *sdp) const;
+
+    // Sets the camera and simulcast layer of a new session from its
+    // request: a sub layer named by "wdemo-camera:" or "wdemo-layer:main"
+    // or "wdemo-layer:sub" pin the layer, otherwise it follows write loss,
+    // starting on the sub layer.
+    void sessionLayers(CSession &sess, const char *sdp) const;
+
+    // Idle callback; moves viewers between simulcast layers by the write
+    // loss on their streams, once per window.
+    void adaptLayers(void);
+
+    // Media worker @shard of @camera, before writing a key frame; its
+    // viewers waiting for that layer switch to it. Each worker does its
+    // own, once it is done with the frames before.
+    void switchLayers(int camera, size_t shard = 0, size_t shards = 1);
 
     void reqAddPeer(const std::string &name) const;
     void listPeers(bool withGadget = false) const;
 
     // about gadgets.
-    std::shared_ptr<CGadget> getGadget(const std::string &) const;
-    std::shared_ptr<CGadget> getGadget(const std::string &, const std::string&) const;
+    std::shared_ptr<CGadget> getGadget(GadgetKind kind) const { return mGadgets[kind]; }
+    std::shared_ptr<CGadget> getGadget(const IdRef &peerId, GadgetKind kind) const;
     void addGadget(std::shared_ptr<CGadget> gadget);
 
     void didGadgetValueChange(const CGadget &gadget) const;
-    void didGadgetValueChange(const CGadget &gadget, const std::string&) const;
 
-    void handleQuery(const std::string &peerName) const;
-    void handleStatus(const std::string &peerName, const std::map<std::string, GadgetValue>&);
-    void handleSync(const std::string &peerName, const std::map<std::string, GadgetValue>&);
-    void handleModify(const std::string &peerName, const std::map<std::string, GadgetValue>&);
+    // Peer gadget commands; an empty peer list addresses every peer.
+    void showPeerGadgets(GadgetKind kind, const std::vector<std::string> &peerIds) const;
+    void modifyPeerGadgets(GadgetKind kind, const GadgetValue &value,
+                           const std::vector<std::string> &peerIds);
+
+    // Commands to run once the agent is ready.
+    void setScript(const char *path) { mScript = path; }
+
+    // Persist gadget values there and restore them when gadgets or peers
+    // are added; set before adding gadgets.
+    void setState(std::shared_ptr<CStateFile> state) { mState = state; }
+
+    void handleQuery(const IdRef &peerId, const GadgetValues&);
+    void handleStatus(const IdRef &peerId, const GadgetValues&);
+    void handleSync(const IdRef &peerId, const GadgetValues&);
+    void handleModify(const IdRef &peerId, const GadgetValues&);
 
-    void sendVideoFrame(const uint8_t*, int);
+    // Write one RTP packet to the viewers of @camera whose shard() falls
+    // on @shard of @shards and who are on that layer; called by the media
+    // workers of the camera's pipeline, each with its own shard.
+    void sendVideoFrame(const uint8_t*, int, int camera = 0,
+                        size_t shard = 0, size_t shards = 1);
 
 private:
-    void refreshPeerGadgets(const std::string &peerName) const;
+    void refreshPeerGadgets(const char *peerId) const;
     void refreshPeerGadgets(void) const;
+    void syncPeerGadgets(const IdRef &peerId, const GadgetValues&);
+    void addPeerGadget(const char *peerId, CPeer &peer, GadgetKind kind,
+                       const GadgetValue &value, bool restored = false);
+    void restorePeerGadgets(const char *peerId, CPeer &peer);
+    void publishSessions(void);
+    int sendMessage(const char *to, const std::string &msg) const;
 private:
     Whisper *mWhisper;
 
     bool mIsConnected;
     bool mIsDummy;
+    int mIdleInterval;
+    int mStateTtl;
+    uint64_t mLayerCheck;
 
     std::shared_ptr<CUser> mUser;
 
     std::shared_ptr<CInput> mInput;
-    std::map<std::string, CPeer> mPeers;
-    std::map<std::string, std::shared_ptr<CGadget>> mGadgets;
+    std::string mScript;
+    std::shared_ptr<CStateFile> mState;
+    std::vector<std::string> mCameras;
+    std::vector<int> mSubLayers;    // per camera, its sub layer or -1
+    std::vector<int> mMainLayers;   // per camera, the camera it is a layer of
+    CIdMap<std::shared_ptr<CPeer>> mPeers;
+    std::array<std::shared_ptr<CGadget>, GadgetKindCount> mGadgets;
+
+    // Immutable lists of peer sessions read by the media path without
+    // locking; rebuilt by the whisper thread whenever peers change.
+    CRcuPtr<SessionLists> mSessions;
 };
 
 #endif /* __AGENT_H__ */
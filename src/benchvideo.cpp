@@ -0,0 +1,405 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <fstream>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "wstub.h"
+#include "vlog.h"
+#include "cfg.h"
+#include "input.h"
+#include "agent.h"
+#include "gadget.h"
+#include "json.h"
+#include "probe.h"
+#include "metrics.h"
+#include "histogram.h"
+#include "sim/sim.h"
+
+/*
+ * wdemo-bench-video: end to end numbers for the media path. The camera
+ * gadget opens its configured driver (libsim.so, which stamps every frame
+ * with its capture time) and frames go through the real pipeline, camera
+ * callback, the media workers (CRtp::streamFwd, CAgent::sendVideoFrame and
+ * CSession::write),
+ * into the stream writes of the whisper stub (wstub.h), captured here, with
+ * one session per synthetic viewer. Stage times come from the PROBE() points
+ * compiled into this build; glass-to-wire is the time from capture to the
+ * last packet of the frame reaching the sink, per viewer.
+ */
+
+struct BenchOptions {
+    int sessions;
+    int duration;       // seconds measured
+    int warmup;         // seconds before measuring
+    const char *output;
+    const char *label;
+};
+
+static BenchOptions opts = {
+    10,                     // sessions
+    10,                     // duration
+    2,                      // warmup
+    "bench-video.json",     // output
+    ""                      // label
+};
+
+/*
+ * Everything below is written by the camera thread and the media workers
+ * under statsLock while measuring is set, and read by the main thread once
+ * the camera is closed.
+ */
+static std::atomic<bool> measuring(false);
+static std::mutex statsLock;
+static CHistogram stages[ProbeStageCount];
+static CHistogram sinkTime;
+static CHistogram glassToWire;
+static uint64_t sinkWrites = 0;
+static uint64_t sinkBytes = 0;
+// A worker sees the stamp of a frame before its packets.
+static thread_local uint64_t captureStamp = 0;
+static thread_local uint8_t wire[2048];
+
+static double benchSeconds = 0;
+static uint64_t benchCpuUs = 0;
+static uint64_t benchPackets = 0;   // RTP packets built while measuring
+
+#define PROBE_STAGE_NAME(id, name) name,
+static const char *stageNames[] = {
+    PROBE_STAGE_LIST(PROBE_STAGE_NAME)
+};
+#undef PROBE_STAGE_NAME
+
+void probeDone(ProbeStage stage, uint64_t start, uint64_t end)
+{
+    if (measuring.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(statsLock);
+        stages[stage].record(end - start);
+    }
+}
+
+static
+uint64_t cpuTimeUs(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static
+std::string viewerId(int index)
+{
+    char id[WHISPER_MAX_ID_LEN + 1];
+
+    snprintf(id, sizeof(id), "Viewer%038d", index);
+    return id;
+}
+
+/*
+ * RTP packets from CRtp: 12 byte header, then either a whole NAL unit or
+ * an FU-A fragment (indicator type 28, header with S/E bits).
+ */
+static
+void inspectPacket(const uint8_t *pkt, size_t len, uint64_t now)
+{
+    const uint8_t *nal = pkt + 12;
+    uint32_t index;
+    uint64_t stamp;
+    int type;
+    bool frameEnd;
+
+    if (len <= 12)
+        return;
+
+    type = nal[0] & 0x1f;
+    if (type == 6 && sim_stamp_parse(nal, (int)(len - 12), &stamp, &index)) {
+        captureStamp = stamp;
+        return;
+    }
+
+    if (type == 28)
+        frameEnd = len > 13 && (nal[1] & 0x40) &&
+                   ((nal[1] & 0x1f) == 1 || (nal[1] & 0x1f) == 5);
+    else
+        frameEnd = (type == 1 || type == 5);
+
+    if (frameEnd && captureStamp && now > captureStamp)
+        glassToWire.record(now - captureStamp);
+}
+
+static
+Json::Value histogramJson(const CHistogram &h)
+{
+    Json::Value node;
+
+    node["count"] = (Json::UInt64)h.count();
+    node["mean_us"] = h.mean() / 1000.0;
+    node["p50_us"] = h.percentile(50) / 1000.0;
+    node["p90_us"] = h.percentile(90) / 1000.0;
+    node["p99_us"] = h.percentile(99) / 1000.0;
+    node["p999_us"] = h.percentile(99.9) / 1000.0;
+    node["max_us"] = h.max() / 1000.0;
+    return node;
+}
+
+static
+void printHistogram(const char *name, const CHistogram &h)
+{
+    printf("%-14s %9lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+           (unsigned long)h.count(), h.mean() / 1000.0,
+           h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+           h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+           h.max() / 1000.0);
+}
+
+static
+bool report(const std::shared_ptr<CConfig> &cfg, double seconds, uint64_t cpuUs)
+{
+    uint64_t frames = stages[ProbeCamera].count();
+    uint64_t packets = benchPackets;
+    Json::Value root;
+    Json::Value config;
+    Json::Value results;
+
+    printf("%-14s %9s %9s %9s %9s %9s %9s %9s\n", "stage (us)", "count",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < ProbeStageCount; i++)
+        printHistogram(stageNames[i], stages[i]);
+    printHistogram("sink", sinkTime);
+    printHistogram("glass_to_wire", glassToWire);
+
+    printf("%lu frames, %.1f rtp packets/s, %.1f writes/s, %.1f kbit/s per viewer, "
+           "%.1f us cpu/frame (%.1f%% cpu)\n", (unsigned long)frames,
+           packets / seconds, sinkWrites / seconds,
+           opts.sessions ? sinkBytes * 8 / seconds / 1000 / opts.sessions : 0.0,
+           frames ? (double)cpuUs / frames : 0.0, cpuUs / seconds / 1e4);
+
+    config["label"] = opts.label;
+    config["sessions"] = opts.sessions;
+    config["duration_s"] = seconds;
+    // Viewers all watch the first camera.
+    const CameraConfig &cam = cfg->cameras()[0];
+    config["camera"] = cam.name;
+    config["width"] = cam.width;
+    config["height"] = cam.height;
+    config["framerate"] = cam.framerate;
+    config["bitrate"] = cam.bitrate;
+    root["config"] = config;
+
+    results["frames"] = (Json::UInt64)frames;
+    results["rtp_packets"] = (Json::UInt64)packets;
+    results["writes"] = (Json::UInt64)sinkWrites;
+    results["bytes"] = (Json::UInt64)sinkBytes;
+    results["rtp_packets_per_s"] = packets / seconds;
+    results["writes_per_s"] = sinkWrites / seconds;
+    results["cpu_us_per_frame"] = frames ? (double)cpuUs / frames : 0.0;
+    results["cpu_percent"] = cpuUs / seconds / 1e4;
+    root["results"] = results;
+
+    for (int i = 0; i < ProbeStageCount; i++)
+        root["stages"][stageNames[i]] = histogramJson(stages[i]);
+    root["stages"]["sink"] = histogramJson(sinkTime);
+    root["glass_to_wire"] = histogramJson(glassToWire);
+
+    std::ofstream out(opts.output);
+    if (!out) {
+        vlogE("Write results to %s error", opts.output);
+        return false;
+    }
+
+    Json::StyledWriter writer;
+    out << writer.write(root);
+    printf("results written to %s\n", opts.output);
+    return true;
+}
+
+static
+void runBench(Whisper *w, int idleInterval)
+{
+    std::vector<std::string> viewers;
+    struct timespec start, end;
+    uint64_t cpuStart;
+    uint64_t packetStart;
+
+    if (w->callbacks.self_info) {
+        WhisperUserInfo info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.userid, sizeof(info.userid), "%s", "BenchHost");
+        w->callbacks.self_info(w, &info, w->context);
+    }
+
+    for (int i = 0; i < opts.sessions; i++) {
+        WhisperFriendInfo info;
+
+        viewers.push_back(viewerId(i));
+        memset(&info, 0, sizeof(info));
+        snprintf(info.user_info.userid, sizeof(info.user_info.userid), "%s",
+                 viewers.back().c_str());
+        info.status = WhisperConnectionStatus_Connected;
+        w->callbacks.friend_list(w, &info, w->context);
+    }
+    w->callbacks.friend_list(w, NULL, w->context);
+    w->callbacks.connection_status(w, WhisperConnectionStatus_Connected, w->context);
+    w->callbacks.ready(w, w->context);
+
+    static const char sdp[] = "v=0 whisper-ice-session bench";
+    for (auto &viewer : viewers)
+        w->sessionCb(w, viewer.c_str(), sdp, sizeof(sdp), w->sessionContext);
+    wstubDeliverStates();
+
+    printf("%d viewers connected, warming up %d s, measuring %d s\n",
+           opts.sessions, opts.warmup, opts.duration);
+    fflush(stdout);
+
+    for (int i = 0; i < opts.warmup * 1000 / idleInterval && !w->stopping.load(); i++) {
+        w->callbacks.idle(w, w->context);
+        usleep(idleInterval * 1000);
+    }
+
+    cpuStart = cpuTimeUs();
+    packetStart = metricRtpPackets.value();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    measuring.store(true);
+
+    for (int i = 0; i < opts.duration * 1000 / idleInterval && !w->stopping.load(); i++) {
+        w->callbacks.idle(w, w->context);
+        wstubDeliverStates();
+        usleep(idleInterval * 1000);
+    }
+
+    measuring.store(false);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    benchSeconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    benchCpuUs = cpuTimeUs() - cpuStart;
+    benchPackets = metricRtpPackets.value() - packetStart;
+}
+
+/*
+ * Stream writes of the media workers; while measuring they land in
+ * inspectPacket().
+ */
+static
+int capturePacket(WhisperSession *ws, const void *data, size_t len)
+{
+    if (!measuring.load(std::memory_order_relaxed))
+        return 0;
+
+    uint64_t start = probeClock();
+
+    // Copy out like the SDK does before returning.
+    size_t copied = len < sizeof(wire) ? len : sizeof(wire);
+    memcpy(wire, data, copied);
+
+    std::lock_guard<std::mutex> lock(statsLock);
+    inspectPacket(wire, copied, start);
+
+    sinkWrites++;
+    sinkBytes += len;
+    sinkTime.record(probeClock() - start);
+    return 0;
+}
+
+static
+void usage(const char *prog)
+{
+    printf("\nUsage: %s -c CONFIG_FILE [options]\n"
+           "  -n, --sessions N     viewers, one session each (%d)\n"
+           "  -d, --duration SEC   seconds measured (%d)\n"
+           "  -w, --warmup SEC     seconds before measuring (%d)\n"
+           "  -o, --output FILE    JSON results (%s)\n"
+           "  -l, --label TEXT     recorded in the results, e.g. a release\n"
+           "The config must point the camera at a driver stamping its frames,\n"
+           "i.e. libsim.so.\n",
+           prog, opts.sessions, opts.duration, opts.warmup, opts.output);
+}
+
+int main(int argc, char **argv)
+{
+    struct option options[] = {
+        { "config",         required_argument,  NULL, 'c' },
+        { "sessions",       required_argument,  NULL, 'n' },
+        { "duration",       required_argument,  NULL, 'd' },
+        { "warmup",         required_argument,  NULL, 'w' },
+        { "output",         required_argument,  NULL, 'o' },
+        { "label",          required_argument,  NULL, 'l' },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL,             0,                  NULL,  0  }
+    };
+    const char *config = NULL;
+    int opt;
+    int idx;
+
+    while ((opt = getopt_long(argc, argv, "c:n:d:w:o:l:h?", options, &idx)) != -1) {
+        switch (opt) {
+        case 'c': config = optarg; break;
+        case 'n': opts.sessions = atoi(optarg); break;
+        case 'd': opts.duration = atoi(optarg); break;
+        case 'w': opts.warmup = atoi(optarg); break;
+        case 'o': opts.output = optarg; break;
+        case 'l': opts.label = optarg; break;
+
+        case 'h':
+        case '?':
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!config || opts.sessions < 0 || opts.duration <= 0 || opts.warmup < 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    WhisperStubHooks hooks = { runBench, NULL, NULL, NULL, NULL, capturePacket };
+    wstubSetup("BenchHost", hooks);
+
+    std::shared_ptr<CConfig> cfg(new CConfig());
+    if (!cfg || !cfg->load(config)) {
+        vlogE("Load config %s error. recheck it.", config);
+        return -1;
+    }
+
+    if (!cfg->drivers() || !cfg->drivers()->provides("camera")) {
+        vlogE("No camera driver in %s, configure libsim.so for camera", config);
+        return -1;
+    }
+
+    if (logFileOpen(cfg->logPath(), VLOG_ERR) < 0)
+        vlogW("Open log %s error, log to console only.", cfg->logPath());
+    logAsyncStart();
+
+    std::shared_ptr<CInput> input(new CInput());
+    std::shared_ptr<CAgent> agent(new CAgent(input));
+
+    std::shared_ptr<CGadget> camera(new CCamera(cfg, agent.get(), false));
+    if (!camera || !camera->open()) {
+        vlogE("Open camera gadget error");
+        return -1;
+    }
+    agent->addGadget(camera);
+
+    if (!agent->setup(cfg)) {
+        vlogE("Setup agent error");
+        return -1;
+    }
+
+    agent->run();
+
+    // Joins the camera thread, the numbers are stable from here on.
+    camera->close();
+
+    return report(cfg, benchSeconds, benchCpuUs) ? 0 : -1;
+}
@@ -0,0 +1,213 @@
+#include <cstring>
+#include <memory>
+
+#include <sys/time.h>
+
+#define VLOG_MODULE VLOG_MOD_CAMERA
+#include "vlog.h"
+#include "camera.h"
+#include "agent.h"
+#include "gadget.h"
+#include "probe.h"
+#include "metrics.h"
+
+void CCameraPipeline::streamFwd(void *data, int len, void *argv)
+{
+    CCameraPipeline *pipeline = static_cast<CCameraPipeline*>(argv);
+    PROBE(Camera);
+
+    metricCameraFrames.add();
+    metricCameraBytes.add(len);
+
+    timeval now;
+    gettimeofday(&now, NULL);
+
+    uint32_t ts = (uint32_t)(now.tv_sec * 1000 + now.tv_usec/1000);
+
+    pipeline->mMedia.submit((const uint8_t*)data, len, ts);
+}
+
+bool CCameraPipeline::open(const GadgetDriver *driver, std::shared_ptr<CConfig> cfg)
+{
+    bool instances = GADGET_DRIVER_HAS(driver, cameras) && driver->cameras.open;
+
+    // Single camera ops only have the one camera.
+    if (!instances && mIndex > 0) {
+        vlogE("Driver %s runs a single camera, camera %s not opened",
+              driver->name, name());
+        return false;
+    }
+
+    if (!mMedia.setup(cfg))
+        return false;
+
+    mDriver = driver;
+
+    if (instances) {
+        GadgetCameraParams params;
+
+        memset(&params, 0, sizeof(params));
+        params.size      = sizeof(params);
+        params.name      = mCam.name.c_str();
+        params.device    = mCam.device;
+        params.port      = mCam.port;
+        params.width     = mCam.width;
+        params.height    = mCam.height;
+        params.bitrate   = mCam.bitrate;
+        params.framerate = mCam.framerate;
+        params.profile   = mCam.profile;
+        params.intra     = mCam.intra;
+        params.source    = mCam.source.empty() ? NULL : mCam.source.c_str();
+
+        mHandle = driver->cameras.open(&params, streamFwd, this);
+        if (!mHandle) {
+            vlogE("Open camera %s error", name());
+            mMedia.stop();
+            return false;
+        }
+    } else {
+        driver->camera.set_callbacks(streamFwd, this);
+        driver->camera.set_port(mCam.port);
+        driver->camera.set_parameters(mCam.width, mCam.height, mCam.bitrate,
+                                      mCam.framerate, mCam.profile);
+
+        if (driver->camera.open() != 0) {
+            vlogE("Open camera %s error", name());
+            mMedia.stop();
+            return false;
+        }
+    }
+
+    mOpened = true;
+    mRunning = true;
+    vlogI("Camera %s opened, %dx%d@%d", name(), mCam.width, mCam.height,
+          mCam.framerate);
+    return true;
+}
+
+bool CCameraPipeline::flip(bool on)
+{
+    int rc;
+
+    if (!mOpened)
+        return false;
+    if (mRunning == on)
+        return true;
+
+    // Single camera ops toggle.
+    rc = mHandle ? mDriver->cameras.flip(mHandle, on) : mDriver->camera.flip();
+    if (rc < 0) {
+        vlogE("Camera %s turn %s error", name(), on ? "on": "off");
+        return false;
+    }
+
+    mRunning = on;
+    vlogI("Camera %s turned %s", name(), on ? "on": "off");
+    return true;
+}
+
+void CCameraPipeline::close(void)
+{
+    if (!mOpened)
+        return;
+
+    if (mHandle)
+        mDriver->cameras.close(mHandle);
+    else
+        mDriver->camera.close();
+    mHandle = NULL;
+    mOpened = false;
+    mRunning = false;
+
+    // The camera thread is gone, nothing submits any more.
+    mMedia.stop();
+}
+
+bool CCamera::open(void)
+{
+    if (!openDriver(mCfg.get(), mDriver))
+        return false;
+
+    if (!mDriver)
+        return true;
+
+    const std::vector<CameraConfig> &cameras = mCfg->cameras();
+
+    for (size_t i = 0; i < cameras.size(); i++) {
+        std::shared_ptr<CCameraPipeline> pipeline(
+                new CCameraPipeline(mAgent, (int)i, cameras[i]));
+        if (!pipeline) {
+            vlogE("Out of memory!!!");
+            close();
+            return false;
+        }
+
+        // Cameras opened so far would keep streaming into a dead agent.
+        if (!pipeline->open(mDriver, mCfg)) {
+            close();
+            return false;
+        }
+
+        mPipelines.push_back(pipeline);
+    }
+
+    // Cameras stream from the moment they open.
+    sync(GadgetValue(!mPipelines.empty()));
+    return true;
+}
+
+bool CCamera::flip(const char *camera, bool on)
+{
+    bool running = false;
+    bool found = false;
+
+    for (size_t i = 0; i < mPipelines.size(); i++) {
+        if (strcmp(mPipelines[i]->name(), camera) == 0) {
+            found = true;
+            if (!mPipelines[i]->flip(on))
+                return false;
+        }
+        running = running || mPipelines[i]->running();
+    }
+
+    if (!found) {
+        vlogE("No camera %s", camera);
+        return false;
+    }
+
+    // The gadget is on while any of its cameras is.
+    GadgetValue value(running);
+    if (!(value == this->value())) {
+        sync(value);
+        mAgent->didGadgetValueChange(*this);
+    }
+    return true;
+}
+
+void CCamera::list(void) const
+{
+    if (mPipelines.empty()) {
+        vlogI("No camera driver");
+        return;
+    }
+
+    for (size_t i = 0; i < mPipelines.size(); i++)
+        vlogI("  %s\t%s", mPipelines[i]->name(), mPipelines[i]->running() ? "on" : "off");
+}
+
+void CCamera::flip(bool on)
+{
+    if (mDriver) {
+        for (size_t i = 0; i < mPipelines.size(); i++)
+            mPipelines[i]->flip(on);
+    } else {
+        vlogI("camera turned %s", on ? "on": "off");
+    }
+}
+
+void CCamera::close(void)
+{
+    for (size_t i = 0; i < mPipelines.size(); i++)
+        mPipelines[i]->close();
+    mPipelines.clear();
+}
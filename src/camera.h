@@ -0,0 +1,47 @@
+#ifndef __CAMERA_H__
+#define __CAMERA_H__
+
+#include <memory>
+
+#include "cfg.h"
+#include "media.h"
+#include "gadget_driver.h"
+
+class CAgent;
+
+/*
+ * One camera pipeline: a camera instance of the driver (its own encoder
+ * and ingest thread), the media workers packetizing its frames and the
+ * viewers that asked for it. Pipelines share nothing, so several cameras,
+ * or a main and a sub stream of one, run side by side in one process.
+ */
+class CCameraPipeline {
+public:
+    CCameraPipeline(CAgent *agent, int index, const CameraConfig &cam):
+        mIndex(index), mCam(cam), mMedia(agent, index),
+        mDriver(NULL), mHandle(NULL), mOpened(false), mRunning(false) {}
+    ~CCameraPipeline() { close(); }
+
+public:
+    const char *name(void) const { return mCam.name.c_str(); }
+    bool running(void) const { return mRunning; }
+
+    bool open(const GadgetDriver *driver, std::shared_ptr<CConfig> cfg);
+    bool flip(bool on);
+    void close(void);
+
+private:
+    static void streamFwd(void *data, int len, void *argv);
+
+private:
+    int mIndex;
+    CameraConfig mCam;
+    CMediaPool mMedia;
+
+    const GadgetDriver *mDriver;
+    void *mHandle;      // driver camera instance, NULL on single camera ops
+    bool mOpened;
+    bool mRunning;      // the driver streams its frames
+};
+
+#endif /* __CAMERA_H__ */
@@ -3,8 +3,8 @@
 #include <memory>
 #include <string>
 #include <cassert>
-#include <dlfcn.h>
 
+#define VLOG_MODULE VLOG_MOD_CFG
 #include "vlog.h"
 #include "confuse.h"
 #include "cfg.h"
@@ -73,13 +73,13 @@ CConfig::~CConfig()
 {
     if (mCfg)
         cfg_free(mCfg);
-
-    if (mDylib)
-        dlclose(mDylib);
 }
 
 bool CConfig::load(const char *cfgFile)
 {
+    // Default of list options; libconfuse takes it as char *.
+    static char emptyList[] = "{}";
+
     cfg_opt_t transportOpts[] = {
         CFG_STR("server", NULL, CFGF_NONE),
         CFG_STR("username", NULL, CFGF_NONE),
@@ -88,6 +88,8 @@ bool CConfig::load(const char *cfgFile)
     };
 
     cfg_opt_t cameraOpts[] = {
+        CFG_STR("name", "main", CFGF_NONE),
+        CFG_INT("device", -1, CFGF_NONE),
         CFG_INT("port", 12300, CFGF_NONE),
         CFG_INT("width", 320, CFGF_NONE),
         CFG_INT("height", 480, CFGF_NONE),
@@ -95,11 +97,33 @@ bool CConfig::load(const char *cfgFile)
         CFG_INT("bitrate", 150000, CFGF_NONE),
         CFG_INT("framerate", 30, CFGF_NONE),
         CFG_INT("intra", 10, CFGF_NONE),
+        CFG_STR("simulcast", NULL, CFGF_NONE),
+        CFG_STR("source", NULL, CFGF_NONE),
+        CFG_END()
+    };
+
+    cfg_opt_t driverOpts[] = {
+        CFG_STR("library", NULL, CFGF_NONE),
+        CFG_STR_LIST("gadgets", emptyList, CFGF_NONE),
+        CFG_END()
+    };
+
+    cfg_opt_t torchOpts[] = {
+        CFG_INT("refresh", 60, CFGF_NONE),
+        CFG_END()
+    };
+
+    cfg_opt_t mediaOpts[] = {
+        CFG_INT("workers", 1, CFGF_NONE),
+        CFG_INT_LIST("cpus", emptyList, CFGF_NONE),
+        CFG_INT("priority", 0, CFGF_NONE),
+        CFG_INT("pacing", 25, CFGF_NONE),
         CFG_END()
     };
 
     cfg_opt_t hostOpts[] = {
-        CFG_SEC("camera", cameraOpts, CFGF_NONE),
+        CFG_SEC("camera", cameraOpts, CFGF_MULTI),
+        CFG_SEC("torch", torchOpts, CFGF_NONE),
         CFG_END()
     };
 
@@ -111,9 +135,21 @@ bool CConfig::load(const char *cfgFile)
         CFG_STR("appkey", NULL, CFGF_NONE),
         CFG_INT("loglevel", 3, CFGF_NONE),
         CFG_STR("logpath", NULL, CFGF_NONE),
+        CFG_STR("logformat", "text", CFGF_NONE),
+        CFG_STR("binlogpath", NULL, CFGF_NONE),
+        CFG_INT("logrotatesize", 1024, CFGF_NONE),
+        CFG_INT("logrotateage", 24, CFGF_NONE),
+        CFG_INT("logrotatekeep", 3, CFGF_NONE),
+        CFG_INT("idleinterval", 500, CFGF_NONE),
         CFG_STR("datadir", NULL, CFGF_NONE),
+        CFG_INT("statettl", 600, CFGF_NONE),
+        CFG_STR("metricspath", NULL, CFGF_NONE),
+        CFG_INT("stallthreshold", 2000, CFGF_NONE),
         CFG_SEC("transport", transportOpts, CFGF_TITLE | CFGF_MULTI | CFGF_NO_TITLE_DUPES),
         CFG_SEC("runhost", hostOpts, CFGF_TITLE | CFGF_MULTI | CFGF_NO_TITLE_DUPES),
+        CFG_SEC("driver", driverOpts, CFGF_TITLE | CFGF_MULTI | CFGF_NO_TITLE_DUPES),
+        CFG_SEC("media", mediaOpts, CFGF_NONE),
+        CFG_SEC("torch", torchOpts, CFGF_NONE),
         CFG_END()
     };
     int rc;
@@ -164,6 +200,8 @@ bool CConfig::load(const char *cfgFile)
         mTrustStore = nullptr;
     }
 
+    mCameras.clear();
+
     mLogLevel = getInt(mCfg, "loglevel");
 
     mLogFile = getString(mCfg, "logpath");
@@ -172,12 +210,54 @@ bool CConfig::load(const char *cfgFile)
         return false;
     }
 
+    mLogFormat = getString(mCfg, "logformat");
+    if (!mLogFormat || (mLogFormat->compare("text") != 0 &&
+                        mLogFormat->compare("binary") != 0)) {
+        vlogE("Invalid logformat %s", mLogFormat ? mLogFormat->c_str() : "none");
+        return false;
+    }
+
+    mBinLogFile = getString(mCfg, "binlogpath");
+    if (binaryLog() && !mBinLogFile) {
+        vlogE("Missing binlogpath");
+        return false;
+    }
+
+    mLogRotateSize = getInt(mCfg, "logrotatesize");
+    mLogRotateAge = getInt(mCfg, "logrotateage");
+    mLogRotateKeep = getInt(mCfg, "logrotatekeep");
+    if (mLogRotateSize < 0 || mLogRotateAge < 0 || mLogRotateKeep < 0) {
+        vlogE("Invalid log rotation settings");
+        return false;
+    }
+
+    mIdleInterval = getInt(mCfg, "idleinterval");
+    if (mIdleInterval <= 0) {
+        vlogE("Invalid idleinterval %d", mIdleInterval);
+        return false;
+    }
+
     mDataDir = getString(mCfg, "datadir");
     if (!mDataDir) {
         vlogE("Missing datadir");
         return false;
     }
 
+    mStateTtl = getInt(mCfg, "statettl");
+    if (mStateTtl < 0) {
+        vlogE("Invalid statettl %d", mStateTtl);
+        return false;
+    }
+
+    mMetricsPath = getString(mCfg, "metricspath");
+
+    // The idle callback beats once per idleinterval at best.
+    mStallThreshold = getInt(mCfg, "stallthreshold");
+    if (mStallThreshold < 0 || (mStallThreshold && mStallThreshold <= mIdleInterval)) {
+        vlogE("Invalid stallthreshold %d, must exceed idleinterval", mStallThreshold);
+        return false;
+    }
+
     cfg_t *sec;
     sec = cfg_getsec(mCfg, "transport");
     if (!sec) {
@@ -210,48 +290,119 @@ bool CConfig::load(const char *cfgFile)
         return false;
     }
 
-    const char *dylibName;
+    // Without a runhost, the torch of the driver sections is set up at the
+    // top level.
+    sec = cfg_getsec(mCfg, "torch");
+    mTorchRefresh = sec ? getInt(sec, "refresh") : 60;
 
     sec = cfg_getsec(mCfg, "runhost");
     if (!sec) {
         mDummy = false;
-        dylibName = NULL;
     } else {
         title = cfg_title(sec);
-
-        if (!title || strcmp(title, "raspberry") != 0) {
-            vlogE("Invalid run host %s", title);
+        if (!title) {
+            vlogE("Missing run host name");
             return false;
         }
 
-        sec = cfg_getsec(sec, "camera");
-        if (!sec) {
+        cfg_t *host = sec;
+
+        sec = cfg_getsec(host, "torch");
+        if (sec)
+            mTorchRefresh = getInt(sec, "refresh");
+
+        unsigned int ncameras = cfg_size(host, "camera");
+        if (!ncameras) {
             vlogE("Missing runhost.camera");
             return false;
         }
 
-        mCameraPort = getInt(sec, "port");
-        mWidthRes = getInt(sec, "width");
-        mHeightRes = getInt(sec, "height");
-        mBitRate = getInt(sec, "bitrate");
-        mFrameRate = getInt(sec, "framerate");
+        for (unsigned int i = 0; i < ncameras; i++) {
+            if (!loadCamera(cfg_getnsec(host, "camera", i)))
+                return false;
+        }
 
-        mProfile = getString(sec, "profile");
-        if (!mProfile) {
-            vlogE("Missing profile");
+        if (!loadSimulcast(host))
             return false;
-        }
 
         mDummy = true;
-        dylibName = "libraspi.so";
     }
 
-    if (dylibName) {
-        mDylib = dlopen(dylibName, RTLD_NOW);
-        if (!mDylib) {
-            vlogE("Loading dynamic library %s error: %s", dylibName, dlerror());
+    if (mTorchRefresh < 0) {
+        vlogE("Invalid torch.refresh %d", mTorchRefresh);
+        return false;
+    }
+
+    if (mCameras.empty())
+        mCameras.push_back(CameraConfig());
+
+    sec = cfg_getsec(mCfg, "media");
+    mMediaWorkers = sec ? getInt(sec, "workers") : 1;
+    mMediaPriority = sec ? getInt(sec, "priority") : 0;
+    mMediaPacing = sec ? getInt(sec, "pacing") : 25;
+    mMediaCpus.clear();
+
+    if (mMediaWorkers < 1 || mMediaWorkers > maxMediaWorkers) {
+        vlogE("Invalid media.workers %d (1-%d)", mMediaWorkers, maxMediaWorkers);
+        return false;
+    }
+
+    if (mMediaPriority < 0 || mMediaPriority > 99) {
+        vlogE("Invalid media.priority %d (0-99)", mMediaPriority);
+        return false;
+    }
+
+    if (mMediaPacing < 0 || mMediaPacing > 100) {
+        vlogE("Invalid media.pacing %d (0-100)", mMediaPacing);
+        return false;
+    }
+
+    unsigned int ncpus = sec ? cfg_size(sec, "cpus") : 0;
+    for (unsigned int i = 0; i < ncpus; i++) {
+        int cpu = (int)cfg_getnint(sec, "cpus", i);
+        if (cpu < 0) {
+            vlogE("Invalid media.cpus entry %d", cpu);
             return false;
         }
+        mMediaCpus.push_back(cpu);
+    }
+
+    mDrivers = std::shared_ptr<CDriverRegistry>(new CDriverRegistry());
+    if (!mDrivers) {
+        vlogE("Out of memory!!!");
+        return false;
+    }
+
+    unsigned int count = cfg_size(mCfg, "driver");
+    for (unsigned int i = 0; i < count; i++) {
+        std::vector<std::string> gadgets;
+
+        sec = cfg_getnsec(mCfg, "driver", i);
+        title = cfg_title(sec);
+
+        const char *library = cfg_getstr(sec, "library");
+        if (!library) {
+            vlogE("Missing library of driver %s", title);
+            return false;
+        }
+
+        unsigned int n = cfg_size(sec, "gadgets");
+        for (unsigned int j = 0; j < n; j++)
+            gadgets.push_back(cfg_getnstr(sec, "gadgets", j));
+
+        if (gadgets.empty()) {
+            vlogE("Driver %s provides no gadgets", title);
+            return false;
+        }
+
+        if (!mDrivers->add(title, library, gadgets))
+            return false;
+    }
+
+    // Old configs only had the run host, which implied the raspberry board.
+    if (mDummy && !count) {
+        std::vector<std::string> gadgets = { "torch", "camera" };
+        mDrivers->add("raspi", "libraspi.so", gadgets);
     }
 
     cfg_free(mCfg);
@@ -260,8 +411,134 @@ bool CConfig::load(const char *cfgFile)
     return true;
 }
 
+bool CConfig::loadCamera(cfg_t *sec)
+{
+    CameraConfig cam;
+
+    std::shared_ptr<std::string> name = getString(sec, "name");
+    std::shared_ptr<std::string> profile = getString(sec, "profile");
+    if (!name || name->empty() || !profile) {
+        vlogE("Missing camera name or profile");
+        return false;
+    }
+
+    cam.name = *name;
+    cam.device = getInt(sec, "device");
+    cam.port = getInt(sec, "port");
+    cam.width = getInt(sec, "width");
+    cam.height = getInt(sec, "height");
+    cam.bitrate = getInt(sec, "bitrate");
+    cam.framerate = getInt(sec, "framerate");
+    cam.intra = getInt(sec, "intra");
+
+    std::shared_ptr<std::string> source = getString(sec, "source");
+    if (source)
+        cam.source = *source;
+
+    if (profile->compare("high") == 0)
+        cam.profile = 2;
+    else if (profile->compare("main") == 0)
+        cam.profile = 1;
+    else
+        cam.profile = 0;
+
+    if (cam.width <= 0 || cam.height <= 0 || cam.bitrate <= 0 ||
+        cam.framerate <= 0 || cam.intra <= 0) {
+        vlogE("Invalid parameters of camera %s", cam.name.c_str());
+        return false;
+    }
+
+    for (size_t i = 0; i < mCameras.size(); i++) {
+        if (mCameras[i].name == cam.name) {
+            vlogE("Duplicate camera name %s", cam.name.c_str());
+            return false;
+        }
+
+        if (mCameras[i].port == cam.port) {
+            vlogE("Cameras %s and %s share port %d", mCameras[i].name.c_str(),
+                  cam.name.c_str(), cam.port);
+            return false;
+        }
+    }
+
+    mCameras.push_back(cam);
+    return true;
+}
+
+bool CConfig::loadSimulcast(cfg_t *host)
+{
+    for (size_t i = 0; i < mCameras.size(); i++) {
+        std::shared_ptr<std::string> main;
+        size_t j;
+
+        main = getString(cfg_getnsec(host, "camera", (unsigned int)i), "simulcast");
+        if (!main)
+            continue;
+
+        for (j = 0; j < mCameras.size(); j++) {
+            if (mCameras[j].name == *main)
+                break;
+        }
+
+        if (j == mCameras.size() || j == i) {
+            vlogE("Invalid simulcast %s of camera %s", main->c_str(),
+                  mCameras[i].name.c_str());
+            return false;
+        }
+
+        mCameras[i].simulcast = (int)j;
+    }
+
+    // Two layers at most: a main camera and one sub layer of it.
+    for (size_t i = 0; i < mCameras.size(); i++) {
+        int main = mCameras[i].simulcast;
+        if (main < 0)
+            continue;
+
+        if (mCameras[main].simulcast >= 0) {
+            vlogE("Camera %s is a sub layer itself, %s can not be one of it",
+                  mCameras[main].name.c_str(), mCameras[i].name.c_str());
+            return false;
+        }
+
+        for (size_t j = 0; j < i; j++) {
+            if (mCameras[j].simulcast == main) {
+                vlogE("Camera %s has two sub layers, %s and %s",
+                      mCameras[main].name.c_str(), mCameras[j].name.c_str(),
+                      mCameras[i].name.c_str());
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 void CConfig::dump(void) const
 {
+    static const char *profiles[] = { "baseline", "main", "high" };
+    std::string cameras;
+    std::string cpus;
+
+    for (size_t i = 0; i < mCameras.size(); i++) {
+        const CameraConfig &cam = mCameras[i];
+        char line[256];
+
+        snprintf(line, sizeof(line), "      camera: %s, device %d, port %d, "
+                 "%dx%d@%d, %d bps, %s, intra %d%s%s\n", cam.name.c_str(),
+                 cam.device, cam.port, cam.width, cam.height, cam.framerate,
+                 cam.bitrate, profiles[cam.profile], cam.intra,
+                 cam.simulcast >= 0 ? ", sub layer of " : "",
+                 cam.simulcast >= 0 ? mCameras[cam.simulcast].name.c_str() : "");
+        cameras += line;
+    }
+
+    for (size_t i = 0; i < mMediaCpus.size(); i++) {
+        if (i)
+            cpus += ",";
+        cpus += std::to_string(mMediaCpus[i]);
+    }
+
     vlogI(" dump config content:\n"
           "  +++++++++++++++++++++++\n"
           "       appId: %s\n"
@@ -270,18 +547,22 @@ void CConfig::dump(void) const
           "  mqttServer: %s\n"
           "  trustStore: %s\n"
           "     dataDir: %s\n"
+          "    stateTtl: %d\n"
           "    logLevel: %d\n"
           "     logFile: %s\n"
+          "   logFormat: %s\n"
+          "  binLogFile: %s\n"
+          "   logRotate: %dKB/%dh, keep %d\n"
+          "idleInterval: %d\n"
+          " metricsPath: %s\n"
+          "stallThreshold: %d\n"
           " turn server: %s\n"
           "    usernmae: %s\n"
           "    password: %s\n"
-          " cmaera port: %d\n"
-          "   widht res: %d\n"
-          "  height res: %d\n"
-          "     bitrate: %d\n"
-          "  frame rate: %d\n"
-          "     profile: %s\n"
+          "torchRefresh: %d\n"
+          "%s"
           "       dummy: %s\n"
+          "       media: %d workers, cpus %s, priority %d, pacing %d%%\n"
           " +++++++++++++++++++++++\n",
           mAppId ? mAppId->c_str(): "none",
           mAppKey ? mAppKey->c_str(): "none",
@@ -289,16 +570,24 @@ void CConfig::dump(void) const
           mMqttServer ? mMqttServer->c_str(): "none",
           mTrustStore ? mTrustStore->c_str() : "none",
           mDataDir ? mDataDir->c_str(): "none",
+          mStateTtl,
           mLogLevel,
           mLogFile ? mLogFile->c_str() : "none",
+          mLogFormat ? mLogFormat->c_str() : "none",
+          mBinLogFile ? mBinLogFile->c_str() : "none",
+          mLogRotateSize, mLogRotateAge, mLogRotateKeep,
+          mIdleInterval,
+          mMetricsPath ? mMetricsPath->c_str() : "none",
+          mStallThreshold,
           mTurnServer ? mTurnServer->c_str(): "none",
           mUsername ? mUsername->c_str(): "none",
           mPassword ? mPassword->c_str(): "none",
-          mCameraPort,
-          mWidthRes,
-          mHeightRes,
-          mBitRate,
-          mFrameRate,
-          mProfile ? mProfile->c_str(): "none",
-          mDummy ? "yes" : "no");
+          mTorchRefresh,
+          cameras.c_str(),
+          mDummy ? "yes" : "no",
+          mMediaWorkers, cpus.empty() ? "any" : cpus.c_str(), mMediaPriority,
+          mMediaPacing);
+
+    if (mDrivers)
+        mDrivers->dump();
 }
@@ -3,8 +3,32 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "confuse.h"
+#include "driver.h"
+
+const int maxMediaWorkers = 16;
+
+// One camera pipeline: a camera, or one encoding of it.
+struct CameraConfig {
+    // Same defaults as the camera section of the config file.
+    CameraConfig(): name("main"), device(-1), port(12300), width(320),
+        height(480), bitrate(150000), framerate(30), intra(10), profile(0),
+        simulcast(-1) {}
+
+    std::string name;   // picked by viewers in their session request
+    int device;         // camera on the board, -1 for the default one
+    int port;
+    int width;
+    int height;
+    int bitrate;
+    int framerate;
+    int intra;
+    int profile;        // 0 baseline, 1 main, 2 high
+    int simulcast;      // camera this is the sub layer of, -1 for none
+    std::string source; // handed to the driver, empty for none
+};
 
 class CConfig {
 public:
@@ -47,6 +71,46 @@ public:
         return mLogFile->c_str();
     }
 
+    bool binaryLog(void) const {
+        return mLogFormat->compare("binary") == 0;
+    }
+
+    const char *binLogPath(void) const {
+        return mBinLogFile ? mBinLogFile->c_str() : NULL;
+    }
+
+    // Rotation thresholds in bytes and seconds, 0 disables.
+    size_t logRotateSize(void) const {
+        return (size_t)mLogRotateSize * 1024;
+    }
+
+    int logRotateAge(void) const {
+        return mLogRotateAge * 3600;
+    }
+
+    int logRotateKeep(void) const {
+        return mLogRotateKeep;
+    }
+
+    // Seconds peer gadget values restored at startup are trusted.
+    int stateTtl(void) const {
+        return mStateTtl;
+    }
+
+    // Milliseconds the whisper thread may go without a beat, 0 disables.
+    int stallThreshold(void) const {
+        return mStallThreshold;
+    }
+
+    // Unix socket the metrics are served on, NULL when not exported.
+    const char *metricsPath(void) const {
+        return mMetricsPath ? mMetricsPath->c_str() : NULL;
+    }
+
+    int idleInterval(void) const {
+        return mIdleInterval;
+    }
+
     const char *turnHost(void) const {
         return mTurnServer->c_str();
     }
@@ -59,45 +123,48 @@ public:
         return mPassword->c_str();
     }
 
-    int cameraPort(void) const {
-        return mCameraPort;
+    int torchRefresh(void) const {
+        return mTorchRefresh;
     }
 
-    int widthRes(void) const {
-        return mWidthRes;
+    // Camera pipelines, never empty; the first is the one viewers get
+    // unless they ask for another.
+    const std::vector<CameraConfig> &cameras(void) const {
+        return mCameras;
     }
 
-    int heightRes(void) const {
-        return mHeightRes;
+    bool isDummy(void) const {
+        return mDummy;
     }
 
-    int bitRate(void) const {
-        return mBitRate;
+    // Media worker threads, the CPUs they are pinned to (none: not
+    // pinned), their SCHED_FIFO priority (0: normal scheduling) and the
+    // share of a frame interval its packets are spread over, in percent.
+    int mediaWorkers(void) const {
+        return mMediaWorkers;
     }
 
-    int frameRate(void) const {
-        return mFrameRate;
+    const std::vector<int> &mediaCpus(void) const {
+        return mMediaCpus;
     }
 
-    int profile(void) const {
-        if (mProfile->compare("high") == 0)
-            return 2;
-        else if (mProfile->compare("main") == 0)
-            return 1;
-        else if (mProfile->compare("baseline") == 0)
-            return 0;
-        else
-            return 0;
+    int mediaPriority(void) const {
+        return mMediaPriority;
     }
 
-    bool isDummy(void) const {
-        return mDummy;
+    int mediaPacing(void) const {
+        return mMediaPacing;
     }
 
-    void *dylib() const {
-        return mDylib;
+    // Gadget driver libraries, loaded lazily by the gadgets they back.
+    CDriverRegistry *drivers(void) const {
+        return mDrivers.get();
     }
 
+private:
+    bool loadCamera(cfg_t *sec);
+    bool loadSimulcast(cfg_t *host);
+
 private:
     std::shared_ptr<std::string> mAppId;
     std::shared_ptr<std::string> mAppKey;
@@ -108,23 +175,37 @@ private:
 
     int mLogLevel;
     std::shared_ptr<std::string> mLogFile;
+    std::shared_ptr<std::string> mLogFormat;
+    std::shared_ptr<std::string> mBinLogFile;
+    int mLogRotateSize;
+    int mLogRotateAge;
+    int mLogRotateKeep;
+
+    int mIdleInterval;
+    int mStateTtl;
+    std::shared_ptr<std::string> mMetricsPath;
+    int mStallThreshold;
 
     // turn server related parameters.
     std::shared_ptr<std::string> mTurnServer;
     std::shared_ptr<std::string> mUsername;
     std::shared_ptr<std::string> mPassword;
 
+    // torch related parameters.
+    int mTorchRefresh;
+
     // camera related parameters.
-    int mCameraPort;
-    int mWidthRes;
-    int mHeightRes;
-    int mBitRate;
-    int mFrameRate;
-    std::shared_ptr<std::string> mProfile;
+    std::vector<CameraConfig> mCameras;
+
+    // media worker parameters.
+    int mMediaWorkers;
+    std::vector<int> mMediaCpus;
+    int mMediaPriority;
+    int mMediaPacing;
 
     // run host related parameters.
     bool mDummy;
-    void *mDylib;
+    std::shared_ptr<CDriverRegistry> mDrivers;
 
     cfg_t *mCfg;
 };
@@ -1,44 +1,48 @@
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
 #include <cassert>
 #include <vector>
 #include <memory>
 #include <string>
 #include "whisper.h"
 #include "vlog.h"
+#include "dispatch.h"
 #include "gadget.h"
 #include "agent.h"
+#include "input.h"
 #include "cmd.h"
+#include "trace.h"
 
-class ArgvParser {
-public:
-    ArgvParser(const std::vector<std::string>& argv): mArgv(argv), mValue() {}
-
-    bool parse(void);
-
-    enum CmdType {
-        GetLocal,
-        GetPeer,
-        SetLocal,
-        SetPeer,
-    };
-    CmdType cmdType(void) const { return mType; }
+bool ArgvParser::parseTargets(const std::string &arg)
+{
+    if (arg.compare("*") == 0)
+        return true;
+
+    size_t start = 0;
+    while (start <= arg.length()) {
+        size_t end = arg.find(',', start);
+        if (end == std::string::npos)
+            end = arg.length();
+
+        std::string peerId(arg, start, end - start);
+        if (!whisper_id_is_valid(peerId.c_str())) {
+            vlogE("Invalid userid %s", peerId.c_str());
+            return false;
+        }
 
-    const GadgetValue& value(void) const { return mValue; }
-    const char *peerName(void) const { return mPeerId; }
-    void dump(void) const;
+        mPeerIds.push_back(peerId);
+        start = end + 1;
+    }
 
-private:
-    CmdType mType;
-    GadgetValue mValue;
-    const char *mPeerId;
-    const std::vector<std::string>& mArgv;
-};
+    return true;
+}
 
 bool ArgvParser::parse(void)
 {
     bool valid = true;
-    int i = 0;
+    size_t i = 0;
 
     while (i < mArgv.size()) {
         switch(i) {
@@ -49,9 +53,8 @@ bool ArgvParser::parse(void)
         case 1:
             if (mArgv[i].compare("me") == 0) {
                 mType = GetLocal;
-            } else if (whisper_id_is_valid(mArgv[i].c_str())) {
+            } else if (parseTargets(mArgv[i])) {
                 mType = GetPeer;
-                mPeerId = mArgv[1].c_str();
             } else {
                 valid = false;
             }
@@ -92,18 +95,28 @@ bool ArgvParser::parse(void)
 
 void ArgvParser::dump(void) const
 {
+    std::string targets;
+
+    for (size_t i = 0; i < mPeerIds.size(); i++) {
+        if (i > 0)
+            targets += ",";
+        targets += mPeerIds[i];
+    }
+    if (targets.empty())
+        targets = "*";
+
     switch(mType) {
     case GetLocal:
-        vlogI(">> bulb me");
+        vlogI(">> %s me", mArgv[0].c_str());
         break;
     case GetPeer:
-        vlogI(">> bulb %s", mPeerId);
+        vlogI(">> %s %s", mArgv[0].c_str(), targets.c_str());
         break;
     case SetLocal:
-        vlogI(">> bulb me %s", mValue.c_str());
+        vlogI(">> %s me %s", mArgv[0].c_str(), mValue.c_str());
         break;
     case SetPeer:
-        vlogI(">> bulb %s %s", mPeerId, mValue.c_str());
+        vlogI(">> %s %s %s", mArgv[0].c_str(), targets.c_str(), mValue.c_str());
         break;
     default:
         break;
@@ -111,25 +124,31 @@ void ArgvParser::dump(void) const
 }
 
 static
-void execCmd(const char *name, ArgvParser &parser, CAgent &agent)
+void execCmd(GadgetKind kind, ArgvParser &parser, CAgent &agent)
 {
-    std::string gadget(name);
+    std::shared_ptr<CGadget> gadget;
 
     switch(parser.cmdType()) {
     case ArgvParser::GetLocal:
-        agent.getGadget(gadget)->status();
-        break;
+    case ArgvParser::SetLocal:
+        gadget = agent.getGadget(kind);
+        if (!gadget) {
+            vlogE("Gadget %s not available", gadgetName(kind));
+            return;
+        }
 
-    case ArgvParser::GetPeer:
-        agent.getGadget(parser.peerName(), gadget)->status(parser.peerName());
+        if (parser.cmdType() == ArgvParser::GetLocal)
+            gadget->status();
+        else
+            gadget->flip(parser.value());
         break;
 
-    case ArgvParser::SetLocal:
-        agent.getGadget(gadget)->flip(parser.value());
+    case ArgvParser::GetPeer:
+        agent.showPeerGadgets(kind, parser.peerIds());
         break;
 
     case ArgvParser::SetPeer:
-        agent.getGadget(parser.peerName(), gadget)->flip(parser.value(), parser.peerName());
+        agent.modifyPeerGadgets(kind, parser.value(), parser.peerIds());
         break;
 
     default:
@@ -137,7 +156,7 @@ void execCmd(const char *name, ArgvParser &parser, CAgent &agent)
     }
 }
 
-void CBulbCmd::execute(CAgent &agent) const
+void CGadgetCmd::execute(CAgent &agent) const
 {
     ArgvParser ap(mArgv);
     if (!ap.parse()) {
@@ -145,140 +164,229 @@ void CBulbCmd::execute(CAgent &agent) const
         return;
     }
 
-    execCmd("bulb", ap, agent);
+    execCmd(mKind, ap, agent);
 }
 
-void CBulbCmd::help(void) const
+void CGadgetCmd::help(void) const
 {
-    vlogI("bulb [ me | userid ] [ on | off ]");
+    if (gadgetType(mKind) == Bool)
+        vlogI("%s [ me | * | userid[,userid...] ] [ on | off ]", gadgetName(mKind));
+    else
+        vlogI("%s [ me | * | userid[,userid...] ] [ value ]", gadgetName(mKind));
 }
 
-void CTorchCmd::execute(CAgent &agent) const
+void CFrequestCmd::execute(CAgent &agent) const
 {
-    ArgvParser ap(mArgv);
-    if (!ap.parse()) {
-        vlogE("Invalid command syntax");
+    if (mArgv.size() != 2) {
+        vlogI("Invalid command syntax");
         return;
     }
 
-    execCmd("torch", ap, agent);
-}
-
-void CTorchCmd::help(void) const
-{
-    vlogI("torch [ me | userid ] [ on | off ]");
-}
-
-void CBrightnessCmd::execute(CAgent& agent) const
-{
-    ArgvParser ap(mArgv);
-    if (!ap.parse()) {
-        vlogE("Invalid command syntax");
+    if (!whisper_id_is_valid(mArgv[1].c_str())) {
+        vlogI("Invalid userid");
         return;
     }
 
-    execCmd("brightness", ap, agent);
+    agent.reqAddPeer(mArgv[1]);
 }
 
-void CBrightnessCmd::help(void) const
+void CFrequestCmd::help(void) const
 {
-    vlogI("brightness [ me | userid ] [ value ]");
+    vlogI("frequest userid");
 }
 
-void CRingCmd::execute(CAgent &agent) const
+void CFriendsCmd::execute(CAgent &agent) const
 {
-    ArgvParser ap(mArgv);
-    if (!ap.parse()) {
-        vlogE("Invalid command syntax");
+    if (mArgv.size() != 1) {
+        vlogI("Invalid command syntax");
         return;
     }
 
-    execCmd("ring", ap, agent);
+    agent.listPeers();
 }
 
-void CRingCmd::help(void) const
+void CFriendsCmd::help(void) const
 {
-    vlogI("ring [ me | userid ] [ on | off ]");
+    vlogI("friends");
 }
 
-void CVolumeCmd::execute(CAgent &agent) const
+void CMeCmd::execute(CAgent &agent) const
 {
-    ArgvParser ap(mArgv);
-    if (!ap.parse()) {
-        vlogE("Invalid command syntax");
+    if (mArgv.size() != 1) {
+        vlogI("Invalid command syntax");
         return;
     }
 
-    execCmd("volume", ap, agent);
+    agent.showMe();
 }
 
-void CVolumeCmd::help(void) const
+void CMeCmd::help(void) const
 {
-    vlogI("volume [ me | userid ] [value]");
+    vlogI("me");
 }
 
-void CCameraCmd::execute(CAgent &agent) const
+void CSourceCmd::execute(CAgent &agent) const
 {
-    ArgvParser ap(mArgv);
-    if (!ap.parse()) {
-        vlogE("Invalid command syntax");
+    if (mArgv.size() != 2) {
+        vlogI("Invalid command syntax");
         return;
     }
 
-    execCmd("camera", ap, agent);
+    execScript(agent, mArgv[1].c_str());
 }
 
-void CCameraCmd::help(void) const
+void CSourceCmd::help(void) const
 {
-    vlogI("camera [ me | userid ] [ on | off ]");
+    vlogI("source file");
 }
 
-void CFrequestCmd::execute(CAgent &agent) const
+void CLogLevelCmd::execute(CAgent &agent) const
 {
-    if (mArgv.size() != 2) {
+    if (mArgv.size() == 1) {
+        for (int i = 0; i < VLOG_MOD_COUNT; i++)
+            vlogI("%-8s %s", logModuleName(i), logLevelName(logLevels[i]));
+        return;
+    }
+
+    if (mArgv.size() > 3) {
         vlogI("Invalid command syntax");
         return;
     }
 
-    if (!whisper_id_is_valid(mArgv[1].c_str())) {
-        vlogI("Invalid userid");
+    int level = logLevelByName(mArgv.back().c_str());
+    if (level < 0) {
+        vlogI("Invalid log level %s", mArgv.back().c_str());
         return;
     }
 
-    agent.reqAddPeer(mArgv[1]);
+    if (mArgv.size() == 2) {
+        setLogLevel(level);
+        return;
+    }
+
+    if (setModuleLogLevel(mArgv[1].c_str(), level) < 0)
+        vlogI("Invalid log module %s", mArgv[1].c_str());
 }
 
-void CFrequestCmd::help(void) const
+void CLogLevelCmd::help(void) const
 {
-    vlogI("frequest userid");
+    vlogI("loglevel [ [ module ] error | warning | info | debug ]");
 }
 
-void CFriendsCmd::execute(CAgent &agent) const
+void CTraceCmd::execute(CAgent &agent) const
 {
     if (mArgv.size() != 1) {
         vlogI("Invalid command syntax");
         return;
     }
 
-    agent.listPeers();
+#ifdef WDEMO_TRACE
+    traceRequestDump();
+#else
+    vlogI("Tracing not built in, rebuild with -DENABLE_TRACE=ON");
+#endif
 }
 
-void CFriendsCmd::help(void) const
+void CTraceCmd::help(void) const
 {
-    vlogI("friends");
+    vlogI("trace");
 }
 
-void CMeCmd::execute(CAgent &agent) const
+void CCamerasCmd::execute(CAgent &agent) const
 {
-    if (mArgv.size() != 1) {
+    std::shared_ptr<CGadget> gadget = agent.getGadget(GadgetCamera);
+    if (!gadget) {
+        vlogI("No camera gadget");
+        return;
+    }
+
+    CCamera *camera = static_cast<CCamera*>(gadget.get());
+
+    if (mArgv.size() == 1) {
+        camera->list();
+        return;
+    }
+
+    if (mArgv.size() != 3 || (mArgv[2] != "on" && mArgv[2] != "off")) {
         vlogI("Invalid command syntax");
         return;
     }
 
-    agent.showMe();
+    camera->flip(mArgv[1].c_str(), mArgv[2] == "on");
 }
 
-void CMeCmd::help(void) const
+void CCamerasCmd::help(void) const
 {
-    vlogI("me");
+    vlogI("cameras [ name on | off ]");
+}
+
+const int maxScriptDepth = 8;
+
+bool execScript(CAgent &agent, const char *path)
+{
+    static int depth = 0;
+
+    if (depth >= maxScriptDepth) {
+        vlogE("Script %s nested too deep, skipped", path);
+        return false;
+    }
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        vlogE("Open script %s error (%d)", path, errno);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int lineNo = 0;
+
+    depth++;
+    while ((len = getline(&line, &cap, fp)) >= 0) {
+        std::vector<std::string> argv;
+
+        lineNo++;
+        CInput::splitLine(line, (size_t)len, argv);
+        if (argv.empty() || argv[0][0] == '#')
+            continue;
+
+        std::shared_ptr<CCommand> cmd(newCommand(argv));
+        if (!cmd) {
+            vlogE("Invalid command at %s:%d, skipped", path, lineNo);
+            continue;
+        }
+        cmd->execute(agent);
+    }
+    depth--;
+
+    free(line);
+    fclose(fp);
+    return true;
+}
+
+CCommand *newCommand(const std::vector<std::string> &argv)
+{
+    if (argv.empty())
+        return NULL;
+
+    const char *name = argv[0].c_str();
+
+#define COMMAND_CASE(n, cls) \
+    case dispatch::hash(n): \
+        if (strcmp(name, n) == 0) return new cls(argv); \
+        break;
+
+    switch(dispatch::hashn(name, argv[0].length())) {
+    COMMAND_LIST(COMMAND_CASE)
+    default:
+        break;
+    }
+#undef COMMAND_CASE
+
+    GadgetKind kind;
+    if (gadgetKind(name, kind))
+        return new CGadgetCmd(kind, argv);
+
+    return NULL;
 }
@@ -5,13 +5,61 @@
 #include <vector>
 #include <string>
 
+#include "gadget.h"
+
 class CAgent;
 
+/*
+ * Gadget command line: "<gadget> [me|*|id[,id...]] [on|off|number]".
+ */
+class ArgvParser {
+public:
+    ArgvParser(const std::vector<std::string>& argv): mValue(), mArgv(argv) {}
+
+    bool parse(void);
+
+    enum CmdType {
+        GetLocal,
+        GetPeer,
+        SetLocal,
+        SetPeer,
+    };
+    CmdType cmdType(void) const { return mType; }
+
+    const GadgetValue& value(void) const { return mValue; }
+    // Empty when the command targets every peer ("*").
+    const std::vector<std::string> &peerIds(void) const { return mPeerIds; }
+    void dump(void) const;
+
+private:
+    bool parseTargets(const std::string &arg);
+
+private:
+    CmdType mType;
+    GadgetValue mValue;
+    std::vector<std::string> mPeerIds;
+    const std::vector<std::string>& mArgv;
+};
+
+/*
+ * Console commands besides the gadget ones, which come from GADGET_LIST.
+ */
+#define COMMAND_LIST(X) \
+    X("frequest", CFrequestCmd) \
+    X("friends",  CFriendsCmd)  \
+    X("me",       CMeCmd)       \
+    X("source",   CSourceCmd)   \
+    X("loglevel", CLogLevelCmd) \
+    X("trace",    CTraceCmd)    \
+    X("cameras",  CCamerasCmd)
+
 class CCommand {
 protected:
     CCommand(const char *name): mName(name) {}
 
 public:
+    virtual ~CCommand() {}
+
     virtual void execute(CAgent &agent) const = 0;
     virtual void help(void) const = 0;
 
@@ -21,120 +69,109 @@ private:
     const std::string mName;
 };
 
-class CBulbCmd: public CCommand {
-public:
-    CBulbCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("bulb") {}
-
-public:
-    virtual void execute(CAgent &agent) const override;
-    virtual void help(void) const override;
-
-private:
-    const std::vector<std::string> &mArgv;
-};
-
-class CTorchCmd: public CCommand {
+class CGadgetCmd: public CCommand {
 public:
-    CTorchCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("torch") {}
+    CGadgetCmd(GadgetKind kind, const std::vector<std::string> &argv):
+        CCommand(gadgetName(kind)), mKind(kind), mArgv(argv) {}
 
 public:
-    void execute(CAgent& agent) const override;
+    void execute(CAgent &agent) const override;
     void help(void) const override;
 
 private:
-    const std::vector<std::string> &mArgv;
+    GadgetKind mKind;
+    const std::vector<std::string> mArgv;
 };
 
-class CBrightnessCmd: public CCommand {
+class CFrequestCmd: public CCommand {
 public:
-    CBrightnessCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("brightness") {}
+    CFrequestCmd(const std::vector<std::string> &argv):
+        mArgv(argv), CCommand("frequest") {}
 
 public:
     void execute(CAgent &agent) const override;
     void help(void) const override;
 
 private:
-    const std::vector<std::string> &mArgv;
+    const std::vector<std::string> mArgv;
 };
 
-class CRingCmd: public CCommand {
+class CFriendsCmd: public CCommand {
 public:
-    CRingCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("ring") {}
+    CFriendsCmd(const std::vector<std::string> &argv):
+        mArgv(argv), CCommand("friends") {}
 
 public:
     void execute(CAgent &agent) const override;
     void help(void) const override;
 
 private:
-    const std::vector<std::string> &mArgv;
+    const std::vector<std::string> mArgv;
 };
 
-class CVolumeCmd: public CCommand {
+class CMeCmd: public CCommand {
 public:
-    CVolumeCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("volume") {}
-
+    CMeCmd(const std::vector<std::string> &argv):
+        mArgv(argv), CCommand("me") {}
 public:
     void execute(CAgent &agent) const override;
     void help(void) const override;
 
 private:
-    const std::vector<std::string>& mArgv;
+    const std::vector<std::string> mArgv;
 };
 
-class CCameraCmd: public CCommand {
+class CSourceCmd: public CCommand {
 public:
-    CCameraCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("camera") {}
-
+    CSourceCmd(const std::vector<std::string> &argv):
+        CCommand("source"), mArgv(argv) {}
 public:
     void execute(CAgent &agent) const override;
     void help(void) const override;
 
 private:
-    const std::vector<std::string> &mArgv;
+    const std::vector<std::string> mArgv;
 };
 
-class CFrequestCmd: public CCommand {
+class CLogLevelCmd: public CCommand {
 public:
-    CFrequestCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("frequest") {}
-
+    CLogLevelCmd(const std::vector<std::string> &argv):
+        CCommand("loglevel"), mArgv(argv) {}
 public:
     void execute(CAgent &agent) const override;
     void help(void) const override;
 
 private:
-    const std::vector<std::string> &mArgv;
+    const std::vector<std::string> mArgv;
 };
 
-class CFriendsCmd: public CCommand {
+class CTraceCmd: public CCommand {
 public:
-    CFriendsCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("friends") {}
-
+    CTraceCmd(const std::vector<std::string> &argv):
+        CCommand("trace"), mArgv(argv) {}
 public:
     void execute(CAgent &agent) const override;
     void help(void) const override;
 
 private:
-    const std::vector<std::string> &mArgv;
+    const std::vector<std::string> mArgv;
 };
 
-class CMeCmd: public CCommand {
+class CCamerasCmd: public CCommand {
 public:
-    CMeCmd(const std::vector<std::string> &argv):
-        mArgv(argv), CCommand("me") {}
+    CCamerasCmd(const std::vector<std::string> &argv):
+        CCommand("cameras"), mArgv(argv) {}
 public:
     void execute(CAgent &agent) const override;
     void help(void) const override;
 
 private:
-    const std::vector<std::string> &mArgv;
+    const std::vector<std::string> mArgv;
 };
 
+CCommand *newCommand(const std::vector<std::string> &argv);
+
+// Run every command in @path, one per line; '#' starts a comment line.
+bool execScript(CAgent &agent, const char *path);
+
 #endif /* __COMMAND_H__ */
@@ -0,0 +1,38 @@
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * FNV-1a string hash usable at compile time (string literals, case labels)
+ * and at run time. Dispatch tables switch on the hash and confirm the hit
+ * with a single strcmp, so two table entries that collide show up as a
+ * duplicate case label when building rather than as a runtime surprise.
+ */
+namespace dispatch {
+
+const uint32_t hashBasis = 2166136261u;
+const uint32_t hashPrime = 16777619u;
+
+constexpr uint32_t hashFrom(const char *str, uint32_t h)
+{
+    return *str ? hashFrom(str + 1, (h ^ (uint8_t)*str) * hashPrime) : h;
+}
+
+constexpr uint32_t hash(const char *str)
+{
+    return hashFrom(str, hashBasis);
+}
+
+inline uint32_t hashn(const char *str, size_t len)
+{
+    uint32_t h = hashBasis;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)str[i]) * hashPrime;
+    return h;
+}
+
+}
+
+#endif /* __DISPATCH_H__ */
@@ -0,0 +1,194 @@
+#include <cstddef>
+#include <cstring>
+#include <dlfcn.h>
+
+#define VLOG_MODULE VLOG_MOD_GADGET
+#include "vlog.h"
+#include "driver.h"
+
+static
+bool providedBy(const GadgetDriver *ops, const char *gadget)
+{
+    const char *const *name;
+
+    // Tables from before the gadgets list always back torch and camera.
+    if (!GADGET_DRIVER_HAS(ops, gadgets))
+        return !strcmp(gadget, "torch") || !strcmp(gadget, "camera");
+
+    for (name = ops->gadgets; name && *name; name++) {
+        if (!strcmp(*name, gadget))
+            return true;
+    }
+    return false;
+}
+
+CDriver::~CDriver()
+{
+    if (mHandle)
+        dlclose(mHandle);
+}
+
+bool CDriver::validate(const GadgetDriver *ops) const
+{
+    if (ops->version != GADGET_DRIVER_VERSION) {
+        vlogE("Driver %s has ABI version %u, expected %u", mPath.c_str(),
+              ops->version, GADGET_DRIVER_VERSION);
+        return false;
+    }
+
+    if (ops->size < GADGET_DRIVER_SIZE_V1) {
+        vlogE("Driver %s table too small (%u < %zu)", mPath.c_str(),
+              ops->size, GADGET_DRIVER_SIZE_V1);
+        return false;
+    }
+
+#define REQUIRE(fn) \
+    if (!ops->fn) { \
+        vlogE("Driver %s misses %s", mPath.c_str(), #fn); \
+        return false; \
+    }
+
+    if (providedBy(ops, "torch")) {
+        REQUIRE(matrix.open);
+        REQUIRE(matrix.flip);
+        REQUIRE(matrix.close);
+    }
+    if (providedBy(ops, "camera")) {
+        REQUIRE(camera.set_callbacks);
+        REQUIRE(camera.set_port);
+        REQUIRE(camera.set_parameters);
+        REQUIRE(camera.open);
+        REQUIRE(camera.flip);
+        REQUIRE(camera.close);
+
+        if (GADGET_DRIVER_HAS(ops, cameras) && ops->cameras.open) {
+            REQUIRE(cameras.flip);
+            REQUIRE(cameras.close);
+        }
+    }
+#undef REQUIRE
+
+    return true;
+}
+
+bool CDriver::load(const char *path)
+{
+    GadgetDriverEntry entry;
+    const GadgetDriver *ops = NULL;
+
+    mPath = path;
+
+    mHandle = dlopen(path, RTLD_NOW);
+    if (!mHandle) {
+        vlogE("Loading dynamic library %s error: %s", path, dlerror());
+        return false;
+    }
+
+    entry = (GadgetDriverEntry)dlsym(mHandle, GADGET_DRIVER_ENTRY);
+    if (entry)
+        ops = entry();
+    else
+        vlogE("Driver %s has no entry %s", path, GADGET_DRIVER_ENTRY);
+
+    if (!ops || !validate(ops)) {
+        dlclose(mHandle);
+        mHandle = NULL;
+        return false;
+    }
+
+    mOps = ops;
+    vlogI("Driver %s (%s) loaded", mOps->name, path);
+    return true;
+}
+
+bool CDriver::provides(const char *gadget) const
+{
+    return mOps && providedBy(mOps, gadget);
+}
+
+bool CDriverRegistry::add(const char *name, const char *library,
+                          const std::vector<std::string> &gadgets)
+{
+    Entry entry;
+
+    for (auto &gadget : gadgets) {
+        const Entry *other = find(gadget.c_str());
+        if (other) {
+            vlogE("Gadget %s provided by both driver %s and %s", gadget.c_str(),
+                  other->name.c_str(), name);
+            return false;
+        }
+    }
+
+    entry.name = name;
+    entry.library = library;
+    entry.gadgets = gadgets;
+    entry.failed = false;
+    mEntries.push_back(entry);
+    return true;
+}
+
+CDriverRegistry::Entry *CDriverRegistry::find(const char *gadget)
+{
+    for (auto &entry : mEntries) {
+        for (auto &name : entry.gadgets) {
+            if (name == gadget)
+                return &entry;
+        }
+    }
+    return NULL;
+}
+
+const CDriverRegistry::Entry *CDriverRegistry::find(const char *gadget) const
+{
+    return const_cast<CDriverRegistry *>(this)->find(gadget);
+}
+
+bool CDriverRegistry::provides(const char *gadget) const
+{
+    return find(gadget) != NULL;
+}
+
+const GadgetDriver *CDriverRegistry::open(const char *gadget)
+{
+    Entry *entry = find(gadget);
+    if (!entry || entry->failed)
+        return NULL;
+
+    if (!entry->driver) {
+        std::shared_ptr<CDriver> driver(new CDriver());
+
+        // Remember failures, the other gadgets of the library would only
+        // hit the same dlopen error again.
+        if (!driver->load(entry->library.c_str())) {
+            entry->failed = true;
+            return NULL;
+        }
+        entry->driver = driver;
+    }
+
+    if (!entry->driver->provides(gadget)) {
+        vlogE("Driver %s (%s) does not provide %s", entry->name.c_str(),
+              entry->library.c_str(), gadget);
+        return NULL;
+    }
+
+    return entry->driver->ops();
+}
+
+void CDriverRegistry::dump(void) const
+{
+    for (auto &entry : mEntries) {
+        std::string gadgets;
+
+        for (auto &name : entry.gadgets) {
+            if (!gadgets.empty())
+                gadgets += ", ";
+            gadgets += name;
+        }
+
+        vlogI("  driver %s: %s { %s }%s", entry.name.c_str(),
+              entry.library.c_str(), gadgets.c_str(),
+              entry.driver ? " loaded" : "");
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef __DRIVER_H__
+#define __DRIVER_H__
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "gadget_driver.h"
+
+/*
+ * A loaded gadget driver library. The GadgetDriver table is resolved and
+ * validated once in load(); gadgets only ever call through ops().
+ */
+class CDriver {
+public:
+    CDriver(): mHandle(NULL), mOps(NULL) {}
+    ~CDriver();
+
+public:
+    bool load(const char *path);
+
+    const GadgetDriver *ops(void) const {
+        return mOps;
+    }
+
+    const char *name(void) const {
+        return mOps ? mOps->name : "none";
+    }
+
+    bool provides(const char *gadget) const;
+
+private:
+    bool validate(const GadgetDriver *ops) const;
+
+private:
+    void *mHandle;
+    const GadgetDriver *mOps;
+    std::string mPath;
+};
+
+/*
+ * Driver libraries listed in the config. Which library backs which gadget
+ * is known from the config alone, libraries are only loaded by the first
+ * gadget that opens through them.
+ */
+class CDriverRegistry {
+public:
+    CDriverRegistry() {}
+    ~CDriverRegistry() {}
+
+public:
+    bool add(const char *name, const char *library,
+             const std::vector<std::string> &gadgets);
+
+    // True if some configured library backs the gadget.
+    bool provides(const char *gadget) const;
+
+    // Loads the library backing the gadget on first use. NULL when none
+    // is configured or it failed to load.
+    const GadgetDriver *open(const char *gadget);
+
+    void dump(void) const;
+
+private:
+    struct Entry {
+        std::string name;
+        std::string library;
+        std::vector<std::string> gadgets;
+        std::shared_ptr<CDriver> driver;
+        bool failed;
+    };
+
+    Entry *find(const char *gadget);
+    const Entry *find(const char *gadget) const;
+
+private:
+    std::vector<Entry> mEntries;
+};
+
+#endif /* __DRIVER_H__ */
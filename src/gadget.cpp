@@ -1,13 +1,70 @@
+#include <cstring>
 #include <memory>
 #include <string>
-#include <dlfcn.h>
-
-#include <sys/time.h>
 
+#define VLOG_MODULE VLOG_MOD_GADGET
 #include "vlog.h"
-#include "rtp.h"
+#include "dispatch.h"
 #include "agent.h"
 #include "gadget.h"
+#include "state.h"
+
+template <typename T>
+static CGadget *createGadget(CAgent *agent, const GadgetValue &value)
+{
+    return new T(agent, value);
+}
+
+struct GadgetDesc {
+    const char *name;
+    GadgetValueTypes type;
+    CGadget *(*create)(CAgent *, const GadgetValue &);
+};
+
+#define GADGET_DESC(kind, name, type, cls) { name, type, createGadget<cls> },
+static const GadgetDesc gadgetDescs[GadgetKindCount] = {
+    GADGET_LIST(GADGET_DESC)
+};
+#undef GADGET_DESC
+
+const char *gadgetName(GadgetKind kind)
+{
+    return (kind >= 0 && kind < GadgetKindCount) ? gadgetDescs[kind].name : "unknown";
+}
+
+GadgetValueTypes gadgetType(GadgetKind kind)
+{
+    return gadgetDescs[kind].type;
+}
+
+bool gadgetKind(const char *name, GadgetKind &kind)
+{
+    GadgetKind found;
+
+#define GADGET_CASE(k, n, type, cls) \
+    case dispatch::hash(n): found = Gadget##k; break;
+
+    switch(dispatch::hashn(name, strlen(name))) {
+    GADGET_LIST(GADGET_CASE)
+    default:
+        return false;
+    }
+#undef GADGET_CASE
+
+    if (strcmp(name, gadgetDescs[found].name) != 0)
+        return false;
+
+    kind = found;
+    return true;
+}
+
+CGadget *newGadget(GadgetKind kind, CAgent *agent, const GadgetValue &value)
+{
+    if (kind < 0 || kind >= GadgetKindCount)
+        return NULL;
+
+    return gadgetDescs[kind].create(agent, value);
+}
 
 bool GadgetValue::operator ==(const GadgetValue &val) const
 {
@@ -25,7 +82,13 @@ bool GadgetValue::operator ==(const GadgetValue &val) const
         isEqual = (mValue.b == val.bValue());
         break;
 
-    case Float:
+    // Bit for bit, as the state file keeps it.
+    case Float: {
+        float f = val.fValue();
+        isEqual = (memcmp(&mValue.f, &f, sizeof(f)) == 0);
+        break;
+    }
+
     default:
         isEqual = false;
         break;
@@ -86,6 +149,9 @@ void CGadget::flip(const GadgetValue &value)
         return;
 
     mValue = value;
+    if (mState)
+        mState->store(mStateSlot, mValue);
+
     switch(mValue.type()) {
     case Int:
         flip(mValue.iValue());
@@ -103,42 +169,49 @@ void CGadget::flip(const GadgetValue &value)
     mAgent->didGadgetValueChange(*this);
 }
 
-void CGadget::flip(const GadgetValue &value, const std::string &peerName)
+void CGadget::sync(const GadgetValue &value)
 {
-    if (mValue == value)
-        return;
+    if (mState && !(mValue == value))
+        mState->store(mStateSlot, value);
 
     mValue = value;
-    switch(mValue.type()) {
-    case Int:
-        flip(mValue.iValue());
-        break;
-    case Bool:
-        flip(mValue.bValue());
-        break;
-    case Float:
-        flip(mValue.fValue());
-        break;
-    default:
-        return;
-    }
-
-    mAgent->didGadgetValueChange(*this, peerName);
 }
 
-void CGadget::sync(const GadgetValue &value)
+void CGadget::persist(CStateFile *state, int slot)
 {
-    mValue = value;
+    mState = state;
+    mStateSlot = slot;
 }
 
 void CGadget::status(void) const
 {
-    vlogI("%s %s", mName.c_str(), mValue.c_str());
+    vlogI("%s %s", name(), mValue.c_str());
 }
 
 void CGadget::status(const std::string &peerName) const
 {
-    vlogI("%s %s %s", mName.c_str(), peerName.c_str(), mValue.c_str());
+    vlogI("%s %s %s", name(), peerName.c_str(), mValue.c_str());
+}
+
+/*
+ * Resolve the driver backing this gadget, loading its library on first
+ * use. Leaves driver NULL for gadgets no library provides, they are only
+ * simulated in the log; fails if the configured library does not load.
+ */
+bool CGadget::openDriver(const CConfig *cfg, const GadgetDriver *&driver) const
+{
+    CDriverRegistry *drivers = cfg ? cfg->drivers() : NULL;
+
+    driver = NULL;
+    if (!drivers || !drivers->provides(name()))
+        return true;
+
+    driver = drivers->open(name());
+    if (!driver) {
+        vlogE("No usable driver for %s", name());
+        return false;
+    }
+    return true;
 }
 
 bool CBulb::open(void)
@@ -159,33 +232,24 @@ void CBulb::close(void)
 
 bool CTorch::open(void)
 {
-    if (mCfg && mCfg->dylib()) {
-        int (*func)() = NULL;
-
-        func = (int (*)())dlsym(mCfg->dylib(), "matrix_open");
-        if (func)
-            return (func() == 0);
-        else {
-            vlogE("Can not find func symbol matrix_open");
-            return false;
-        }
-    } else {
+    if (!openDriver(mCfg.get(), mDriver))
+        return false;
+
+    if (!mDriver)
         return true;
-    }
+
+    if (GADGET_DRIVER_HAS(mDriver, matrix_set_refresh) && mDriver->matrix_set_refresh &&
+        mDriver->matrix_set_refresh(mCfg->torchRefresh()) < 0)
+        vlogW("Torch refresh rate %d not supported", mCfg->torchRefresh());
+
+    return (mDriver->matrix.open() == 0);
 }
 
 void CTorch::flip(bool on)
 {
-    if (mCfg && mCfg->dylib()) {
-        int (*func)() = NULL;
-
-        func = (int (*)())dlsym(mCfg->dylib(), "matrix_flip");
-        if (func)
-           func();
-        else {
-            vlogE("Can not find func symbol matrix_flip");
-            exit(-1);
-        }
+    if (mDriver) {
+        if (mDriver->matrix.flip() < 0)
+            vlogE("Torch turn %s error", on ? "on": "off");
     } else {
         vlogI("Torch turned %s", on ? "on": "off");
     }
@@ -193,13 +257,8 @@ void CTorch::flip(bool on)
 
 void CTorch::close(void)
 {
-    if (mCfg && mCfg->dylib()) {
-        void (*func)() = NULL;
-
-        func = (void (*)())dlsym(mCfg->dylib(), "matrix_close");
-        if (func)
-            func();
-    }
+    if (mDriver)
+        mDriver->matrix.close();
 }
 
 bool CBrightness::open(void)
@@ -249,101 +308,3 @@ void CVolume::close(void)
 {
     //TODO;
 }
-
-static
-void streamFwd(void *data, int len, void *argv)
-{
-    CRtp *rtp = static_cast<CRtp*>(argv);
-
-    timeval now;
-    gettimeofday(&now, NULL);
-
-    uint32_t ts = (uint32_t)(now.tv_sec * 1000 + now.tv_usec/1000);
-
-    rtp->streamFwd((const uint8_t*)data, len, ts);
-}
-
-bool CCamera::open(void)
-{
-    mRtp = std::shared_ptr<CRtp>(new CRtp(mAgent));
-    if (!mRtp) {
-        vlogE("Out of memory!!!");
-        return false;
-    }
-
-    if (mCfg && mCfg->dylib()) {
-        typedef void (*CameraCbsPtr)(void *, void *);
-        CameraCbsPtr f1;
-
-        f1 = (CameraCbsPtr)dlsym(mCfg->dylib(), "camera_set_callbacks");
-        if (f1)
-            f1((void *)streamFwd, mRtp.get());
-        else {
-            vlogE("Can not find symbol camera_set_callbacks");
-            return false;
-        }
-
-        typedef void (*CameraPortPtr)(int);
-        CameraPortPtr f2;
-
-        f2 = (CameraPortPtr)dlsym(mCfg->dylib(), "camera_set_port");
-        if (f2)
-            f2(mCfg->cameraPort());
-        else {
-            vlogE("Can not find symbol camera_set_port");
-            return false;
-        }
-
-        typedef void (*CameraParamsPtr)(int, int, int, int, int);
-        CameraParamsPtr f3;
-
-        f3 = (CameraParamsPtr)dlsym(mCfg->dylib(), "camera_set_parameters");
-        if (f3) {
-            f3(mCfg->widthRes(), mCfg->heightRes(), mCfg->bitRate(),
-                 mCfg->frameRate(), mCfg->profile());
-        } else {
-            vlogE("Can not find symbol camera_set_paramters");
-            return false;
-        }
-
-        typedef int (*CameraOpenPtr)(void);
-        CameraOpenPtr f4 = NULL;
-        f4 = (CameraOpenPtr)dlsym(mCfg->dylib(), "camera_open");
-        if (f4)
-            return (f4() == 0);
-        else {
-            vlogE("Can not find func symbol camera_open");
-            return false;
-        }
-    } else {
-        return true;
-    }
-}
-
-void CCamera::flip(bool on)
-{
-    if (mCfg && mCfg->dylib()) {
-        int (*func)() = NULL;
-
-        func = (int (*)())dlsym(mCfg->dylib(), "camera_flip");
-        if (func)
-            func();
-        else {
-            vlogE("Can not find func symbol camera_flip");
-            exit(-1);
-        }
-    } else {
-        vlogI("camera turned %s", on ? "on": "off");
-    }
-}
-
-void CCamera::close(void)
-{
-    if (mCfg && mCfg->dylib()) {
-        void (*func)() = NULL;
-
-        func = (void (*)())dlsym(mCfg->dylib(), "camera_close");
-        if (func)
-            func();
-    }
-}
@@ -2,14 +2,17 @@
 #define __GADGET_H__
 
 #include <cstdbool>
+#include <cstdint>
 #include <memory>
 #include <string>
-#include <map>
+#include <array>
+#include <vector>
 
 #include "cfg.h"
 
-class CRtp;
+class CCameraPipeline;
 class CAgent;
+class CStateFile;
 
 enum GadgetValueTypes {
     Int,
@@ -17,6 +20,35 @@ enum GadgetValueTypes {
     Float
 };
 
+/*
+ * Gadget registry: kind, protocol name, value type and implementing class.
+ * The kind enum, name lookup, message decoding, peer gadget factory and
+ * console command are all generated from this list, so a new gadget type
+ * only needs its class and one line here.
+ */
+#define GADGET_LIST(X) \
+    X(Bulb,       "bulb",       Bool,  CBulb)       \
+    X(Torch,      "torch",      Bool,  CTorch)      \
+    X(Brightness, "brightness", Float, CBrightness) \
+    X(Ring,       "ring",       Bool,  CRing)       \
+    X(Volume,     "volume",     Float, CVolume)     \
+    X(Camera,     "camera",     Bool,  CCamera)
+
+#define GADGET_KIND(kind, name, type, cls) Gadget##kind,
+enum GadgetKind {
+    GADGET_LIST(GADGET_KIND)
+    GadgetKindCount
+};
+#undef GADGET_KIND
+
+struct GadgetValue;
+class CGadget;
+
+const char *gadgetName(GadgetKind kind);
+GadgetValueTypes gadgetType(GadgetKind kind);
+bool gadgetKind(const char *name, GadgetKind &kind);
+CGadget *newGadget(GadgetKind kind, CAgent *agent, const GadgetValue &value);
+
 struct GadgetValue {
 public:
     GadgetValue(int val): mType(Int) { mValue.i = val; }
@@ -47,26 +79,49 @@ private:
     GadgetValueTypes mType;
 };
 
+class GadgetValues {
+public:
+    GadgetValues(): mMask(0) {}
+
+public:
+    void set(GadgetKind kind, const GadgetValue &value) {
+        mValues[kind] = value;
+        mMask |= (1u << kind);
+    }
+
+    bool has(GadgetKind kind) const { return (mMask & (1u << kind)) != 0; }
+    const GadgetValue &get(GadgetKind kind) const { return mValues[kind]; }
+    bool empty(void) const { return mMask == 0; }
+
+private:
+    std::array<GadgetValue, GadgetKindCount> mValues;
+    uint32_t mMask;
+};
+
 class CGadget {
 protected:
-    CGadget(const char *name, CAgent *agent, int val):
-        mName(name), mAgent(agent), mValue(val) {}
+    CGadget(GadgetKind kind, CAgent *agent, int val):
+        mAgent(agent), mKind(kind), mValue(val), mState(NULL), mStateSlot(-1) {}
 
-    CGadget(const char *name, CAgent *agent, bool val):
-        mName(name), mAgent(agent), mValue(val) {}
+    CGadget(GadgetKind kind, CAgent *agent, bool val):
+        mAgent(agent), mKind(kind), mValue(val), mState(NULL), mStateSlot(-1) {}
 
-    CGadget(const char *name, CAgent *agent, float &val):
-        mName(name), mAgent(agent), mValue(val) {}
+    CGadget(GadgetKind kind, CAgent *agent, float &val):
+        mAgent(agent), mKind(kind), mValue(val), mState(NULL), mStateSlot(-1) {}
+
+    CGadget(GadgetKind kind, CAgent *agent, const GadgetValue &val):
+        mAgent(agent), mKind(kind), mValue(val), mState(NULL), mStateSlot(-1) {}
 
 public:
-    const std::string &name(void) const { return mName; }
+    GadgetKind kind(void) const { return mKind; }
+    const char *name(void) const { return gadgetName(mKind); }
     const GadgetValue &value(void) const { return mValue; }
 
     virtual bool open(void) { return true; }
     virtual void close(void) { }
 
-    void query(std::map<std::string, GadgetValue> &result) const {
-        result[mName] = mValue;
+    void query(GadgetValues &result) const {
+        result.set(mKind, mValue);
     }
 
     void query(GadgetValue &value) const {
@@ -74,14 +129,18 @@ public:
     }
 
     void flip(const GadgetValue&);
-    void flip(const GadgetValue&, const std::string&);
 
     void sync(const GadgetValue&);
 
     void status(void) const;
     void status(const std::string&) const;
 
+    // Store every later value change in a state file slot.
+    void persist(CStateFile *state, int slot);
+
 protected:
+    bool openDriver(const CConfig *cfg, const GadgetDriver *&driver) const;
+
     virtual void flip(int val) {}
     virtual void flip(bool val) {}
     virtual void flip(const float &val) {}
@@ -90,13 +149,17 @@ protected:
     CAgent *mAgent;
 
 private:
-    std::string mName;
+    GadgetKind mKind;
     GadgetValue mValue;
+
+    CStateFile *mState;
+    int mStateSlot;
 };
 
 class CBulb: public CGadget {
 public:
-    CBulb(CAgent *agent, bool val): CGadget("bulb", agent, val) {}
+    CBulb(CAgent *agent, bool val): CGadget(GadgetBulb, agent, val) {}
+    CBulb(CAgent *agent, const GadgetValue &val): CGadget(GadgetBulb, agent, val) {}
 
 protected:
     bool open(void) override;
@@ -107,7 +170,9 @@ protected:
 class CTorch: public CGadget {
 public:
     CTorch(std::shared_ptr<CConfig> cfg, CAgent *agent, bool val):
-        mCfg(cfg), CGadget("torch", agent, val) {}
+        CGadget(GadgetTorch, agent, val), mCfg(cfg), mDriver(NULL) {}
+    CTorch(CAgent *agent, const GadgetValue &val):
+        CGadget(GadgetTorch, agent, val), mCfg(nullptr), mDriver(NULL) {}
 
 protected:
     bool open(void) override;
@@ -116,11 +181,13 @@ protected:
 
 private:
     std::shared_ptr<CConfig> mCfg;
+    const GadgetDriver *mDriver;
 };
 
 class CBrightness: public CGadget {
 public:
-    CBrightness(CAgent *agent, float val): CGadget("brightness", agent, val) {}
+    CBrightness(CAgent *agent, float val): CGadget(GadgetBrightness, agent, val) {}
+    CBrightness(CAgent *agent, const GadgetValue &val): CGadget(GadgetBrightness, agent, val) {}
 
 protected:
     bool open(void) override;
@@ -130,7 +197,8 @@ protected:
 
 class CRing: public CGadget {
 public:
-    CRing(CAgent *agent, bool val): CGadget("ring", agent, val) {}
+    CRing(CAgent *agent, bool val): CGadget(GadgetRing, agent, val) {}
+    CRing(CAgent *agent, const GadgetValue &val): CGadget(GadgetRing, agent, val) {}
 
 protected:
     bool open(void) override;
@@ -140,7 +208,8 @@ protected:
 
 class CVolume: public CGadget {
 public:
-    CVolume(CAgent *agent, float val): CGadget("volume", agent, val) {}
+    CVolume(CAgent *agent, float val): CGadget(GadgetVolume, agent, val) {}
+    CVolume(CAgent *agent, const GadgetValue &val): CGadget(GadgetVolume, agent, val) {}
 
 protected:
     bool open(void) override;
@@ -151,7 +220,14 @@ protected:
 class CCamera: public CGadget {
 public:
     CCamera(std::shared_ptr<CConfig> cfg, CAgent *agent, bool val):
-        mCfg(cfg), CGadget("camera", agent, val) {}
+        CGadget(GadgetCamera, agent, val), mCfg(cfg), mDriver(NULL) {}
+    CCamera(CAgent *agent, const GadgetValue &val):
+        CGadget(GadgetCamera, agent, val), mCfg(nullptr), mDriver(NULL) {}
+
+public:
+    // Turn one camera of the gadget on or off by its config name.
+    bool flip(const char *camera, bool on);
+    void list(void) const;
 
 protected:
     bool open(void) override;
@@ -160,7 +236,8 @@ protected:
 
 private:
     std::shared_ptr<CConfig> mCfg;
-    std::shared_ptr<CRtp> mRtp;
+    const GadgetDriver *mDriver;
+    std::vector<std::shared_ptr<CCameraPipeline>> mPipelines;
 };
 
 #endif /* __GADGET_H__*/
@@ -0,0 +1,107 @@
+#ifndef __GADGET_DRIVER_H__
+#define __GADGET_DRIVER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Gadget driver ABI between wdemo and the hardware libraries it loads
+ * (libraspi.so). A driver library exports a single entry point that
+ * returns a static GadgetDriver table; wdemo resolves and validates it
+ * once when loading the library and calls through it afterwards.
+ *
+ * Compatibility rules:
+ *  - version is bumped for incompatible changes, wdemo refuses drivers
+ *    with another version;
+ *  - new members are only appended, size tells wdemo how much of the
+ *    table the driver knows about.
+ *
+ * A driver lists the gadgets it backs in gadgets; only the ops of those
+ * gadgets have to be set. Tables older than the gadgets member (size
+ * GADGET_DRIVER_SIZE_V1) back both torch and camera.
+ *
+ * The camera ops drive a single camera. Drivers that can run several at
+ * once (two cameras, or a main and a sub stream of one) also set the
+ * cameras ops, which work on instances; wdemo then only uses those.
+ */
+#define GADGET_DRIVER_VERSION   1
+#define GADGET_DRIVER_ENTRY     "gadget_driver_entry"
+
+typedef void (*GadgetStreamCallback)(void *data, int len, void *context);
+
+/* Parameters of one camera instance. */
+typedef struct GadgetCameraParams {
+    uint32_t size;          /* sizeof(GadgetCameraParams) wdemo was built with */
+    const char *name;
+    int device;             /* camera on the board, -1 for the default one */
+    int port;               /* local UDP port the encoder streams to */
+    int width;
+    int height;
+    int bitrate;
+    int framerate;
+    int profile;            /* 0 baseline, 1 main, 2 high */
+    int intra;              /* frames between key frames */
+    const char *source;     /* driver specific input, e.g. a file to replay;
+                               NULL for the camera itself */
+} GadgetCameraParams;
+
+typedef struct GadgetDriver {
+    uint32_t size;          /* sizeof(GadgetDriver) the driver was built with */
+    uint32_t version;       /* GADGET_DRIVER_VERSION */
+    const char *name;
+
+    /* LED matrix, backs the torch gadget. */
+    struct {
+        int  (*open)(void);
+        int  (*flip)(void);
+        void (*close)(void);
+    } matrix;
+
+    /* H.264 camera, backs the camera gadget. */
+    struct {
+        void (*set_callbacks)(GadgetStreamCallback cb, void *context);
+        void (*set_port)(int port);
+        void (*set_parameters)(int width, int height, int bitrate,
+                               int framerate, int profile);
+        int  (*open)(void);
+        int  (*flip)(void);
+        void (*close)(void);
+    } camera;
+
+    /* NULL terminated gadget names, e.g. { "torch", NULL }. */
+    const char *const *gadgets;
+
+    /* Optional: matrix persistence rate in frames per second, 0 for
+     * matrices that latch their rows. */
+    int  (*matrix_set_refresh)(int hz);
+
+    /* Optional: camera instances. open returns the handle the other ops
+     * take, NULL on error; each instance delivers its frames to cb from
+     * a thread of its own until turned off by flip or closed. */
+    struct {
+        void *(*open)(const GadgetCameraParams *params,
+                      GadgetStreamCallback cb, void *context);
+        int   (*flip)(void *camera, int on);
+        void  (*close)(void *camera);
+    } cameras;
+} GadgetDriver;
+
+#define GADGET_DRIVER_SIZE_V1   offsetof(GadgetDriver, gadgets)
+
+/* True if the driver table is large enough to carry member. */
+#define GADGET_DRIVER_HAS(ops, member) \
+    ((ops)->size >= offsetof(GadgetDriver, member) + sizeof((ops)->member))
+
+typedef const GadgetDriver *(*GadgetDriverEntry)(void);
+
+const GadgetDriver *gadget_driver_entry(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GADGET_DRIVER_H__ */
@@ -0,0 +1,86 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Latency histogram with fixed memory, so recording neither allocates nor
+ * shows up as growth: 16 linear sub-buckets per power of two of
+ * nanoseconds, which keeps percentiles within about 6%. Not thread safe;
+ * keep one per thread and merge() them for reporting.
+ */
+class CHistogram {
+public:
+    CHistogram() { reset(); }
+
+public:
+    void record(uint64_t ns) {
+        mCounts[index(ns)]++;
+        mCount++;
+        mSum += ns;
+        if (ns > mMax)
+            mMax = ns;
+    }
+
+    void merge(const CHistogram &other) {
+        for (int i = 0; i < Buckets; i++)
+            mCounts[i] += other.mCounts[i];
+        mCount += other.mCount;
+        mSum += other.mSum;
+        if (other.mMax > mMax)
+            mMax = other.mMax;
+    }
+
+    void reset(void) {
+        memset(mCounts, 0, sizeof(mCounts));
+        mCount = mSum = mMax = 0;
+    }
+
+    uint64_t count(void) const { return mCount; }
+    uint64_t mean(void) const { return mCount ? mSum / mCount : 0; }
+    uint64_t max(void) const { return mMax; }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = (uint64_t)(p / 100.0 * mCount + 0.5);
+        uint64_t seen = 0;
+
+        if (rank == 0)
+            rank = 1;
+
+        for (int i = 0; i < Buckets; i++) {
+            seen += mCounts[i];
+            if (seen >= rank)
+                return upper(i) < mMax ? upper(i) : mMax;
+        }
+        return mMax;
+    }
+
+public:
+    // Bucket layout, shared with the metrics histograms.
+    static const int Buckets = 61 * 16;
+
+    static int index(uint64_t v) {
+        if (v < 16)
+            return (int)v;
+
+        int e = 63 - __builtin_clzll(v);
+        return (e - 3) * 16 + (int)((v >> (e - 4)) & 15);
+    }
+
+    static uint64_t upper(int idx) {
+        if (idx < 16)
+            return idx;
+
+        int e = idx / 16 + 3;
+        return ((uint64_t)(17 + idx % 16) << (e - 4)) - 1;
+    }
+
+private:
+    uint64_t mCounts[Buckets];
+    uint64_t mCount;
+    uint64_t mSum;
+    uint64_t mMax;
+};
+
+#endif /* __HISTOGRAM_H__ */
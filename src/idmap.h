@@ -0,0 +1,175 @@
+#ifndef __IDMAP_H__
+#define __IDMAP_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <whisper.h>
+#include "dispatch.h"
+
+/*
+ * Non-owning reference to a user id. Whisper callbacks hand us either
+ * bare userids or "userid@nodeid" strings; IdRef lets us look those up
+ * without building a temporary std::string first.
+ */
+struct IdRef {
+public:
+    IdRef(const char *id): mId(id), mLen(strlen(id)) {}
+    IdRef(const char *id, size_t len): mId(id), mLen(len) {}
+    IdRef(const std::string &id): mId(id.c_str()), mLen(id.length()) {}
+
+public:
+    const char *data(void) const { return mId; }
+    size_t length(void) const { return mLen; }
+
+    std::string str(void) const { return std::string(mId, mLen); }
+
+    uint32_t hash(void) const { return dispatch::hashn(mId, mLen); }
+
+private:
+    const char *mId;
+    size_t mLen;
+};
+
+/*
+ * Open-addressing (linear probing) hash table keyed by user id. Keys are
+ * interned into the slot itself, so lookups never allocate and callers
+ * can keep using the interned, NUL-terminated copy as a whisper id.
+ */
+template <typename T>
+class CIdMap {
+public:
+    CIdMap(): mSlots(minCapacity), mUsed(0), mDeleted(0) {}
+
+public:
+    T *find(const IdRef &id) {
+        Slot *slot = lookup(id, id.hash());
+        return slot ? &slot->value : nullptr;
+    }
+
+    const T *find(const IdRef &id) const {
+        return const_cast<CIdMap*>(this)->find(id);
+    }
+
+    const char *key(const IdRef &id) const {
+        Slot *slot = const_cast<CIdMap*>(this)->lookup(id, id.hash());
+        return slot ? slot->key : nullptr;
+    }
+
+    T *insert(const IdRef &id, const T &value) {
+        if (id.length() == 0 || id.length() > WHISPER_MAX_ID_LEN)
+            return nullptr;
+
+        uint32_t hash = id.hash();
+        Slot *slot = lookup(id, hash);
+        if (slot) {
+            slot->value = value;
+            return &slot->value;
+        }
+
+        if ((mUsed + mDeleted + 1) * 4 > mSlots.size() * 3)
+            rehash((mUsed + 1) * 2 > mSlots.size() ? mSlots.size() * 2 : mSlots.size());
+
+        size_t mask = mSlots.size() - 1;
+        size_t idx = hash & mask;
+        while (mSlots[idx].state == Used)
+            idx = (idx + 1) & mask;
+
+        slot = &mSlots[idx];
+        if (slot->state == Deleted)
+            mDeleted--;
+
+        slot->state = Used;
+        slot->hash = hash;
+        memcpy(slot->key, id.data(), id.length());
+        slot->key[id.length()] = '\0';
+        slot->value = value;
+        mUsed++;
+
+        return &slot->value;
+    }
+
+    bool erase(const IdRef &id) {
+        Slot *slot = lookup(id, id.hash());
+        if (!slot)
+            return false;
+
+        slot->state = Deleted;
+        slot->value = T();
+        mUsed--;
+        mDeleted++;
+        return true;
+    }
+
+    size_t size(void) const { return mUsed; }
+
+    template <typename F>
+    void forEach(F func) const {
+        for (size_t i = 0; i < mSlots.size(); i++) {
+            if (mSlots[i].state == Used)
+                func(mSlots[i].key, mSlots[i].value);
+        }
+    }
+
+private:
+    enum SlotState {
+        Empty = 0,
+        Used,
+        Deleted
+    };
+
+    struct Slot {
+        Slot(): hash(0), state(Empty), value() { key[0] = '\0'; }
+
+        uint32_t hash;
+        uint8_t  state;
+        char key[WHISPER_MAX_ID_LEN + 1];
+        T value;
+    };
+
+    static const size_t minCapacity = 16;
+
+    Slot *lookup(const IdRef &id, uint32_t hash) {
+        size_t mask = mSlots.size() - 1;
+        size_t idx = hash & mask;
+
+        while (mSlots[idx].state != Empty) {
+            Slot &slot = mSlots[idx];
+            if (slot.state == Used && slot.hash == hash &&
+                strncmp(slot.key, id.data(), id.length()) == 0 &&
+                slot.key[id.length()] == '\0')
+                return &slot;
+
+            idx = (idx + 1) & mask;
+        }
+        return nullptr;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> slots(capacity);
+        size_t mask = capacity - 1;
+
+        for (size_t i = 0; i < mSlots.size(); i++) {
+            if (mSlots[i].state != Used)
+                continue;
+
+            size_t idx = mSlots[i].hash & mask;
+            while (slots[idx].state == Used)
+                idx = (idx + 1) & mask;
+            slots[idx] = mSlots[i];
+        }
+
+        mSlots.swap(slots);
+        mDeleted = 0;
+    }
+
+private:
+    std::vector<Slot> mSlots;
+    size_t mUsed;
+    size_t mDeleted;
+};
+
+#endif /* __IDMAP_H__ */
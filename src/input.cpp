@@ -1,15 +1,18 @@
 #include <cstdlib>
 #include <cctype>
-#include <iostream>
+#include <cerrno>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <vector>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include "vlog.h"
 #include "cmd.h"
 #include "gadget.h"
 #include "input.h"
+#include "metrics.h"
 
 inline bool isLF(int ch)
 {
@@ -21,94 +24,182 @@ inline bool isCR(int ch)
     return (ch == 0x0D);
 }
 
+CInput::~CInput()
+{
+    stop();
+
+    CCommand *cmd;
+    while (mCmds.pop(cmd))
+        delete cmd;
+}
+
 bool CInput::setup(void)
 {
-    int fd;
     int rc;
 
-    fd = fileno(stdin);
-    rc = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
-    if (rc < 0)
-        vlogE("Setup input error");
+    rc = pipe(mWakeFds);
+    if (rc < 0) {
+        vlogE("Setup input error (%d)", errno);
+        return false;
+    }
+
+    rc = pthread_create(&mThread, NULL, readRoutine, this);
+    if (rc != 0) {
+        vlogE("Create input thread error (%d)", rc);
+        close(mWakeFds[0]);
+        close(mWakeFds[1]);
+        mWakeFds[0] = mWakeFds[1] = -1;
+        return false;
+    }
 
-    return (rc != -1);
+    mRunning = true;
+    return true;
 }
 
-bool CInput::readCmd(void)
+void CInput::stop(void)
 {
-    int ch;
+    if (mRunning) {
+        char ch = 0;
+        if (write(mWakeFds[1], &ch, 1) < 0)
+            vlogW("Wake up input thread error (%d)", errno);
 
-    do {
-        ch = std::getchar();
+        pthread_join(mThread, NULL);
+        mRunning = false;
+    }
 
-        if (isLF(ch) || isCR(ch)) {
-            if (mPos > 0) {
-                mCmdArgv.push_back(std::string(mTmpBuf.data()));
-                mTmpBuf.fill('\0');
-                mPos = 0;
-            }
-            return true;
+    if (mWakeFds[0] >= 0) {
+        close(mWakeFds[0]);
+        close(mWakeFds[1]);
+        mWakeFds[0] = mWakeFds[1] = -1;
+    }
+}
+
+std::shared_ptr<CCommand> CInput::popCmd(void)
+{
+    CCommand *cmd;
+
+    if (!mCmds.pop(cmd))
+        return nullptr;
+
+    metricCommandQueue.add(-1);
+    return std::shared_ptr<CCommand>(cmd);
+}
+
+void CInput::splitLine(const char *line, size_t len, std::vector<std::string> &argv)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        while (i < len && isspace((unsigned char)line[i]))
+            i++;
+
+        size_t start = i;
+        while (i < len && !isspace((unsigned char)line[i]))
+            i++;
+
+        if (i > start)
+            argv.push_back(std::string(line + start, i - start));
+    }
+}
+
+void *CInput::readRoutine(void *argv)
+{
+    CInput *input = static_cast<CInput*>(argv);
+
+    input->readLoop();
+    return NULL;
+}
+
+void CInput::readLoop(void)
+{
+    struct pollfd fds[2];
+    char buf[256];
+    ssize_t rc;
+
+    fds[0].fd = fileno(stdin);
+    fds[0].events = POLLIN;
+    fds[1].fd = mWakeFds[0];
+    fds[1].events = POLLIN;
+
+    while (true) {
+        rc = poll(fds, 2, -1);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            vlogE("Poll console input error (%d)", errno);
+            break;
         }
 
-        if (isspace(ch)) {
-            if (mPos > 0) {
-                mCmdArgv.push_back(std::string(mTmpBuf.data()));
-                mTmpBuf.fill('\0');
-                mPos = 0;
-            }
+        if (fds[1].revents)
+            break;
+
+        if (!fds[0].revents)
             continue;
+
+        rc = read(fds[0].fd, buf, sizeof(buf));
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            vlogE("Read console input error (%d)", errno);
+            break;
         }
 
-        if (isprint(ch)) {
-            if (mPos + 1 == LINEBUF_SZ)
-                vlogW("Temprary input buffer full, skipped input");
-            else
-                mTmpBuf[mPos++] = (char)ch;
+        if (rc == 0)  // stdin closed, nothing more to read.
+            break;
+
+        feed(buf, (size_t)rc);
+    }
+}
+
+void CInput::feed(const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        char ch = data[i];
+
+        if (isLF(ch) || isCR(ch)) {
+            if (!mDiscard && mLen > 0)
+                dispatchLine(mLine, mLen);
 
+            mLen = 0;
+            mDiscard = false;
             continue;
         }
 
-    } while (ch != EOF);
+        if (mDiscard)
+            continue;
+
+        if (mLen == sizeof(mLine)) {
+            vlogW("Temprary input buffer full, skipped input");
+            mDiscard = true;
+            continue;
+        }
 
-    return false;
+        if (isprint((unsigned char)ch) || isspace((unsigned char)ch))
+            mLine[mLen++] = ch;
+    }
 }
 
-std::shared_ptr<CCommand> CInput::getCmd(void) const
+void CInput::dispatchLine(const char *line, size_t len)
 {
-    if (mCmdArgv.empty())
-        return nullptr;
+    std::vector<std::string> argv;
+
+    splitLine(line, len, argv);
+    if (argv.empty())
+        return;
 
-    CCommand *cmd = NULL;
-
-    if (mCmdArgv[0].compare("bulb") == 0)
-        cmd = new CBulbCmd(mCmdArgv);
-    else if (mCmdArgv[0].compare("torch") == 0)
-        cmd = new CTorchCmd(mCmdArgv);
-    else if (mCmdArgv[0].compare("brightness") == 0)
-        cmd = new CBrightnessCmd(mCmdArgv);
-    else if (mCmdArgv[0].compare("ring") == 0)
-        cmd = new CRingCmd(mCmdArgv);
-    else if (mCmdArgv[0].compare("volume") == 0)
-        cmd = new CVolumeCmd(mCmdArgv);
-    else if (mCmdArgv[0].compare("camera") == 0)
-        cmd = new CCameraCmd(mCmdArgv);
-    else if (mCmdArgv[0].compare("frequest") == 0)
-        cmd = new CFrequestCmd(mCmdArgv);
-    else if (mCmdArgv[0].compare("friends") == 0)
-        cmd = new CFriendsCmd(mCmdArgv);
-    else if (mCmdArgv[0].compare("me") == 0)
-        cmd = new CMeCmd(mCmdArgv);
-    else {
+    CCommand *cmd;
+
+    cmd = newCommand(argv);
+    if (!cmd) {
         vlogE("Invalid command, skipped");
-        return nullptr;
+        return;
     }
 
-    return std::shared_ptr<CCommand>(cmd);
-}
+    if (!mCmds.push(cmd)) {
+        vlogW("Command queue full, skipped");
+        delete cmd;
+        return;
+    }
 
-void CInput::reset(void)
-{
-    mPos = 0;
-    mTmpBuf.fill('\0');
-    mCmdArgv.clear();
+    metricCommandQueue.add(1);
 }
@@ -3,29 +3,53 @@
 
 #include <memory>
 #include <vector>
-#include <array>
 #include <string>
+#include <pthread.h>
 
-const int LINEBUF_SZ = 128;
+#include "spscq.h"
+
+const int LINEBUF_SZ = 1024;
+const int CMDQUEUE_SZ = 64;
 
 class CCommand;
 
+/*
+ * Console reader. A dedicated thread waits on stdin with poll(), splits
+ * complete lines into commands and hands them to the whisper thread
+ * through a lock-free queue, which the agent drains from its idle
+ * callback.
+ */
 class CInput {
 public:
-    CInput() { reset(); }
-    ~CInput() = default;
+    CInput(): mCmds(CMDQUEUE_SZ), mRunning(false), mLen(0), mDiscard(false) {
+        mWakeFds[0] = mWakeFds[1] = -1;
+    }
+    ~CInput();
 
 public:
     bool setup(void);
+    void stop(void);
+
+    std::shared_ptr<CCommand> popCmd(void);
+
+    static void splitLine(const char *line, size_t len, std::vector<std::string> &argv);
 
-    bool readCmd(void);
-    std::shared_ptr<CCommand> getCmd(void) const;
-    void reset(void);
+private:
+    static void *readRoutine(void *argv);
+    void readLoop(void);
+    void feed(const char *data, size_t len);
+    void dispatchLine(const char *line, size_t len);
 
 private:
-    int mPos;
-    std::array<char, LINEBUF_SZ> mTmpBuf;
-    std::vector<std::string> mCmdArgv;
+    CSpscQueue<CCommand*> mCmds;
+
+    pthread_t mThread;
+    bool mRunning;
+    int mWakeFds[2];
+
+    char mLine[LINEBUF_SZ];
+    size_t mLen;
+    bool mDiscard;
 };
 
 #endif /* __INPUT_H__ */
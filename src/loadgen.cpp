@@ -0,0 +1,660 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "wstub.h"
+#include "vlog.h"
+#include "cfg.h"
+#include "input.h"
+#include "agent.h"
+#include "gadget.h"
+#include "state.h"
+#include "histogram.h"
+
+/*
+ * wdemo-load: put a CAgent under the load of a large hub without any
+ * network. The agent links against the passive whisper stub (wstub.h),
+ * whose whisper_run() plays a scenario of synthetic peers straight into
+ * the callbacks the agent registered (friend list, connection changes,
+ * friend messages, session requests and stream states) and times every
+ * callback, while an optional media thread fans video frames out to the
+ * open sessions. Every report prints callback latency percentiles and how
+ * the process grew since the friend list was loaded.
+ */
+
+#define LOAD_CALLBACK_LIST(X) \
+    X(FriendList,       "friend_list")      \
+    X(FriendConnection, "friend_conn")      \
+    X(MsgQuery,         "msg_query")        \
+    X(MsgStatus,        "msg_status")       \
+    X(MsgSync,          "msg_sync")         \
+    X(MsgModify,        "msg_modify")       \
+    X(SessionRequest,   "session_request")  \
+    X(StreamState,      "stream_state")     \
+    X(Idle,             "idle")             \
+    X(VideoFrame,       "video_frame")
+
+#define LOAD_CALLBACK_ENUM(id, name) Cb##id,
+enum LoadCallback {
+    LOAD_CALLBACK_LIST(LOAD_CALLBACK_ENUM)
+    CbCount
+};
+#undef LOAD_CALLBACK_ENUM
+
+#define LOAD_CALLBACK_NAME(id, name) name,
+static const char *callbackNames[] = {
+    LOAD_CALLBACK_LIST(LOAD_CALLBACK_NAME)
+};
+#undef LOAD_CALLBACK_NAME
+
+struct LoadOptions {
+    int peers;
+    int online;         // percent of peers online after the friend list
+    double messages;    // friend messages per second
+    int modify;         // percent of messages that are "modify"
+    double flaps;       // connection changes per second
+    double sessionRate; // session requests per second
+    int sessions;       // concurrent sessions
+    int fps;            // video frames per second fanned out, 0: none
+    int frameSize;
+    int duration;       // seconds after the friend list
+    int report;         // seconds between reports
+    unsigned seed;
+    bool state;
+};
+
+struct LoadPeer {
+    std::string id;
+    bool online;
+    uint32_t session;   // id of the open session, 0: none
+};
+
+static LoadOptions opts = {
+    1000,   // peers
+    50,     // online
+    200,    // messages
+    5,      // modify
+    10,     // flaps
+    5,      // sessionRate
+    100,    // sessions
+    0,      // fps
+    4096,   // frameSize
+    30,     // duration
+    5,      // report
+    1,      // seed
+    false   // state
+};
+
+static CAgent *theAgent = NULL;
+static std::string selfId;
+
+static std::vector<LoadPeer> peers;
+static std::map<std::string, int> peerIndex;
+static std::deque<uint32_t> sessionOrder;
+static std::mt19937 rng;
+
+static CHistogram histograms[CbCount];
+static CHistogram totals[CbCount];
+static std::mutex videoLock;
+
+static uint64_t messagesOut = 0;
+static uint64_t messageBytesOut = 0;
+static std::atomic<uint64_t> streamWrites(0);
+static std::atomic<uint64_t> streamBytes(0);
+
+static
+uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Resident and peak resident set size in kB, from /proc/self/status. */
+static
+void memoryUsage(long &rss, long &hwm)
+{
+    char line[128];
+    FILE *fp;
+
+    rss = hwm = 0;
+    fp = fopen("/proc/self/status", "r");
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+            rss = atol(line + 6);
+        else if (strncmp(line, "VmHWM:", 6) == 0)
+            hwm = atol(line + 6);
+    }
+    fclose(fp);
+}
+
+// Deterministic, valid whisper ids: base58 digits of the index, padded.
+static
+std::string peerId(int index)
+{
+    static const char base58[] =
+        "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+    std::string id(WHISPER_MAX_ID_LEN - 1, '1');
+
+    id[0] = 'L';
+    for (size_t pos = id.length() - 1; index > 0; pos--) {
+        id[pos] = base58[index % 58];
+        index /= 58;
+    }
+    return id;
+}
+
+template <typename Fn>
+static
+void timed(LoadCallback cb, Fn fn)
+{
+    uint64_t start = nowNs();
+    fn();
+    histograms[cb].record(nowNs() - start);
+}
+
+static
+void friendInfo(const LoadPeer &peer, WhisperFriendInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    snprintf(info->user_info.userid, sizeof(info->user_info.userid), "%s", peer.id.c_str());
+    snprintf(info->user_info.name, sizeof(info->user_info.name), "load-%s", peer.id.c_str() + 36);
+    info->entrusted = 1;
+    info->status = peer.online ? WhisperConnectionStatus_Connected
+                               : WhisperConnectionStatus_Disconnected;
+    info->presence = WhisperPresenceStatus_None;
+}
+
+static
+int randomPeer(bool online)
+{
+    std::uniform_int_distribution<int> pick(0, opts.peers - 1);
+
+    // Plenty of tries unless almost every peer is in the other state.
+    for (int i = 0; i < 64; i++) {
+        int idx = pick(rng);
+        if (peers[idx].online == online)
+            return idx;
+    }
+    return -1;
+}
+
+static
+void loadFriendList(Whisper *w)
+{
+    std::bernoulli_distribution online(opts.online / 100.0);
+
+    for (int i = 0; i < opts.peers; i++) {
+        LoadPeer peer = { peerId(i), online(rng), 0 };
+        WhisperFriendInfo info;
+
+        peerIndex[peer.id] = i;
+        peers.push_back(peer);
+
+        friendInfo(peer, &info);
+        timed(CbFriendList, [&]() {
+            w->callbacks.friend_list(w, &info, w->context);
+        });
+    }
+
+    w->callbacks.friend_list(w, NULL, w->context);
+}
+
+static
+void flapPeer(Whisper *w)
+{
+    int idx = std::uniform_int_distribution<int>(0, opts.peers - 1)(rng);
+    LoadPeer &peer = peers[idx];
+
+    peer.online = !peer.online;
+    timed(CbFriendConnection, [&]() {
+        w->callbacks.friend_connection(w, peer.id.c_str(),
+            peer.online ? WhisperConnectionStatus_Connected
+                        : WhisperConnectionStatus_Disconnected, w->context);
+    });
+}
+
+static
+void sendMessage(Whisper *w)
+{
+    std::uniform_int_distribution<int> percent(0, 99);
+    LoadCallback cb;
+    char msg[256];
+    int idx;
+
+    idx = randomPeer(true);
+    if (idx < 0)
+        return;
+
+    // Modify changes local gadgets and so fans a sync out to every peer.
+    if (percent(rng) < opts.modify) {
+        cb = CbMsgModify;
+        snprintf(msg, sizeof(msg), "{\"type\":\"modify\",\"brightness\":%d}",
+                 percent(rng));
+    } else {
+        switch (percent(rng) % 3) {
+        case 0:
+            cb = CbMsgQuery;
+            snprintf(msg, sizeof(msg), "{\"type\":\"query\"}");
+            break;
+        case 1:
+            cb = CbMsgStatus;
+            snprintf(msg, sizeof(msg),
+                     "{\"type\":\"status\",\"bulb\":%s,\"brightness\":%d,"
+                     "\"ring\":false,\"volume\":%d}",
+                     percent(rng) & 1 ? "true" : "false", percent(rng), percent(rng));
+            break;
+        default:
+            cb = CbMsgSync;
+            snprintf(msg, sizeof(msg), "{\"type\":\"sync\",\"volume\":%d}",
+                     percent(rng));
+            break;
+        }
+    }
+
+    timed(cb, [&]() {
+        w->callbacks.friend_message(w, peers[idx].id.c_str(), msg,
+                                    strlen(msg) + 1, w->context);
+    });
+}
+
+static
+void requestSession(Whisper *w)
+{
+    static const char sdp[] = "v=0 whisper-ice-session load";
+    int idx;
+
+    if (!opts.sessions)
+        return;
+
+    // At the cap the oldest session is hung up by its peer first.
+    if ((int)sessionOrder.size() >= opts.sessions) {
+        wstubQueueState(sessionOrder.front(), WhisperStreamState_closed);
+        sessionOrder.pop_front();
+    }
+
+    idx = randomPeer(true);
+    if (idx < 0 || peers[idx].session || !w->sessionCb)
+        return;
+
+    timed(CbSessionRequest, [&]() {
+        w->sessionCb(w, peers[idx].id.c_str(), sdp, sizeof(sdp), w->sessionContext);
+    });
+}
+
+static
+void deliverStreamState(WhisperSession *ws, WhisperStreamState state)
+{
+    timed(CbStreamState, [&]() {
+        ws->callbacks.state_changed(ws, 1, state, ws->context);
+    });
+}
+
+static
+void videoRoutine(std::atomic<bool> *running)
+{
+    std::vector<uint8_t> frame(opts.frameSize, 0x80);
+    uint64_t interval = 1000000000ULL / opts.fps;
+    uint64_t next = nowNs();
+
+    while (running->load()) {
+        uint64_t start = nowNs();
+        theAgent->sendVideoFrame(frame.data(), (int)frame.size());
+
+        {
+            std::lock_guard<std::mutex> guard(videoLock);
+            histograms[CbVideoFrame].record(nowNs() - start);
+        }
+
+        next += interval;
+        uint64_t now = nowNs();
+        if (next > now)
+            usleep((useconds_t)((next - now) / 1000));
+    }
+}
+
+static
+void printReport(double elapsed, long baseRss, bool final)
+{
+    long rss, hwm;
+
+    memoryUsage(rss, hwm);
+
+    printf("\n--- %s %.1fs: %zu online sessions, %lu msgs out (%lu bytes), "
+           "%lu stream writes (%lu bytes)\n",
+           final ? "total" : "at", elapsed, sessionOrder.size(),
+           (unsigned long)messagesOut, (unsigned long)messageBytesOut,
+           (unsigned long)streamWrites.load(), (unsigned long)streamBytes.load());
+    printf("%-16s %9s %9s %9s %9s %9s %9s %9s\n", "callback (us)", "count",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+
+    std::lock_guard<std::mutex> guard(videoLock);
+    for (int i = 0; i < CbCount; i++) {
+        CHistogram &h = final ? totals[i] : histograms[i];
+
+        if (!final)
+            totals[i].merge(h);
+        if (!h.count())
+            continue;
+
+        printf("%-16s %9lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", callbackNames[i],
+               (unsigned long)h.count(), h.mean() / 1000.0,
+               h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+               h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+               h.max() / 1000.0);
+
+    }
+
+    if (!final) {
+        for (int i = 0; i < CbCount; i++)
+            histograms[i].reset();
+    }
+
+    printf("memory: rss %ld kB (%+ld kB since friend list, %.1f bytes/peer), peak %ld kB\n",
+           rss, rss - baseRss, (rss - baseRss) * 1024.0 / opts.peers, hwm);
+    fflush(stdout);
+}
+
+/*
+ * One event source firing at a fixed rate; the due time advances by the
+ * interval so a slow callback makes the following ones fire back to back.
+ */
+struct Ticker {
+    Ticker(double rate, uint64_t start):
+        interval(rate > 0 ? (uint64_t)(1e9 / rate) : 0), due(start) {}
+
+    bool fire(uint64_t now) {
+        if (!interval || now < due)
+            return false;
+        due += interval;
+        return true;
+    }
+
+    uint64_t interval;
+    uint64_t due;
+};
+
+static
+void runScenario(Whisper *w, int idleInterval)
+{
+    long rss, hwm, baseRss;
+    uint64_t start, end, now;
+
+    memoryUsage(rss, hwm);
+    printf("baseline: rss %ld kB, loading %d peers\n", rss, opts.peers);
+
+    if (w->callbacks.self_info) {
+        WhisperUserInfo info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.userid, sizeof(info.userid), "%s", selfId.c_str());
+        w->callbacks.self_info(w, &info, w->context);
+    }
+
+    start = nowNs();
+    loadFriendList(w);
+    w->callbacks.connection_status(w, WhisperConnectionStatus_Connected, w->context);
+    w->callbacks.ready(w, w->context);
+
+    memoryUsage(baseRss, hwm);
+    printf("friend list: %d peers in %.1f ms, rss %ld kB (%.1f bytes/peer)\n",
+           opts.peers, (nowNs() - start) / 1e6, baseRss,
+           (baseRss - rss) * 1024.0 / opts.peers);
+
+    std::atomic<bool> videoRunning(opts.fps > 0);
+    std::thread video;
+    if (opts.fps > 0)
+        video = std::thread(videoRoutine, &videoRunning);
+
+    start = nowNs();
+    end = start + (uint64_t)opts.duration * 1000000000ULL;
+
+    Ticker messages(opts.messages, start);
+    Ticker flaps(opts.flaps, start);
+    Ticker requests(opts.sessionRate, start);
+    Ticker idle(1000.0 / idleInterval, start);
+    Ticker report(1.0 / opts.report, start + (uint64_t)opts.report * 1000000000ULL);
+
+    while ((now = nowNs()) < end && !w->stopping.load()) {
+        while (messages.fire(now))
+            sendMessage(w);
+        while (flaps.fire(now))
+            flapPeer(w);
+        while (requests.fire(now))
+            requestSession(w);
+
+        wstubDeliverStates(deliverStreamState);
+
+        if (idle.fire(now))
+            timed(CbIdle, [&]() { w->callbacks.idle(w, w->context); });
+
+        if (report.fire(now))
+            printReport((now - start) / 1e9, baseRss, false);
+
+        usleep(200);
+    }
+
+    videoRunning.store(false);
+    if (video.joinable())
+        video.join();
+
+    printReport((nowNs() - start) / 1e9, baseRss, false);
+    printReport((nowNs() - start) / 1e9, baseRss, true);
+}
+
+/*
+ * What the agent sends to the synthetic peers, seen through the whisper stub.
+ */
+static
+int sendFriendMessage(const char *to, const char *msg, size_t len)
+{
+    auto it = peerIndex.find(to);
+    if (it == peerIndex.end())
+        return WERR_NOT_EXIST;
+    if (!peers[it->second].online)
+        return WERR_NOT_READY;
+
+    messagesOut++;
+    messageBytesOut += len;
+    return 0;
+}
+
+static
+int newSession(const char *peer)
+{
+    return peerIndex.count(peer) ? 0 : WERR_NOT_EXIST;
+}
+
+static
+void startSession(WhisperSession *ws)
+{
+    LoadPeer &peer = peers[peerIndex[ws->peer]];
+
+    if (!peer.session) {
+        peer.session = ws->id;
+        sessionOrder.push_back(ws->id);
+    }
+}
+
+static
+void closeSession(WhisperSession *ws)
+{
+    LoadPeer &peer = peers[peerIndex[ws->peer]];
+
+    if (peer.session == ws->id) {
+        peer.session = 0;
+        for (auto it = sessionOrder.begin(); it != sessionOrder.end(); ++it) {
+            if (*it == ws->id) {
+                sessionOrder.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+static
+int writeStream(WhisperSession *ws, const void *data, size_t len)
+{
+    streamWrites.fetch_add(1, std::memory_order_relaxed);
+    streamBytes.fetch_add(len, std::memory_order_relaxed);
+    return 0;
+}
+
+static
+void usage(const char *prog)
+{
+    printf("\nUsage: %s -c CONFIG_FILE [options]\n"
+           "  -p, --peers N          friends of the agent (%d)\n"
+           "  -o, --online PCT       percent of them online at start (%d)\n"
+           "  -m, --messages RATE    friend messages per second (%g)\n"
+           "      --modify PCT       percent of messages that modify gadgets (%d)\n"
+           "  -f, --flaps RATE       friend connection changes per second (%g)\n"
+           "  -r, --session-rate R   session requests per second (%g)\n"
+           "  -s, --sessions N       concurrent sessions (%d)\n"
+           "      --fps N            video frames per second to sessions (%d)\n"
+           "      --frame-size N     bytes per video frame (%d)\n"
+           "  -d, --duration SEC     length of the run (%d)\n"
+           "  -i, --report SEC       seconds between reports (%d)\n"
+           "      --seed N           random seed (%u)\n"
+           "      --state            persist gadgets in the data dir state file\n",
+           prog, opts.peers, opts.online, opts.messages, opts.modify, opts.flaps,
+           opts.sessionRate, opts.sessions, opts.fps, opts.frameSize,
+           opts.duration, opts.report, opts.seed);
+}
+
+int main(int argc, char **argv)
+{
+    struct option options[] = {
+        { "config",         required_argument,  NULL, 'c' },
+        { "peers",          required_argument,  NULL, 'p' },
+        { "online",         required_argument,  NULL, 'o' },
+        { "messages",       required_argument,  NULL, 'm' },
+        { "modify",         required_argument,  NULL,  1  },
+        { "flaps",          required_argument,  NULL, 'f' },
+        { "session-rate",   required_argument,  NULL, 'r' },
+        { "sessions",       required_argument,  NULL, 's' },
+        { "fps",            required_argument,  NULL,  2  },
+        { "frame-size",     required_argument,  NULL,  3  },
+        { "duration",       required_argument,  NULL, 'd' },
+        { "report",         required_argument,  NULL, 'i' },
+        { "seed",           required_argument,  NULL,  4  },
+        { "state",          no_argument,        NULL,  5  },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL,             0,                  NULL,  0  }
+    };
+    const char *config = NULL;
+    int opt;
+    int idx;
+
+    while ((opt = getopt_long(argc, argv, "c:p:o:m:f:r:s:d:i:h?", options, &idx)) != -1) {
+        switch (opt) {
+        case 'c': config = optarg; break;
+        case 'p': opts.peers = atoi(optarg); break;
+        case 'o': opts.online = atoi(optarg); break;
+        case 'm': opts.messages = atof(optarg); break;
+        case 1:   opts.modify = atoi(optarg); break;
+        case 'f': opts.flaps = atof(optarg); break;
+        case 'r': opts.sessionRate = atof(optarg); break;
+        case 's': opts.sessions = atoi(optarg); break;
+        case 2:   opts.fps = atoi(optarg); break;
+        case 3:   opts.frameSize = atoi(optarg); break;
+        case 'd': opts.duration = atoi(optarg); break;
+        case 'i': opts.report = atoi(optarg); break;
+        case 4:   opts.seed = (unsigned)atoi(optarg); break;
+        case 5:   opts.state = true; break;
+
+        case 'h':
+        case '?':
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!config || opts.peers <= 0 || opts.online < 0 || opts.online > 100 ||
+        opts.sessions < 0 || opts.fps < 0 || opts.frameSize <= 0 ||
+        opts.duration <= 0 || opts.report <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    rng.seed(opts.seed);
+    selfId = peerId(0).replace(0, 1, "S");
+
+    WhisperStubHooks hooks = {
+        runScenario, sendFriendMessage, newSession, startSession, closeSession,
+        writeStream
+    };
+    wstubSetup(selfId.c_str(), hooks);
+
+    std::shared_ptr<CConfig> cfg(new CConfig());
+    if (!cfg || !cfg->load(config)) {
+        vlogE("Load config %s error. recheck it.", config);
+        return -1;
+    }
+
+    // Log like wdemo does, so logging costs are part of the numbers; only
+    // errors reach the console next to the report.
+    if (cfg->binaryLog()) {
+        if (logBinaryOpen(cfg->binLogPath(), VLOG_ERR) < 0)
+            vlogW("Open binary log %s error, log to console only.", cfg->binLogPath());
+    } else {
+        if (logFileOpen(cfg->logPath(), VLOG_ERR) < 0)
+            vlogW("Open log %s error, log to console only.", cfg->logPath());
+    }
+    logAsyncStart();
+
+    std::shared_ptr<CStateFile> state;
+    if (opts.state) {
+        state = std::shared_ptr<CStateFile>(new CStateFile());
+        if (!state->open(cfg->dataDir()))
+            state = nullptr;
+    }
+
+    // Not set up: no console thread, the idle callback finds no commands.
+    std::shared_ptr<CInput> input(new CInput());
+    std::shared_ptr<CAgent> agent(new CAgent(input));
+    theAgent = agent.get();
+    agent->setState(state);
+
+    // Hardware gadgets (torch, camera) are left out; the media path is
+    // driven by --fps instead.
+    std::shared_ptr<CGadget> gadgets[] = {
+        std::shared_ptr<CGadget>(new CBulb(agent.get(), false)),
+        std::shared_ptr<CGadget>(new CBrightness(agent.get(), 0)),
+        std::shared_ptr<CGadget>(new CRing(agent.get(), false)),
+        std::shared_ptr<CGadget>(new CVolume(agent.get(), 0))
+    };
+
+    for (auto &gadget : gadgets) {
+        if (!gadget->open()) {
+            vlogE("Open %s gadget error", gadget->name());
+            return -1;
+        }
+        agent->addGadget(gadget);
+    }
+
+    if (!agent->setup(cfg)) {
+        vlogE("Setup agent error");
+        return -1;
+    }
+
+    agent->run();
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "logfmt.h"
+
+/*
+ * wdemo-logdecode: turn a binary log written by vlog (logformat = binary)
+ * back into the text format wdemo prints on stderr.
+ */
+
+#define TIME_FORMAT     "%Y-%m-%d %H:%M:%S"
+
+static const char* level_names[] = {
+    "ERROR",
+    "WARNING",
+    "INFO",
+    "DEBUG"
+};
+
+struct Decoder {
+    Decoder(): realtime(0), monotonic(0), records(0), errors(0) {}
+
+    uint64_t realtime;
+    uint64_t monotonic;
+    std::unordered_map<uint32_t, std::string> formats;
+
+    unsigned long records;
+    unsigned long errors;
+};
+
+static
+void printLine(const Decoder &dec, uint64_t stamp, int level, const char *msg, int len)
+{
+    uint64_t ns = dec.realtime + (stamp - dec.monotonic);
+    time_t sec = (time_t)(ns / 1000000000ULL);
+    char timestr[20];
+    struct tm tm;
+
+    strftime(timestr, sizeof(timestr), TIME_FORMAT, localtime_r(&sec, &tm));
+    printf("%s.%03u - %-7s : %.*s\n", timestr,
+           (unsigned)(ns % 1000000000ULL / 1000000), level_names[level & 3],
+           len, msg);
+}
+
+static
+void decodeFrame(Decoder &dec, const LogFrameHeader &frame, const uint8_t *data)
+{
+    uint32_t id;
+    uint64_t stamp;
+
+    switch (frame.kind) {
+    case LogFrameFormat:
+        if (frame.len < 4)
+            break;
+        memcpy(&id, data, 4);
+        dec.formats[id].assign((const char *)data + 4, frame.len - 4);
+        return;
+
+    case LogFrameRecord: {
+        if (frame.len < 12)
+            break;
+        memcpy(&id, data, 4);
+        memcpy(&stamp, data + 4, 8);
+
+        auto it = dec.formats.find(id);
+        if (it == dec.formats.end())
+            break;
+
+        char text[4096];
+        int len = logFormatArgs(it->second.c_str(), data + 12, frame.len - 12,
+                                text, sizeof(text));
+        if (len < 0)
+            break;
+
+        printLine(dec, stamp, frame.level, text, len);
+        dec.records++;
+        return;
+    }
+
+    case LogFrameText:
+        if (frame.len < 8)
+            break;
+        memcpy(&stamp, data, 8);
+        printLine(dec, stamp, frame.level, (const char *)data + 8, frame.len - 8);
+        dec.records++;
+        return;
+
+    case LogFrameDropped: {
+        if (frame.len < 4)
+            break;
+        memcpy(&id, data, 4);
+        printf("%u log messages dropped\n", id);
+        return;
+    }
+
+    default:
+        break;
+    }
+
+    dec.errors++;
+}
+
+static
+int decode(FILE *fp)
+{
+    Decoder dec;
+    std::vector<uint8_t> data;
+    bool header = false;
+
+    for (;;) {
+        int c = fgetc(fp);
+        if (c == EOF)
+            break;
+        ungetc(c, fp);
+
+        // A new file header starts every time wdemo (re)opened the log.
+        if (c == (LOG_FILE_MAGIC & 0xff)) {
+            LogFileHeader hdr;
+            if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != LOG_FILE_MAGIC) {
+                fprintf(stderr, "Corrupted log header.\n");
+                return -1;
+            }
+            if (hdr.version != LOG_FILE_VERSION) {
+                fprintf(stderr, "Unsupported log version %d.\n", hdr.version);
+                return -1;
+            }
+
+            dec.realtime = hdr.realtime;
+            dec.monotonic = hdr.monotonic;
+            dec.formats.clear();
+            header = true;
+            continue;
+        }
+
+        if (!header) {
+            fprintf(stderr, "Not a wdemo binary log.\n");
+            return -1;
+        }
+
+        LogFrameHeader frame;
+        if (fread(&frame, sizeof(frame), 1, fp) != 1)
+            break;
+
+        data.resize(frame.len);
+        if (frame.len && fread(data.data(), 1, frame.len, fp) != frame.len) {
+            fprintf(stderr, "Truncated log frame.\n");
+            break;
+        }
+
+        decodeFrame(dec, frame, data.data());
+    }
+
+    if (dec.errors)
+        fprintf(stderr, "%lu records decoded, %lu undecodable.\n",
+                dec.records, dec.errors);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *fp = stdin;
+    int rc;
+
+    if (argc > 2 || (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))) {
+        printf("\nUsage: %s [BINARY_LOG_FILE]\n", argv[0]);
+        return -1;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "-") != 0) {
+        fp = fopen(argv[1], "rb");
+        if (!fp) {
+            fprintf(stderr, "Open %s error.\n", argv[1]);
+            return -1;
+        }
+    }
+
+    rc = decode(fp);
+
+    if (fp != stdin)
+        fclose(fp);
+
+    return rc;
+}
@@ -0,0 +1,318 @@
+#ifndef __LOGFMT_H__
+#define __LOGFMT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Binary log stream layout, shared by vlog and wdemo-logdecode.
+ *
+ * The stream starts with a LogFileHeader and is followed by frames. Every
+ * frame starts with a LogFrameHeader, all fields are host byte order:
+ *
+ *   LogFrameFormat   u32 site id, format string (not NUL terminated)
+ *   LogFrameRecord   u32 site id, u64 monotonic ns, packed arguments
+ *   LogFrameText     u64 monotonic ns, preformatted message
+ *   LogFrameDropped  u32 number of records lost to full rings
+ *
+ * A format frame is written before the first record of each site in a
+ * file, so every file can be decoded on its own. Arguments are packed in
+ * the order the format consumes them (see logFormatSignature()).
+ */
+#define LOG_FILE_MAGIC      0x4c424457  /* "WDBL" */
+#define LOG_FILE_VERSION    1
+
+#define LOG_MAX_ARGS        16
+#define LOG_MAX_STRING      128
+
+enum {
+    LogFrameFormat  = 1,
+    LogFrameRecord  = 2,
+    LogFrameText    = 3,
+    LogFrameDropped = 4
+};
+
+/* Argument types, as stored in a format signature. */
+enum {
+    LogArgInt       = 'i',  /* 4 bytes */
+    LogArgLong      = 'l',  /* 8 bytes */
+    LogArgWord      = 'w',  /* long, size_t, ptrdiff_t: 4 or 8 bytes as */
+    LogArgUWord     = 'W',  /* passed, widened to 8 bytes when packed */
+    LogArgDouble    = 'd',  /* 8 bytes, long double is narrowed */
+    LogArgLongDouble= 'D',
+    LogArgPointer   = 'p',  /* 8 bytes */
+    LogArgString    = 's'   /* u16 length + bytes */
+};
+
+#pragma pack(push, 1)
+typedef struct LogFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t realtime;      /* CLOCK_REALTIME ns ... */
+    uint64_t monotonic;     /* ... taken together with this CLOCK_MONOTONIC ns */
+} LogFileHeader;
+
+typedef struct LogFrameHeader {
+    uint8_t  kind;
+    uint8_t  level;
+    uint16_t len;           /* payload length, header excluded */
+} LogFrameHeader;
+#pragma pack(pop)
+
+/*
+ * Walk a printf format and describe the arguments it consumes. Returns
+ * the number of arguments written into sig (NUL terminated), or -1 when
+ * the format uses more than max arguments or conversions we don't pack
+ * (%n). sig must have room for max + 1 characters.
+ */
+static inline
+int logFormatSignature(const char *format, char *sig, int max)
+{
+    const char *p = format;
+    int n = 0;
+
+    while (*p) {
+        if (*p++ != '%')
+            continue;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+
+        int lng = 0;
+
+        while (*p && strchr("-+ #0'", *p))
+            p++;
+
+        // width / precision, '*' consumes an int argument.
+        for (int i = 0; i < 2; i++) {
+            if (i == 1) {
+                if (*p != '.')
+                    break;
+                p++;
+            }
+            if (*p == '*') {
+                if (n >= max)
+                    return -1;
+                sig[n++] = LogArgInt;
+                p++;
+            } else {
+                while (*p >= '0' && *p <= '9')
+                    p++;
+            }
+        }
+
+        switch (*p) {
+        case 'h':
+            while (*p == 'h')
+                p++;
+            break;
+        case 'l':
+            lng = p[1] == 'l' ? 1 : 3;
+            while (*p == 'l')
+                p++;
+            break;
+        case 'z':
+        case 't':
+            lng = 3;
+            p++;
+            break;
+        case 'j':
+        case 'q':
+            lng = 1;
+            p++;
+            break;
+        case 'L':
+            lng = 2;
+            p++;
+            break;
+        default:
+            break;
+        }
+
+        char type;
+        switch (*p) {
+        case 'd': case 'i':
+            type = lng == 3 ? LogArgWord : lng ? LogArgLong : LogArgInt;
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            type = lng == 3 ? LogArgUWord : lng ? LogArgLong : LogArgInt;
+            break;
+        case 'c':
+            type = LogArgInt;
+            break;
+        case 'f': case 'F': case 'e': case 'E':
+        case 'g': case 'G': case 'a': case 'A':
+            type = lng == 2 ? LogArgLongDouble : LogArgDouble;
+            break;
+        case 'p':
+            type = LogArgPointer;
+            break;
+        case 's':
+            type = LogArgString;
+            break;
+        default:
+            return -1;
+        }
+        p++;
+
+        if (n >= max)
+            return -1;
+        sig[n++] = type;
+    }
+
+    sig[n] = '\0';
+    return n;
+}
+
+static inline
+size_t logArgSize(char type)
+{
+    return type == LogArgInt ? 4 : 8;
+}
+
+/*
+ * Render one packed record back to text using its format string. Returns
+ * the number of characters written into out (always NUL terminated), or
+ * -1 when the payload doesn't match the format.
+ */
+static inline
+int logFormatArgs(const char *format, const uint8_t *args, size_t len,
+                  char *out, size_t outlen)
+{
+    const char *p = format;
+    size_t off = 0;
+
+    if (!outlen)
+        return -1;
+
+    while (*p && off + 1 < outlen) {
+        if (*p != '%') {
+            out[off++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[off++] = '%';
+            p += 2;
+            continue;
+        }
+
+        // Copy the conversion, dropping length modifiers; integers are
+        // re-emitted as long long since that's how they were widened.
+        char spec[32];
+        char sig[4];
+        size_t slen = 0;
+        const char *end = p + 1;
+
+        while (*end && !strchr("diouxXcfFeEgGaApsn", *end))
+            end++;
+        if (!*end || end - p >= (int)sizeof(spec) - 3)
+            return -1;
+
+        memcpy(spec, p, end - p + 1);
+        spec[end - p + 1] = '\0';
+        if (logFormatSignature(spec, sig, 3) < 0)
+            return -1;
+
+        for (const char *q = p; q < end; q++) {
+            if (!strchr("hljztqL", *q))
+                spec[slen++] = *q;
+        }
+        char last = sig[strlen(sig) - 1];
+        if (last == LogArgLong || last == LogArgWord || last == LogArgUWord) {
+            spec[slen++] = 'l';
+            spec[slen++] = 'l';
+        }
+        spec[slen++] = *end;
+        spec[slen] = '\0';
+        p = end + 1;
+
+        int stars[2];
+        int nstars = 0;
+        const char *s;
+        for (s = sig; s[1]; s++) {
+            if (len < 4)
+                return -1;
+            int32_t v;
+            memcpy(&v, args, 4);
+            stars[nstars++] = v;
+            args += 4;
+            len -= 4;
+        }
+
+        char str[LOG_MAX_STRING + 1];
+        int32_t i32 = 0;
+        int64_t i64 = 0;
+        double dbl = 0;
+        const void *ptr = NULL;
+        const char *sval = NULL;
+
+        if (*s == LogArgString) {
+            uint16_t n;
+            if (len < 2)
+                return -1;
+            memcpy(&n, args, 2);
+            if (n > LOG_MAX_STRING || len < 2 + (size_t)n)
+                return -1;
+            memcpy(str, args + 2, n);
+            str[n] = '\0';
+            sval = str;
+            args += 2 + n;
+            len -= 2 + n;
+        } else {
+            size_t sz = logArgSize(*s);
+            if (len < sz)
+                return -1;
+            switch (*s) {
+            case LogArgInt:
+                memcpy(&i32, args, 4);
+                break;
+            case LogArgLong:
+            case LogArgWord:
+            case LogArgUWord:
+                memcpy(&i64, args, 8);
+                break;
+            case LogArgPointer:
+                memcpy(&i64, args, 8);
+                ptr = (const void *)(uintptr_t)i64;
+                break;
+            default:
+                memcpy(&dbl, args, 8);
+                break;
+            }
+            args += sz;
+            len -= sz;
+        }
+
+#define LOG_EMIT(val) \
+        (nstars == 0 ? snprintf(out + off, outlen - off, spec, val) : \
+         nstars == 1 ? snprintf(out + off, outlen - off, spec, stars[0], val) : \
+                       snprintf(out + off, outlen - off, spec, stars[0], stars[1], val))
+
+        int rc;
+        switch (*s) {
+        case LogArgInt:     rc = LOG_EMIT(i32); break;
+        case LogArgLong:
+        case LogArgWord:
+        case LogArgUWord:   rc = LOG_EMIT((long long)i64); break;
+        case LogArgPointer: rc = LOG_EMIT(ptr); break;
+        case LogArgString:  rc = LOG_EMIT(sval); break;
+        default:            rc = LOG_EMIT(dbl); break;
+        }
+#undef LOG_EMIT
+
+        if (rc < 0)
+            return -1;
+        off += (size_t)rc;
+        if (off >= outlen)
+            off = outlen - 1;
+    }
+
+    out[off] = '\0';
+    return (int)off;
+}
+
+#endif /* __LOGFMT_H__ */
@@ -13,6 +13,10 @@
 #include "input.h"
 #include "agent.h"
 #include "gadget.h"
+#include "state.h"
+#include "metrics.h"
+#include "trace.h"
+#include "watchdog.h"
 
 static
 void showBanner(void)
@@ -52,6 +56,7 @@ int main(int argc, char **argv)
     char buffer[2048] = {0};
     struct option options[] = {
         { "config",         required_argument,  NULL, 'c' },
+        { "script",         required_argument,  NULL, 's' },
         { "coredump",       no_argument,        NULL,  1  },
         { "debug",          no_argument,        NULL,  2  },
         { "help",           no_argument,        NULL, 'h' },
@@ -60,13 +65,18 @@ int main(int argc, char **argv)
     int opt;
     int idx;
     bool waitForDebug = false;
+    const char *script = NULL;
 
-    while ((opt = getopt_long(argc, argv, "c:h?", options, &idx)) != -1) {
+    while ((opt = getopt_long(argc, argv, "c:s:h?", options, &idx)) != -1) {
         switch (opt) {
         case 'c':
             strcpy(buffer, optarg);
             break;
 
+        case 's':
+            script = optarg;
+            break;
+
         case 1:
             enableCoredump(true);
             break;
@@ -78,7 +88,7 @@ int main(int argc, char **argv)
         case 'h':
         case '?':
         default:
-            printf("\nUsage: %s [-c CONFIG_FILE] [ -h|-?]\n", argv[0]);
+            printf("\nUsage: %s [-c CONFIG_FILE] [-s SCRIPT_FILE] [ -h|-?]\n", argv[0]);
             exit(-1);
         }
     }
@@ -101,18 +111,50 @@ int main(int argc, char **argv)
     }
     cfg->dump();
 
+    logSetRotation(cfg->logRotateSize(), cfg->logRotateAge(), cfg->logRotateKeep());
+
+    if (cfg->binaryLog()) {
+        if (logBinaryOpen(cfg->binLogPath(), VLOG_INFO) < 0)
+            vlogW("Open binary log %s error, log to console only.", cfg->binLogPath());
+    } else {
+        if (logFileOpen(cfg->logPath(), VLOG_INFO) < 0)
+            vlogW("Open log %s error, log to console only.", cfg->logPath());
+    }
+
+    if (logAsyncStart() < 0)
+        vlogW("Start asynchronous logging error, keep logging synchronously.");
+
+    std::shared_ptr<CMetricsExporter> metrics(new CMetricsExporter());
+    if (cfg->metricsPath() && (!metrics || !metrics->setup(cfg->metricsPath())))
+        vlogW("Metrics will not be exported.");
+
+    if (!traceStart(cfg->dataDir()))
+        vlogW("Trace dumps unavailable.");
+
     std::shared_ptr<CInput> input(new CInput());
     if (!input || !input->setup()) {
         vlogE("Setup input error.");
         return -1;
     }
 
+    // Outlives the agent and the gadgets writing into it.
+    std::shared_ptr<CStateFile> state(new CStateFile());
+    if (!state || !state->open(cfg->dataDir())) {
+        vlogW("Gadget values will not survive a restart.");
+        state = nullptr;
+    }
+
     std::shared_ptr<CAgent> agent(new CAgent(input));
     if (!agent) {
         vlogE("Out of memory!!!");
         return -1;
     }
 
+    if (script)
+        agent->setScript(script);
+
+    agent->setState(state);
+
     std::shared_ptr<CGadget> bulb(new CBulb(agent.get(), false));
     if (!bulb || !bulb->open()) {
         vlogE("Open bulb gadget error");
@@ -161,7 +203,12 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    if (cfg->stallThreshold() && !watchdogStart(cfg->stallThreshold()))
+        vlogW("Whisper thread stalls will not be reported.");
+
     agent->run();
+    watchdogStop();
+    traceStop();
     vlogI("whisper demo exited", argv[0]);
 
     return 0;
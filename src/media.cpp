@@ -0,0 +1,330 @@
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <pthread.h>
+#include <sched.h>
+
+#define VLOG_MODULE VLOG_MOD_MEDIA
+#include "vlog.h"
+#include "cfg.h"
+#include "agent.h"
+#include "media.h"
+#include "probe.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Frames further apart than this (camera restarted) are not paced.
+const uint64_t MEDIA_MAX_INTERVAL = 200000000ULL;
+// Not worth sleeping for less; packets due sooner go out together.
+const uint64_t MEDIA_MIN_GAP = 100000ULL;
+
+class CMediaWorker {
+public:
+    CMediaWorker(CMediaPool *pool, int index, int cpu, int priority):
+        mPool(pool), mIndex(index), mCpu(cpu), mPriority(priority),
+        mRunning(false), mStopping(false), mQueued(0) {}
+
+public:
+    bool start(void);
+    void stop(void);
+
+    void push(MediaFrame *frame);
+
+private:
+    static void *workRoutine(void *argv);
+    void workLoop(void);
+    void setupThread(void);
+    void write(MediaFrame *frame);
+
+private:
+    CMediaPool *mPool;
+    int mIndex;
+    int mCpu;
+    int mPriority;
+
+    pthread_t mThread;
+    bool mRunning;
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::deque<MediaFrame*> mQueue;
+    bool mStopping;
+    std::atomic<int> mQueued;
+};
+
+bool CMediaWorker::start(void)
+{
+    int rc = pthread_create(&mThread, NULL, workRoutine, this);
+    if (rc != 0) {
+        vlogE("Create media worker %d.%d error (%d)", mPool->mCamera, mIndex, rc);
+        return false;
+    }
+
+    mRunning = true;
+    return true;
+}
+
+void CMediaWorker::stop(void)
+{
+    if (!mRunning)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopping = true;
+    }
+    mCond.notify_one();
+
+    pthread_join(mThread, NULL);
+    mRunning = false;
+    mQueue.clear();
+    mQueued.store(0);
+}
+
+void CMediaWorker::push(MediaFrame *frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mQueue.push_back(frame);
+        mQueued.fetch_add(1, std::memory_order_relaxed);
+    }
+    mCond.notify_one();
+}
+
+void *CMediaWorker::workRoutine(void *argv)
+{
+    CMediaWorker *worker = static_cast<CMediaWorker*>(argv);
+
+    worker->setupThread();
+    worker->workLoop();
+    return NULL;
+}
+
+void CMediaWorker::setupThread(void)
+{
+#ifdef __linux__
+    char name[16];
+
+    snprintf(name, sizeof(name), "wdemo-media%d.%d", mPool->mCamera, mIndex);
+    pthread_setname_np(pthread_self(), name);
+
+    if (mCpu >= 0) {
+        cpu_set_t cpus;
+        int rc;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(mCpu, &cpus);
+
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rc != 0)
+            vlogW("Pin media worker %d.%d to cpu %d error (%d)", mPool->mCamera,
+                  mIndex, mCpu, rc);
+        else
+            vlogI("Media worker %d.%d pinned to cpu %d", mPool->mCamera, mIndex, mCpu);
+    }
+#else
+    if (mCpu >= 0)
+        vlogW("CPU affinity not supported here, media worker %d.%d not pinned",
+              mPool->mCamera, mIndex);
+#endif
+
+    if (mPriority > 0) {
+        struct sched_param param;
+        int rc;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = mPriority;
+
+        rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (rc != 0)
+            vlogW("Set SCHED_FIFO priority %d for media worker %d.%d error (%d), "
+                  "running with normal priority", mPriority, mPool->mCamera,
+                  mIndex, rc);
+    }
+}
+
+void CMediaWorker::workLoop(void)
+{
+    while (true) {
+        MediaFrame *frame;
+
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            mCond.wait(lock, [this] { return mStopping || !mQueue.empty(); });
+            if (mStopping)
+                break;
+
+            frame = mQueue.front();
+            mQueue.pop_front();
+            mQueued.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        // The first worker packetizes for everyone, in frame order.
+        if (mIndex == 0)
+            mPool->packetize(frame);
+
+        write(frame);
+        mPool->release(frame);
+    }
+}
+
+void CMediaWorker::write(MediaFrame *frame)
+{
+    const RtpPackets &packets = frame->packets;
+    const uint8_t *pkt = packets.data.data();
+    size_t count = packets.lens.size();
+    size_t shards = mPool->mWorkers.size();
+    uint64_t window = frame->interval * mPool->mPacing / 100;
+    uint64_t gap = count > 1 ? window / count : 0;
+    uint64_t start = probeClock();
+    TRACE("CMediaWorker::write");
+
+    // Only now are this worker's viewers past the frames before, so those
+    // switched here start on this key frame.
+    if (packets.keyframe)
+        mPool->mAgent->switchLayers(mPool->mCamera, mIndex, shards);
+
+    for (size_t i = 0; i < count; i++) {
+        mPool->mAgent->sendVideoFrame(pkt, packets.lens[i], mPool->mCamera,
+                                      mIndex, shards);
+        pkt += packets.lens[i];
+
+        // Frames waiting behind this one: catch up rather than pace.
+        if (!gap || i + 1 == count || mQueued.load(std::memory_order_relaxed))
+            continue;
+
+        uint64_t due = start + (i + 1) * gap;
+        uint64_t now = probeClock();
+        if (due > now + MEDIA_MIN_GAP) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)((due - now) / 1000000000ULL);
+            ts.tv_nsec = (long)((due - now) % 1000000000ULL);
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    metricMediaFrame.record(probeClock() - frame->arrival);
+}
+
+CMediaPool::CMediaPool(CAgent *agent, int camera):
+    mAgent(agent), mCamera(camera), mRtp(10 + camera), mPacing(0), mLastArrival(0),
+    mRunning(false)
+{
+}
+
+CMediaPool::~CMediaPool()
+{
+    stop();
+}
+
+bool CMediaPool::setup(std::shared_ptr<CConfig> cfg)
+{
+    const std::vector<int> &cpus = cfg->mediaCpus();
+    int workers = cfg->mediaWorkers();
+
+    mPacing = cfg->mediaPacing();
+    mLastArrival = 0;
+
+    mFree.clear();
+    for (int i = 0; i < MEDIA_FRAMES; i++)
+        mFree.push_back(&mFrames[i]);
+
+    for (int i = 0; i < workers; i++) {
+        // Pipelines take the listed CPUs in turn.
+        int cpu = cpus.empty() ? -1 : cpus[(mCamera * workers + i) % cpus.size()];
+        std::unique_ptr<CMediaWorker> worker(
+                new CMediaWorker(this, i, cpu, cfg->mediaPriority()));
+
+        if (!worker->start()) {
+            stop();
+            return false;
+        }
+        mWorkers.push_back(std::move(worker));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mFreeLock);
+        mRunning = true;
+    }
+
+    vlogI("%d media workers started for camera %d", workers, mCamera);
+    return true;
+}
+
+void CMediaPool::stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(mFreeLock);
+        mRunning = false;
+    }
+
+    for (size_t i = 0; i < mWorkers.size(); i++)
+        mWorkers[i]->stop();
+    mWorkers.clear();
+
+    // Frames left in the queues were never written; all buffers are free.
+    std::lock_guard<std::mutex> lock(mFreeLock);
+    mFree.clear();
+    for (int i = 0; i < MEDIA_FRAMES; i++)
+        mFree.push_back(&mFrames[i]);
+}
+
+void CMediaPool::submit(const uint8_t *data, int len, uint32_t timestamp)
+{
+    uint64_t now = probeClock();
+    MediaFrame *frame = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(mFreeLock);
+        // Not set up, or stopped under a camera that is still running.
+        if (!mRunning)
+            return;
+
+        if (!mFree.empty()) {
+            frame = mFree.back();
+            mFree.pop_back();
+        }
+    }
+
+    if (!frame) {
+        metricMediaDropped.add();
+        vlogLimitW("Media workers behind, camera frame dropped");
+        return;
+    }
+
+    frame->data.assign(data, data + len);
+    frame->timestamp = timestamp;
+    frame->arrival = now;
+    frame->interval = mLastArrival ? now - mLastArrival : 0;
+    if (frame->interval > MEDIA_MAX_INTERVAL)
+        frame->interval = 0;
+    mLastArrival = now;
+
+    // stop() gives every buffer back, this one included.
+    std::lock_guard<std::mutex> lock(mFreeLock);
+    if (mRunning)
+        mWorkers[0]->push(frame);
+}
+
+void CMediaPool::packetize(MediaFrame *frame)
+{
+    frame->packets.clear();
+    mRtp.streamFwd(frame->data.data(), (int)frame->data.size(),
+                   frame->timestamp, frame->packets);
+
+    frame->pending.store((int)mWorkers.size());
+    for (size_t i = 1; i < mWorkers.size(); i++)
+        mWorkers[i]->push(frame);
+}
+
+void CMediaPool::release(MediaFrame *frame)
+{
+    if (frame->pending.fetch_sub(1) > 1)
+        return;
+
+    std::lock_guard<std::mutex> lock(mFreeLock);
+    mFree.push_back(frame);
+}
@@ -0,0 +1,69 @@
+#ifndef __MEDIA_H__
+#define __MEDIA_H__
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "rtp.h"
+
+class CAgent;
+class CConfig;
+class CMediaWorker;
+
+const int MEDIA_FRAMES = 8;     // frames in flight across all workers
+
+struct MediaFrame {
+    std::vector<uint8_t> data;
+    uint32_t timestamp;
+    uint64_t arrival;           // CLOCK_MONOTONIC ns
+    uint64_t interval;          // since the previous frame, 0 for the first
+    RtpPackets packets;
+    std::atomic<int> pending;   // workers still writing it
+};
+
+/*
+ * Media workers of one camera pipeline. The camera thread only copies each
+ * frame in; the first worker packetizes it and hands the packets to every
+ * worker, which writes them to its share of the pipeline's sessions
+ * (CSession::shard()) spread over part of the frame interval, so a key
+ * frame does not leave in one burst. The whisper thread keeps the control
+ * traffic, and the workers can be pinned to CPUs of their own and run
+ * SCHED_FIFO so that a burst of messages does not delay video.
+ */
+class CMediaPool {
+public:
+    CMediaPool(CAgent *agent, int camera);
+    ~CMediaPool();
+
+public:
+    bool setup(std::shared_ptr<CConfig> cfg);
+    void stop(void);
+
+    // Camera thread; the frame is dropped when every buffer is in use.
+    void submit(const uint8_t *data, int len, uint32_t timestamp);
+
+private:
+    friend class CMediaWorker;
+
+    void packetize(MediaFrame *frame);
+    void release(MediaFrame *frame);
+
+private:
+    CAgent *mAgent;
+    int mCamera;
+    CRtp mRtp;
+    int mPacing;
+    uint64_t mLastArrival;
+
+    MediaFrame mFrames[MEDIA_FRAMES];
+    std::mutex mFreeLock;
+    std::vector<MediaFrame*> mFree;
+    bool mRunning;              // workers take frames; under mFreeLock
+
+    std::vector<std::unique_ptr<CMediaWorker>> mWorkers;
+};
+
+#endif /* __MEDIA_H__ */
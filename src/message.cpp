@@ -0,0 +1,88 @@
+#include "json.h"
+#include "message.h"
+
+static
+bool encodeValue(const GadgetValue &value, Json::Value &node)
+{
+    switch(value.type()) {
+    case Int:
+        node = Json::Value(value.iValue());
+        break;
+    case Bool:
+        node = Json::Value(value.bValue());
+        break;
+    case Float:
+        node = Json::Value(value.fValue());
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static
+bool decodeValue(const Json::Value &node, GadgetValueTypes type, GadgetValue &value)
+{
+    if (node.isNull())
+        return false;
+
+    switch(type) {
+    case Int:
+        if (!node.isConvertibleTo(Json::intValue)) return false;
+        value = GadgetValue(node.asInt());
+        break;
+    case Bool:
+        if (!node.isConvertibleTo(Json::booleanValue)) return false;
+        value = GadgetValue(node.asBool());
+        break;
+    case Float:
+        if (!node.isConvertibleTo(Json::realValue)) return false;
+        value = GadgetValue(node.asFloat());
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+std::string encodeMessage(const char *type, const GadgetValues &values)
+{
+    Json::StyledWriter writer;
+    Json::Value root;
+
+    root["type"] = Json::Value(type);
+
+    for (int i = 0; i < GadgetKindCount; i++) {
+        GadgetKind kind = (GadgetKind)i;
+        Json::Value node;
+
+        if (values.has(kind) && encodeValue(values.get(kind), node))
+            root[gadgetName(kind)] = node;
+    }
+
+    return writer.write(root);
+}
+
+bool decodeMessage(const char *msg, size_t len, std::string &type,
+                   GadgetValues &values)
+{
+    Json::Reader reader;
+    Json::Value root;
+
+    if (!reader.parse(msg, msg + len, root) || !root.isObject() ||
+        !root["type"].isString())
+        return false;
+
+    type = root["type"].asString();
+
+    Json::ValueConstIterator it;
+    for (it = root.begin(); it != root.end(); ++it) {
+        GadgetKind kind;
+        GadgetValue value;
+
+        if (gadgetKind(it.name().c_str(), kind) &&
+            decodeValue(*it, gadgetType(kind), value))
+            values.set(kind, value);
+    }
+    return true;
+}
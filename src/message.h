@@ -0,0 +1,18 @@
+#ifndef __MESSAGE_H__
+#define __MESSAGE_H__
+
+#include <string>
+
+#include "gadget.h"
+
+/*
+ * Friend messages are JSON objects carrying a "type" member plus one
+ * member per gadget, named and typed after the gadget registry.
+ */
+std::string encodeMessage(const char *type, const GadgetValues &values);
+
+// Members that are not gadgets or have the wrong type are skipped.
+bool decodeMessage(const char *msg, size_t len, std::string &type,
+                   GadgetValues &values);
+
+#endif /* __MESSAGE_H__ */
@@ -0,0 +1,362 @@
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vlog.h"
+#include "metrics.h"
+
+#define METRIC_DEFINE(kind, id, name, labels, help) \
+    METRIC_CLASS_##kind metric##id;
+METRIC_LIST(METRIC_DEFINE)
+#undef METRIC_DEFINE
+
+// Exported histogram buckets are powers of two of nanoseconds, 1us to 34s.
+static const int bucketFirstPow = 10;
+static const int bucketLastPow  = 35;
+
+uint64_t CCounter::value(void) const
+{
+    uint64_t sum = 0;
+
+    for (int i = 0; i < METRIC_SHARDS; i++)
+        sum += mShards[i].value.load(std::memory_order_relaxed);
+    return sum;
+}
+
+CMetricHistogram::CMetricHistogram()
+{
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        for (int j = 0; j < CHistogram::Buckets; j++)
+            mShards[i].counts[j].store(0, std::memory_order_relaxed);
+        mShards[i].sum.store(0, std::memory_order_relaxed);
+    }
+}
+
+void CMetricHistogram::snapshot(uint64_t *counts, uint64_t &sum) const
+{
+    memset(counts, 0, sizeof(uint64_t) * CHistogram::Buckets);
+    sum = 0;
+
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        for (int j = 0; j < CHistogram::Buckets; j++)
+            counts[j] += mShards[i].counts[j].load(std::memory_order_relaxed);
+        sum += mShards[i].sum.load(std::memory_order_relaxed);
+    }
+}
+
+CCounter *CCounterFamily::get(const std::string &label)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    std::unique_ptr<CCounter> &member = mMembers[label];
+
+    if (!member)
+        member.reset(new CCounter());
+    return member.get();
+}
+
+static
+void appendf(std::string &out, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (len > 0)
+        out.append(buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+}
+
+static
+std::string labelSet(const char *labels, const std::string &extra)
+{
+    std::string set(labels);
+
+    if (!extra.empty()) {
+        if (!set.empty())
+            set += ",";
+        set += extra;
+    }
+    return set.empty() ? set : "{" + set + "}";
+}
+
+static
+std::string escapeLabel(const std::string &value)
+{
+    std::string escaped;
+
+    for (size_t i = 0; i < value.length(); i++) {
+        char ch = value[i];
+
+        if (ch == '\n') {
+            escaped += "\\n";
+            continue;
+        }
+
+        if (ch == '\\' || ch == '"')
+            escaped += '\\';
+        escaped += ch;
+    }
+    return escaped;
+}
+
+static
+void exportHeader(std::string &out, const char *name, const char *type,
+                  const char *help, const char *&last)
+{
+    if (last && strcmp(last, name) == 0)
+        return;
+
+    appendf(out, "# HELP %s %s\n", name, help);
+    appendf(out, "# TYPE %s %s\n", name, type);
+    last = name;
+}
+
+static
+void exportMetric(std::string &out, const char *name, const char *labels,
+                  const char *help, const char *&last, const CCounter &counter)
+{
+    exportHeader(out, name, "counter", help, last);
+    appendf(out, "%s%s %llu\n", name, labelSet(labels, "").c_str(),
+            (unsigned long long)counter.value());
+}
+
+static
+void exportMetric(std::string &out, const char *name, const char *labels,
+                  const char *help, const char *&last, const CGauge &gauge)
+{
+    exportHeader(out, name, "gauge", help, last);
+    appendf(out, "%s%s %lld\n", name, labelSet(labels, "").c_str(),
+            (long long)gauge.value());
+}
+
+static
+void exportMetric(std::string &out, const char *name, const char *labels,
+                  const char *help, const char *&last, const CMetricHistogram &histogram)
+{
+    uint64_t counts[CHistogram::Buckets];
+    uint64_t sum;
+    uint64_t seen = 0;
+    int idx = 0;
+
+    exportHeader(out, name, "histogram", help, last);
+    histogram.snapshot(counts, sum);
+
+    for (int pow = bucketFirstPow; pow <= bucketLastPow; pow++) {
+        // Sum up every bucket holding values below 2^pow.
+        int end = (pow - 4) * 16 + 15;
+
+        for (; idx <= end; idx++)
+            seen += counts[idx];
+
+        char le[32];
+        snprintf(le, sizeof(le), "le=\"%.9g\"", (double)(1ULL << pow) / 1e9);
+        appendf(out, "%s_bucket%s %llu\n", name, labelSet(labels, le).c_str(),
+                (unsigned long long)seen);
+    }
+
+    for (; idx < CHistogram::Buckets; idx++)
+        seen += counts[idx];
+
+    appendf(out, "%s_bucket%s %llu\n", name, labelSet(labels, "le=\"+Inf\"").c_str(),
+            (unsigned long long)seen);
+    appendf(out, "%s_sum%s %.9f\n", name, labelSet(labels, "").c_str(), sum / 1e9);
+    appendf(out, "%s_count%s %llu\n", name, labelSet(labels, "").c_str(),
+            (unsigned long long)seen);
+}
+
+static
+void exportMetric(std::string &out, const char *name, const char *label,
+                  const char *help, const char *&last, const CCounterFamily &family)
+{
+    exportHeader(out, name, "counter", help, last);
+    family.forEach([&](const std::string &value, const CCounter &counter) {
+        std::string set = std::string(label) + "=\"" + escapeLabel(value) + "\"";
+        appendf(out, "%s%s %llu\n", name, labelSet("", set).c_str(),
+                (unsigned long long)counter.value());
+    });
+}
+
+std::string metricsText(void)
+{
+    std::string out;
+    const char *last = NULL;
+
+#define METRIC_EXPORT(kind, id, name, labels, help) \
+    exportMetric(out, name, labels, help, last, metric##id);
+    METRIC_LIST(METRIC_EXPORT)
+#undef METRIC_EXPORT
+
+    return out;
+}
+
+bool CMetricsExporter::setup(const char *path)
+{
+    struct sockaddr_un addr;
+    int rc;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        vlogE("Metrics socket path %s too long", path);
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    mListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mListenFd < 0) {
+        vlogE("Create metrics socket error (%d)", errno);
+        return false;
+    }
+
+    // A socket file left behind by an earlier run would fail the bind.
+    unlink(path);
+
+    rc = bind(mListenFd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc < 0 || listen(mListenFd, 4) < 0) {
+        vlogE("Listen on metrics socket %s error (%d)", path, errno);
+        stop();
+        return false;
+    }
+    mPath = path;
+
+    rc = pipe(mWakeFds);
+    if (rc < 0) {
+        vlogE("Setup metrics exporter error (%d)", errno);
+        stop();
+        return false;
+    }
+
+    rc = pthread_create(&mThread, NULL, serveRoutine, this);
+    if (rc != 0) {
+        vlogE("Create metrics thread error (%d)", rc);
+        stop();
+        return false;
+    }
+
+    mRunning = true;
+    vlogI("Metrics served on %s", path);
+    return true;
+}
+
+void CMetricsExporter::stop(void)
+{
+    if (mRunning) {
+        char ch = 0;
+        if (write(mWakeFds[1], &ch, 1) < 0)
+            vlogW("Wake up metrics thread error (%d)", errno);
+
+        pthread_join(mThread, NULL);
+        mRunning = false;
+    }
+
+    if (mWakeFds[0] >= 0) {
+        close(mWakeFds[0]);
+        close(mWakeFds[1]);
+        mWakeFds[0] = mWakeFds[1] = -1;
+    }
+
+    if (mListenFd >= 0) {
+        close(mListenFd);
+        mListenFd = -1;
+    }
+
+    if (!mPath.empty()) {
+        unlink(mPath.c_str());
+        mPath.clear();
+    }
+}
+
+void *CMetricsExporter::serveRoutine(void *argv)
+{
+    CMetricsExporter *exporter = static_cast<CMetricsExporter*>(argv);
+
+    exporter->serveLoop();
+    return NULL;
+}
+
+void CMetricsExporter::serveLoop(void)
+{
+    struct pollfd fds[2];
+    int rc;
+
+    fds[0].fd = mListenFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = mWakeFds[0];
+    fds[1].events = POLLIN;
+
+    while (true) {
+        rc = poll(fds, 2, -1);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            vlogE("Poll metrics socket error (%d)", errno);
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        if (!fds[0].revents)
+            continue;
+
+        int fd = accept4(mListenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                vlogLimitE("Accept metrics client error (%d)", errno);
+            continue;
+        }
+
+        serve(fd);
+        close(fd);
+    }
+}
+
+void CMetricsExporter::serve(int fd)
+{
+    // Give an HTTP client a moment to send its request line; scripts
+    // reading the socket straight away send nothing.
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct timeval tv = { 1, 0 };
+    char req[512];
+    bool http = false;
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (poll(&pfd, 1, 100) > 0) {
+        ssize_t len = recv(fd, req, sizeof(req), MSG_DONTWAIT);
+        http = (len >= 4 && memcmp(req, "GET ", 4) == 0);
+    }
+
+    std::string body = metricsText();
+    std::string out;
+
+    if (http) {
+        appendf(out, "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n", body.length());
+    }
+    out += body;
+
+    size_t off = 0;
+    while (off < out.length()) {
+        ssize_t rc = send(fd, out.data() + off, out.length() - off, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            vlogLimitE("Send metrics error (%d)", errno);
+            break;
+        }
+        off += rc;
+    }
+}
@@ -0,0 +1,211 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <cstdint>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <pthread.h>
+
+#include "histogram.h"
+#include "probe.h"
+
+/*
+ * Process metrics, exported in the Prometheus text format. Every metric is
+ * declared once here with its kind, exported name, constant labels (for a
+ * family, the name of the label its members differ in) and help text; the
+ * global objects and the export are generated from this list. Entries
+ * sharing a name (one histogram per callback) must be adjacent, the first
+ * of them carries the help text.
+ *
+ * Updates never lock: counters and histograms are split into per-thread
+ * shards that are merged when read, gauges are single atomics. Families
+ * only lock to create a member, which callers look up once and keep.
+ */
+#define METRIC_LIST(X) \
+    X(Counter,   CameraFrames,      "wdemo_camera_frames_total",          "",                          "Access units delivered by the camera driver") \
+    X(Counter,   CameraBytes,       "wdemo_camera_bytes_total",           "",                          "Bytes delivered by the camera driver") \
+    X(Counter,   RtpNals,           "wdemo_rtp_nals_total",               "",                          "NAL units parsed by the RTP packetizer") \
+    X(Counter,   RtpPackets,        "wdemo_rtp_packets_total",            "",                          "RTP packets built") \
+    X(Family,    PeerRtpPackets,    "wdemo_peer_rtp_packets_total",       "peer",                      "RTP packets written to the session of a peer") \
+    X(Counter,   StreamWriteErrors, "wdemo_stream_write_errors_total",    "",                          "Session stream writes that failed") \
+    X(Counter,   MessagesReceived,  "wdemo_messages_received_total",      "",                          "Friend messages received") \
+    X(Counter,   MessagesInvalid,   "wdemo_messages_invalid_total",       "",                          "Friend messages received but not understood") \
+    X(Counter,   MessagesSent,      "wdemo_messages_sent_total",          "",                          "Friend messages sent") \
+    X(Counter,   MessageErrors,     "wdemo_message_send_errors_total",    "",                          "Friend messages that could not be sent") \
+    X(Counter,   LogDropped,        "wdemo_log_dropped_total",            "",                          "Log messages dropped on full log queues") \
+    X(Gauge,     Peers,             "wdemo_peers",                        "",                          "Friends known to the agent") \
+    X(Gauge,     Sessions,          "wdemo_sessions",                     "",                          "Sessions the media path writes to") \
+    X(Gauge,     CommandQueue,      "wdemo_command_queue_depth",          "",                          "Console commands waiting for the idle callback") \
+    X(Counter,   LoopStalls,        "wdemo_loop_stalls_total",            "",                          "Whisper thread stalls caught by the watchdog") \
+    X(Histogram, LoopIteration,     "wdemo_loop_iteration_seconds",       "",                          "Time between two idle callbacks of the whisper thread") \
+    X(Counter,   MediaDropped,      "wdemo_media_frames_dropped_total",   "",                          "Camera frames dropped with every media buffer in use") \
+    X(Histogram, MediaFrame,        "wdemo_media_frame_seconds",          "",                          "Time from a camera frame to its last packet written by a media worker") \
+    X(Counter,   LayerSwitches,     "wdemo_layer_switches_total",         "",                          "Viewers switched to another simulcast layer at a key frame") \
+    X(Histogram, FrameFanout,       "wdemo_frame_fanout_seconds",         "",                          "Time to write one RTP packet to the sessions of a media worker") \
+    X(Histogram, CbIdle,            "wdemo_callback_duration_seconds",    "callback=\"idle\"",         "Time spent in whisper callbacks") \
+    X(Histogram, CbConnection,      "wdemo_callback_duration_seconds",    "callback=\"connection\"",   "") \
+    X(Histogram, CbFriendInfo,      "wdemo_callback_duration_seconds",    "callback=\"friend_info\"",  "") \
+    X(Histogram, CbFriendConn,      "wdemo_callback_duration_seconds",    "callback=\"friend_conn\"",  "") \
+    X(Histogram, CbFriendAdded,     "wdemo_callback_duration_seconds",    "callback=\"friend_added\"", "") \
+    X(Histogram, CbFriendRemoved,   "wdemo_callback_duration_seconds",    "callback=\"friend_removed\"", "") \
+    X(Histogram, CbFriendMessage,   "wdemo_callback_duration_seconds",    "callback=\"friend_message\"", "") \
+    X(Histogram, CbSessionRequest,  "wdemo_callback_duration_seconds",    "callback=\"session_request\"", "") \
+    X(Histogram, CbStreamState,     "wdemo_callback_duration_seconds",    "callback=\"stream_state\"", "")
+
+const int METRIC_SHARDS = 8;
+
+// Shard of the calling thread, handed out round robin at first use.
+inline int metricShard(void)
+{
+    static std::atomic<unsigned> next(0);
+    static thread_local int shard =
+            (int)(next.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS);
+
+    return shard;
+}
+
+class CCounter {
+public:
+    CCounter() {
+        for (int i = 0; i < METRIC_SHARDS; i++)
+            mShards[i].value.store(0, std::memory_order_relaxed);
+    }
+
+public:
+    void add(uint64_t n = 1) {
+        mShards[metricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value(void) const;
+
+private:
+    // Padded rather than aligned: families allocate counters with new,
+    // which C++11 does not align past max_align_t.
+    struct Shard {
+        std::atomic<uint64_t> value;
+        char pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    Shard mShards[METRIC_SHARDS];
+};
+
+class CGauge {
+public:
+    CGauge(): mValue(0) {}
+
+public:
+    void set(int64_t v) { mValue.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { mValue.fetch_add(n, std::memory_order_relaxed); }
+
+    int64_t value(void) const { return mValue.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> mValue;
+};
+
+/*
+ * Nanosecond histogram with the bucket layout of CHistogram, so values
+ * keep about 6% precision from nanoseconds to minutes.
+ */
+class CMetricHistogram {
+public:
+    CMetricHistogram();
+
+public:
+    void record(uint64_t ns) {
+        Shard &shard = mShards[metricShard()];
+
+        shard.counts[CHistogram::index(ns)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // Merge every shard into @counts (CHistogram::Buckets entries).
+    void snapshot(uint64_t *counts, uint64_t &sum) const;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[CHistogram::Buckets];
+        std::atomic<uint64_t> sum;
+    };
+
+    Shard mShards[METRIC_SHARDS];
+};
+
+/*
+ * Counters told apart by one label, e.g. one per peer. Members are never
+ * removed, so the pointers get() returns stay valid for the process.
+ */
+class CCounterFamily {
+public:
+    CCounter *get(const std::string &label);
+
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        std::lock_guard<std::mutex> lock(mLock);
+        for (auto it = mMembers.begin(); it != mMembers.end(); ++it)
+            fn(it->first, *it->second);
+    }
+
+private:
+    mutable std::mutex mLock;
+    std::map<std::string, std::unique_ptr<CCounter>> mMembers;
+};
+
+#define METRIC_CLASS_Counter   CCounter
+#define METRIC_CLASS_Gauge     CGauge
+#define METRIC_CLASS_Histogram CMetricHistogram
+#define METRIC_CLASS_Family    CCounterFamily
+
+#define METRIC_DECLARE(kind, id, name, labels, help) \
+    extern METRIC_CLASS_##kind metric##id;
+METRIC_LIST(METRIC_DECLARE)
+#undef METRIC_DECLARE
+
+// Records the lifetime of the enclosing scope into a histogram.
+class CMetricTimer {
+public:
+    explicit CMetricTimer(CMetricHistogram &histogram):
+        mHistogram(histogram), mStart(probeClock()) {}
+    ~CMetricTimer() { mHistogram.record(probeClock() - mStart); }
+
+private:
+    CMetricHistogram &mHistogram;
+    uint64_t mStart;
+};
+
+// Every metric in the Prometheus text exposition format.
+std::string metricsText(void);
+
+/*
+ * Serves metricsText() on a Unix stream socket from its own thread, one
+ * client at a time. Clients sending an HTTP GET get an HTTP reply (as
+ * curl --unix-socket does), anyone else just the text.
+ */
+class CMetricsExporter {
+public:
+    CMetricsExporter(): mRunning(false), mListenFd(-1) {
+        mWakeFds[0] = mWakeFds[1] = -1;
+    }
+    ~CMetricsExporter() { stop(); }
+
+public:
+    bool setup(const char *path);
+    void stop(void);
+
+private:
+    static void *serveRoutine(void *argv);
+    void serveLoop(void);
+    void serve(int fd);
+
+private:
+    pthread_t mThread;
+    bool mRunning;
+    int mListenFd;
+    int mWakeFds[2];
+    std::string mPath;
+};
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,318 @@
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "gadget.h"
+#include "agent.h"
+#include "input.h"
+#include "cmd.h"
+#include "message.h"
+
+/*
+ * wdemo-microbench: google-benchmark cases for the per-message CPU work of
+ * the agent, run against the real code rather than copies of it. Inputs
+ * are drawn up front from a fixed seed with the same message mix the load
+ * generator plays (5% modify, the rest split evenly between query, status
+ * and sync) so runs stay comparable; the *Mix cases cycle through them.
+ */
+
+static const int corpusSize = 1024;
+static const int modifyPercent = 5;
+
+enum MessageType {
+    MsgQuery,
+    MsgStatus,
+    MsgSync,
+    MsgModify,
+    MsgTypeCount
+};
+
+static const char *msgTypeNames[MsgTypeCount] = {
+    "query", "status", "sync", "modify"
+};
+
+struct Message {
+    MessageType type;
+    GadgetValues values;
+    std::string text;
+};
+
+static
+Message makeMessage(MessageType type, std::mt19937 &rng)
+{
+    std::uniform_int_distribution<int> percent(0, 99);
+    Message m;
+
+    m.type = type;
+
+    switch(type) {
+    case MsgStatus:
+        // What a peer running wdemo answers a query with.
+        m.values.set(GadgetBulb, GadgetValue((percent(rng) & 1) != 0));
+        m.values.set(GadgetTorch, GadgetValue((percent(rng) & 1) != 0));
+        m.values.set(GadgetBrightness, GadgetValue(percent(rng) / 100.0f));
+        m.values.set(GadgetRing, GadgetValue(false));
+        m.values.set(GadgetVolume, GadgetValue(percent(rng) / 100.0f));
+        m.values.set(GadgetCamera, GadgetValue(false));
+        break;
+    case MsgSync:
+        m.values.set(GadgetVolume, GadgetValue(percent(rng) / 100.0f));
+        break;
+    case MsgModify:
+        m.values.set(GadgetBrightness, GadgetValue(percent(rng) / 100.0f));
+        break;
+    case MsgQuery:
+    default:
+        break;
+    }
+
+    m.text = encodeMessage(msgTypeNames[type], m.values);
+    return m;
+}
+
+static
+const std::vector<Message> &messageCorpus(void)
+{
+    static std::vector<Message> corpus;
+
+    if (!corpus.empty())
+        return corpus;
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> percent(0, 99);
+
+    for (int i = 0; i < corpusSize; i++) {
+        MessageType type;
+
+        if (percent(rng) < modifyPercent)
+            type = MsgModify;
+        else
+            type = (MessageType)(percent(rng) % 3);
+
+        corpus.push_back(makeMessage(type, rng));
+    }
+    return corpus;
+}
+
+static
+Message typedMessage(MessageType type)
+{
+    std::mt19937 rng(42);
+
+    return makeMessage(type, rng);
+}
+
+/* Building a friend message, as didGadgetValueChange() and handleQuery() do. */
+
+static
+void BM_EncodeMessage(benchmark::State &state)
+{
+    Message m = typedMessage((MessageType)state.range(0));
+    size_t bytes = 0;
+
+    for (auto _ : state) {
+        std::string msg = encodeMessage(msgTypeNames[m.type], m.values);
+        bytes += msg.length();
+        benchmark::DoNotOptimize(msg);
+    }
+
+    state.SetLabel(msgTypeNames[m.type]);
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_EncodeMessage)->DenseRange(MsgQuery, MsgModify);
+
+static
+void BM_EncodeMix(benchmark::State &state)
+{
+    const std::vector<Message> &corpus = messageCorpus();
+    size_t bytes = 0;
+    size_t i = 0;
+
+    for (auto _ : state) {
+        const Message &m = corpus[i++ % corpus.size()];
+        std::string msg = encodeMessage(msgTypeNames[m.type], m.values);
+        bytes += msg.length();
+        benchmark::DoNotOptimize(msg);
+    }
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_EncodeMix);
+
+/* Parsing a friend message, as onFriendMessage() does before dispatching. */
+
+static
+void BM_DecodeMessage(benchmark::State &state)
+{
+    Message m = typedMessage((MessageType)state.range(0));
+    size_t bytes = 0;
+
+    for (auto _ : state) {
+        std::string type;
+        GadgetValues values;
+
+        benchmark::DoNotOptimize(decodeMessage(m.text.c_str(), m.text.length(),
+                                               type, values));
+        benchmark::DoNotOptimize(values);
+        bytes += m.text.length();
+    }
+
+    state.SetLabel(msgTypeNames[m.type]);
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_DecodeMessage)->DenseRange(MsgQuery, MsgModify);
+
+static
+void BM_DecodeMix(benchmark::State &state)
+{
+    const std::vector<Message> &corpus = messageCorpus();
+    size_t bytes = 0;
+    size_t i = 0;
+
+    for (auto _ : state) {
+        const Message &m = corpus[i++ % corpus.size()];
+        std::string type;
+        GadgetValues values;
+
+        benchmark::DoNotOptimize(decodeMessage(m.text.c_str(), m.text.length(),
+                                               type, values));
+        benchmark::DoNotOptimize(values);
+        bytes += m.text.length();
+    }
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_DecodeMix);
+
+/* GadgetValue conversions on the sync and logging paths. */
+
+static
+std::vector<GadgetValue> valueCorpus(void)
+{
+    std::vector<GadgetValue> values;
+
+    for (const Message &m : messageCorpus()) {
+        for (int i = 0; i < GadgetKindCount; i++) {
+            if (m.values.has((GadgetKind)i))
+                values.push_back(m.values.get((GadgetKind)i));
+        }
+    }
+    return values;
+}
+
+static
+void BM_GadgetValueCStr(benchmark::State &state)
+{
+    std::vector<GadgetValue> values = valueCorpus();
+    size_t i = 0;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(values[i++ % values.size()].c_str());
+}
+BENCHMARK(BM_GadgetValueCStr);
+
+static
+void BM_GadgetValueCompare(benchmark::State &state)
+{
+    std::vector<GadgetValue> values = valueCorpus();
+    size_t i = 0;
+
+    for (auto _ : state) {
+        const GadgetValue &a = values[i % values.size()];
+        const GadgetValue &b = values[(i + 1) % values.size()];
+
+        benchmark::DoNotOptimize(a == b);
+        i++;
+    }
+}
+BENCHMARK(BM_GadgetValueCompare);
+
+static
+void BM_GadgetValueUpdate(benchmark::State &state)
+{
+    std::vector<GadgetValue> values = valueCorpus();
+    GadgetValue current;
+    size_t i = 0;
+
+    for (auto _ : state) {
+        current = values[i++ % values.size()];
+        current.value(values[i % values.size()]);
+        benchmark::DoNotOptimize(current);
+    }
+}
+BENCHMARK(BM_GadgetValueUpdate);
+
+/* Console gadget commands. */
+
+static
+std::string peerId(std::mt19937 &rng)
+{
+    static const char base58[] =
+        "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+    std::uniform_int_distribution<int> pick(0, sizeof(base58) - 2);
+    std::string id;
+
+    for (int i = 0; i < 44; i++)
+        id += base58[pick(rng)];
+    return id;
+}
+
+static
+void BM_ArgvParse(benchmark::State &state)
+{
+    std::mt19937 rng(42);
+    std::string a = peerId(rng);
+    std::string b = peerId(rng);
+    std::vector<std::string> lines = {
+        "torch",
+        "torch me",
+        "torch me on",
+        "brightness me 0.75",
+        "bulb " + a,
+        "bulb " + a + " off",
+        "volume " + a + "," + b + " 0.5",
+        "ring * on",
+    };
+    std::vector<std::vector<std::string>> argvs;
+    size_t i = 0;
+
+    for (const std::string &line : lines) {
+        std::vector<std::string> argv;
+
+        CInput::splitLine(line.c_str(), line.length(), argv);
+        argvs.push_back(argv);
+    }
+
+    for (auto _ : state) {
+        ArgvParser parser(argvs[i++ % argvs.size()]);
+
+        benchmark::DoNotOptimize(parser.parse());
+        benchmark::DoNotOptimize(parser.peerIds());
+    }
+}
+BENCHMARK(BM_ArgvParse);
+
+/* The gadgets a peer's first status message creates on the agent. */
+
+static
+void BM_PeerAddGadget(benchmark::State &state)
+{
+    CAgent agent(std::shared_ptr<CInput>(new CInput()));
+    Message m = typedMessage(MsgStatus);
+
+    for (auto _ : state) {
+        CPeer peer(nullptr);
+
+        for (int i = 0; i < GadgetKindCount; i++) {
+            GadgetKind kind = (GadgetKind)i;
+            if (m.values.has(kind))
+                peer.addGadget(&agent, kind, m.values.get(kind));
+        }
+        benchmark::DoNotOptimize(peer.getGadget(GadgetBulb));
+    }
+}
+BENCHMARK(BM_PeerAddGadget);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,56 @@
+#ifndef __PROBE_H__
+#define __PROBE_H__
+
+#include <cstdint>
+#include <ctime>
+
+/*
+ * Media path probes. In builds defining WDEMO_PROBES (the video benchmark)
+ * PROBE() times the enclosing scope and reports it to probeDone(), which
+ * that build provides; everywhere else the probes compile to nothing.
+ */
+#define PROBE_STAGE_LIST(X) \
+    X(Camera,  "camera")    \
+    X(Rtp,     "rtp")       \
+    X(Agent,   "agent")     \
+    X(Session, "session")
+
+#define PROBE_STAGE_ENUM(id, name) Probe##id,
+enum ProbeStage {
+    PROBE_STAGE_LIST(PROBE_STAGE_ENUM)
+    ProbeStageCount
+};
+#undef PROBE_STAGE_ENUM
+
+inline uint64_t probeClock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef WDEMO_PROBES
+
+// Start and end of one pass through a stage, CLOCK_MONOTONIC ns.
+void probeDone(ProbeStage stage, uint64_t start, uint64_t end);
+
+class CProbe {
+public:
+    explicit CProbe(ProbeStage stage): mStage(stage), mStart(probeClock()) {}
+    ~CProbe() { probeDone(mStage, mStart, probeClock()); }
+
+private:
+    ProbeStage mStage;
+    uint64_t mStart;
+};
+
+#define PROBE(stage) CProbe __probe(Probe##stage)
+
+#else
+
+#define PROBE(stage) do {} while(0)
+
+#endif
+
+#endif /* __PROBE_H__ */
@@ -5,52 +5,87 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-char data[8*1024];
+#include "gadget_driver.h"
+
+/*
+ * One raspivid process per camera instance, streaming H.264 to a local
+ * UDP port, and a thread forwarding what arrives there to the stream
+ * callback. Instances share nothing, so several cameras (-cs) or several
+ * encodings of one camera run side by side.
+ */
+#define CAMERA_DATA_SZ  (8 * 1024)
+
+typedef struct raspi_camera {
+    char name[32];
+    int device;
+    int port;
+    int width;
+    int height;
+    int bitrate;
+    int framerate;
+    int profile;
+    int intra;
+
+    GadgetStreamCallback cb;
+    void *context;
 
-static const char *host = "127.0.0.1";
-static int stream_port = 12300;
-static int width = 320;
-static int height = 240;
-static int bitrate = 150000;
-static int framerate = 30;
-static int profile = 0;
+    pid_t pid;
+    int sock;
+    int wake[2];
+    bool running;
+    pthread_t thread;
 
-static bool running = false;
-static pthread_t camera_thread;
+    char data[CAMERA_DATA_SZ];
+} raspi_camera;
+
+static const char *host = "127.0.0.1";
 
-static void (*streamFwdCb)(void *, int, void *) = NULL;
-static void* streamFwdArgv = NULL;
+// The instance behind the single camera ops.
+static raspi_camera default_camera = {
+    .name      = "camera",
+    .device    = -1,
+    .port      = 12300,
+    .width     = 320,
+    .height    = 240,
+    .bitrate   = 150000,
+    .framerate = 30,
+    .profile   = 0,
+    .intra     = 10,
+    .pid       = -1,
+    .sock      = -1,
+    .wake      = { -1, -1 }
+};
 
 void camera_set_callbacks(void *streamCb, void *context)
 {
-    streamFwdCb = (void (*)(void *, int, void *))streamCb;
-    streamFwdArgv = context;
+    default_camera.cb = (GadgetStreamCallback)streamCb;
+    default_camera.context = context;
 }
 
 void camera_set_port(int port)
 {
-    stream_port = port;
+    default_camera.port = port;
 }
 
 void camera_set_parameters(int w, int h, int br, int fps, int pf)
 {
-    width = w;
-    height = h;
-    bitrate = br;
-    framerate = fps;
-    profile = pf;
+    default_camera.width = w;
+    default_camera.height = h;
+    default_camera.bitrate = br;
+    default_camera.framerate = fps;
+    default_camera.profile = pf;
 }
 
-static pid_t raspivid_pid = -1;
-
-static int raspivid_open(void)
+static int raspivid_open(raspi_camera *cam)
 {
     pid_t pid;
 
@@ -77,15 +112,25 @@ static int raspivid_open(void)
         argv[i++] = buf + off;
         off += rc + 1;
 
-        rc = sprintf(buf + off, "udp://127.0.0.1:%d", stream_port);
+        rc = sprintf(buf + off, "udp://127.0.0.1:%d", cam->port);
         argv[i++] = buf + off;
         off += rc + 1;
 
+        if (cam->device >= 0) {
+            rc = sprintf(buf + off, "-cs");
+            argv[i++] = buf + off;
+            off += rc + 1;
+
+            rc = sprintf(buf + off, "%d", cam->device);
+            argv[i++] = buf + off;
+            off += rc + 1;
+        }
+
         rc = sprintf(buf + off, "-w");
         argv[i++] = buf + off;
         off += rc + 1;
 
-        rc = sprintf(buf + off, "%d", width);
+        rc = sprintf(buf + off, "%d", cam->width);
         argv[i++] = buf + off;
         off += rc + 1;
 
@@ -93,7 +138,7 @@ static int raspivid_open(void)
         argv[i++] = buf + off;
         off += rc + 1;
 
-        rc = sprintf(buf + off, "%d", height);
+        rc = sprintf(buf + off, "%d", cam->height);
         argv[i++] = buf + off;
         off += rc + 1;
 
@@ -101,9 +146,9 @@ static int raspivid_open(void)
         argv[i++] = buf + off;
         off += rc + 1;
 
-        if (profile == 2)
+        if (cam->profile == 2)
             rc = sprintf(buf + off, "high");
-        else if (profile == 1)
+        else if (cam->profile == 1)
             rc = sprintf(buf + off, "main");
         else
             rc = sprintf(buf + off, "baseline");
@@ -114,7 +159,7 @@ static int raspivid_open(void)
         argv[i++] = buf + off;
         off += rc + 1;
 
-        rc = sprintf(buf + off, "%d", bitrate);
+        rc = sprintf(buf + off, "%d", cam->bitrate);
         argv[i++] = buf + off;
         off += rc + 1;
 
@@ -122,7 +167,7 @@ static int raspivid_open(void)
         argv[i++] = buf + off;
         off += rc + 1;
 
-        rc = sprintf(buf + off, "%d", framerate);
+        rc = sprintf(buf + off, "%d", cam->framerate);
         argv[i++] = buf + off;
         off += rc + 1;
 
@@ -146,7 +191,7 @@ static int raspivid_open(void)
         argv[i++] = buf + off;
         off += rc + 1;
 
-        rc = sprintf(buf + off, "10");
+        rc = sprintf(buf + off, "%d", cam->intra);
         argv[i++] = buf + off;
         off += rc + 1;
 
@@ -167,128 +212,228 @@ static int raspivid_open(void)
         exit(0);
 
     } else {
-        raspivid_pid = pid;
+        cam->pid = pid;
     }
 
     return 0;
 }
 
-static void raspivid_close(void)
+static void raspivid_close(raspi_camera *cam)
 {
-    if (raspivid_pid > 0)
-        kill(raspivid_pid, SIGKILL);
+    if (cam->pid > 0) {
+        kill(cam->pid, SIGKILL);
+        waitpid(cam->pid, NULL, 0);
+        cam->pid = -1;
+    }
 }
 
 static
 void *camera_forwarding_routine(void *argv)
 {
-    int sock = (int)argv;
+    raspi_camera *cam = (raspi_camera *)argv;
+    struct pollfd fds[2];
     int rc;
 
-    running = true;
-
-    while(running) {
-        fd_set rfds;
+    fds[0].fd = cam->sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = cam->wake[0];
+    fds[1].events = POLLIN;
 
-        FD_ZERO(&rfds);
-        FD_SET(sock, &rfds);
-
-        rc = select(sock + 1, &rfds, NULL, NULL, NULL);
+    while (true) {
+        rc = poll(fds, 2, -1);
         if (rc < 0) {
-            printf("select error: \n");
-            close(sock);
-            return NULL;
+            if (errno == EINTR)
+                continue;
+            printf("camera %s poll error: %d\n", cam->name, errno);
+            break;
         }
 
-        if (FD_ISSET(sock, &rfds)) {
-            struct sockaddr_in raddr;
-            socklen_t addrlen = sizeof(raddr);
-
-            //memset(&data, 0, sizeof(data));
-            memset(&raddr,0, sizeof(raddr));
+        if (fds[1].revents)
+            break;
 
-            rc = recvfrom(sock, data, sizeof(data), 0, (struct sockaddr *)&raddr, &addrlen);
+        if (fds[0].revents & POLLIN) {
+            rc = recv(cam->sock, cam->data, sizeof(cam->data), 0);
             if (rc < 0) {
-                printf("recvfrom error: %d\n", errno);
-                close(sock);
-                return NULL;
+                printf("camera %s recv error: %d\n", cam->name, errno);
+                break;
             }
 
-            if (streamFwdCb)
-                streamFwdCb(data, rc, streamFwdArgv);
+            if (cam->cb)
+                cam->cb(cam->data, rc, cam->context);
         }
     }
 
-    close(sock);
     return NULL;
 }
 
-int camera_open(void)
+static
+void camera_release(raspi_camera *cam)
 {
-    int sock;
+    if (cam->wake[0] >= 0) {
+        close(cam->wake[0]);
+        close(cam->wake[1]);
+        cam->wake[0] = cam->wake[1] = -1;
+    }
 
-    if (raspivid_open() < 0) {
-        printf("open raspivid error");
-        return -1;
+    if (cam->sock >= 0) {
+        close(cam->sock);
+        cam->sock = -1;
     }
+}
+
+static
+int camera_start(raspi_camera *cam)
+{
+    struct sockaddr_in saddr;
+    int tmp = 1;
+    int rc;
+
+    if (cam->running)
+        return 0;
 
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock == -1) {
+    cam->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (cam->sock == -1) {
         printf("socket error: %d\n", errno);
-        raspivid_close();
         return -1;
     }
 
-    int tmp = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof(int));
-    struct sockaddr_in saddr;
+    setsockopt(cam->sock, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof(int));
     memset(&saddr, 0, sizeof(saddr));
     saddr.sin_family = AF_INET;
-    saddr.sin_port = htons(stream_port);
+    saddr.sin_port = htons(cam->port);
 
-    int rc;
     rc = inet_aton(host, &saddr.sin_addr);
     if (rc == 0) {
         printf("inet_aton error\n");
-        close(sock);
-        raspivid_close();
+        camera_release(cam);
         return -1;
     }
 
-    rc = bind(sock, (struct sockaddr *)&saddr, sizeof(saddr));
+    // Bound before raspivid starts sending, so no frame is lost.
+    rc = bind(cam->sock, (struct sockaddr *)&saddr, sizeof(saddr));
     if (rc == -1) {
         printf("bind error: %d\n", errno);
-        close(sock);
-        raspivid_close();
+        camera_release(cam);
         return -1;
     }
 
-    printf("binded to stream port:%s:%d successfully\n", host, stream_port);
+    if (pipe(cam->wake) < 0) {
+        printf("pipe error: %d\n", errno);
+        cam->wake[0] = cam->wake[1] = -1;
+        camera_release(cam);
+        return -1;
+    }
 
-    pthread_attr_t attr;
+    if (raspivid_open(cam) < 0) {
+        printf("open raspivid error");
+        camera_release(cam);
+        return -1;
+    }
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    printf("camera %s binded to stream port:%s:%d successfully\n", cam->name,
+           host, cam->port);
 
-    rc = pthread_create(&camera_thread, &attr, camera_forwarding_routine, (void*)sock);
-    if (rc < 0) {
+    rc = pthread_create(&cam->thread, NULL, camera_forwarding_routine, cam);
+    if (rc != 0) {
         printf("create camera forwarding thread error :%d\n", rc);
-        close(sock);
-        raspivid_close();
+        raspivid_close(cam);
+        camera_release(cam);
         return -1;
     }
 
+    cam->running = true;
     return 0;
 }
 
+static
+void camera_stop(raspi_camera *cam)
+{
+    char ch = 0;
+
+    if (!cam->running)
+        return;
+
+    if (write(cam->wake[1], &ch, 1) < 0)
+        printf("wake camera %s thread error: %d\n", cam->name, errno);
+    pthread_join(cam->thread, NULL);
+    cam->running = false;
+
+    raspivid_close(cam);
+    camera_release(cam);
+}
+
+int camera_open(void)
+{
+    return camera_start(&default_camera);
+}
+
 void camera_close(void)
 {
-    running = false;
-    raspivid_close();
+    camera_stop(&default_camera);
 }
 
 int camera_flip(void)
 {
-    //TODO;
+    if (!default_camera.running)
+        return camera_start(&default_camera);
+
+    camera_stop(&default_camera);
+    return 0;
+}
+
+void *cameras_open(const GadgetCameraParams *params, GadgetStreamCallback cb,
+                   void *context)
+{
+    raspi_camera *cam;
+
+    cam = (raspi_camera *)calloc(1, sizeof(*cam));
+    if (!cam)
+        return NULL;
+
+    snprintf(cam->name, sizeof(cam->name), "%s", params->name ? params->name : "camera");
+    cam->device    = params->device;
+    cam->port      = params->port;
+    cam->width     = params->width;
+    cam->height    = params->height;
+    cam->bitrate   = params->bitrate;
+    cam->framerate = params->framerate;
+    cam->profile   = params->profile;
+    cam->intra     = params->intra > 0 ? params->intra : 10;
+    cam->cb        = cb;
+    cam->context   = context;
+    cam->pid       = -1;
+    cam->sock      = -1;
+    cam->wake[0]   = cam->wake[1] = -1;
+
+    if (camera_start(cam) < 0) {
+        free(cam);
+        return NULL;
+    }
+
+    return cam;
+}
+
+int cameras_flip(void *camera, int on)
+{
+    raspi_camera *cam = (raspi_camera *)camera;
+
+    if (!cam)
+        return -1;
+
+    if (on)
+        return camera_start(cam);
+
+    camera_stop(cam);
     return 0;
 }
+
+void cameras_close(void *camera)
+{
+    raspi_camera *cam = (raspi_camera *)camera;
+
+    if (!cam)
+        return;
+
+    camera_stop(cam);
+    free(cam);
+}
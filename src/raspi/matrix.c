@@ -2,91 +2,226 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <unistd.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
 
-void display(uint8_t *buf)
+/*
+ * The matrix is multiplexed by row: one SPI transfer selects a row and
+ * sets its columns, so a full picture only shows while rows are scanned
+ * over and over. The refresh thread scans at the persistence rate while
+ * the torch is lit and sleeps on a condition variable otherwise, waking
+ * only when matrix_flip() or matrix_set_refresh() change something.
+ */
+#define MATRIX_ROWS         8
+#define MATRIX_XFER_SIZE    4
+#define MATRIX_REFRESH      60      /* full frames per second */
+
+typedef uint8_t matrix_frame[MATRIX_ROWS][MATRIX_XFER_SIZE];
+
+static const uint8_t image_on[MATRIX_ROWS] = {
+    0x00, 0x66, 0xFF, 0xFF, 0xFF, 0x7E, 0x3C, 0x18
+};
+static const uint8_t image_off[MATRIX_ROWS] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static matrix_frame frame_on;
+static matrix_frame frame_off;
+
+static pthread_mutex_t matrix_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t matrix_cond;
+static pthread_t matrix_thread;
+
+static bool matrix_on = false;
+static bool running = false;
+static bool exit_hooked = false;
+static bool dirty = false;
+static int refresh = MATRIX_REFRESH;
+
+void matrix_close(void);
+
+static
+void build_frame(matrix_frame frame, const uint8_t *image)
 {
-    uint8_t data[4] = {0x0,0x0,0x0,0x0};
     int j;
 
-    for (j=0; j<8; j++) {
-        data[0] = ~buf[j];
-        data[2] = 0xff;
-        data[1] = 0xff;
-        data[3] = 0x01 << j ;
-
-        wiringPiSPIDataRW(0,data,sizeof(data));
-        delay(2);
+    for (j = 0; j < MATRIX_ROWS; j++) {
+        frame[j][0] = ~image[j];
+        frame[j][1] = 0xff;
+        frame[j][2] = 0xff;
+        frame[j][3] = 0x01 << j;
     }
 }
 
-void turnon(void)
+static
+void send_row(const uint8_t *row)
 {
-    uint8_t data[8] = {0x00, 0x66, 0xFF, 0xFF, 0xFF, 0x7E, 0x3C, 0x18};
-    display(data);
+    uint8_t data[MATRIX_XFER_SIZE];
+
+    // wiringPiSPIDataRW overwrites the buffer with the bytes read back.
+    memcpy(data, row, sizeof(data));
+    wiringPiSPIDataRW(0, data, sizeof(data));
 }
 
-void turnoff(void)
+static
+void draw_frame(matrix_frame frame)
 {
-    uint8_t data[8] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-    display(data);
+    int j;
+
+    for (j = 0; j < MATRIX_ROWS; j++)
+        send_row(frame[j]);
 }
 
-static bool matrix_on = false;
-static bool running = false;
-static pthread_t matrix_thread;
+static
+void row_deadline(struct timespec *ts, int hz)
+{
+    long ns = 1000000000L / (hz * MATRIX_ROWS);
+
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_nsec += ns;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
 
 void *matrix_routine(void *argv)
 {
-    running = true;
+    struct timespec deadline;
+    int row = 0;
+
+    pthread_mutex_lock(&matrix_lock);
 
     while (running) {
-        if (matrix_on)
-            turnon();
-        else
-            turnoff();
+        bool on = matrix_on;
+        bool scan = on && refresh > 0;
+
+        if (!dirty && !scan) {
+            pthread_cond_wait(&matrix_cond, &matrix_lock);
+            continue;
+        }
+
+        if (dirty) {
+            dirty = false;
+            row = 0;
+        }
+
+        if (!scan) {
+            // Nothing to multiplex: draw once, then sleep until a change.
+            pthread_mutex_unlock(&matrix_lock);
+            draw_frame(on ? frame_on : frame_off);
+            pthread_mutex_lock(&matrix_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&matrix_lock);
+        send_row(frame_on[row]);
+        row = (row + 1) % MATRIX_ROWS;
+        pthread_mutex_lock(&matrix_lock);
+
+        // Hold the row for its share of the frame; a flip cuts it short.
+        row_deadline(&deadline, refresh);
+        if (!dirty && running)
+            pthread_cond_timedwait(&matrix_cond, &matrix_lock, &deadline);
     }
 
-    turnoff();
+    pthread_mutex_unlock(&matrix_lock);
+
+    draw_frame(frame_off);
     return NULL;
 }
 
 int matrix_open(void)
 {
-    wiringPiSetup();
-    wiringPiSPISetup(0,500000);
+    pthread_condattr_t cattr;
+    int rc;
 
-    atexit(turnoff);
+    pthread_mutex_lock(&matrix_lock);
+    if (running) {
+        pthread_mutex_unlock(&matrix_lock);
+        return 0;
+    }
 
-    pthread_attr_t attr;
+    wiringPiSetup();
+    wiringPiSPISetup(0,500000);
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    build_frame(frame_on, image_on);
+    build_frame(frame_off, image_off);
 
-    int rc;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&matrix_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
 
-    rc = pthread_create(&matrix_thread, &attr, matrix_routine, NULL);
-    pthread_attr_destroy(&attr);
+    running = true;
+    dirty = true;
 
+    rc = pthread_create(&matrix_thread, NULL, matrix_routine, NULL);
     if (rc != 0) {
+        running = false;
+        pthread_cond_destroy(&matrix_cond);
+        pthread_mutex_unlock(&matrix_lock);
         printf("create matrix thread error (%d)\n", rc);
         return -1;
     }
+
+    if (!exit_hooked) {
+        exit_hooked = true;
+        atexit(matrix_close);
+    }
+
+    pthread_mutex_unlock(&matrix_lock);
+    return 0;
 }
 
 int matrix_flip(void)
 {
+    pthread_mutex_lock(&matrix_lock);
     matrix_on = !matrix_on;
+    dirty = true;
+    if (running)
+        pthread_cond_signal(&matrix_cond);
+    pthread_mutex_unlock(&matrix_lock);
+
+    return 0;
+}
+
+/*
+ * Persistence rate in full frames per second while lit. 0 draws each
+ * change once, for matrices that latch their rows.
+ */
+int matrix_set_refresh(int hz)
+{
+    if (hz < 0 || hz > 1000)
+        return -1;
+
+    pthread_mutex_lock(&matrix_lock);
+    refresh = hz;
+    dirty = true;
+    if (running)
+        pthread_cond_signal(&matrix_cond);
+    pthread_mutex_unlock(&matrix_lock);
+
     return 0;
 }
 
 void matrix_close(void)
 {
+    pthread_mutex_lock(&matrix_lock);
+    if (!running) {
+        pthread_mutex_unlock(&matrix_lock);
+        return;
+    }
+
     matrix_on = false;
-    sleep(1);
     running = false;
+    pthread_cond_signal(&matrix_cond);
+    pthread_mutex_unlock(&matrix_lock);
+
+    pthread_join(matrix_thread, NULL);
+    pthread_cond_destroy(&matrix_cond);
 }
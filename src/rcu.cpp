@@ -0,0 +1,83 @@
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <sched.h>
+
+#include "vlog.h"
+#include "rcu.h"
+
+const int maxRcuReaders = 64;
+
+static std::atomic<uint64_t> gEpoch(1);
+static std::atomic<uint64_t> gSlots[maxRcuReaders];
+static std::atomic<bool> gSlotUsed[maxRcuReaders];
+
+class CRcuSlot {
+public:
+    CRcuSlot(): mIndex(-1), mDepth(0) {
+        for (int i = 0; i < maxRcuReaders; i++) {
+            bool expected = false;
+            if (gSlotUsed[i].compare_exchange_strong(expected, true)) {
+                mIndex = i;
+                break;
+            }
+        }
+
+        if (mIndex < 0)
+            vlogE("Too many rcu reader threads (max %d)", maxRcuReaders);
+    }
+
+    ~CRcuSlot() {
+        if (mIndex >= 0) {
+            gSlots[mIndex].store(0);
+            gSlotUsed[mIndex].store(false);
+        }
+    }
+
+public:
+    int mIndex;
+    int mDepth;
+};
+
+static thread_local CRcuSlot tSlot;
+
+void CRcu::readLock(void)
+{
+    // Readers without a slot can not be tracked; fail loudly in debug
+    // builds rather than risk a use-after-free.
+    assert(tSlot.mIndex >= 0);
+
+    if (tSlot.mDepth++ == 0 && tSlot.mIndex >= 0)
+        gSlots[tSlot.mIndex].store(gEpoch.load());
+}
+
+void CRcu::readUnlock(void)
+{
+    if (--tSlot.mDepth == 0 && tSlot.mIndex >= 0)
+        gSlots[tSlot.mIndex].store(0);
+}
+
+uint64_t CRcu::advance(void)
+{
+    return ++gEpoch;
+}
+
+bool CRcu::quiescent(uint64_t epoch)
+{
+    for (int i = 0; i < maxRcuReaders; i++) {
+        uint64_t pinned = gSlots[i].load();
+        if (pinned != 0 && pinned < epoch)
+            return false;
+    }
+    return true;
+}
+
+void CRcu::synchronize(void)
+{
+    // Waiting from inside a read section would never finish.
+    assert(tSlot.mDepth == 0);
+
+    uint64_t epoch = advance();
+    while (!quiescent(epoch))
+        sched_yield();
+}
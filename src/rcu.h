@@ -0,0 +1,78 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+ * Epoch based read-copy-update.
+ *
+ * Readers pin the current epoch in a per-thread slot for the duration of a
+ * CRcuReadLock scope and never block. Writers publish a new object with an
+ * atomic pointer swap, then retire the old one; it is freed once no reader
+ * still pins an epoch older than the retirement.
+ */
+class CRcu {
+public:
+    static void readLock(void);
+    static void readUnlock(void);
+
+    // Start a new epoch and return it.
+    static uint64_t advance(void);
+    // True when no reader pins an epoch older than @epoch.
+    static bool quiescent(uint64_t epoch);
+    // Block until all readers that started before this call have finished.
+    static void synchronize(void);
+};
+
+class CRcuReadLock {
+public:
+    CRcuReadLock() { CRcu::readLock(); }
+    ~CRcuReadLock() { CRcu::readUnlock(); }
+};
+
+template <typename T>
+class CRcuPtr {
+public:
+    CRcuPtr(): mPtr(nullptr) {}
+    ~CRcuPtr() {
+        delete mPtr.load();
+        for (size_t i = 0; i < mRetired.size(); i++)
+            delete mRetired[i].second;
+    }
+
+public:
+    // Must be called with a CRcuReadLock held; the object stays valid
+    // until the lock is released.
+    const T *get(void) const { return mPtr.load(); }
+
+    // Writer side. Callers must serialize publish() and reclaim().
+    void publish(T *ptr) {
+        T *old = mPtr.exchange(ptr);
+        if (old)
+            mRetired.push_back(std::make_pair(CRcu::advance(), old));
+        reclaim();
+    }
+
+    void reclaim(void) {
+        size_t i = 0;
+        while (i < mRetired.size()) {
+            if (CRcu::quiescent(mRetired[i].first)) {
+                delete mRetired[i].second;
+                mRetired[i] = mRetired.back();
+                mRetired.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+
+private:
+    std::atomic<T*> mPtr;
+    std::vector<std::pair<uint64_t, T*>> mRetired;
+};
+
+#endif /* __RCU_H__ */
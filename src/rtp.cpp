@@ -2,7 +2,13 @@
 #include <cstdlib>
 #include <cstring>
 #include <arpa/inet.h>
+
+#define VLOG_MODULE VLOG_MOD_RTP
+#include "vlog.h"
 #include "rtp.h"
+#include "probe.h"
+#include "metrics.h"
+#include "trace.h"
 
 struct RtpFixHeader {
     uint8_t csrcLen:4;
@@ -75,23 +81,30 @@ int readNalu(const uint8_t* data, int length, int offset, nalu::NaluUnit& nalu)
 }
 }
 
-int CRtp::streamFwd(const uint8_t* data, int length,  uint32_t timestamp)
+int CRtp::streamFwd(const uint8_t* data, int length,  uint32_t timestamp,
+                    RtpPackets &out)
 {
-    static uint16_t seqNo = 0;
     nalu::NaluUnit nalu;
     uint8_t* payload = NULL;
     int len = 0;
     int off = 0;
+    int nals = 0;
+    int packets = 0;
+    TRACE("CRtp::streamFwd");
+    PROBE(Rtp);
 
     while((len = nalu::readNalu(data, length, off, nalu)) > 0) {
+        nals++;
+        if (nalu.nal_unit_type == 5 || nalu.nal_unit_type == 7)
+            out.keyframe = true;
         memset(mOutbuf, 0, ::maxPktMtu);
 
         int sz = 0;
         RtpFixHeader* hdr = (RtpFixHeader*)&mOutbuf[sz];
         hdr->payload = 96; // h264;
         hdr->version = 2;
-        hdr->seqNo   = htons(++seqNo);
-        hdr->ssrc    = htonl(10);
+        hdr->seqNo   = htons(++mSeqNo);
+        hdr->ssrc    = htonl(mSsrc);
         hdr->timestamp = htonl(timestamp);
 
         if (nalu.length <= ::maxPktMtu) { // All in one package.
@@ -108,7 +121,8 @@ int CRtp::streamFwd(const uint8_t* data, int length,  uint32_t timestamp)
             memcpy(payload, nalu.data + 1, nalu.length - 1); //wierd.
             sz += nalu.length -1;
 
-            mAgent->sendVideoFrame(mOutbuf, sz);
+            out.add(mOutbuf, sz);
+            packets++;
 
             off += len;
             continue;
@@ -141,14 +155,15 @@ int CRtp::streamFwd(const uint8_t* data, int length,  uint32_t timestamp)
         payload = (uint8_t*)&mOutbuf[sz];
         memcpy(payload, nalu.data + 1, ::maxPktMtu -1);
         sz += ::maxPktMtu -1;
-        mAgent->sendVideoFrame(mOutbuf, sz); // send the first package.
+        out.add(mOutbuf, sz); // the first package.
+        packets++;
         idx++;
 
         // The middle packages.
         while(idx < pktNum) {
             sz = 0;
             hdr->marker = 0;
-            hdr->seqNo  = htons(++seqNo);
+            hdr->seqNo  = htons(++mSeqNo);
             sz += sizeof(*hdr);
 
             /* same rtpFuIndicator */
@@ -164,7 +179,8 @@ int CRtp::streamFwd(const uint8_t* data, int length,  uint32_t timestamp)
             memcpy(payload, nalu.data + idx*::maxPktMtu, ::maxPktMtu);
             sz += ::maxPktMtu;
 
-            mAgent->sendVideoFrame(mOutbuf, sz);
+            out.add(mOutbuf, sz);
+            packets++;
             idx++;
         }
 
@@ -172,7 +188,7 @@ int CRtp::streamFwd(const uint8_t* data, int length,  uint32_t timestamp)
             /* the last package */
             sz = 0;
             hdr->marker = 1;
-            hdr->seqNo  = htons(++seqNo);
+            hdr->seqNo  = htons(++mSeqNo);
             sz += sizeof(*hdr);
 
             /* same rtpFuIndicator*/
@@ -188,11 +204,18 @@ int CRtp::streamFwd(const uint8_t* data, int length,  uint32_t timestamp)
             memcpy(payload, nalu.data + idx*::maxPktMtu, pktLast);
             sz += pktLast;
 
-            mAgent->sendVideoFrame(mOutbuf, sz);
+            out.add(mOutbuf, sz);
+            packets++;
         }
 
         off += len;
     }
+
+    if (!nals)
+        vlogLimitW("Dropped %d byte frame without NAL units", length);
+
+    metricRtpNals.add(nals);
+    metricRtpPackets.add(packets);
     return 0;
 }
 
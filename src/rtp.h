@@ -5,8 +5,7 @@
 #include <cstdlib>
 #include <memory>
 #include <array>
-
-#include "agent.h"
+#include <vector>
 
 namespace nalu {
 
@@ -25,16 +24,34 @@ int readNalu(const uint8_t* data, int length, int offset, nalu::NaluUnit& nalu);
 const int maxRtpMtu = 1500;
 const int maxPktMtu = 1400;
 
+// Packets of one frame, back to back; capacity is kept across frames.
+struct RtpPackets {
+    std::vector<uint8_t> data;
+    std::vector<int> lens;
+    bool keyframe;      // carries an SPS or IDR slice; decoding can start here
+
+    RtpPackets(): keyframe(false) {}
+
+    void clear(void) { data.clear(); lens.clear(); keyframe = false; }
+    void add(const uint8_t *pkt, int len) {
+        data.insert(data.end(), pkt, pkt + len);
+        lens.push_back(len);
+    }
+};
+
 class CRtp{
 public:
-    CRtp(CAgent *agent): mAgent(agent) {}
+    // Each stream numbers its packets on its own; @ssrc tells them apart.
+    explicit CRtp(uint32_t ssrc = 10): mSsrc(ssrc), mSeqNo(0) {}
     ~CRtp() {}
 
-    int streamFwd(const uint8_t*, int, uint32_t);
+    // Packetize one access unit, appending its packets to @out.
+    int streamFwd(const uint8_t*, int, uint32_t, RtpPackets &out);
 
 private:
+    uint32_t mSsrc;
+    uint16_t mSeqNo;
     uint8_t mOutbuf[::maxRtpMtu];
-    CAgent *mAgent;
 };
 
 #endif
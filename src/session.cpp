@@ -1,8 +1,14 @@
 #include <cstring>
 #include <cstdint>
 
+#define VLOG_MODULE VLOG_MOD_SESSION
 #include "vlog.h"
+#include "rcu.h"
 #include "session.h"
+#include "probe.h"
+#include "metrics.h"
+#include "trace.h"
+#include "watchdog.h"
 
 class state2str {
 public:
@@ -53,6 +59,8 @@ static
 void onStreamStateChanged(WhisperSession *session, int stream,
                           WhisperStreamState state, void *context)
 {
+    CWatchdogScope scope("onStreamStateChanged");
+    CMetricTimer timer(metricCbStreamState);
     CSession *sess = static_cast<CSession*>(context);
     int rc;
 
@@ -116,28 +124,45 @@ bool CSession::start(Whisper *whisper)
 
     vlogI("Add whisper stream %d successs", rc);
 
+    mPackets = metricPeerRtpPackets.get(*mTo);
+
     return true;
 }
 
 void CSession::close() {
     if (mSession) {
+        // The media path may still be writing through a snapshot taken
+        // before the stream was torn down; let it drain first.
+        mStream.store(-1);
+        CRcu::synchronize();
+
         whisper_session_close(mSession);
         mSession = NULL;
-        mStream = -1;
     }
 }
 
 void CSession::write(const uint8_t *data, size_t len)
 {
-    if (mStream < 0) {
+    int stream = mStream.load();
+    if (stream < 0) {
         //vlogE("Session not prepared for writing data");
         return;
     }
 
+    TRACE("CSession::write");
+    PROBE(Session);
     ssize_t rc;
 
-    rc = whisper_stream_write(mSession, mStream, data, len);
-    if (rc < 0)
-        vlogE("Write data to stream %d error: 0x%x", mStream,
+    rc = whisper_stream_write(mSession, stream, data, len);
+    if (rc < 0) {
+        mFailed.fetch_add(1, std::memory_order_relaxed);
+        metricStreamWriteErrors.add();
+        vlogLimitE("Write data to stream %d error: 0x%x", stream,
             whisper_get_error());
+        return;
+    }
+
+    mWritten.fetch_add(1, std::memory_order_relaxed);
+    if (mPackets)
+        mPackets->add();
 }
@@ -2,24 +2,66 @@
 #define __SESSION_H__
 
 #include <cstdint>
+#include <atomic>
 #include <memory>
 #include <string>
+#include <functional>
 
 #include "whisper.h"
 #include "whisper_session.h"
 
+class CCounter;
+
 class CSession {
 public:
     CSession(std::shared_ptr<std::string> to, std::shared_ptr<std::string> sdp)
         :mSession(NULL), mStream(-1),
-         mTo(to), mSdp(sdp) {}
+         mTo(to), mSdp(sdp), mShard(std::hash<std::string>()(*to)),
+         mCamera(0), mLayer(0), mTarget(0), mPinned(false), mCleanWindows(0),
+         mWritten(0), mFailed(0), mPackets(NULL) {}
 
     ~CSession();
 
 public:
     const char *getTo (void) const { return mTo->c_str(); }
     const char *getSdp(void) const { return mSdp->c_str(); }
-    void stream(int stream) { mStream = stream; }
+    void stream(int stream) { mStream.store(stream); }
+
+    // Picks the media worker writing to this peer; stable across sessions.
+    size_t shard(void) const { return mShard; }
+
+    // Camera pipeline the viewer watches, index into CConfig::cameras();
+    // the main layer of a simulcast camera.
+    int camera(void) const { return mCamera; }
+    void camera(int camera) { mCamera = camera; layer(camera); }
+
+    // Simulcast layer, the pipeline whose packets the viewer gets. A new
+    // target is taken at the next key frame of its pipeline, which calls
+    // switchLayer() before writing the frame.
+    int layer(void) const { return mLayer.load(std::memory_order_relaxed); }
+    void layer(int camera) { mLayer.store(camera); mTarget.store(camera); }
+    int target(void) const { return mTarget.load(std::memory_order_relaxed); }
+    void target(int camera) { mTarget.store(camera); }
+    bool switchLayer(int camera) {
+        if (mTarget.load() != camera || mLayer.load() == camera)
+            return false;
+        mLayer.store(camera);
+        return true;
+    }
+
+    // Layer asked for by the viewer, not moved by write loss.
+    bool pinned(void) const { return mPinned; }
+    void pinned(bool pinned) { mPinned = pinned; }
+
+    // Loss free windows in a row on the sub layer; whisper thread only.
+    int cleanWindows(void) const { return mCleanWindows; }
+    void cleanWindows(int windows) { mCleanWindows = windows; }
+
+    // Packets written and failed since the last call.
+    void takeWrites(uint32_t &written, uint32_t &failed) {
+        written = mWritten.exchange(0, std::memory_order_relaxed);
+        failed = mFailed.exchange(0, std::memory_order_relaxed);
+    }
 
     bool start(Whisper *whisper);
     void close(void);
@@ -28,10 +70,21 @@ public:
 
 private:
     WhisperSession *mSession;
-    int mStream;
+    std::atomic<int> mStream;
 
     std::shared_ptr<std::string> mTo;
     std::shared_ptr<std::string> mSdp;
+    size_t mShard;
+    int mCamera;
+    std::atomic<int> mLayer;
+    std::atomic<int> mTarget;
+    bool mPinned;
+    int mCleanWindows;
+    std::atomic<uint32_t> mWritten;
+    std::atomic<uint32_t> mFailed;
+
+    // Packets written to this peer, kept across its sessions.
+    CCounter *mPackets;
 };
 
 #endif
@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "gadget_driver.h"
+#include "sim.h"
+
+/*
+ * Simulated camera: instead of raspivid feeding a UDP socket, a thread
+ * hands one access unit per frame interval straight to the stream
+ * callback, either replayed from an Annex-B file or made up on the fly.
+ * Every instance has its own thread, source and parameters.
+ */
+#define SIM_MAX_FRAME   (512 * 1024)
+
+typedef struct sim_camera {
+    char name[32];
+    int width;
+    int height;
+    int bitrate;
+    int framerate;
+    int profile;
+    int intra;                  // 0: GOP from the environment
+    char source[256];           // file to replay, empty: WDEMO_SIM_H264
+
+    bool running;
+    pthread_t thread;
+
+    GadgetStreamCallback cb;
+    void *context;
+
+    // Replay source, the whole file is kept in memory.
+    uint8_t *stream;
+    size_t stream_len;
+    size_t stream_off;
+    bool stream_loop;
+
+    // Synthetic source.
+    int frame_size;
+    int gop;
+
+    bool stamp;
+
+    uint8_t frame[SIM_MAX_FRAME];
+} sim_camera;
+
+// The instance behind the single camera ops.
+static sim_camera default_camera = {
+    .name      = "camera",
+    .width     = 320,
+    .height    = 240,
+    .bitrate   = 150000,
+    .framerate = 30,
+    .profile   = 0
+};
+
+// All instances together.
+static uint64_t frames_sent = 0;
+static uint64_t bytes_sent = 0;
+
+void camera_set_callbacks(void *streamCb, void *context)
+{
+    default_camera.cb = (GadgetStreamCallback)streamCb;
+    default_camera.context = context;
+}
+
+void camera_set_port(int port)
+{
+    // Frames go straight to the callback, there is no socket.
+}
+
+void camera_set_parameters(int w, int h, int br, int fps, int pf)
+{
+    default_camera.width = w;
+    default_camera.height = h;
+    default_camera.bitrate = br;
+    default_camera.framerate = fps;
+    default_camera.profile = pf;
+}
+
+static
+int env_int(const char *name, int def)
+{
+    const char *val = getenv(name);
+    return (val && *val) ? atoi(val) : def;
+}
+
+static
+int load_stream(sim_camera *cam, const char *path)
+{
+    FILE *fp;
+    long len;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        printf("open %s error: %d\n", path, errno);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (len <= 0) {
+        printf("%s is empty\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    cam->stream = (uint8_t *)malloc(len);
+    if (!cam->stream || fread(cam->stream, 1, len, fp) != (size_t)len) {
+        printf("read %s error\n", path);
+        free(cam->stream);
+        cam->stream = NULL;
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    cam->stream_len = len;
+    cam->stream_off = 0;
+    return 0;
+}
+
+/* Offset of the next 00 00 01 start code at or after off, or len. */
+static
+size_t next_start(const uint8_t *buf, size_t len, size_t off)
+{
+    for (; off + 3 <= len; off++) {
+        if (buf[off] == 0 && buf[off + 1] == 0 && buf[off + 2] == 1)
+            return off;
+    }
+    return len;
+}
+
+/*
+ * Cut the next access unit out of the file: NAL units up to and including
+ * the first slice (types 1 and 5), so SPS/PPS/SEI travel with their frame.
+ */
+static
+int replay_frame(sim_camera *cam, uint8_t *out, int max)
+{
+    const uint8_t *stream = cam->stream;
+    size_t stream_len = cam->stream_len;
+    size_t begin, off, len;
+
+    if (cam->stream_off >= stream_len) {
+        if (!cam->stream_loop)
+            return 0;
+        cam->stream_off = 0;
+    }
+
+    begin = next_start(stream, stream_len, cam->stream_off);
+    if (begin == stream_len) {
+        cam->stream_off = stream_len;
+        return 0;
+    }
+
+    off = begin;
+    for (;;) {
+        size_t nal = next_start(stream, stream_len, off) + 3;
+        int type = nal < stream_len ? (stream[nal] & 0x1f) : 0;
+
+        off = nal < stream_len ? next_start(stream, stream_len, nal) : stream_len;
+        // Keep the leading zero of a 4-byte start code with the next NAL.
+        if (off < stream_len && stream[off - 1] == 0)
+            off--;
+
+        if (type == 1 || type == 5 || off >= stream_len)
+            break;
+    }
+
+    cam->stream_off = off;
+    len = off - begin;
+    if (len > (size_t)max)
+        len = max;
+
+    memcpy(out, stream + begin, len);
+    return (int)len;
+}
+
+static
+int put_nal(uint8_t *out, int type, int ref, int size)
+{
+    int i;
+
+    out[0] = 0;
+    out[1] = 0;
+    out[2] = 0;
+    out[3] = 1;
+    out[4] = (uint8_t)((ref << 5) | type);
+
+    // Payload without zero bytes, so it never contains a start code.
+    for (i = 5; i < size; i++)
+        out[i] = (uint8_t)(0x80 | ((i * 31) & 0x7f));
+
+    return size;
+}
+
+static
+int synth_frame(sim_camera *cam, uint8_t *out, int max, uint64_t index)
+{
+    int len = 0;
+    int size = cam->frame_size;
+    int gop = cam->gop;
+
+    if (size < 16)
+        size = 16;
+
+    if (index % gop == 0) {
+        len += put_nal(out + len, 7, 3, 16);    // SPS
+        len += put_nal(out + len, 8, 3, 8);     // PPS
+        size *= 4;                              // IDR slices are larger
+    }
+
+    if (len + size > max)
+        size = max - len;
+
+    len += put_nal(out + len, index % gop == 0 ? 5 : 1, 2, size);
+    return len;
+}
+
+static
+void put_bits7(uint8_t *out, uint64_t value, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++, value >>= 7)
+        out[i] = (uint8_t)(0x80 | (value & 0x7f));
+}
+
+static
+int put_stamp(uint8_t *out, uint64_t when, uint64_t index)
+{
+    uint8_t *p = out;
+
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 1;
+    *p++ = 6;                           // SEI
+    *p++ = 5;                           // user data unregistered
+    *p++ = SIM_STAMP_PAYLOAD_SIZE;
+    memcpy(p, SIM_STAMP_UUID, SIM_STAMP_UUID_SIZE);
+    p += SIM_STAMP_UUID_SIZE;
+    put_bits7(p, when, SIM_STAMP_TIME_SIZE);
+    p += SIM_STAMP_TIME_SIZE;
+    put_bits7(p, index, SIM_STAMP_INDEX_SIZE);
+    p += SIM_STAMP_INDEX_SIZE;
+    *p++ = 0x80;                        // rbsp trailing bits
+
+    return (int)(p - out);
+}
+
+static
+void next_tick(struct timespec *ts, long interval)
+{
+    ts->tv_nsec += interval;
+    while (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static
+void *camera_routine(void *argv)
+{
+    sim_camera *cam = (sim_camera *)argv;
+    uint8_t *frame = cam->frame;
+    struct timespec tick;
+    long interval = 1000000000L / (cam->framerate > 0 ? cam->framerate : 30);
+    uint64_t index = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+
+    while (__atomic_load_n(&cam->running, __ATOMIC_ACQUIRE)) {
+        struct timespec now;
+        int len = 0;
+        int au;
+
+        if (cam->stamp) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            len = put_stamp(frame, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec,
+                            index);
+        }
+
+        if (cam->stream)
+            au = replay_frame(cam, frame + len, SIM_MAX_FRAME - len);
+        else
+            au = synth_frame(cam, frame + len, SIM_MAX_FRAME - len, index);
+
+        if (au <= 0)
+            break;
+        len += au;
+
+        if (cam->cb)
+            cam->cb(frame, len, cam->context);
+
+        __atomic_add_fetch(&frames_sent, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bytes_sent, len, __ATOMIC_RELAXED);
+        index++;
+
+        // Absolute deadlines, a slow callback does not shift later frames.
+        next_tick(&tick, interval);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL) == EINTR)
+            ;
+    }
+
+    return NULL;
+}
+
+static
+int camera_start(sim_camera *cam)
+{
+    const char *path;
+    int rc;
+
+    if (cam->running)
+        return 0;
+
+    path = cam->source[0] ? cam->source : getenv("WDEMO_SIM_H264");
+    if (path && *path) {
+        if (load_stream(cam, path) < 0)
+            return -1;
+        cam->stream_loop = env_int("WDEMO_SIM_LOOP", 1) != 0;
+    }
+
+    // Instances follow their own parameters, the single camera the
+    // environment.
+    cam->frame_size = cam->bitrate / 8 / (cam->framerate > 0 ? cam->framerate : 30);
+    if (!cam->intra)
+        cam->frame_size = env_int("WDEMO_SIM_FRAME_SIZE", cam->frame_size);
+    if (cam->frame_size > SIM_MAX_FRAME / 8)
+        cam->frame_size = SIM_MAX_FRAME / 8;
+
+    cam->gop = cam->intra ? cam->intra : env_int("WDEMO_SIM_GOP", 10);
+    if (cam->gop <= 0)
+        cam->gop = 1;
+
+    cam->stamp = env_int("WDEMO_SIM_STAMP", 1) != 0;
+
+    printf("sim camera %s %dx%d@%d, %s\n", cam->name, cam->width, cam->height,
+           cam->framerate, cam->stream ? path : "synthetic stream");
+
+    cam->running = true;
+    rc = pthread_create(&cam->thread, NULL, camera_routine, cam);
+    if (rc != 0) {
+        printf("create camera thread error :%d\n", rc);
+        cam->running = false;
+        free(cam->stream);
+        cam->stream = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+void camera_stop(sim_camera *cam)
+{
+    if (!cam->running)
+        return;
+
+    __atomic_store_n(&cam->running, false, __ATOMIC_RELEASE);
+    pthread_join(cam->thread, NULL);
+
+    free(cam->stream);
+    cam->stream = NULL;
+    cam->stream_len = 0;
+}
+
+int camera_open(void)
+{
+    return camera_start(&default_camera);
+}
+
+void camera_close(void)
+{
+    camera_stop(&default_camera);
+}
+
+int camera_flip(void)
+{
+    if (!default_camera.running)
+        return camera_start(&default_camera);
+
+    camera_stop(&default_camera);
+    return 0;
+}
+
+void *cameras_open(const GadgetCameraParams *params, GadgetStreamCallback cb,
+                   void *context)
+{
+    sim_camera *cam;
+
+    cam = (sim_camera *)calloc(1, sizeof(*cam));
+    if (!cam)
+        return NULL;
+
+    snprintf(cam->name, sizeof(cam->name), "%s", params->name ? params->name : "camera");
+    cam->width     = params->width;
+    cam->height    = params->height;
+    cam->bitrate   = params->bitrate;
+    cam->framerate = params->framerate;
+    cam->profile   = params->profile;
+    cam->intra     = params->intra > 0 ? params->intra : 10;
+    cam->cb        = cb;
+    cam->context   = context;
+
+    // Drivers are loaded by wdemo builds of other ages.
+    if (params->size >= offsetof(GadgetCameraParams, source) + sizeof(params->source) &&
+        params->source)
+        snprintf(cam->source, sizeof(cam->source), "%s", params->source);
+
+    if (camera_start(cam) < 0) {
+        free(cam);
+        return NULL;
+    }
+
+    return cam;
+}
+
+int cameras_flip(void *camera, int on)
+{
+    sim_camera *cam = (sim_camera *)camera;
+
+    if (!cam)
+        return -1;
+
+    if (on)
+        return camera_start(cam);
+
+    camera_stop(cam);
+    return 0;
+}
+
+void cameras_close(void *camera)
+{
+    sim_camera *cam = (sim_camera *)camera;
+
+    if (!cam)
+        return;
+
+    camera_stop(cam);
+    free(cam);
+}
+
+uint64_t sim_camera_frames(void)
+{
+    return __atomic_load_n(&frames_sent, __ATOMIC_RELAXED);
+}
+
+uint64_t sim_camera_bytes(void)
+{
+    return __atomic_load_n(&bytes_sent, __ATOMIC_RELAXED);
+}
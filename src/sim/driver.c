@@ -0,0 +1,68 @@
+#include <stddef.h>
+
+#include "gadget_driver.h"
+
+int  matrix_open(void);
+int  matrix_flip(void);
+int  matrix_set_refresh(int hz);
+void matrix_close(void);
+
+void camera_set_callbacks(void *streamCb, void *context);
+void camera_set_port(int port);
+void camera_set_parameters(int w, int h, int br, int fps, int pf);
+int  camera_open(void);
+int  camera_flip(void);
+void camera_close(void);
+
+void *cameras_open(const GadgetCameraParams *params, GadgetStreamCallback cb,
+                   void *context);
+int   cameras_flip(void *camera, int on);
+void  cameras_close(void *camera);
+
+static
+void set_callbacks(GadgetStreamCallback cb, void *context)
+{
+    camera_set_callbacks((void *)cb, context);
+}
+
+static const char *const sim_gadgets[] = {
+    "torch",
+    "camera",
+    NULL
+};
+
+static const GadgetDriver sim_driver = {
+    .size    = sizeof(GadgetDriver),
+    .version = GADGET_DRIVER_VERSION,
+    .name    = "sim",
+
+    .matrix = {
+        .open  = matrix_open,
+        .flip  = matrix_flip,
+        .close = matrix_close
+    },
+
+    .camera = {
+        .set_callbacks  = set_callbacks,
+        .set_port       = camera_set_port,
+        .set_parameters = camera_set_parameters,
+        .open           = camera_open,
+        .flip           = camera_flip,
+        .close          = camera_close
+    },
+
+    .gadgets = sim_gadgets,
+
+    .matrix_set_refresh = matrix_set_refresh,
+
+    .cameras = {
+        .open  = cameras_open,
+        .flip  = cameras_flip,
+        .close = cameras_close
+    }
+};
+
+const GadgetDriver *gadget_driver_entry(void)
+{
+    return &sim_driver;
+}
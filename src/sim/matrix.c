@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sim.h"
+
+/*
+ * Simulated LED matrix: every state change is "drawn" into an in-memory
+ * history with the SPI frame the real matrix would receive. There is no
+ * multiplexing to emulate, so nothing runs between changes.
+ */
+static const uint8_t image_on[SIM_MATRIX_ROWS] = {
+    0x00, 0x66, 0xFF, 0xFF, 0xFF, 0x7E, 0x3C, 0x18
+};
+static const uint8_t image_off[SIM_MATRIX_ROWS] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static pthread_mutex_t matrix_lock = PTHREAD_MUTEX_INITIALIZER;
+static SimMatrixFrame history[SIM_MATRIX_HISTORY];
+static uint64_t count = 0;
+
+static bool matrix_on = false;
+static bool opened = false;
+static int refresh = 60;
+
+static
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called with matrix_lock held. */
+static
+void record(const uint8_t *image)
+{
+    SimMatrixFrame *frame = &history[count % SIM_MATRIX_HISTORY];
+    int j;
+
+    frame->stamp = now_ns();
+    for (j = 0; j < SIM_MATRIX_ROWS; j++) {
+        frame->spi[j][0] = ~image[j];
+        frame->spi[j][1] = 0xff;
+        frame->spi[j][2] = 0xff;
+        frame->spi[j][3] = 0x01 << j;
+    }
+    count++;
+}
+
+int matrix_open(void)
+{
+    pthread_mutex_lock(&matrix_lock);
+    if (!opened) {
+        opened = true;
+        record(matrix_on ? image_on : image_off);
+    }
+    pthread_mutex_unlock(&matrix_lock);
+
+    return 0;
+}
+
+int matrix_flip(void)
+{
+    pthread_mutex_lock(&matrix_lock);
+    matrix_on = !matrix_on;
+    if (opened)
+        record(matrix_on ? image_on : image_off);
+    pthread_mutex_unlock(&matrix_lock);
+
+    return 0;
+}
+
+int matrix_set_refresh(int hz)
+{
+    if (hz < 0 || hz > 1000)
+        return -1;
+
+    pthread_mutex_lock(&matrix_lock);
+    refresh = hz;
+    pthread_mutex_unlock(&matrix_lock);
+
+    return 0;
+}
+
+void matrix_close(void)
+{
+    pthread_mutex_lock(&matrix_lock);
+    if (opened) {
+        matrix_on = false;
+        opened = false;
+        record(image_off);
+    }
+    pthread_mutex_unlock(&matrix_lock);
+}
+
+uint64_t sim_matrix_count(void)
+{
+    uint64_t n;
+
+    pthread_mutex_lock(&matrix_lock);
+    n = count;
+    pthread_mutex_unlock(&matrix_lock);
+
+    return n;
+}
+
+int sim_matrix_frames(SimMatrixFrame *frames, int max)
+{
+    uint64_t first;
+    int n = 0;
+
+    if (!frames || max <= 0)
+        return 0;
+
+    pthread_mutex_lock(&matrix_lock);
+
+    first = count > SIM_MATRIX_HISTORY ? count - SIM_MATRIX_HISTORY : 0;
+    if (count - first > (uint64_t)max)
+        first = count - max;
+
+    for (; first < count; first++)
+        memcpy(&frames[n++], &history[first % SIM_MATRIX_HISTORY],
+               sizeof(SimMatrixFrame));
+
+    pthread_mutex_unlock(&matrix_lock);
+
+    return n;
+}
@@ -0,0 +1,94 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hardware-free gadget driver (libsim.so). It exports the same symbols as
+ * libraspi.so, plus the hooks below for benchmarks to inspect what the
+ * "hardware" was asked to do.
+ *
+ * The camera is configured through the environment, read when it starts:
+ *   WDEMO_SIM_H264        Annex-B H.264 file replayed one access unit per
+ *                         frame interval; synthetic NALs when unset.
+ *   WDEMO_SIM_LOOP        replay the file again at its end (default 1).
+ *   WDEMO_SIM_FRAME_SIZE  synthetic slice size in bytes (default
+ *                         bitrate / 8 / framerate).
+ *   WDEMO_SIM_GOP         frames per synthetic IDR (default 10).
+ * Camera instances (cameras_open) replay their own source if they have
+ * one, and size their synthetic frames and IDR interval by their bitrate,
+ * framerate and intra instead of WDEMO_SIM_FRAME_SIZE and WDEMO_SIM_GOP.
+ *   WDEMO_SIM_STAMP       prefix every access unit with a capture stamp
+ *                         (default 1).
+ */
+
+#define SIM_MATRIX_ROWS         8
+#define SIM_MATRIX_XFER_SIZE    4
+#define SIM_MATRIX_HISTORY      256
+
+/* One matrix redraw, exactly the SPI transfers libraspi would issue. */
+typedef struct SimMatrixFrame {
+    uint64_t stamp;     /* CLOCK_MONOTONIC, ns */
+    uint8_t  spi[SIM_MATRIX_ROWS][SIM_MATRIX_XFER_SIZE];
+} SimMatrixFrame;
+
+/* Redraws recorded since load, including those no longer in history. */
+uint64_t sim_matrix_count(void);
+
+/* Copies up to max of the most recent redraws, oldest first. */
+int sim_matrix_frames(SimMatrixFrame *frames, int max);
+
+/* Frames and bytes handed to the stream callbacks since load, all cameras. */
+uint64_t sim_camera_frames(void);
+uint64_t sim_camera_bytes(void);
+
+/*
+ * Capture stamp: an SEI NAL unit (user data unregistered) leading each
+ * access unit, with the CLOCK_MONOTONIC time in ns the frame was captured
+ * and its index. Numbers are stored 7 bits per byte, least significant
+ * first, with the top bit set, so the NAL never holds a start code and
+ * survives any packetization unchanged.
+ */
+#define SIM_STAMP_UUID          "wdemo-sim-stamp."
+#define SIM_STAMP_UUID_SIZE     16
+#define SIM_STAMP_TIME_SIZE     10
+#define SIM_STAMP_INDEX_SIZE    5
+#define SIM_STAMP_PAYLOAD_SIZE  (SIM_STAMP_UUID_SIZE + SIM_STAMP_TIME_SIZE + \
+                                 SIM_STAMP_INDEX_SIZE)
+/* NAL header, SEI type and size, payload, rbsp trailing bits. */
+#define SIM_STAMP_NAL_SIZE      (3 + SIM_STAMP_PAYLOAD_SIZE + 1)
+
+/* Stamp from a NAL unit starting at its header byte; 0 if it holds none. */
+static inline int sim_stamp_parse(const uint8_t *nal, int len,
+                                  uint64_t *stamp, uint32_t *index)
+{
+    const uint8_t *p = nal + 3 + SIM_STAMP_UUID_SIZE;
+    int i;
+
+    if (len < SIM_STAMP_NAL_SIZE || (nal[0] & 0x1f) != 6 || nal[1] != 5 ||
+        nal[2] != SIM_STAMP_PAYLOAD_SIZE ||
+        memcmp(nal + 3, SIM_STAMP_UUID, SIM_STAMP_UUID_SIZE) != 0)
+        return 0;
+
+    *stamp = 0;
+    for (i = 0; i < SIM_STAMP_TIME_SIZE; i++)
+        *stamp |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+
+    p += SIM_STAMP_TIME_SIZE;
+    *index = 0;
+    for (i = 0; i < SIM_STAMP_INDEX_SIZE; i++)
+        *index |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+
+    return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SIM_H__ */
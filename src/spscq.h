@@ -0,0 +1,71 @@
+#ifndef __SPSCQ_H__
+#define __SPSCQ_H__
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/*
+ * Bounded lock-free queue for exactly one producer thread and one
+ * consumer thread. Capacity is rounded up to a power of two.
+ */
+template <typename T>
+class CSpscQueue {
+public:
+    explicit CSpscQueue(size_t capacity): mHead(0), mTail(0) {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        mSlots.resize(size);
+        mMask = size - 1;
+    }
+
+public:
+    // Producer side; returns false when the queue is full.
+    bool push(const T &item) {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) > mMask)
+            return false;
+
+        mSlots[tail & mMask] = item;
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side; all @n items become visible to the consumer at once,
+    // or none when they don't fit.
+    bool push(const T *items, size_t n) {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail + n - mHead.load(std::memory_order_acquire) > mMask + 1)
+            return false;
+
+        for (size_t i = 0; i < n; i++)
+            mSlots[(tail + i) & mMask] = items[i];
+        mTail.store(tail + n, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; returns false when the queue is empty.
+    bool pop(T &item) {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire))
+            return false;
+
+        item = mSlots[head & mMask];
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty(void) const {
+        return mHead.load(std::memory_order_acquire) ==
+               mTail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> mSlots;
+    size_t mMask;
+    std::atomic<size_t> mHead;
+    std::atomic<size_t> mTail;
+};
+
+#endif /* __SPSCQ_H__ */
@@ -0,0 +1,374 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VLOG_MODULE VLOG_MOD_GADGET
+#include "vlog.h"
+#include "state.h"
+
+#define STATE_SLOTS_OFFSET  64
+
+static_assert(sizeof(StateFileHeader) <= STATE_SLOTS_OFFSET, "state header too large");
+
+static
+uint32_t crc32(const void *data, size_t len)
+{
+    static uint32_t table[256];
+    static bool ready = false;
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t crc = 0xffffffff;
+
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+            table[i] = c;
+        }
+        ready = true;
+    }
+
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc ^ 0xffffffff;
+}
+
+static
+uint32_t recordCrc(const StateRecord *rec)
+{
+    return crc32((const uint8_t *)rec + sizeof(rec->crc),
+                 sizeof(*rec) - sizeof(rec->crc));
+}
+
+static
+uint32_t headerCrc(const StateFileHeader *hdr)
+{
+    return crc32(hdr, offsetof(StateFileHeader, crc));
+}
+
+static
+bool validRecord(const StateRecord *rec)
+{
+    return rec->used && rec->kind < GadgetKindCount &&
+           rec->peer[WHISPER_MAX_ID_LEN] == '\0' && rec->crc == recordCrc(rec);
+}
+
+static
+size_t fileSize(uint32_t capacity)
+{
+    return STATE_SLOTS_OFFSET + sizeof(StateSlot) * capacity;
+}
+
+CStateFile::~CStateFile()
+{
+    if (mHeader) {
+        msync(mHeader, fileSize(mCapacity), MS_SYNC);
+        munmap(mHeader, fileSize(mCapacity));
+    }
+
+    if (mFd >= 0)
+        close(mFd);
+}
+
+bool CStateFile::open(const char *dataDir)
+{
+    std::string path = std::string(dataDir) + "/" + STATE_FILE_NAME;
+    struct stat st;
+    bool fresh;
+
+    // The whisper SDK creates datadir later, on its own first run.
+    if (mkdir(dataDir, 0700) < 0 && errno != EEXIST) {
+        vlogE("Create data directory %s error (%d)", dataDir, errno);
+        return false;
+    }
+
+    mFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (mFd < 0) {
+        vlogE("Open state file %s error (%d)", path.c_str(), errno);
+        return false;
+    }
+
+    if (fstat(mFd, &st) < 0) {
+        vlogE("Stat state file %s error (%d)", path.c_str(), errno);
+        return false;
+    }
+
+    // A crash while growing leaves the file longer than its header says.
+    fresh = (st.st_size < (off_t)fileSize(STATE_CAPACITY));
+    if (!fresh) {
+        StateFileHeader hdr;
+
+        if (pread(mFd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+            hdr.magic != STATE_FILE_MAGIC ||
+            hdr.version != STATE_FILE_VERSION ||
+            hdr.slotSize != sizeof(StateSlot) ||
+            hdr.capacity < STATE_CAPACITY || hdr.capacity > STATE_CAPACITY_MAX ||
+            st.st_size < (off_t)fileSize(hdr.capacity) ||
+            hdr.crc != headerCrc(&hdr)) {
+            vlogW("State file %s unusable, starting cold", path.c_str());
+            fresh = true;
+        } else {
+            mCapacity = hdr.capacity;
+        }
+    }
+
+    if (fresh) {
+        mCapacity = STATE_CAPACITY;
+        if (ftruncate(mFd, 0) < 0 || ftruncate(mFd, fileSize(mCapacity)) < 0) {
+            vlogE("Resize state file %s error (%d)", path.c_str(), errno);
+            return false;
+        }
+    }
+
+    if (!map(fileSize(mCapacity))) {
+        vlogE("Map state file %s error (%d)", path.c_str(), errno);
+        return false;
+    }
+
+    if (fresh) {
+        mHeader->magic = STATE_FILE_MAGIC;
+        mHeader->version = STATE_FILE_VERSION;
+        mHeader->slotSize = sizeof(StateSlot);
+        mHeader->capacity = mCapacity;
+        mHeader->crc = headerCrc(mHeader);
+        msync(mHeader, fileSize(mCapacity), MS_SYNC);
+        return true;
+    }
+
+    for (uint32_t i = 0; i < mCapacity; i++) {
+        const StateRecord *rec = latest(i);
+        if (!rec)
+            continue;
+
+        mIndex[key(rec->peer, (GadgetKind)rec->kind)] = i;
+        mUsed = i + 1;
+    }
+
+    // Slots never stored in or cleared before the last run ended.
+    for (uint32_t i = mUsed; i-- > 0; ) {
+        if (!latest(i)) {
+            memset(&mSlots[i], 0, sizeof(StateSlot));
+            mFree.push_back(i);
+        }
+    }
+
+    vlogI("State file %s loaded, %zu gadget values", path.c_str(), mIndex.size());
+    return true;
+}
+
+bool CStateFile::map(size_t size)
+{
+    void *addr;
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (addr == MAP_FAILED)
+        return false;
+
+    mHeader = (StateFileHeader *)addr;
+    mSlots = (StateSlot *)((uint8_t *)addr + STATE_SLOTS_OFFSET);
+    return true;
+}
+
+bool CStateFile::grow(void)
+{
+    uint32_t capacity = mCapacity * 2;
+
+    if (capacity > STATE_CAPACITY_MAX)
+        return false;
+
+    // The new slots read as zeroes, i.e. unused, before the header
+    // admits them.
+    if (ftruncate(mFd, fileSize(capacity)) < 0) {
+        vlogE("Grow state file error (%d)", errno);
+        return false;
+    }
+
+    msync(mHeader, fileSize(mCapacity), MS_SYNC);
+    munmap(mHeader, fileSize(mCapacity));
+    mHeader = NULL;
+    mSlots = NULL;
+
+    if (!map(fileSize(capacity))) {
+        vlogE("Map state file error (%d)", errno);
+        return false;
+    }
+
+    mCapacity = capacity;
+    mHeader->capacity = mCapacity;
+    mHeader->crc = headerCrc(mHeader);
+    msync(mHeader, STATE_SLOTS_OFFSET, MS_SYNC);
+
+    vlogI("State file grown to %u slots", mCapacity);
+    return true;
+}
+
+std::string CStateFile::key(const char *peerId, GadgetKind kind)
+{
+    std::string k(peerId ? peerId : "");
+
+    k += '/';
+    k += gadgetName(kind);
+    return k;
+}
+
+const StateRecord *CStateFile::latest(int slot) const
+{
+    const StateRecord *a, *b;
+
+    if (!mSlots || slot < 0 || (uint32_t)slot >= mCapacity)
+        return NULL;
+
+    a = &mSlots[slot].copy[0];
+    b = &mSlots[slot].copy[1];
+
+    if (!validRecord(a))
+        return validRecord(b) ? b : NULL;
+    if (!validRecord(b))
+        return a;
+
+    return (int32_t)(b->seq - a->seq) > 0 ? b : a;
+}
+
+int CStateFile::slot(const char *peerId, GadgetKind kind)
+{
+    if (!mSlots)
+        return -1;
+
+    std::string k = key(peerId, kind);
+    auto it = mIndex.find(k);
+    if (it != mIndex.end())
+        return it->second;
+
+    if (peerId && strlen(peerId) > WHISPER_MAX_ID_LEN)
+        return -1;
+
+    if (mFree.empty() && mUsed >= mCapacity && !grow()) {
+        vlogLimitW("State file full, %s not persisted", k.c_str());
+        return -1;
+    }
+
+    // Claimed for good only once a value is stored in it.
+    int slot;
+    if (!mFree.empty()) {
+        slot = mFree.back();
+        mFree.pop_back();
+    } else {
+        slot = mUsed++;
+    }
+    memset(&mSlots[slot], 0, sizeof(StateSlot));
+    mSlots[slot].copy[0].kind = kind;
+    strcpy(mSlots[slot].copy[0].peer, peerId ? peerId : "");
+
+    mIndex[k] = slot;
+    return slot;
+}
+
+void CStateFile::release(const char *peerId)
+{
+    if (!mSlots || !peerId)
+        return;
+
+    for (int kind = 0; kind < GadgetKindCount; kind++) {
+        auto it = mIndex.find(key(peerId, (GadgetKind)kind));
+        if (it == mIndex.end())
+            continue;
+
+        StateSlot *slot = &mSlots[it->second];
+        memset(slot, 0, sizeof(*slot));
+
+        uintptr_t page = (uintptr_t)slot & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+        msync((void *)page, (uintptr_t)(slot + 1) - page, MS_ASYNC);
+
+        mFree.push_back(it->second);
+        mIndex.erase(it);
+    }
+}
+
+bool CStateFile::load(int slot, GadgetValue &value, uint64_t *stamp) const
+{
+    const StateRecord *rec = latest(slot);
+    if (!rec)
+        return false;
+
+    switch(rec->type) {
+    case Int:
+        value = GadgetValue((int)rec->value);
+        break;
+    case Bool:
+        value = GadgetValue(rec->value != 0);
+        break;
+    case Float: {
+        float f;
+        memcpy(&f, &rec->value, sizeof(f));
+        value = GadgetValue(f);
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (stamp)
+        *stamp = rec->stamp;
+    return true;
+}
+
+void CStateFile::store(int slot, const GadgetValue &value)
+{
+    const StateRecord *last;
+    StateRecord *rec;
+    StateRecord *kept;
+
+    if (!mSlots || slot < 0 || (uint32_t)slot >= mCapacity)
+        return;
+
+    // Key fields live in copy[0] until the slot's first store.
+    last = latest(slot);
+    kept = &mSlots[slot].copy[0];
+    if (!last || last == kept)
+        rec = &mSlots[slot].copy[1];
+    else
+        rec = kept;
+
+    if (!last)
+        last = kept;
+
+    StateRecord next;
+    memset(&next, 0, sizeof(next));
+    next.seq = last->used ? last->seq + 1 : 1;
+    next.stamp = (uint64_t)time(NULL);
+    next.kind = last->kind;
+    next.type = value.type();
+    next.used = 1;
+    memcpy(next.peer, last->peer, sizeof(next.peer));
+
+    switch(value.type()) {
+    case Int:
+        next.value = (uint32_t)value.iValue();
+        break;
+    case Bool:
+        next.value = value.bValue() ? 1 : 0;
+        break;
+    case Float: {
+        float f = value.fValue();
+        memcpy(&next.value, &f, sizeof(f));
+        break;
+    }
+    default:
+        return;
+    }
+    next.crc = recordCrc(&next);
+
+    memcpy(rec, &next, sizeof(next));
+
+    // Let the kernel write the page back soon; the process may die at
+    // any time, the page cache keeps what is already in the mapping.
+    uintptr_t page = (uintptr_t)rec & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+    msync((void *)page, (uintptr_t)(rec + 1) - page, MS_ASYNC);
+}
@@ -0,0 +1,104 @@
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <whisper.h>
+#include "gadget.h"
+
+/*
+ * Gadget values persisted across restarts in <datadir>/gadgets.state.
+ *
+ * The file is an array of slots mapped into memory, one per local gadget
+ * or (peer, gadget) pair, and is updated in place whenever a value
+ * changes. Slots of removed peers are cleared and reused; when none is
+ * left the file doubles, up to STATE_CAPACITY_MAX slots. Each slot holds two copies of its record, each with a CRC and
+ * a sequence number; a write always goes to the older copy, so a crash in
+ * the middle of it leaves the other copy intact and the newest copy with a
+ * valid CRC wins on load.
+ */
+#define STATE_FILE_NAME     "gadgets.state"
+#define STATE_FILE_MAGIC    0x54534457  /* "WDST" */
+#define STATE_FILE_VERSION  1
+#define STATE_CAPACITY      1024
+#define STATE_CAPACITY_MAX  65536
+
+struct StateRecord {
+    uint32_t crc;       // over the rest of the record
+    uint32_t seq;
+    uint64_t stamp;     // wall clock seconds of the last update
+    uint8_t  kind;
+    uint8_t  type;
+    uint8_t  used;
+    uint8_t  reserved;
+    uint32_t value;     // raw GadgetValue bits
+    char     peer[WHISPER_MAX_ID_LEN + 1];   // empty for local gadgets
+};
+
+struct StateSlot {
+    StateRecord copy[2];
+};
+
+struct StateFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slotSize;
+    uint32_t capacity;
+    uint32_t crc;       // over the header fields above
+};
+
+class CStateFile {
+public:
+    CStateFile(): mFd(-1), mHeader(NULL), mSlots(NULL), mCapacity(0), mUsed(0) {}
+    ~CStateFile();
+
+public:
+    bool open(const char *dataDir);
+
+    // Slot of a local (peerId NULL) or peer gadget, allocated on first
+    // use; -1 when the file is full or not open.
+    int slot(const char *peerId, GadgetKind kind);
+
+    // Clear the slots of a removed peer for reuse.
+    void release(const char *peerId);
+
+    // Last stored value of a slot and its wall clock time.
+    bool load(int slot, GadgetValue &value, uint64_t *stamp = NULL) const;
+    void store(int slot, const GadgetValue &value);
+
+    // Calls fn(kind, value, stamp) for every stored gadget of a peer.
+    template <typename Fn>
+    void forEach(const char *peerId, Fn fn) const {
+        for (uint32_t i = 0; i < mUsed; i++) {
+            const StateRecord *rec = latest(i);
+            GadgetValue value;
+            uint64_t stamp;
+
+            if (!rec || strcmp(rec->peer, peerId ? peerId : "") != 0)
+                continue;
+            if (load(i, value, &stamp))
+                fn((GadgetKind)rec->kind, value, stamp);
+        }
+    }
+
+private:
+    bool map(size_t size);
+    bool grow(void);
+    const StateRecord *latest(int slot) const;
+    static std::string key(const char *peerId, GadgetKind kind);
+
+private:
+    int mFd;
+    StateFileHeader *mHeader;
+    StateSlot *mSlots;
+    uint32_t mCapacity;
+    uint32_t mUsed;     // slots at and past this one were never used
+    std::vector<int> mFree;
+    std::unordered_map<std::string, int> mIndex;
+};
+
+#endif /* __STATE_H__ */
@@ -0,0 +1,327 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "vlog.h"
+#include "trace.h"
+
+#ifdef WDEMO_TRACE
+
+const int TRACE_RING_SZ = 8192;     // spans kept per thread, power of two
+const int TRACE_DEPTH   = 16;       // open spans tracked per thread
+
+struct TraceEvent {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> dur;
+    std::atomic<uint32_t> tid;
+};
+
+/*
+ * Spans of one thread. The owner is the only writer; a dump reads it
+ * concurrently, seqlock style: head is bumped before a slot is reused and
+ * done after it is filled, so the reader can tell which slots it copied
+ * may have been torn.
+ */
+struct TraceRing {
+    TraceRing(): head(0), done(0), depth(0), tid(0), owned(true), next(NULL) {
+        memset(threadName, 0, sizeof(threadName));
+    }
+
+    TraceEvent events[TRACE_RING_SZ];
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> done;
+
+    // Spans entered but not left yet, innermost last.
+    std::atomic<const char*> openName[TRACE_DEPTH];
+    std::atomic<uint64_t> openStart[TRACE_DEPTH];
+    std::atomic<int> depth;
+
+    // Owner, guarded by ringLock.
+    uint32_t tid;
+    char threadName[16];
+    bool owned;
+
+    TraceRing *next;
+};
+
+static std::mutex ringLock;
+static TraceRing *rings = NULL;
+
+static sem_t dumpSem;
+static pthread_t dumpThread;
+static std::atomic<bool> dumpRunning(false);
+static std::atomic<bool> dumpStopping(false);
+static std::string dumpDir;
+static struct sigaction oldAction;
+
+static
+TraceRing *acquireRing(void)
+{
+    std::lock_guard<std::mutex> lock(ringLock);
+    TraceRing *ring;
+
+    // Reuse the ring of an exited thread first; its spans carry their tid.
+    for (ring = rings; ring; ring = ring->next) {
+        if (!ring->owned)
+            break;
+    }
+
+    if (!ring) {
+        ring = new TraceRing();
+        ring->next = rings;
+        rings = ring;
+    }
+
+    ring->owned = true;
+    ring->tid = (uint32_t)syscall(SYS_gettid);
+    ring->depth.store(0, std::memory_order_relaxed);
+    if (pthread_getname_np(pthread_self(), ring->threadName, sizeof(ring->threadName)) != 0)
+        ring->threadName[0] = 0;
+
+    return ring;
+}
+
+class TraceRingHolder {
+public:
+    TraceRingHolder(): mRing(NULL) {}
+    ~TraceRingHolder() {
+        if (mRing) {
+            std::lock_guard<std::mutex> lock(ringLock);
+            mRing->owned = false;
+        }
+    }
+
+    TraceRing *ring(void) {
+        if (!mRing)
+            mRing = acquireRing();
+        return mRing;
+    }
+
+private:
+    TraceRing *mRing;
+};
+
+static thread_local TraceRingHolder ringHolder;
+
+void traceEnter(const char *name, uint64_t start)
+{
+    TraceRing *ring = ringHolder.ring();
+    int depth = ring->depth.load(std::memory_order_relaxed);
+
+    if (depth < TRACE_DEPTH) {
+        ring->openName[depth].store(name, std::memory_order_relaxed);
+        ring->openStart[depth].store(start, std::memory_order_relaxed);
+    }
+    ring->depth.store(depth + 1, std::memory_order_release);
+}
+
+void traceLeave(const char *name, uint64_t start, uint64_t end)
+{
+    TraceRing *ring = ringHolder.ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceEvent &ev = ring->events[head & (TRACE_RING_SZ - 1)];
+
+    ring->depth.store(ring->depth.load(std::memory_order_relaxed) - 1,
+                      std::memory_order_release);
+
+    ring->head.store(head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    ev.name.store(name, std::memory_order_relaxed);
+    ev.start.store(start, std::memory_order_relaxed);
+    ev.dur.store(end - start, std::memory_order_relaxed);
+    ev.tid.store(ring->tid, std::memory_order_relaxed);
+
+    ring->done.store(head + 1, std::memory_order_release);
+}
+
+static
+void dumpRing(FILE *fp, TraceRing *ring, int pid, bool &first)
+{
+    static TraceEvent copy[TRACE_RING_SZ];
+    uint64_t done = ring->done.load(std::memory_order_acquire);
+    uint64_t from = done > TRACE_RING_SZ ? done - TRACE_RING_SZ : 0;
+    uint64_t i;
+
+    for (i = from; i < done; i++) {
+        TraceEvent &ev = ring->events[i & (TRACE_RING_SZ - 1)];
+        TraceEvent &cp = copy[i & (TRACE_RING_SZ - 1)];
+
+        cp.name.store(ev.name.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        cp.start.store(ev.start.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        cp.dur.store(ev.dur.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        cp.tid.store(ev.tid.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    // Slots the owner started to reuse meanwhile may be torn, skip them.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head > TRACE_RING_SZ && head - TRACE_RING_SZ > from)
+        from = head - TRACE_RING_SZ;
+
+    for (i = from; i < done; i++) {
+        TraceEvent &cp = copy[i & (TRACE_RING_SZ - 1)];
+
+        fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"wdemo\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                first ? "" : ",\n",
+                cp.name.load(std::memory_order_relaxed),
+                cp.start.load(std::memory_order_relaxed) / 1000.0,
+                cp.dur.load(std::memory_order_relaxed) / 1000.0,
+                pid, cp.tid.load(std::memory_order_relaxed));
+        first = false;
+    }
+
+    // Spans still open end with the trace; a stuck callback is one of them.
+    int depth = ring->depth.load(std::memory_order_acquire);
+    if (depth > TRACE_DEPTH)
+        depth = TRACE_DEPTH;
+
+    for (int d = 0; d < depth; d++) {
+        fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"wdemo\",\"ph\":\"B\","
+                "\"ts\":%.3f,\"pid\":%d,\"tid\":%u}",
+                first ? "" : ",\n",
+                ring->openName[d].load(std::memory_order_relaxed),
+                ring->openStart[d].load(std::memory_order_relaxed) / 1000.0,
+                pid, ring->tid);
+        first = false;
+    }
+
+    if (ring->owned) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pid, ring->tid, ring->threadName);
+        first = false;
+    }
+}
+
+static
+void dumpTrace(void)
+{
+    static unsigned seq = 0;
+    int pid = (int)getpid();
+    char path[512];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/trace-%d-%u.json", dumpDir.c_str(), pid, seq++);
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        vlogE("Open trace file %s error (%d)", path, errno);
+        return;
+    }
+
+    bool first = true;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    {
+        std::lock_guard<std::mutex> lock(ringLock);
+        for (TraceRing *ring = rings; ring; ring = ring->next)
+            dumpRing(fp, ring, pid, first);
+    }
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0)
+        vlogE("Write trace file %s error (%d)", path, errno);
+    else
+        vlogI("Trace written to %s", path);
+}
+
+static
+void *dumpRoutine(void *argv)
+{
+    while (true) {
+        if (sem_wait(&dumpSem) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (dumpStopping.load())
+            break;
+
+        dumpTrace();
+    }
+    return NULL;
+}
+
+static
+void onDumpSignal(int signo)
+{
+    traceRequestDump();
+}
+
+bool traceStart(const char *dir)
+{
+    struct sigaction sa;
+    int rc;
+
+    dumpDir = dir;
+
+    if (sem_init(&dumpSem, 0, 0) < 0) {
+        vlogE("Setup trace dump error (%d)", errno);
+        return false;
+    }
+
+    rc = pthread_create(&dumpThread, NULL, dumpRoutine, NULL);
+    if (rc != 0) {
+        vlogE("Create trace dump thread error (%d)", rc);
+        sem_destroy(&dumpSem);
+        return false;
+    }
+    dumpRunning.store(true);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onDumpSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, &oldAction);
+
+    vlogI("Tracing enabled, kill -USR2 %d or \"trace\" dumps to %s", (int)getpid(), dir);
+    return true;
+}
+
+void traceStop(void)
+{
+    if (!dumpRunning.exchange(false))
+        return;
+
+    sigaction(SIGUSR2, &oldAction, NULL);
+
+    dumpStopping.store(true);
+    sem_post(&dumpSem);
+    pthread_join(dumpThread, NULL);
+    sem_destroy(&dumpSem);
+}
+
+void traceRequestDump(void)
+{
+    if (dumpRunning.load())
+        sem_post(&dumpSem);
+}
+
+#else
+
+bool traceStart(const char *dir)
+{
+    return true;
+}
+
+void traceStop(void)
+{
+}
+
+void traceRequestDump(void)
+{
+}
+
+#endif
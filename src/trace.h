@@ -0,0 +1,53 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <cstdint>
+
+#include "probe.h"
+
+/*
+ * Scoped trace spans. In builds defining WDEMO_TRACE (cmake
+ * -DENABLE_TRACE=ON) TRACE() records the enclosing scope into a ring of
+ * recent spans kept by each thread; elsewhere it compiles to nothing.
+ *
+ * A dump writes the rings as Chrome trace event JSON (chrome://tracing,
+ * ui.perfetto.dev), spans still open included, so a stalled callback
+ * shows up as the one that never ended. Dumps are written by a thread of
+ * their own and can be asked for with SIGUSR2 or the "trace" console
+ * command, even while the whisper thread is stuck.
+ */
+
+// Start the dump thread, dumps go to @dir; harmless without WDEMO_TRACE.
+bool traceStart(const char *dir);
+void traceStop(void);
+
+// Ask for a dump; async-signal-safe.
+void traceRequestDump(void);
+
+#ifdef WDEMO_TRACE
+
+void traceEnter(const char *name, uint64_t start);
+void traceLeave(const char *name, uint64_t start, uint64_t end);
+
+class CTraceSpan {
+public:
+    explicit CTraceSpan(const char *name): mName(name), mStart(probeClock()) {
+        traceEnter(mName, mStart);
+    }
+    ~CTraceSpan() { traceLeave(mName, mStart, probeClock()); }
+
+private:
+    const char *mName;
+    uint64_t mStart;
+};
+
+// @name must be a string literal.
+#define TRACE(name) CTraceSpan __span(name)
+
+#else
+
+#define TRACE(name) do {} while(0)
+
+#endif
+
+#endif /* __TRACE_H__ */
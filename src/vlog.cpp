@@ -1,13 +1,36 @@
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <algorithm>
+
+#include "spscq.h"
+#include "logfmt.h"
 #include "vlog.h"
+#include "metrics.h"
 
 #define TIME_FORMAT     "%Y-%m-%d %H:%M:%S"
 
-int logLevel = VLOG_INFO;
+#define VLOG_LEVEL_INIT(id, name) VLOG_INFO,
+int logLevels[VLOG_MOD_COUNT] = {
+    VLOG_MODULE_LIST(VLOG_LEVEL_INIT)
+};
+#undef VLOG_LEVEL_INIT
+
+#define VLOG_MODULE_NAME(id, name) name,
+static const char *module_names[VLOG_MOD_COUNT] = {
+    VLOG_MODULE_LIST(VLOG_MODULE_NAME)
+};
+#undef VLOG_MODULE_NAME
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -18,43 +41,893 @@ static const char* level_names[] = {
     "DEBUG"
 };
 
-void eclogv(int level, const char *format, va_list args)
+/*
+ * Asynchronous logging.
+ *
+ * Each producer thread owns a lock-free ring of fixed-size records. The
+ * record is formatted on the producer (no locks, no I/O), and a single
+ * writer thread drains every ring, orders the batch by time, prefixes
+ * the timestamp (re-rendered only when the second changes) and writes
+ * it with one fwrite/fflush. Until logAsyncStart() is called, and after
+ * logAsyncStop(), messages are written synchronously as before.
+ *
+ * A text message longer than one record continues in the records right
+ * after it, pushed and numbered together so the writer always gets the
+ * whole chain; messages are cut at LOG_TEXT_MAX bytes, as on the
+ * synchronous path.
+ *
+ * In binary mode the producer doesn't format at all: it copies the raw
+ * arguments of a registered call site into the record and the writer
+ * appends it to the binary log (see logfmt.h).
+ */
+const int LOG_RECORD_SZ = 256;
+const int LOG_RING_SZ   = 1024;
+const int LOG_BATCH_SZ  = 1024;
+const int LOG_IDLE_MS   = 200;
+const int LOG_MAX_SITES = 4096;
+const int LOG_ROTATE_KEEP = 3;
+const int LOG_TEXT_MAX  = 1024;
+
+enum {
+    RecordText = 0,
+    RecordBinary
+};
+
+struct LogRecord {
+    uint64_t seq;
+    uint64_t stamp;     // CLOCK_MONOTONIC ns
+    uint32_t site;      // text: number of continuation records that follow
+    uint16_t len;
+    uint8_t  level;
+    uint8_t  kind;
+    char     msg[LOG_RECORD_SZ - 24];
+};
+
+// Records one text message takes at most.
+const int LOG_TEXT_RECORDS = (LOG_TEXT_MAX + sizeof(LogRecord::msg) - 1) /
+                             sizeof(LogRecord::msg);
+
+struct LogRing {
+    LogRing(): queue(LOG_RING_SZ), dropped(0), owned(true), next(NULL) {}
+
+    CSpscQueue<LogRecord> queue;
+    std::atomic<unsigned> dropped;
+    std::atomic<bool> owned;
+    LogRing *next;
+};
+
+struct LogSiteEntry {
+    const LogSite *site;
+    char sig[LOG_MAX_ARGS + 1];
+    uint16_t reserve;   // packed size of everything but string bytes
+};
+
+static std::atomic<LogRing*> rings(NULL);
+static std::atomic<uint64_t> logSeq(0);
+static std::atomic<bool> asyncRunning(false);
+static std::atomic<bool> writerSleeping(false);
+static std::atomic<bool> binaryMode(false);
+static pthread_t writerThread;
+static sem_t writerSem;
+
+static LogSiteEntry sites[LOG_MAX_SITES];
+static int siteCount = 0;
+
+static int consoleLevel = VLOG_INFO;
+static uint8_t siteDefined[LOG_MAX_SITES];
+
+static uint64_t anchorRealtime;
+static uint64_t anchorMonotonic;
+
+static
+uint64_t clockNs(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+LogRing *acquireRing(void)
+{
+    LogRing *ring;
+
+    // Reuse a drained ring left behind by an exited thread first.
+    for (ring = rings.load(); ring; ring = ring->next) {
+        bool expected = false;
+        if (!ring->queue.empty() ||
+            !ring->owned.compare_exchange_strong(expected, true))
+            continue;
+        if (ring->queue.empty())
+            return ring;
+        ring->owned.store(false);
+    }
+
+    ring = new LogRing();
+    ring->next = rings.load();
+    while (!rings.compare_exchange_weak(ring->next, ring))
+        ;
+    return ring;
+}
+
+class LogRingHolder {
+public:
+    LogRingHolder(): mRing(NULL) {}
+    ~LogRingHolder() {
+        if (mRing)
+            mRing->owned.store(false);
+    }
+
+    LogRing *ring(void) {
+        if (!mRing)
+            mRing = acquireRing();
+        return mRing;
+    }
+
+private:
+    LogRing *mRing;
+};
+
+static thread_local LogRingHolder ringHolder;
+
+static
+void writeSync(int level, const char *msg)
+{
+    char timestr[20];
+    time_t cur = time(NULL);
+    struct tm tm;
+
+    strftime(timestr, 20, TIME_FORMAT, localtime_r(&cur, &tm));
+
+    pthread_mutex_lock(&lock);
+    fprintf(stderr, "%s - %-7s : %s\n", timestr, level_names[level], msg);
+    fflush(stderr);
+    pthread_mutex_unlock(&lock);
+}
+
+static
+bool recordLess(const LogRecord &a, const LogRecord &b)
+{
+    return a.seq < b.seq;
+}
+
+/*
+ * Output buffers of the writer thread. Only the writer thread (or
+ * logAsyncStop once it has exited) touches them.
+ */
+static char consoleBuf[LOG_BATCH_SZ * 64];
+static size_t consoleOff = 0;
+static char fileBuf[LOG_BATCH_SZ * 64];
+static size_t fileOff = 0;
+
+/*
+ * The log file, text or binary. It is rotated by the writer thread once
+ * it grows over maxSize bytes or gets older than maxAge seconds; path.1
+ * is the newest rotated file and path.<keep> the oldest one kept.
+ */
+struct LogSink {
+    FILE *fp;
+    char path[256];
+    bool binary;
+    size_t size;
+    time_t opened;
+
+    size_t maxSize;
+    int maxAge;
+    int keep;
+};
+
+static LogSink sink = { NULL, { 0 }, false, 0, 0, 0, 0, LOG_ROTATE_KEEP };
+
+static
+void consoleFlush(void)
+{
+    if (consoleOff) {
+        fwrite(consoleBuf, 1, consoleOff, stderr);
+        fflush(stderr);
+        consoleOff = 0;
+    }
+}
+
+static
+void fileFlush(void)
+{
+    if (fileOff) {
+        fwrite(fileBuf, 1, fileOff, sink.fp);
+        fflush(sink.fp);
+        sink.size += fileOff;
+        fileOff = 0;
+    }
+}
+
+static
+void fileAppend(const void *data, size_t len)
+{
+    if (fileOff + len > sizeof(fileBuf))
+        fileFlush();
+
+    memcpy(fileBuf + fileOff, data, len);
+    fileOff += len;
+}
+
+static
+int textRender(char *buf, size_t size, uint64_t stamp, int level,
+               const char *msg, int len)
+{
+    static time_t cachedSec = 0;
+    static char cachedTime[20];
+
+    time_t sec = (time_t)((anchorRealtime + (stamp - anchorMonotonic)) / 1000000000ULL);
+    if (sec != cachedSec) {
+        struct tm tm;
+        cachedSec = sec;
+        strftime(cachedTime, sizeof(cachedTime), TIME_FORMAT,
+                 localtime_r(&cachedSec, &tm));
+    }
+
+    int rc = snprintf(buf, size, "%s - %-7s : %.*s\n",
+                      cachedTime, level_names[level], len, msg);
+    return std::min<int>(rc, size - 1);
+}
+
+static
+void textAppend(uint64_t stamp, int level, const char *msg, int len, bool echo)
+{
+    char line[LOG_RECORD_SZ * 4 + 64];
+    int n = textRender(line, sizeof(line), stamp, level, msg, len);
+
+    if (sink.fp && !sink.binary)
+        fileAppend(line, n);
+
+    if (echo) {
+        if (consoleOff + n > sizeof(consoleBuf))
+            consoleFlush();
+        memcpy(consoleBuf + consoleOff, line, n);
+        consoleOff += n;
+    }
+}
+
+static
+void binAppend(uint8_t kind, uint8_t level, const void *head, size_t headLen,
+               const void *body, size_t bodyLen)
+{
+    LogFrameHeader frame;
+
+    frame.kind  = kind;
+    frame.level = level;
+    frame.len   = (uint16_t)(headLen + bodyLen);
+
+    if (fileOff + sizeof(frame) + headLen + bodyLen > sizeof(fileBuf))
+        fileFlush();
+
+    fileAppend(&frame, sizeof(frame));
+    fileAppend(head, headLen);
+    if (bodyLen)
+        fileAppend(body, bodyLen);
+}
+
+/*
+ * Write the record at @r, with the continuation records of a long text
+ * message; returns the number of records written.
+ */
+static
+size_t writeRecord(const LogRecord *recs)
+{
+    const LogRecord &r = recs[0];
+    bool binary = sink.fp && sink.binary;
+    bool echo = !sink.fp || r.level <= consoleLevel;
+
+    if (r.kind == RecordText) {
+        char text[LOG_TEXT_MAX];
+        const char *msg = r.msg;
+        size_t len = r.len;
+
+        if (r.site) {
+            len = 0;
+            for (uint32_t i = 0; i <= r.site; i++) {
+                memcpy(text + len, recs[i].msg, recs[i].len);
+                len += recs[i].len;
+            }
+            msg = text;
+        }
+
+        if (binary)
+            binAppend(LogFrameText, r.level, &r.stamp, sizeof(r.stamp), msg, len);
+        if (!binary || echo)
+            textAppend(r.stamp, r.level, msg, (int)len, echo);
+        return 1 + r.site;
+    }
+
+    const LogSite *site = sites[r.site].site;
+
+    if (binary) {
+        if (!siteDefined[r.site]) {
+            binAppend(LogFrameFormat, site->level, &r.site, sizeof(r.site),
+                      site->format, std::min<size_t>(strlen(site->format), 0xfff0));
+            siteDefined[r.site] = 1;
+        }
+
+        char head[12];
+        memcpy(head, &r.site, 4);
+        memcpy(head + 4, &r.stamp, 8);
+        binAppend(LogFrameRecord, r.level, head, sizeof(head), r.msg, r.len);
+    }
+
+    if (echo) {
+        char text[1024];
+        int len = logFormatArgs(site->format, (const uint8_t *)r.msg, r.len,
+                                text, sizeof(text));
+        if (len >= 0)
+            textAppend(r.stamp, r.level, text, len, true);
+    }
+    return 1;
+}
+
+static
+bool sinkOpen(void)
+{
+    sink.fp = fopen(sink.path, sink.binary ? "ab" : "a");
+    if (!sink.fp)
+        return false;
+
+    fseek(sink.fp, 0, SEEK_END);
+    sink.size = (size_t)ftell(sink.fp);
+    sink.opened = time(NULL);
+
+    if (sink.binary) {
+        LogFileHeader header;
+
+        header.magic     = LOG_FILE_MAGIC;
+        header.version   = LOG_FILE_VERSION;
+        header.reserved  = 0;
+        header.realtime  = clockNs(CLOCK_REALTIME);
+        header.monotonic = clockNs(CLOCK_MONOTONIC);
+
+        if (fwrite(&header, sizeof(header), 1, sink.fp) != 1) {
+            fclose(sink.fp);
+            sink.fp = NULL;
+            return false;
+        }
+        sink.size += sizeof(header);
+
+        // Every file has to be decodable on its own.
+        memset(siteDefined, 0, sizeof(siteDefined));
+    }
+
+    return true;
+}
+
+static
+void sinkRotate(void)
+{
+    char from[sizeof(sink.path) + 12];   // ".%d" of any int fits
+    char to[sizeof(sink.path) + 12];
+
+    if (!sink.fp)
+        return;
+
+    if (!((sink.maxSize && sink.size >= sink.maxSize) ||
+          (sink.maxAge && time(NULL) - sink.opened >= sink.maxAge)))
+        return;
+
+    fclose(sink.fp);
+    sink.fp = NULL;
+
+    for (int i = sink.keep; i > 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", sink.path, i - 1);
+        snprintf(to, sizeof(to), "%s.%d", sink.path, i);
+        rename(from, to);
+    }
+
+    if (sink.keep > 0) {
+        snprintf(to, sizeof(to), "%s.1", sink.path);
+        rename(sink.path, to);
+    } else {
+        unlink(sink.path);
+    }
+
+    if (!sinkOpen()) {
+        char msg[sizeof(sink.path) + 64];
+        int len = snprintf(msg, sizeof(msg), "Reopen log %s error (%d), log to console only",
+                           sink.path, errno);
+        textAppend(clockNs(CLOCK_MONOTONIC), VLOG_ERR, msg, len, true);
+        binaryMode.store(false);
+        sink.binary = false;
+    }
+}
+
+/*
+ * Drain every ring once and write what was found; returns the number of
+ * records written.
+ */
+static
+size_t drainRings(void)
+{
+    static LogRecord batch[LOG_BATCH_SZ + LOG_TEXT_RECORDS];
+
+    size_t count = 0;
+    unsigned dropped = 0;
+
+    for (LogRing *ring = rings.load(); ring; ring = ring->next) {
+        while (count < LOG_BATCH_SZ && ring->queue.pop(batch[count])) {
+            const LogRecord &head = batch[count++];
+
+            // Continuations were published together with their head.
+            for (uint32_t i = 0; head.kind == RecordText && i < head.site; i++)
+                ring->queue.pop(batch[count++]);
+        }
+        dropped += ring->dropped.exchange(0);
+    }
+
+    if (!count && !dropped) {
+        sinkRotate();
+        return 0;
+    }
+
+    std::sort(batch, batch + count, recordLess);
+
+    for (size_t i = 0; i < count; )
+        i += writeRecord(batch + i);
+
+    if (dropped) {
+        char msg[64];
+
+        metricLogDropped.add(dropped);
+        int len = snprintf(msg, sizeof(msg), "%u log messages dropped", dropped);
+
+        if (sink.fp && sink.binary)
+            binAppend(LogFrameDropped, VLOG_WARN, &dropped, sizeof(dropped), NULL, 0);
+        textAppend(clockNs(CLOCK_MONOTONIC), VLOG_WARN, msg, len, true);
+    }
+
+    consoleFlush();
+    if (sink.fp) {
+        fileFlush();
+        sinkRotate();
+    }
+
+    return count;
+}
+
+static
+void *writerRoutine(void *argv)
+{
+    while (asyncRunning.load()) {
+        if (drainRings() > 0)
+            continue;
+
+        writerSleeping.store(true);
+        if (drainRings() == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_IDLE_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            sem_timedwait(&writerSem, &ts);
+        }
+        writerSleeping.store(false);
+    }
+
+    return NULL;
+}
+
+int logAsyncStart(void)
+{
+    int rc;
+
+    if (asyncRunning.load())
+        return 0;
+
+    anchorRealtime  = clockNs(CLOCK_REALTIME);
+    anchorMonotonic = clockNs(CLOCK_MONOTONIC);
+
+    sem_init(&writerSem, 0, 0);
+    asyncRunning.store(true);
+
+    rc = pthread_create(&writerThread, NULL, writerRoutine, NULL);
+    if (rc != 0) {
+        asyncRunning.store(false);
+        sem_destroy(&writerSem);
+        return -1;
+    }
+
+    atexit(logAsyncStop);
+    return 0;
+}
+
+void logAsyncStop(void)
 {
-    if (level > logLevel)
+    if (!asyncRunning.exchange(false))
         return;
-    
+
+    sem_post(&writerSem);
+    pthread_join(writerThread, NULL);
+    sem_destroy(&writerSem);
+
+    while (drainRings() > 0)
+        ;
+
+    binaryMode.store(false);
+    if (sink.fp) {
+        fclose(sink.fp);
+        sink.fp = NULL;
+    }
+}
+
+static
+int logFileSetup(const char *path, bool binary, int level)
+{
+    if (asyncRunning.load() || sink.fp)
+        return -1;
+
+    if (strlen(path) >= sizeof(sink.path))
+        return -1;
+
+    strcpy(sink.path, path);
+    sink.binary = binary;
+    if (!sinkOpen())
+        return -1;
+
+    consoleLevel = level;
+    binaryMode.store(binary);
+    return 0;
+}
+
+int logFileOpen(const char *path, int level)
+{
+    return logFileSetup(path, false, level);
+}
+
+int logBinaryOpen(const char *path, int level)
+{
+    return logFileSetup(path, true, level);
+}
+
+void logSetRotation(size_t maxSize, int maxAge, int keep)
+{
+    sink.maxSize = maxSize;
+    sink.maxAge  = maxAge;
+    sink.keep    = keep;
+}
+
+static
+void prepareRecord(LogRecord &rec, int level, uint8_t kind)
+{
+    rec.seq   = logSeq.fetch_add(1, std::memory_order_relaxed);
+    rec.stamp = clockNs(CLOCK_MONOTONIC);
+    rec.site  = 0;
+    rec.level = (uint8_t)level;
+    rec.kind  = kind;
+}
+
+static
+void pushRecord(const LogRecord &rec)
+{
+    LogRing *ring = ringHolder.ring();
+
+    if (!ring->queue.push(rec)) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (writerSleeping.load(std::memory_order_relaxed) &&
+        writerSleeping.exchange(false))
+        sem_post(&writerSem);
+}
+
+/*
+ * A text message that doesn't fit in @head: format it again in full and
+ * push it as a chain of records with consecutive sequence numbers.
+ */
+static
+void pushLongText(LogRecord &head, const char *format, va_list args)
+{
+    LogRecord recs[LOG_TEXT_RECORDS];
+    char text[LOG_TEXT_MAX];
+    const size_t chunk = sizeof(head.msg);
+    size_t len;
+    size_t n;
+    int rc;
+
+    rc = vsnprintf(text, sizeof(text), format, args);
+    len = rc < 0 ? 0 : std::min<size_t>(rc, sizeof(text) - 1);
+    while (len > 0 && text[len - 1] == '\n')
+        len--;
+
+    n = std::max<size_t>(1, (len + chunk - 1) / chunk);
+    head.seq = logSeq.fetch_add(n, std::memory_order_relaxed);
+    head.site = (uint32_t)(n - 1);
+
+    for (size_t i = 0; i < n; i++) {
+        size_t off = i * chunk;
+
+        recs[i] = head;
+        recs[i].seq = head.seq + i;
+        recs[i].len = (uint16_t)std::min(chunk, len - off);
+        memcpy(recs[i].msg, text + off, recs[i].len);
+    }
+
+    LogRing *ring = ringHolder.ring();
+
+    if (!ring->queue.push(recs, n)) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (writerSleeping.load(std::memory_order_relaxed) &&
+        writerSleeping.exchange(false))
+        sem_post(&writerSem);
+}
+
+void eclogv(int level, const char *format, va_list args)
+{
     if (level > VLOG_DEBUG)
         level = VLOG_DEBUG;
 
-    {
+    if (!asyncRunning.load()) {
+        char buf[LOG_TEXT_MAX];
         int rc;
-        char timestr[20];
-        char buf[1024];
-        char out[1024];
-        time_t cur = time(NULL);
 
-        strftime(timestr, 20, TIME_FORMAT, localtime(&cur));
         rc = vsnprintf(buf, sizeof(buf), format, args);
         if (rc == -1)
-            buf[1023] = 0;
+            buf[LOG_TEXT_MAX - 1] = 0;
 
-        rc = snprintf(out, sizeof(out), "%s - %-7s : %s\n",
-                       timestr, level_names[level], buf);
-        if (rc == -1)
-            out[1023] = 0;
+        for (rc = (int)strlen(buf); rc > 0 && buf[rc - 1] == '\n'; rc--)
+            buf[rc - 1] = 0;
 
-        pthread_mutex_lock(&lock);
-        //set_color(level);
-        fputs(out, stderr);
-        //reset_color();
-        pthread_mutex_unlock(&lock);
-        fflush(stderr);
+        writeSync(level, buf);
+        return;
+    }
+
+    LogRecord rec;
+    va_list again;
+    int rc;
+
+    prepareRecord(rec, level, RecordText);
+
+    va_copy(again, args);
+    rc = vsnprintf(rec.msg, sizeof(rec.msg), format, args);
+    if (rc < 0)
+        rc = 0;
+
+    if ((size_t)rc >= sizeof(rec.msg)) {
+        pushLongText(rec, format, again);
+        va_end(again);
+        return;
+    }
+    va_end(again);
+
+    rec.len = (uint16_t)rc;
+    while (rec.len > 0 && rec.msg[rec.len - 1] == '\n')
+        rec.len--;
+
+    pushRecord(rec);
+}
+
+static
+int registerSite(LogSite *site)
+{
+    int id;
+
+    pthread_mutex_lock(&lock);
+    id = site->id;
+    if (id == 0) {
+        LogSiteEntry *entry = &sites[siteCount + 1];
+        int n = -1;
+
+        if (siteCount + 1 < LOG_MAX_SITES)
+            n = logFormatSignature(site->format, entry->sig, LOG_MAX_ARGS);
+
+        if (n < 0) {
+            id = -1;
+        } else {
+            entry->site = site;
+            entry->reserve = 0;
+            for (int i = 0; i < n; i++) {
+                char type = entry->sig[i];
+                entry->reserve += type == LogArgString ? 2 : logArgSize(type);
+            }
+            id = ++siteCount;
+        }
+        __atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return id;
+}
+
+static
+void packSite(int id, int level, va_list args)
+{
+    const LogSiteEntry &entry = sites[id];
+    LogRecord rec;
+    size_t off = 0;
+    size_t reserve = entry.reserve;
+
+    prepareRecord(rec, level, RecordBinary);
+    rec.site = (uint32_t)id;
+
+    for (const char *s = entry.sig; *s; s++) {
+        switch (*s) {
+        case LogArgInt: {
+            int32_t v = va_arg(args, int);
+            memcpy(rec.msg + off, &v, 4);
+            break;
+        }
+        case LogArgLong: {
+            int64_t v = va_arg(args, long long);
+            memcpy(rec.msg + off, &v, 8);
+            break;
+        }
+        case LogArgWord: {
+            // Only 4 bytes on 32-bit ARM; read at the width passed.
+            int64_t v = va_arg(args, long);
+            memcpy(rec.msg + off, &v, 8);
+            break;
+        }
+        case LogArgUWord: {
+            uint64_t v = va_arg(args, unsigned long);
+            memcpy(rec.msg + off, &v, 8);
+            break;
+        }
+        case LogArgPointer: {
+            uint64_t v = (uintptr_t)va_arg(args, void *);
+            memcpy(rec.msg + off, &v, 8);
+            break;
+        }
+        case LogArgDouble: {
+            double v = va_arg(args, double);
+            memcpy(rec.msg + off, &v, 8);
+            break;
+        }
+        case LogArgLongDouble: {
+            double v = (double)va_arg(args, long double);
+            memcpy(rec.msg + off, &v, 8);
+            break;
+        }
+        case LogArgString: {
+            const char *v = va_arg(args, const char *);
+            size_t room = sizeof(rec.msg) - off - reserve;
+            uint16_t len;
+
+            if (!v)
+                v = "(null)";
+            len = (uint16_t)std::min(strnlen(v, LOG_MAX_STRING), room);
+            memcpy(rec.msg + off, &len, 2);
+            memcpy(rec.msg + off + 2, v, len);
+            off += len;
+            break;
+        }
+        }
+
+        size_t sz = *s == LogArgString ? 2 : logArgSize(*s);
+        off += sz;
+        reserve -= sz;
+    }
+
+    rec.len = (uint16_t)off;
+    pushRecord(rec);
+}
+
+void logSite(LogSite *site, ...)
+{
+    va_list args;
+    int id;
+
+    va_start(args, site);
+
+    if (binaryMode.load() && asyncRunning.load()) {
+        id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+        if (id == 0)
+            id = registerSite(site);
+        if (id > 0) {
+            packSite(id, site->level, args);
+            va_end(args);
+            return;
+        }
+    }
+
+    eclogv(site->level, site->format, args);
+    va_end(args);
+}
+
+static
+uint64_t clockMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Rate limited sites that have suppressed anything; sites are static, so
+// the list only grows.
+static std::atomic<LogLimit*> limitSites(NULL);
+
+static
+void logSuppressed(LogLimit *limit)
+{
+    static LogSite summary[] = {
+        { "Suppressed %u similar messages: %s", VLOG_ERR,   0 },
+        { "Suppressed %u similar messages: %s", VLOG_WARN,  0 },
+        { "Suppressed %u similar messages: %s", VLOG_INFO,  0 },
+        { "Suppressed %u similar messages: %s", VLOG_DEBUG, 0 }
+    };
+
+    unsigned suppressed = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed) {
+        int level = limit->site.level;
+        if (level < VLOG_ERR || level > VLOG_DEBUG)
+            level = VLOG_DEBUG;
+        logSite(&summary[level], suppressed, limit->site.format);
+    }
+}
+
+int logLimitPass(LogLimit *limit)
+{
+    const uint64_t refill = 1000 / VLOG_LIMIT_RATE;
+    uint64_t now = clockMs();
+    uint64_t state = __atomic_load_n(&limit->state, __ATOMIC_RELAXED);
+    uint64_t next;
+
+    do {
+        uint64_t last = state >> 8;
+        uint64_t tokens = state & 0xff;
+
+        if (!last) {
+            last = now;
+            tokens = VLOG_LIMIT_BURST;
+        } else if (now - last >= refill) {
+            tokens = std::min<uint64_t>(VLOG_LIMIT_BURST, tokens + (now - last) / refill);
+            last = now;
+        }
+
+        if (!tokens) {
+            __atomic_fetch_add(&limit->suppressed, 1, __ATOMIC_RELAXED);
+            if (!__atomic_exchange_n(&limit->listed, 1, __ATOMIC_RELAXED)) {
+                LogLimit *head = limitSites.load();
+                do {
+                    limit->next = head;
+                } while (!limitSites.compare_exchange_weak(head, limit));
+            }
+            return 0;
+        }
+
+        next = (last << 8) | (tokens - 1);
+    } while (!__atomic_compare_exchange_n(&limit->state, &state, next, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    logSuppressed(limit);
+    return 1;
+}
+
+void logLimitFlush(void)
+{
+    const uint64_t refill = 1000 / VLOG_LIMIT_RATE;
+    uint64_t now = clockMs();
+
+    for (LogLimit *limit = limitSites.load(); limit; limit = limit->next) {
+        if (!__atomic_load_n(&limit->suppressed, __ATOMIC_RELAXED))
+            continue;
+
+        // Still within the window the site is suppressing for; it reports
+        // itself when it logs again, or the next flush does.
+        uint64_t last = __atomic_load_n(&limit->state, __ATOMIC_RELAXED) >> 8;
+        if (now - last < refill)
+            continue;
+
+        logSuppressed(limit);
     }
 }
 
 void logMsg(int level, const char *format, ...)
 {
     va_list args;
+
+    if (level > logLevels[VLOG_MOD_CORE])
+        return;
+
     va_start(args, format);
     eclogv(level, format, args);
     va_end(args);
@@ -62,16 +935,10 @@ void logMsg(int level, const char *format, ...)
 
 void logMsgV(int level, const char *format, va_list args)
 {
-    char out[512];
-    int rc;
-    (void)level;
-
-    rc = vsnprintf(out, sizeof(out), format, args);
-    if (rc == -1)
-        out[511] = 0;
+    if (level < VLOG_ERR || level > logLevels[VLOG_MOD_WHISPER])
+        return;
 
-    fputs(out, stderr);
-    fflush(stderr);
+    eclogv(level, format, args);
 }
 
 void setLogLevel(int level)
@@ -79,5 +946,49 @@ void setLogLevel(int level)
     if (level > VLOG_DEBUG)
         level = VLOG_DEBUG;
 
-    logLevel = level;
+    for (int i = 0; i < VLOG_MOD_COUNT; i++)
+        logLevels[i] = level;
+}
+
+int setModuleLogLevel(const char *module, int level)
+{
+    if (level < VLOG_ERR)
+        return -1;
+    if (level > VLOG_DEBUG)
+        level = VLOG_DEBUG;
+
+    for (int i = 0; i < VLOG_MOD_COUNT; i++) {
+        if (strcmp(module, module_names[i]) == 0) {
+            logLevels[i] = level;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const char *logModuleName(int module)
+{
+    return (module >= 0 && module < VLOG_MOD_COUNT) ? module_names[module] : "unknown";
+}
+
+const char *logLevelName(int level)
+{
+    return (level >= VLOG_ERR && level <= VLOG_DEBUG) ? level_names[level] : "UNKNOWN";
+}
+
+int logLevelByName(const char *name)
+{
+    for (int i = VLOG_ERR; i <= VLOG_DEBUG; i++) {
+        if (strcasecmp(name, level_names[i]) == 0)
+            return i;
+    }
+
+    if (strcasecmp(name, "warn") == 0)
+        return VLOG_WARN;
+
+    if (name[0] >= '0' && name[0] <= '0' + VLOG_DEBUG && name[1] == '\0')
+        return name[0] - '0';
+
+    return -1;
 }
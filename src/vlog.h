@@ -2,6 +2,8 @@
 #define __VLOG_H__
 
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,38 +14,141 @@ extern "C" {
 #define VLOG_INFO       2
 #define VLOG_DEBUG      3
 
-extern int logLevel;
+/*
+ * Least severe level compiled in; calls above it disappear at build time
+ * together with their arguments, e.g. -DVLOG_MIN_LEVEL=VLOG_INFO.
+ */
+#ifndef VLOG_MIN_LEVEL
+#define VLOG_MIN_LEVEL  VLOG_DEBUG
+#endif
 
-#define vlogE(format, ...) \
-    do { \
-        if (logLevel >= VLOG_ERR) \
-            logMsg(VLOG_ERR, format, ##__VA_ARGS__); \
-    } while(0)
+/*
+ * Log modules, each with its own runtime level. A source file picks its
+ * module by defining VLOG_MODULE before including this header.
+ */
+#define VLOG_MODULE_LIST(X) \
+    X(CORE,    "core")      \
+    X(AGENT,   "agent")     \
+    X(SESSION, "session")   \
+    X(RTP,     "rtp")       \
+    X(CAMERA,  "camera")    \
+    X(CFG,     "cfg")       \
+    X(GADGET,  "gadget")    \
+    X(WHISPER, "whisper")   \
+    X(MEDIA,   "media")
 
-#define vlogW(format, ...) \
-    do { \
-        if (logLevel >= VLOG_WARN) \
-            logMsg(VLOG_WARN, format, ##__VA_ARGS__); \
-    } while(0)
+#define VLOG_MODULE_ENUM(id, name) VLOG_MOD_##id,
+enum {
+    VLOG_MODULE_LIST(VLOG_MODULE_ENUM)
+    VLOG_MOD_COUNT
+};
+#undef VLOG_MODULE_ENUM
+
+#ifndef VLOG_MODULE
+#define VLOG_MODULE     VLOG_MOD_CORE
+#endif
+
+extern int logLevels[VLOG_MOD_COUNT];
 
-#define vlogI(format, ...) \
+/*
+ * Every vlog call site owns a static LogSite, so the binary log can refer
+ * to its format string by id instead of formatting the message.
+ */
+typedef struct LogSite {
+    const char *format;
+    int level;
+    int id;     /* 0: not registered yet, -1: always logged as text */
+} LogSite;
+
+#define vlogSite(lvl, format, ...) \
     do { \
-        if (logLevel >= VLOG_INFO) \
-            logMsg(VLOG_INFO, format, ##__VA_ARGS__); \
+        if ((lvl) <= VLOG_MIN_LEVEL && logLevels[VLOG_MODULE] >= (lvl)) { \
+            static LogSite __vlog_site = { format, lvl, 0 }; \
+            logSite(&__vlog_site, ##__VA_ARGS__); \
+        } \
     } while(0)
 
-#define vlogD(format, ...) \
+#define vlogE(format, ...) vlogSite(VLOG_ERR, format, ##__VA_ARGS__)
+#define vlogW(format, ...) vlogSite(VLOG_WARN, format, ##__VA_ARGS__)
+#define vlogI(format, ...) vlogSite(VLOG_INFO, format, ##__VA_ARGS__)
+#define vlogD(format, ...) vlogSite(VLOG_DEBUG, format, ##__VA_ARGS__)
+
+/*
+ * Rate limited variants for hot paths (per packet, per peer fan-out).
+ * Each call site gets a token bucket of VLOG_LIMIT_BURST messages that
+ * refills at VLOG_LIMIT_RATE per second; what doesn't fit is counted and
+ * reported as "suppressed N similar messages" once the site logs again,
+ * or by logLimitFlush() once the burst is over.
+ */
+#define VLOG_LIMIT_BURST    5
+#define VLOG_LIMIT_RATE     1
+
+typedef struct LogLimit {
+    LogSite site;
+    uint64_t state;         /* last refill in ms << 8 | tokens */
+    unsigned suppressed;
+    struct LogLimit *next;  /* sites that ever suppressed, for the flush */
+    int listed;
+} LogLimit;
+
+#define vlogLimit(lvl, format, ...) \
     do { \
-        if (logLevel >= VLOG_DEBUG) \
-            logMsg(VLOG_DEBUG, format, ##__VA_ARGS__); \
+        if ((lvl) <= VLOG_MIN_LEVEL && logLevels[VLOG_MODULE] >= (lvl)) { \
+            static LogLimit __vlog_limit = { { format, lvl, 0 }, 0, 0, NULL, 0 }; \
+            if (logLimitPass(&__vlog_limit)) \
+                logSite(&__vlog_limit.site, ##__VA_ARGS__); \
+        } \
     } while(0)
 
-    
+#define vlogLimitE(format, ...) vlogLimit(VLOG_ERR, format, ##__VA_ARGS__)
+#define vlogLimitW(format, ...) vlogLimit(VLOG_WARN, format, ##__VA_ARGS__)
+#define vlogLimitI(format, ...) vlogLimit(VLOG_INFO, format, ##__VA_ARGS__)
+#define vlogLimitD(format, ...) vlogLimit(VLOG_DEBUG, format, ##__VA_ARGS__)
 
+void logSite(LogSite *site, ...);
+int  logLimitPass(LogLimit *limit);
+/* Reports what rate limited sites suppressed if they stayed quiet since. */
+void logLimitFlush(void);
 void logMsg(int level, const char *format, ...);
+/* Printer for whisper SDK logs, filtered by the "whisper" module level. */
 void logMsgV(int level, const char *format, va_list args);
 void setLogLevel(int level);
 
+/*
+ * Runtime level of one module; returns -1 if module is unknown. Module
+ * names come from VLOG_MODULE_LIST, level names are "error", "warning",
+ * "info" and "debug".
+ */
+int  setModuleLogLevel(const char *module, int level);
+const char *logModuleName(int module);
+const char *logLevelName(int level);
+int  logLevelByName(const char *name);
+
+/*
+ * Move log output to a background writer thread. Callers only format
+ * into a per-thread ring; logAsyncStop() drains what is left and falls
+ * back to synchronous output (it also runs at exit).
+ */
+int  logAsyncStart(void);
+void logAsyncStop(void);
+
+/*
+ * Write the log to path, as text (logFileOpen) or as binary records
+ * (logBinaryOpen, decode with wdemo-logdecode). Call it before
+ * logAsyncStart(); the file is only used while the asynchronous writer
+ * runs. Messages at consoleLevel or more severe are still echoed to
+ * stderr as text.
+ */
+int  logFileOpen(const char *path, int consoleLevel);
+int  logBinaryOpen(const char *path, int consoleLevel);
+
+/*
+ * Rotate the log file once it reaches maxSize bytes or maxAge seconds
+ * (0 disables either), keeping keep older files as path.1 .. path.keep.
+ * Rotation runs on the writer thread.
+ */
+void logSetRotation(size_t maxSize, int maxAge, int keep);
+
 #ifdef __cplusplus
 }
 #endif
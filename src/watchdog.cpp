@@ -0,0 +1,222 @@
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+#include <atomic>
+#include <execinfo.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "vlog.h"
+#include "probe.h"
+#include "metrics.h"
+#include "trace.h"
+#include "watchdog.h"
+
+const int WATCHDOG_FRAMES = 64;
+
+// Written by the whisper thread only.
+static std::atomic<uint64_t> lastBeat(0);
+static std::atomic<const char*> current(NULL);
+static std::atomic<uint64_t> enteredAt(0);
+static uint64_t lastIdle = 0;
+
+static std::atomic<bool> loopKnown(false);
+static pthread_t loopThread;
+
+static uint64_t threshold;
+static pthread_t watchThread;
+static bool running = false;
+static int wakeFds[2] = { -1, -1 };
+
+// Filled by the whisper thread in the SIGUSR1 handler.
+static void *frames[WATCHDOG_FRAMES];
+static std::atomic<int> frameCount(0);
+static sem_t framesSem;
+static struct sigaction oldAction;
+
+static
+void beat(uint64_t now)
+{
+    if (!loopKnown.load(std::memory_order_relaxed)) {
+        loopThread = pthread_self();
+        loopKnown.store(true, std::memory_order_release);
+    }
+    lastBeat.store(now, std::memory_order_release);
+}
+
+void watchdogIdle(void)
+{
+    uint64_t now = probeClock();
+
+    if (lastIdle)
+        metricLoopIteration.record(now - lastIdle);
+    lastIdle = now;
+
+    beat(now);
+}
+
+const char *watchdogEnter(const char *name)
+{
+    const char *prev = current.load(std::memory_order_relaxed);
+    uint64_t now = probeClock();
+
+    enteredAt.store(now, std::memory_order_relaxed);
+    current.store(name, std::memory_order_relaxed);
+    beat(now);
+    return prev;
+}
+
+void watchdogLeave(const char *prev)
+{
+    current.store(prev, std::memory_order_relaxed);
+    beat(probeClock());
+}
+
+static
+void onBacktraceSignal(int signo)
+{
+    int saved = errno;
+
+    frameCount.store(backtrace(frames, WATCHDOG_FRAMES), std::memory_order_relaxed);
+    sem_post(&framesSem);
+    errno = saved;
+}
+
+static
+void logBacktrace(void)
+{
+    struct timespec deadline;
+    int rc;
+
+    if (pthread_kill(loopThread, SIGUSR1) != 0)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+
+    while ((rc = sem_timedwait(&framesSem, &deadline)) < 0 && errno == EINTR)
+        ;
+    if (rc < 0) {
+        vlogW("No backtrace from the whisper thread");
+        return;
+    }
+
+    int count = frameCount.load(std::memory_order_relaxed);
+    char **symbols = backtrace_symbols(frames, count);
+
+    // Frame 0 is the signal handler.
+    for (int i = 1; i < count; i++)
+        vlogW("  #%-2d %s", i - 1, symbols ? symbols[i] : "?");
+    free(symbols);
+}
+
+static
+void *watchRoutine(void *argv)
+{
+    struct pollfd pfd = { wakeFds[0], POLLIN, 0 };
+    int interval = (int)(threshold / 4000000);
+    uint64_t stalledBeat = 0;
+
+    if (interval < 10)
+        interval = 10;
+
+    while (true) {
+        int rc = poll(&pfd, 1, interval);
+        if (rc < 0 && errno != EINTR) {
+            vlogE("Poll watchdog wake up error (%d)", errno);
+            break;
+        }
+
+        if (rc > 0)
+            break;
+
+        uint64_t last = lastBeat.load(std::memory_order_acquire);
+        uint64_t now = probeClock();
+
+        if (!last)
+            continue;
+
+        if (stalledBeat && last != stalledBeat) {
+            vlogW("Whisper thread resumed after %llu ms",
+                  (unsigned long long)(last - stalledBeat) / 1000000);
+            stalledBeat = 0;
+        }
+
+        if (stalledBeat || now - last < threshold)
+            continue;
+
+        const char *name = current.load(std::memory_order_relaxed);
+        uint64_t since = name ? enteredAt.load(std::memory_order_relaxed) : last;
+
+        vlogE("Whisper thread stalled for %llu ms in %s",
+              (unsigned long long)(now - since) / 1000000,
+              name ? name : "whisper_run");
+
+        if (loopKnown.load(std::memory_order_acquire))
+            logBacktrace();
+
+        metricLoopStalls.add();
+        traceRequestDump();
+        stalledBeat = last;
+    }
+    return NULL;
+}
+
+bool watchdogStart(int thresholdMs)
+{
+    struct sigaction sa;
+    int rc;
+
+    threshold = (uint64_t)thresholdMs * 1000000;
+
+    if (sem_init(&framesSem, 0, 0) < 0 || pipe(wakeFds) < 0) {
+        vlogE("Setup watchdog error (%d)", errno);
+        return false;
+    }
+
+    // The first backtrace() loads libgcc; keep that out of the handler.
+    backtrace(frames, WATCHDOG_FRAMES);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onBacktraceSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, &oldAction);
+
+    rc = pthread_create(&watchThread, NULL, watchRoutine, NULL);
+    if (rc != 0) {
+        vlogE("Create watchdog thread error (%d)", rc);
+        sigaction(SIGUSR1, &oldAction, NULL);
+        close(wakeFds[0]);
+        close(wakeFds[1]);
+        wakeFds[0] = wakeFds[1] = -1;
+        sem_destroy(&framesSem);
+        return false;
+    }
+
+    running = true;
+    return true;
+}
+
+void watchdogStop(void)
+{
+    if (!running)
+        return;
+
+    char ch = 0;
+    if (write(wakeFds[1], &ch, 1) < 0)
+        vlogW("Wake up watchdog thread error (%d)", errno);
+
+    pthread_join(watchThread, NULL);
+    running = false;
+
+    sigaction(SIGUSR1, &oldAction, NULL);
+    close(wakeFds[0]);
+    close(wakeFds[1]);
+    wakeFds[0] = wakeFds[1] = -1;
+    sem_destroy(&framesSem);
+}
@@ -0,0 +1,31 @@
+#ifndef __WATCHDOG_H__
+#define __WATCHDOG_H__
+
+/*
+ * Stall watchdog for the whisper thread, which runs every callback. The
+ * callbacks mark their entry and exit and the idle callback beats once per
+ * loop iteration; when no beat comes for longer than the threshold, the
+ * watchdog thread logs the callback running and a backtrace of the whisper
+ * thread (taken through SIGUSR1), counts the stall and asks for a trace
+ * dump. Loop iteration times go to wdemo_loop_iteration_seconds.
+ */
+bool watchdogStart(int thresholdMs);
+void watchdogStop(void);
+
+// Once per whisper_run() iteration, from the idle callback.
+void watchdogIdle(void);
+
+// Mark the whisper thread entering a callback; returns the one it was in.
+const char *watchdogEnter(const char *name);
+void watchdogLeave(const char *prev);
+
+class CWatchdogScope {
+public:
+    explicit CWatchdogScope(const char *name): mPrev(watchdogEnter(name)) {}
+    ~CWatchdogScope() { watchdogLeave(mPrev); }
+
+private:
+    const char *mPrev;
+};
+
+#endif /* __WATCHDOG_H__ */
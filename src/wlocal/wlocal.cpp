@@ -0,0 +1,1239 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdarg>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <functional>
+#include <condition_variable>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <whisper.h>
+#include <whisper_session.h>
+#include "wlocal.h"
+
+#define WLOCAL_MAGIC        0x4c434c57  /* "WLCL" */
+#define WLOCAL_MAX_FRAME    (64 * 1024)
+#define WLOCAL_PING_MS      2000
+#define WLOCAL_TIMEOUT_MS   6000
+#define WLOCAL_SDP          "v=0 whisper-ice-session wlocal"
+
+enum FrameType {
+    FrameHello = 1,
+    FrameHelloAck,
+    FrameBye,
+    FramePing,
+    FrameFriendRequest,
+    FrameFriendAccept,
+    FrameMessage,
+    FrameSessionRequest,
+    FrameSessionReply,
+    FrameStreamData,
+    FrameSessionClose
+};
+
+struct FrameHeader {
+    uint32_t magic;
+    uint8_t  type;
+    uint8_t  status;
+    uint16_t stream;
+    uint32_t dst;       // receiver's session id
+    uint32_t src;       // sender's session id
+    char     from[WHISPER_MAX_ID_LEN + 1];
+};
+
+struct Packet {
+    uint64_t due;
+    std::string to;
+    std::vector<uint8_t> data;
+
+    bool operator <(const Packet &other) const {
+        return due > other.due;     // earliest first in priority_queue
+    }
+};
+
+struct FriendState {
+    WhisperConnectionStatus status;
+    uint64_t lastSeen;
+};
+
+struct Stream {
+    int id;
+    WhisperStreamCallbacks callbacks;
+    void *context;
+    std::atomic<int> state;
+};
+
+struct WhisperSession {
+    Whisper *whisper;
+    uint32_t id;
+    std::atomic<uint32_t> remote;
+    std::string peer;
+    std::vector<Stream *> streams;
+
+    WhisperSessionRequestCompleteCallback *requestCb;
+    void *requestContext;
+};
+
+struct Whisper {
+    WhisperCallbacks callbacks;
+    void *context;
+
+    std::string dir;
+    std::string dataDir;
+    std::string userid;
+
+    int sock;
+    int wakeFd[2];
+    std::atomic<bool> running;
+    std::atomic<bool> stopping;
+    std::thread::id runner;
+
+    // Touched by the run thread only.
+    std::map<std::string, FriendState> friends;
+    std::map<uint32_t, WhisperSession *> sessions;
+    std::map<std::string, uint32_t> pendingRequests;
+    uint32_t nextSession;
+    WhisperSessionRequestCallback *sessionCb;
+    void *sessionContext;
+
+    std::mutex postLock;
+    std::deque<std::function<void()>> posted;
+
+    // Outgoing link: impairments, delay queue and its thread.
+    std::mutex linkLock;
+    std::condition_variable linkCond;
+    WLocalLink link;
+    std::priority_queue<Packet> delayed;
+    uint64_t linkFree;
+    std::mt19937 rng;
+    std::thread shaper;
+
+    std::mutex statsLock;
+    WLocalStats stats;
+};
+
+static thread_local int lastError = 0;
+
+static WhisperLogLevel logLevel = WhisperLogLevel_Info;
+static void (*logPrinter)(const char *format, va_list args) = NULL;
+
+static
+void wlog(WhisperLogLevel level, const char *format, ...)
+{
+    va_list args;
+
+    if (level > logLevel)
+        return;
+
+    va_start(args, format);
+    if (logPrinter) {
+        logPrinter(format, args);
+    } else {
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+    }
+    va_end(args);
+}
+
+static
+int fail(int code)
+{
+    lastError = W_GENERAL_ERROR(code);
+    return -1;
+}
+
+static
+uint64_t nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static
+uint64_t nowUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static
+const char *envStr(const char *name, const char *def)
+{
+    const char *val = getenv(name);
+    return (val && *val) ? val : def;
+}
+
+static
+int envInt(const char *name, int def)
+{
+    return atoi(envStr(name, std::to_string(def).c_str()));
+}
+
+static const char base58[] =
+    "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+static
+std::string sockPath(const Whisper *w, const std::string &userid)
+{
+    return w->dir + "/" + userid + ".sock";
+}
+
+static
+std::string bareId(const char *id)
+{
+    const char *at = strchr(id, '@');
+    return at ? std::string(id, at - id) : std::string(id);
+}
+
+/*
+ * Identity and friend list live in the persistent location, so a
+ * restarted instance comes back as the same user with the same friends.
+ */
+static
+bool loadIdentity(Whisper *w)
+{
+    std::string path = w->dataDir + "/wlocal.id";
+    const char *env = getenv("WLOCAL_USERID");
+    char buf[WHISPER_MAX_ID_LEN + 2] = {0};
+    FILE *fp;
+
+    if (env && *env) {
+        w->userid = env;
+        return whisper_id_is_valid(env);
+    }
+
+    fp = fopen(path.c_str(), "r");
+    if (fp) {
+        if (fgets(buf, sizeof(buf), fp))
+            buf[strcspn(buf, "\r\n")] = 0;
+        fclose(fp);
+        if (whisper_id_is_valid(buf)) {
+            w->userid = buf;
+            return true;
+        }
+    }
+
+    std::random_device rd;
+    for (int i = 0; i < 44; i++)
+        w->userid += base58[rd() % (sizeof(base58) - 1)];
+
+    fp = fopen(path.c_str(), "w");
+    if (!fp)
+        return false;
+    fprintf(fp, "%s\n", w->userid.c_str());
+    fclose(fp);
+    return true;
+}
+
+static
+void loadFriends(Whisper *w)
+{
+    std::string path = w->dataDir + "/wlocal.friends";
+    char buf[WHISPER_MAX_ID_LEN + 2];
+    FILE *fp;
+
+    fp = fopen(path.c_str(), "r");
+    if (!fp)
+        return;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        buf[strcspn(buf, "\r\n")] = 0;
+        if (whisper_id_is_valid(buf))
+            w->friends[buf] = { WhisperConnectionStatus_Disconnected, 0 };
+    }
+    fclose(fp);
+}
+
+static
+void saveFriends(Whisper *w)
+{
+    std::string path = w->dataDir + "/wlocal.friends";
+    std::string tmp = path + ".tmp";
+    FILE *fp;
+
+    fp = fopen(tmp.c_str(), "w");
+    if (!fp)
+        return;
+
+    for (auto &f : w->friends)
+        fprintf(fp, "%s\n", f.first.c_str());
+    fclose(fp);
+
+    rename(tmp.c_str(), path.c_str());
+}
+
+static
+void friendInfo(const Whisper *w, const std::string &userid, WhisperFriendInfo *info)
+{
+    auto it = w->friends.find(userid);
+
+    memset(info, 0, sizeof(*info));
+    snprintf(info->user_info.userid, sizeof(info->user_info.userid), "%s", userid.c_str());
+    snprintf(info->user_info.name, sizeof(info->user_info.name), "%s", userid.c_str());
+    info->entrusted = 1;
+    info->status = it != w->friends.end() ? it->second.status
+                                          : WhisperConnectionStatus_Disconnected;
+    info->presence = WhisperPresenceStatus_None;
+}
+
+static
+void wake(Whisper *w)
+{
+    char c = 0;
+    ssize_t rc = write(w->wakeFd[1], &c, 1);
+    (void)rc;
+}
+
+static
+void post(Whisper *w, std::function<void()> fn)
+{
+    {
+        std::lock_guard<std::mutex> guard(w->postLock);
+        w->posted.push_back(fn);
+    }
+    wake(w);
+}
+
+static
+bool transmit(Whisper *w, const std::string &to, const void *data, size_t len)
+{
+    struct sockaddr_un addr;
+    std::string path = sockPath(w, to);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+
+    return sendto(w->sock, data, len, MSG_DONTWAIT,
+                  (struct sockaddr *)&addr, sizeof(addr)) == (ssize_t)len;
+}
+
+static
+void shaperRoutine(Whisper *w)
+{
+    std::unique_lock<std::mutex> guard(w->linkLock);
+
+    while (!w->stopping.load() || !w->delayed.empty()) {
+        if (w->delayed.empty()) {
+            w->linkCond.wait(guard);
+            continue;
+        }
+
+        uint64_t now = nowUs();
+        const Packet &top = w->delayed.top();
+        if (top.due > now && !w->stopping.load()) {
+            w->linkCond.wait_for(guard, std::chrono::microseconds(top.due - now));
+            continue;
+        }
+
+        Packet pkt = top;
+        w->delayed.pop();
+
+        guard.unlock();
+        transmit(w, pkt.to, pkt.data.data(), pkt.data.size());
+        guard.lock();
+    }
+}
+
+/*
+ * Send one frame. Media frames go through loss and the bandwidth cap,
+ * everything goes through the delay; undelayed frames skip the queue.
+ */
+static
+bool sendFrame(Whisper *w, const std::string &to, FrameHeader &hdr,
+               const void *payload, size_t len, bool media)
+{
+    std::vector<uint8_t> data(sizeof(hdr) + len);
+    bool dropped = false;
+    bool queued = false;
+
+    hdr.magic = WLOCAL_MAGIC;
+    snprintf(hdr.from, sizeof(hdr.from), "%s", w->userid.c_str());
+    memcpy(data.data(), &hdr, sizeof(hdr));
+    if (len)
+        memcpy(data.data() + sizeof(hdr), payload, len);
+
+    {
+        std::lock_guard<std::mutex> guard(w->linkLock);
+        const WLocalLink &link = w->link;
+        uint64_t now = nowUs();
+        uint64_t due = now;
+
+        if (media && link.loss > 0 &&
+            std::uniform_real_distribution<double>(0, 100)(w->rng) < link.loss)
+            dropped = true;
+
+        if (!dropped && media && link.bandwidth_kbps > 0) {
+            uint64_t cost = (uint64_t)data.size() * 8 * 1000 / link.bandwidth_kbps;
+            uint64_t start = w->linkFree > now ? w->linkFree : now;
+
+            if (start - now > (uint64_t)link.queue_ms * 1000) {
+                dropped = true;
+            } else {
+                w->linkFree = start + cost;
+                due = w->linkFree;
+            }
+        }
+
+        if (!dropped) {
+            due += (uint64_t)link.latency_ms * 1000;
+            if (link.jitter_ms > 0)
+                due += std::uniform_int_distribution<uint64_t>(0, link.jitter_ms * 1000)(w->rng);
+
+            // Once anything is queued, later frames queue too to keep order.
+            if (due > now || !w->delayed.empty()) {
+                w->delayed.push(Packet { due, to, std::move(data) });
+                w->linkCond.notify_one();
+                queued = true;
+            }
+        }
+    }
+
+    if (!dropped && !queued && !transmit(w, to, data.data(), data.size())) {
+        if (!media)
+            return false;
+        dropped = true;
+    }
+
+    if (media) {
+        std::lock_guard<std::mutex> guard(w->statsLock);
+        if (dropped) {
+            w->stats.dropped_packets++;
+        } else {
+            w->stats.sent_packets++;
+            w->stats.sent_bytes += len;
+        }
+    }
+    return true;
+}
+
+static
+bool sendControl(Whisper *w, const std::string &to, uint8_t type,
+                 const void *payload = NULL, size_t len = 0,
+                 uint32_t dst = 0, uint32_t src = 0, uint8_t status = 0)
+{
+    FrameHeader hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.status = status;
+    hdr.dst = dst;
+    hdr.src = src;
+    return sendFrame(w, to, hdr, payload, len, false);
+}
+
+static
+void setStreamState(WhisperSession *ws, Stream *stream, WhisperStreamState state)
+{
+    stream->state.store(state);
+    if (stream->callbacks.state_changed)
+        stream->callbacks.state_changed(ws, stream->id, state, stream->context);
+}
+
+// Deliver a state change later on the run thread, if the session survives.
+static
+void postState(WhisperSession *ws, WhisperStreamState state)
+{
+    Whisper *w = ws->whisper;
+    uint32_t id = ws->id;
+
+    post(w, [w, id, state]() {
+        auto it = w->sessions.find(id);
+        if (it == w->sessions.end())
+            return;
+
+        WhisperSession *ws = it->second;
+        for (size_t i = 0; i < ws->streams.size(); i++) {
+            if (w->sessions.count(id))
+                setStreamState(ws, ws->streams[i], state);
+        }
+    });
+}
+
+static
+void setFriendStatus(Whisper *w, const std::string &userid,
+                     WhisperConnectionStatus status)
+{
+    auto it = w->friends.find(userid);
+    if (it == w->friends.end())
+        return;
+
+    if (status == WhisperConnectionStatus_Connected)
+        it->second.lastSeen = nowMs();
+
+    if (it->second.status == status)
+        return;
+
+    it->second.status = status;
+    if (w->callbacks.friend_connection)
+        w->callbacks.friend_connection(w, userid.c_str(), status, w->context);
+}
+
+static
+void handleFrame(Whisper *w, const FrameHeader &hdr, const uint8_t *payload, size_t len)
+{
+    std::string from(hdr.from, strnlen(hdr.from, sizeof(hdr.from)));
+    bool isFriend = w->friends.count(from) != 0;
+    std::string text((const char *)payload, len);
+
+    switch (hdr.type) {
+    case FrameHello:
+    case FrameHelloAck:
+    case FramePing:
+        if (!isFriend)
+            break;
+        if (hdr.type == FrameHello)
+            sendControl(w, from, FrameHelloAck);
+        setFriendStatus(w, from, WhisperConnectionStatus_Connected);
+        break;
+
+    case FrameBye:
+        setFriendStatus(w, from, WhisperConnectionStatus_Disconnected);
+        break;
+
+    case FrameFriendRequest:
+        if (w->callbacks.friend_request) {
+            WhisperFriendInfo info;
+            friendInfo(w, from, &info);
+            w->callbacks.friend_request(w, from.c_str(), &info.user_info,
+                                        text.c_str(), w->context);
+        }
+        break;
+
+    case FrameFriendAccept:
+        if (!isFriend) {
+            WhisperFriendInfo info;
+
+            w->friends[from] = { WhisperConnectionStatus_Connected, nowMs() };
+            saveFriends(w);
+
+            friendInfo(w, from, &info);
+            if (w->callbacks.friend_response)
+                w->callbacks.friend_response(w, from.c_str(), 0, NULL, true,
+                                             NULL, w->context);
+            if (w->callbacks.friend_added)
+                w->callbacks.friend_added(w, &info, w->context);
+        }
+        break;
+
+    case FrameMessage:
+        if (isFriend && w->callbacks.friend_message)
+            w->callbacks.friend_message(w, from.c_str(), text.c_str(),
+                                        text.length() + 1, w->context);
+        break;
+
+    case FrameSessionRequest:
+        w->pendingRequests[from] = hdr.src;
+        if (w->sessionCb)
+            w->sessionCb(w, from.c_str(), text.c_str(), text.length() + 1,
+                         w->sessionContext);
+        break;
+
+    case FrameSessionReply: {
+        auto it = w->sessions.find(hdr.dst);
+        if (it == w->sessions.end())
+            break;
+
+        // Queued first, the callback usually goes on to session_start().
+        WhisperSession *ws = it->second;
+        ws->remote.store(hdr.status == 0 ? hdr.src : 0);
+        if (hdr.status == 0)
+            postState(ws, WhisperStreamState_transport_ready);
+
+        if (ws->requestCb)
+            ws->requestCb(ws, hdr.status, hdr.status ? text.c_str() : NULL,
+                          hdr.status ? NULL : text.c_str(), text.length() + 1,
+                          ws->requestContext);
+        break;
+    }
+
+    case FrameStreamData: {
+        auto it = w->sessions.find(hdr.dst);
+        if (it == w->sessions.end())
+            break;
+
+        WhisperSession *ws = it->second;
+        for (size_t i = 0; i < ws->streams.size(); i++) {
+            Stream *stream = ws->streams[i];
+            if (stream->id != hdr.stream || !stream->callbacks.stream_data)
+                continue;
+            stream->callbacks.stream_data(ws, stream->id, payload, len, stream->context);
+        }
+
+        std::lock_guard<std::mutex> guard(w->statsLock);
+        w->stats.received_packets++;
+        w->stats.received_bytes += len;
+        break;
+    }
+
+    case FrameSessionClose: {
+        auto it = w->sessions.find(hdr.dst);
+        if (it == w->sessions.end())
+            break;
+
+        it->second->remote.store(0);
+        postState(it->second, WhisperStreamState_closed);
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+static
+void receiveFrames(Whisper *w)
+{
+    uint8_t buf[WLOCAL_MAX_FRAME];
+
+    for (;;) {
+        ssize_t len = recv(w->sock, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0)
+            break;
+
+        FrameHeader hdr;
+        if ((size_t)len < sizeof(hdr))
+            continue;
+
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (hdr.magic != WLOCAL_MAGIC)
+            continue;
+
+        handleFrame(w, hdr, buf + sizeof(hdr), len - sizeof(hdr));
+    }
+}
+
+static
+void runPosted(Whisper *w)
+{
+    std::deque<std::function<void()>> todo;
+
+    {
+        std::lock_guard<std::mutex> guard(w->postLock);
+        todo.swap(w->posted);
+    }
+
+    for (auto &fn : todo)
+        fn();
+}
+
+static
+void keepAlive(Whisper *w)
+{
+    uint64_t now = nowMs();
+    std::vector<std::string> lost;
+
+    for (auto &f : w->friends) {
+        sendControl(w, f.first, FramePing);
+        if (f.second.status == WhisperConnectionStatus_Connected &&
+            now - f.second.lastSeen > WLOCAL_TIMEOUT_MS)
+            lost.push_back(f.first);
+    }
+
+    for (auto &userid : lost)
+        setFriendStatus(w, userid, WhisperConnectionStatus_Disconnected);
+}
+
+static
+void destroy(Whisper *w)
+{
+    {
+        std::lock_guard<std::mutex> guard(w->linkLock);
+        w->stopping.store(true);
+        w->linkCond.notify_all();
+    }
+    if (w->shaper.joinable())
+        w->shaper.join();
+
+    for (auto &s : w->sessions) {
+        for (auto stream : s.second->streams)
+            delete stream;
+        delete s.second;
+    }
+
+    if (w->sock >= 0) {
+        close(w->sock);
+        unlink(sockPath(w, w->userid).c_str());
+    }
+    close(w->wakeFd[0]);
+    close(w->wakeFd[1]);
+
+    delete w;
+}
+
+extern "C" {
+
+void whisper_log_init(WhisperLogLevel level, const char *log_file,
+                      void (*log_printer)(const char *format, va_list args))
+{
+    logLevel = level;
+    logPrinter = log_printer;
+}
+
+bool whisper_id_is_valid(const char *id)
+{
+    size_t len;
+
+    if (!id)
+        return false;
+
+    len = strlen(id);
+    return len > 0 && len <= WHISPER_MAX_ID_LEN && strspn(id, base58) == len;
+}
+
+bool whisper_address_is_valid(const char *address)
+{
+    return whisper_id_is_valid(address);
+}
+
+int whisper_get_error(void)
+{
+    return lastError;
+}
+
+void whisper_clear_error(void)
+{
+    lastError = 0;
+}
+
+Whisper *whisper_new(const WhisperOptions *options, WhisperCallbacks *callbacks,
+                     void *context)
+{
+    Whisper *w;
+
+    if (!options || !options->persistent_location || !callbacks) {
+        fail(WERR_INVALID_ARGS);
+        return NULL;
+    }
+
+    w = new Whisper();
+    w->callbacks = *callbacks;
+    w->context = context;
+    w->dir = envStr("WLOCAL_DIR", "/tmp/wlocal");
+    w->dataDir = options->persistent_location;
+    w->sock = -1;
+    w->running.store(false);
+    w->stopping.store(false);
+    w->nextSession = 0;
+    w->sessionCb = NULL;
+    w->sessionContext = NULL;
+    w->linkFree = 0;
+    w->rng.seed(std::random_device()());
+    memset(&w->stats, 0, sizeof(w->stats));
+
+    w->link.latency_ms = envInt("WLOCAL_LATENCY", 0);
+    w->link.jitter_ms = envInt("WLOCAL_JITTER", 0);
+    w->link.loss = atof(envStr("WLOCAL_LOSS", "0"));
+    w->link.bandwidth_kbps = envInt("WLOCAL_BANDWIDTH", 0);
+    w->link.queue_ms = envInt("WLOCAL_QUEUE", 1000);
+
+    mkdir(w->dir.c_str(), 0700);
+    mkdir(w->dataDir.c_str(), 0700);
+
+    if (pipe2(w->wakeFd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        fail(WERR_OUT_OF_MEMORY);
+        delete w;
+        return NULL;
+    }
+
+    if (!loadIdentity(w)) {
+        wlog(WhisperLogLevel_Error, "wlocal: no usable identity in %s", w->dataDir.c_str());
+        fail(WERR_BAD_PERSISTENT_DATA);
+        destroy(w);
+        return NULL;
+    }
+    loadFriends(w);
+
+    w->sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    struct sockaddr_un addr;
+    std::string path = sockPath(w, w->userid);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path.c_str());
+    unlink(path.c_str());
+
+    if (w->sock < 0 || bind(w->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        wlog(WhisperLogLevel_Error, "wlocal: bind %s error (%d)", path.c_str(), errno);
+        fail(WERR_ALREADY_RUN);
+        destroy(w);
+        return NULL;
+    }
+
+    int size = 4 * 1024 * 1024;
+    setsockopt(w->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(w->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    w->shaper = std::thread(shaperRoutine, w);
+
+    wlog(WhisperLogLevel_Info, "wlocal: %s listening on %s", w->userid.c_str(), path.c_str());
+    return w;
+}
+
+void whisper_kill(Whisper *w)
+{
+    if (!w)
+        return;
+
+    // Only this frees the instance; a whisper_run() still using it is
+    // stopped first. One of its own callbacks can only ask it to stop,
+    // the instance is then freed by whisper_kill() after it returned.
+    if (w->running.load()) {
+        w->stopping.store(true);
+        if (std::this_thread::get_id() == w->runner)
+            return;
+
+        wake(w);
+        while (w->running.load())
+            usleep(1000);
+    }
+
+    destroy(w);
+}
+
+int whisper_run(Whisper *w, int interval)
+{
+    uint64_t nextIdle, nextPing;
+
+    if (!w)
+        return fail(WERR_INVALID_ARGS);
+    if (w->running.exchange(true))
+        return fail(WERR_ALREADY_RUN);
+    w->runner = std::this_thread::get_id();
+
+    if (interval <= 0)
+        interval = 1000;
+
+    if (w->callbacks.self_info) {
+        WhisperFriendInfo info;
+        friendInfo(w, w->userid, &info);
+        w->callbacks.self_info(w, &info.user_info, w->context);
+    }
+
+    if (w->callbacks.friend_list) {
+        for (auto &f : w->friends) {
+            WhisperFriendInfo info;
+            friendInfo(w, f.first, &info);
+            if (!w->callbacks.friend_list(w, &info, w->context))
+                break;
+        }
+        w->callbacks.friend_list(w, NULL, w->context);
+    }
+
+    if (w->callbacks.connection_status)
+        w->callbacks.connection_status(w, WhisperConnectionStatus_Connected, w->context);
+    if (w->callbacks.ready)
+        w->callbacks.ready(w, w->context);
+
+    for (auto &f : w->friends)
+        sendControl(w, f.first, FrameHello);
+
+    nextIdle = nowMs() + interval;
+    nextPing = nowMs() + WLOCAL_PING_MS;
+
+    while (!w->stopping.load()) {
+        struct pollfd fds[2] = {
+            { w->sock, POLLIN, 0 },
+            { w->wakeFd[0], POLLIN, 0 }
+        };
+        uint64_t now = nowMs();
+        int timeout = nextIdle > now ? (int)(nextIdle - now) : 0;
+
+        poll(fds, 2, timeout);
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(w->wakeFd[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+
+        if (fds[0].revents & POLLIN)
+            receiveFrames(w);
+
+        runPosted(w);
+
+        now = nowMs();
+        if (now >= nextPing) {
+            keepAlive(w);
+            nextPing = now + WLOCAL_PING_MS;
+        }
+
+        if (now >= nextIdle) {
+            if (w->callbacks.idle)
+                w->callbacks.idle(w, w->context);
+            nextIdle = now + interval;
+        }
+    }
+
+    for (auto &f : w->friends)
+        sendControl(w, f.first, FrameBye);
+
+    if (w->callbacks.connection_status)
+        w->callbacks.connection_status(w, WhisperConnectionStatus_Disconnected, w->context);
+
+    // Left to whisper_kill(), which may be waiting for this.
+    w->running.store(false);
+    return 0;
+}
+
+char *whisper_get_appid(Whisper *w, char *appid, size_t len)
+{
+    snprintf(appid, len, "wlocal");
+    return appid;
+}
+
+char *whisper_get_address(Whisper *w, char *address, size_t len)
+{
+    snprintf(address, len, "%s", w->userid.c_str());
+    return address;
+}
+
+char *whisper_get_nodeid(Whisper *w, char *nodeid, size_t len)
+{
+    snprintf(nodeid, len, "%s", w->userid.c_str());
+    return nodeid;
+}
+
+char *whisper_get_userid(Whisper *w, char *userid, size_t len)
+{
+    snprintf(userid, len, "%s", w->userid.c_str());
+    return userid;
+}
+
+char *whisper_get_login(Whisper *w, char *login, size_t len)
+{
+    snprintf(login, len, "%s", w->userid.c_str());
+    return login;
+}
+
+bool whisper_is_ready(Whisper *w)
+{
+    return w && w->running.load();
+}
+
+bool whisper_is_friend(Whisper *w, const char *userid)
+{
+    return w && userid && w->friends.count(bareId(userid)) != 0;
+}
+
+int whisper_add_friend(Whisper *w, const char *address, const char *hello)
+{
+    if (!w || !whisper_address_is_valid(address))
+        return fail(WERR_INVALID_ARGS);
+
+    if (w->friends.count(address))
+        return fail(WERR_ALREADY_EXIST);
+
+    if (!sendControl(w, address, FrameFriendRequest, hello, hello ? strlen(hello) : 0))
+        return fail(WERR_NOT_EXIST);
+
+    return 0;
+}
+
+int whisper_accept_friend(Whisper *w, const char *userid, bool entrusted,
+                          const char *expire)
+{
+    WhisperFriendInfo info;
+
+    if (!w || !whisper_id_is_valid(userid))
+        return fail(WERR_INVALID_ARGS);
+
+    if (w->friends.count(userid))
+        return fail(WERR_ALREADY_EXIST);
+
+    if (!sendControl(w, userid, FrameFriendAccept))
+        return fail(WERR_NOT_EXIST);
+
+    w->friends[userid] = { WhisperConnectionStatus_Connected, nowMs() };
+    saveFriends(w);
+
+    friendInfo(w, userid, &info);
+    if (w->callbacks.friend_added)
+        w->callbacks.friend_added(w, &info, w->context);
+
+    return 0;
+}
+
+int whisper_remove_friend(Whisper *w, const char *userid)
+{
+    if (!w || !userid || !w->friends.erase(userid))
+        return fail(WERR_NOT_EXIST);
+
+    saveFriends(w);
+    if (w->callbacks.friend_removed)
+        w->callbacks.friend_removed(w, userid, w->context);
+    return 0;
+}
+
+int whisper_send_friend_message(Whisper *w, const char *to, const char *msg,
+                                size_t len)
+{
+    if (!w || !to || !msg || !len || len > WHISPER_MAX_APP_MESSAGE_LEN)
+        return fail(WERR_INVALID_ARGS);
+
+    std::string peer = bareId(to);
+    auto it = w->friends.find(peer);
+    if (it == w->friends.end())
+        return fail(WERR_NOT_EXIST);
+    if (it->second.status != WhisperConnectionStatus_Connected)
+        return fail(WERR_NOT_READY);
+
+    // Messages arrive NUL terminated, the terminator is not sent.
+    if (msg[len - 1] == '\0')
+        len--;
+
+    if (!sendControl(w, peer, FrameMessage, msg, len))
+        return fail(WERR_NOT_READY);
+
+    return 0;
+}
+
+int whisper_session_init(Whisper *w, WhisperSessionRequestCallback *callback,
+                         void *context)
+{
+    if (!w)
+        return fail(WERR_INVALID_ARGS);
+
+    w->sessionCb = callback;
+    w->sessionContext = context;
+    return 0;
+}
+
+void whisper_session_cleanup(Whisper *w)
+{
+    if (w)
+        w->sessionCb = NULL;
+}
+
+int whisper_transport_add(Whisper *w, WhisperTransportType transport,
+                          WhisperTransportOptions *options)
+{
+    return w ? 0 : fail(WERR_INVALID_ARGS);
+}
+
+void whisper_transport_remove(Whisper *w, WhisperTransportType transport)
+{
+}
+
+WhisperSession *whisper_session_new(Whisper *w, const char *address,
+                                    WhisperTransportType transport,
+                                    WhisperTransportOptions *options)
+{
+    WhisperSession *ws;
+
+    if (!w || !address) {
+        fail(WERR_INVALID_ARGS);
+        return NULL;
+    }
+
+    ws = new WhisperSession();
+    ws->whisper = w;
+    ws->id = ++w->nextSession;
+    ws->peer = bareId(address);
+    ws->remote.store(0);
+    ws->requestCb = NULL;
+    ws->requestContext = NULL;
+
+    // Answering side: bind to the request this peer sent last.
+    auto it = w->pendingRequests.find(ws->peer);
+    if (it != w->pendingRequests.end()) {
+        ws->remote.store(it->second);
+        w->pendingRequests.erase(it);
+    }
+
+    w->sessions[ws->id] = ws;
+    return ws;
+}
+
+void whisper_session_close(WhisperSession *ws)
+{
+    if (!ws)
+        return;
+
+    Whisper *w = ws->whisper;
+    uint32_t remote = ws->remote.exchange(0);
+
+    if (remote)
+        sendControl(w, ws->peer, FrameSessionClose, NULL, 0, remote, ws->id);
+
+    w->sessions.erase(ws->id);
+    for (auto stream : ws->streams)
+        delete stream;
+    delete ws;
+}
+
+char *whisper_session_get_peer(WhisperSession *ws, char *address, size_t len)
+{
+    snprintf(address, len, "%s", ws->peer.c_str());
+    return address;
+}
+
+int whisper_session_request(WhisperSession *ws,
+                            WhisperSessionRequestCompleteCallback *callback,
+                            void *context)
+{
+    if (!ws)
+        return fail(WERR_INVALID_ARGS);
+
+    ws->requestCb = callback;
+    ws->requestContext = context;
+
+    if (!sendControl(ws->whisper, ws->peer, FrameSessionRequest,
+                     WLOCAL_SDP, strlen(WLOCAL_SDP), 0, ws->id))
+        return fail(WERR_NOT_EXIST);
+
+    return 0;
+}
+
+int whisper_session_reply_request(WhisperSession *ws, int status, const char *reason)
+{
+    const char *payload = status ? (reason ? reason : "refused") : WLOCAL_SDP;
+    uint32_t remote;
+
+    if (!ws)
+        return fail(WERR_INVALID_ARGS);
+
+    remote = ws->remote.load();
+    if (!remote)
+        return fail(WERR_NO_MATCHED_REQUEST);
+
+    if (!sendControl(ws->whisper, ws->peer, FrameSessionReply, payload,
+                     strlen(payload), remote, ws->id, status ? 1 : 0))
+        return fail(WERR_NOT_EXIST);
+
+    if (status)
+        ws->remote.store(0);
+    else
+        postState(ws, WhisperStreamState_transport_ready);
+
+    return 0;
+}
+
+int whisper_session_start(WhisperSession *ws, const char *sdp, size_t len)
+{
+    if (!ws)
+        return fail(WERR_INVALID_ARGS);
+    if (!ws->remote.load())
+        return fail(WERR_WRONG_STATE);
+
+    postState(ws, WhisperStreamState_connecting);
+    postState(ws, WhisperStreamState_connected);
+    return 0;
+}
+
+int whisper_session_add_stream(WhisperSession *ws, WhisperStreamType type,
+                               int options, WhisperStreamCallbacks *callbacks,
+                               void *context)
+{
+    Stream *stream;
+
+    if (!ws || !callbacks)
+        return fail(WERR_INVALID_ARGS);
+
+    stream = new Stream();
+    stream->id = (int)ws->streams.size() + 1;
+    stream->callbacks = *callbacks;
+    stream->context = context;
+    stream->state.store(0);
+    ws->streams.push_back(stream);
+
+    postState(ws, WhisperStreamState_initialized);
+    return stream->id;
+}
+
+int whisper_stream_get_state(WhisperSession *ws, int stream, WhisperStreamState *state)
+{
+    if (!ws || stream <= 0 || stream > (int)ws->streams.size() || !state)
+        return fail(WERR_INVALID_ARGS);
+
+    *state = (WhisperStreamState)ws->streams[stream - 1]->state.load();
+    return 0;
+}
+
+/*
+ * Called from media threads. The session stays valid until the caller
+ * closes it, so only the fields that change while connected are atomic.
+ */
+ssize_t whisper_stream_write(WhisperSession *ws, int stream, const void *data,
+                             size_t len)
+{
+    uint32_t remote;
+    FrameHeader hdr;
+
+    if (!ws || stream <= 0 || stream > (int)ws->streams.size() || !data)
+        return fail(WERR_INVALID_ARGS);
+
+    if (len > WLOCAL_MAX_FRAME - sizeof(hdr))
+        return fail(WERR_LIMIT_EXCEEDED);
+
+    remote = ws->remote.load();
+    if (!remote ||
+        ws->streams[stream - 1]->state.load() != WhisperStreamState_connected)
+        return fail(WERR_WRONG_STATE);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = FrameStreamData;
+    hdr.stream = (uint16_t)stream;
+    hdr.dst = remote;
+    hdr.src = ws->id;
+
+    sendFrame(ws->whisper, ws->peer, hdr, data, len, true);
+    return (ssize_t)len;
+}
+
+int wlocal_set_link(Whisper *w, const WLocalLink *link)
+{
+    if (!w || !link || link->latency_ms < 0 || link->jitter_ms < 0 ||
+        link->loss < 0 || link->loss > 100 || link->bandwidth_kbps < 0 ||
+        link->queue_ms < 0)
+        return fail(WERR_INVALID_ARGS);
+
+    std::lock_guard<std::mutex> guard(w->linkLock);
+    w->link = *link;
+    w->linkCond.notify_one();
+    return 0;
+}
+
+void wlocal_get_link(Whisper *w, WLocalLink *link)
+{
+    std::lock_guard<std::mutex> guard(w->linkLock);
+    *link = w->link;
+}
+
+void wlocal_get_stats(Whisper *w, WLocalStats *stats)
+{
+    std::lock_guard<std::mutex> guard(w->statsLock);
+    *stats = w->stats;
+}
+
+int wlocal_post(Whisper *w, void (*fn)(Whisper *w, void *arg), void *arg)
+{
+    if (!w || !fn)
+        return fail(WERR_INVALID_ARGS);
+
+    post(w, [w, fn, arg]() { fn(w, arg); });
+    return 0;
+}
+
+} // extern "C"
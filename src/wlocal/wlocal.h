@@ -0,0 +1,69 @@
+#ifndef __WLOCAL_H__
+#define __WLOCAL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <whisper.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * wlocal: stand-in for libwcore/libwsession covering the part of
+ * whisper.h and whisper_session.h wdemo uses. Instances on one machine
+ * reach each other through Unix datagram sockets in a shared directory,
+ * so several wdemo processes (or test clients) can befriend each other,
+ * exchange friend messages and stream media without any server.
+ *
+ * Environment, read by whisper_new():
+ *   WLOCAL_DIR         rendezvous directory (default /tmp/wlocal)
+ *   WLOCAL_USERID      user id; otherwise one is generated and kept in
+ *                      the persistent location
+ *   WLOCAL_LATENCY     one way delay in ms added to everything sent
+ *   WLOCAL_JITTER      uniform extra delay in ms, 0..jitter
+ *   WLOCAL_LOSS        percentage of stream packets dropped
+ *   WLOCAL_BANDWIDTH   stream bandwidth cap in kbit/s (0: unlimited)
+ *   WLOCAL_QUEUE       ms of backlog the cap may build before tail drop
+ *                      (default 1000)
+ *
+ * Friend messages and session signalling are delayed but never dropped
+ * or throttled, like the reliable channel of the real SDK.
+ */
+
+typedef struct WLocalLink {
+    int    latency_ms;
+    int    jitter_ms;
+    double loss;            /* percent */
+    int    bandwidth_kbps;  /* 0: unlimited */
+    int    queue_ms;
+} WLocalLink;
+
+typedef struct WLocalStats {
+    uint64_t sent_packets;
+    uint64_t sent_bytes;
+    uint64_t dropped_packets;   /* loss, cap overflow or receiver full */
+    uint64_t received_packets;
+    uint64_t received_bytes;
+} WLocalStats;
+
+/* Change the impairments applied to what this instance sends. */
+int wlocal_set_link(Whisper *whisper, const WLocalLink *link);
+void wlocal_get_link(Whisper *whisper, WLocalLink *link);
+
+/* Counters of stream packets, messages and signalling excluded. */
+void wlocal_get_stats(Whisper *whisper, WLocalStats *stats);
+
+/*
+ * Run fn on the thread inside whisper_run(), where all callbacks are
+ * delivered and the rest of the API is meant to be called. Safe from
+ * any thread.
+ */
+int wlocal_post(Whisper *whisper, void (*fn)(Whisper *whisper, void *arg),
+                void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __WLOCAL_H__ */
@@ -0,0 +1,217 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <deque>
+#include <map>
+
+#include "wstub.h"
+
+struct StreamEvent {
+    uint32_t session;
+    WhisperStreamState state;
+};
+
+static WhisperStubHooks hooks;
+static std::string login;
+static Whisper theWhisper;
+static std::map<uint32_t, WhisperSession *> sessions;
+static std::deque<StreamEvent> streamEvents;
+static uint32_t nextSession = 1;
+
+static thread_local int lastError = 0;
+
+static
+int fail(int code)
+{
+    lastError = W_GENERAL_ERROR(code);
+    return -1;
+}
+
+void wstubSetup(const char *self, const WhisperStubHooks &stubHooks)
+{
+    login = self;
+    hooks = stubHooks;
+}
+
+void wstubQueueState(uint32_t session, WhisperStreamState state)
+{
+    StreamEvent event = { session, state };
+    streamEvents.push_back(event);
+}
+
+void wstubDeliverStates(void (*deliver)(WhisperSession *ws,
+                                        WhisperStreamState state))
+{
+    while (!streamEvents.empty()) {
+        StreamEvent event = streamEvents.front();
+        streamEvents.pop_front();
+
+        auto it = sessions.find(event.session);
+        if (it == sessions.end())
+            continue;
+
+        WhisperSession *ws = it->second;
+        if (!ws->callbacks.state_changed)
+            continue;
+
+        if (deliver)
+            deliver(ws, event.state);
+        else
+            ws->callbacks.state_changed(ws, 1, event.state, ws->context);
+    }
+}
+
+extern "C" {
+
+void whisper_log_init(WhisperLogLevel level, const char *log_file,
+                      void (*log_printer)(const char *format, va_list args))
+{
+}
+
+bool whisper_id_is_valid(const char *id)
+{
+    return id && *id && strlen(id) <= WHISPER_MAX_ID_LEN;
+}
+
+int whisper_get_error(void)
+{
+    return lastError;
+}
+
+Whisper *whisper_new(const WhisperOptions *options, WhisperCallbacks *callbacks,
+                     void *context)
+{
+    theWhisper.callbacks = *callbacks;
+    theWhisper.context = context;
+    theWhisper.sessionCb = NULL;
+    theWhisper.sessionContext = NULL;
+    theWhisper.stopping.store(false);
+    return &theWhisper;
+}
+
+int whisper_session_init(Whisper *w, WhisperSessionRequestCallback *callback,
+                         void *context)
+{
+    w->sessionCb = callback;
+    w->sessionContext = context;
+    return 0;
+}
+
+int whisper_transport_add(Whisper *w, WhisperTransportType transport,
+                          WhisperTransportOptions *options)
+{
+    return 0;
+}
+
+int whisper_run(Whisper *w, int interval)
+{
+    hooks.run(w, interval > 0 ? interval : 500);
+    return 0;
+}
+
+void whisper_kill(Whisper *w)
+{
+    w->stopping.store(true);
+}
+
+char *whisper_get_login(Whisper *w, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s", login.c_str());
+    return buf;
+}
+
+char *whisper_get_userid(Whisper *w, char *userid, size_t len)
+{
+    return whisper_get_login(w, userid, len);
+}
+
+char *whisper_get_address(Whisper *w, char *address, size_t len)
+{
+    return whisper_get_login(w, address, len);
+}
+
+char *whisper_get_nodeid(Whisper *w, char *nodeid, size_t len)
+{
+    return whisper_get_login(w, nodeid, len);
+}
+
+int whisper_add_friend(Whisper *w, const char *address, const char *hello)
+{
+    return fail(WERR_NOT_IMPLEMENTED);
+}
+
+int whisper_accept_friend(Whisper *w, const char *userid, bool entrusted,
+                          const char *expire)
+{
+    return fail(WERR_NOT_IMPLEMENTED);
+}
+
+int whisper_send_friend_message(Whisper *w, const char *to, const char *msg,
+                                size_t len)
+{
+    int rc = hooks.message ? hooks.message(to, msg, len) : 0;
+    return rc ? fail(rc) : 0;
+}
+
+WhisperSession *whisper_session_new(Whisper *w, const char *address,
+                                    WhisperTransportType transport,
+                                    WhisperTransportOptions *options)
+{
+    int rc = hooks.sessionNew ? hooks.sessionNew(address) : 0;
+    if (rc) {
+        fail(rc);
+        return NULL;
+    }
+
+    WhisperSession *ws = new WhisperSession();
+    ws->id = nextSession++;
+    ws->peer = address;
+    memset(&ws->callbacks, 0, sizeof(ws->callbacks));
+    ws->context = NULL;
+
+    sessions[ws->id] = ws;
+    return ws;
+}
+
+int whisper_session_add_stream(WhisperSession *ws, WhisperStreamType type,
+                               int options, WhisperStreamCallbacks *callbacks,
+                               void *context)
+{
+    ws->callbacks = *callbacks;
+    ws->context = context;
+    wstubQueueState(ws->id, WhisperStreamState_initialized);
+    return 1;
+}
+
+int whisper_session_reply_request(WhisperSession *ws, int status, const char *reason)
+{
+    if (status == 0)
+        wstubQueueState(ws->id, WhisperStreamState_transport_ready);
+    return 0;
+}
+
+int whisper_session_start(WhisperSession *ws, const char *sdp, size_t len)
+{
+    wstubQueueState(ws->id, WhisperStreamState_connected);
+    if (hooks.sessionStart)
+        hooks.sessionStart(ws);
+    return 0;
+}
+
+void whisper_session_close(WhisperSession *ws)
+{
+    if (hooks.sessionClose)
+        hooks.sessionClose(ws);
+
+    sessions.erase(ws->id);
+    delete ws;
+}
+
+ssize_t whisper_stream_write(WhisperSession *ws, int stream, const void *data,
+                             size_t len)
+{
+    int rc = hooks.streamWrite ? hooks.streamWrite(ws, data, len) : 0;
+    return rc ? fail(rc) : (ssize_t)len;
+}
+
+} // extern "C"
@@ -0,0 +1,61 @@
+#ifndef __WSTUB_H__
+#define __WSTUB_H__
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+#include <whisper.h>
+#include <whisper_session.h>
+
+/*
+ * Passive stand-in for the part of the whisper API wdemo calls, linked by
+ * the tools driving a CAgent without the SDK (wdemo-load and
+ * wdemo-bench-video). Nothing happens on its own: whisper_run() hands the
+ * thread to the tool's scenario, which plays callbacks into the agent, and
+ * the hooks see what the agent sends. Sessions connect as soon as they are
+ * asked to; their stream states are queued and delivered by the scenario.
+ */
+struct WhisperSession {
+    uint32_t id;
+    std::string peer;
+    WhisperStreamCallbacks callbacks;
+    void *context;
+};
+
+struct Whisper {
+    WhisperCallbacks callbacks;
+    void *context;
+    WhisperSessionRequestCallback *sessionCb;
+    void *sessionContext;
+    std::atomic<bool> stopping;
+};
+
+/*
+ * Hooks returning int give 0 or a WERR_* code, which the API call turns
+ * into its error. Only run is required.
+ */
+struct WhisperStubHooks {
+    // The scenario, run by whisper_run() until done or w->stopping.
+    void (*run)(Whisper *w, int idleInterval);
+
+    int (*message)(const char *to, const char *msg, size_t len);
+    int (*sessionNew)(const char *peer);
+    void (*sessionStart)(WhisperSession *ws);
+    void (*sessionClose)(WhisperSession *ws);
+
+    // Media workers, concurrently.
+    int (*streamWrite)(WhisperSession *ws, const void *data, size_t len);
+};
+
+// Before CAgent::setup(); @login is the user id the agent runs as.
+void wstubSetup(const char *login, const WhisperStubHooks &hooks);
+
+// Queue a stream state change, delivered by wstubDeliverStates().
+void wstubQueueState(uint32_t session, WhisperStreamState state);
+
+// Scenario thread; @deliver, if given, makes each state_changed call.
+void wstubDeliverStates(void (*deliver)(WhisperSession *ws,
+                                        WhisperStreamState state) = NULL);
+
+#endif /* __WSTUB_H__ */